@@ -0,0 +1,83 @@
+#ifndef CHK_PKG_BATCH_H
+#define CHK_PKG_BATCH_H
+
+#include <utilities/my_utils.h>
+#include <utilities/work_pool.h>
+
+#define BATCH_AHEAD_PER_WORKER (4)      // Packages queued per worker ahead of the one being printed
+
+/* Query run on every package of a batch, as the single package flags of the same name. */
+enum BatchMode {
+    BATCH_FILE_CHECK = 0,
+    BATCH_CHUNK_CHECK,
+    BATCH_MIN_HASHES,
+};
+
+/* Totals of a batch. */
+typedef struct batch_stats {
+    uint32_t npkgs;                     // Packages checked
+    uint32_t nfailed;                   // Packages that could not be loaded
+    uint64_t nchunks;                   // Chunks in the packages loaded
+    uint64_t ncomplete;                 // Chunks that matched their hash
+    uint64_t bytes;                     // Bytes of data hashed
+} batch_stats_t;
+
+/* One package of a batch. Workers load and query it, keeping the result as text
+** so the tree is freed straight away; the caller prints results in input order.
+*/
+typedef struct batch_job {
+    work_t work;                        // Queued on the pool, must come first
+    const char* path;
+    enum BatchMode mode;
+    struct batch* batch;
+    char* output;                       // Result lines, from open_memstream
+    size_t output_len;
+    bool loaded;
+    uint32_t nchunks;
+    uint32_t ncomplete;
+    uint64_t bytes;
+    bool done;                          // Result is ready, guarded by the batch lock
+} batch_job_t;
+
+/* Jobs of a batch and what signals their completion. */
+typedef struct batch {
+    batch_job_t* jobs;
+    uint32_t njobs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // Signalled whenever a job finishes
+} batch_t;
+
+/**
+ * @brief Expands arguments into package paths. Directories are searched recursively
+ * for .bpkg files, which are taken in name order.
+ *
+ * @param args Package paths and directories.
+ * @param nargs Number of arguments.
+ * @param count Output for the number of paths.
+ * @return Array of paths, freed with bpkg_batch_paths_destroy, or NULL if there are none.
+ */
+char** bpkg_batch_collect(char** args, int nargs, uint32_t* count);
+
+/**
+ * @brief Frees paths returned by bpkg_batch_collect.
+ *
+ * @param paths Array of paths.
+ * @param count Number of paths.
+ */
+void bpkg_batch_paths_destroy(char** paths, uint32_t count);
+
+/**
+ * @brief Runs one query over many packages on a pool, printing each package's
+ * result in input order as soon as it and those before it are done.
+ *
+ * @param paths Package paths.
+ * @param count Number of paths.
+ * @param mode Query to run.
+ * @param nworkers Worker threads, 0 for one per online CPU.
+ * @param out Stream for the results.
+ * @param stats Output for the totals, may be NULL.
+ * @return 0 if every package loaded, 1 otherwise.
+ */
+int bpkg_batch_run(char** paths, uint32_t count, enum BatchMode mode, uint32_t nworkers, FILE* out, batch_stats_t* stats);
+
+#endif
@@ -73,6 +73,19 @@ void combine_nodes(mtree_t* mtree);
  */
 char** bpkg_get_subtree_chunks(mtree_node_t* node, int* numchunks);
 
+/**
+ * @brief Collect the chunk nodes under a subtree that are not yet verified.
+ *
+ * Completed subtrees are pruned without being descended into, so a mostly
+ * complete package is expanded in time proportional to what is missing.
+ *
+ * @param mtree Pointer to the Merkle tree owning the subtree.
+ * @param root Root node of the subtree (a chunk node yields itself).
+ * @param count Pointer to store the number of chunk nodes found.
+ * @return Array of chunk nodes in file order, or NULL if none are missing.
+ */
+mtree_node_t** bpkg_get_incomplete_chunk_nodes(mtree_t* mtree, mtree_node_t* root, uint32_t* count);
+
 /**
  * @brief Find a node by hash in a Merkle tree.
  *
@@ -0,0 +1,83 @@
+#ifndef CHK_PKG_STREAM_H
+#define CHK_PKG_STREAM_H
+
+#include <utilities/my_utils.h>
+#include <pthread.h>
+#include <tree/merkletree.h>
+
+#define STREAM_SLOT_BYTES (2u << 20)    // Data read into a slot at once, grown to fit the largest chunk
+#define STREAM_SLOTS_SPARE (3)          // Slots beyond one per hasher: being read, waiting and being written
+#define STREAM_SLOT_CHUNKS (1024)       // Chunks one slot covers at most
+#define STREAM_HASHERS_MAX (64)         // Hasher threads at most
+
+/* One chunk table entry and, once hashed, whether its data matched. */
+typedef struct stream_chunk {
+    char hash[SHA256_HEXLEN + 1];
+    uint64_t offset;
+    uint32_t size;
+    uint32_t index;                     // Position in the chunk table
+    bool ok;
+} stream_chunk_t;
+
+enum StreamSlotState {
+    SLOT_FREE = 0,                      // Waiting for the reader
+    SLOT_FILLED,                        // Read, waiting for a hasher
+    SLOT_HASHED,                        // Hashed, waiting for the writer
+};
+
+/* A contiguous run of the data file and the chunks it holds. */
+typedef struct stream_slot {
+    uint8_t* buf;
+    size_t cap;                         // Bytes buf can hold
+    uint64_t base;                      // File offset of buf[0]
+    size_t len;                         // Bytes of buf read from the file
+    stream_chunk_t chunks[STREAM_SLOT_CHUNKS];
+    uint32_t nchunks;
+    enum StreamSlotState state;
+} stream_slot_t;
+
+/* Totals of a streaming verify. */
+typedef struct stream_stats {
+    uint32_t nchunks;                   // Chunks in the table
+    uint32_t verified;                  // Chunks whose data matched
+    uint32_t failed;                    // Chunks whose data differed or was missing
+    uint64_t bytes;                     // Bytes hashed
+} stream_stats_t;
+
+/* Verifies a data file against its .bpkg without building the tree. A reader
+** thread walks the chunk table and the file in order, filling a ring of slots;
+** hasher threads take filled slots in any order; the caller writes results slot
+** by slot in file order. Memory is a slot per hasher plus STREAM_SLOTS_SPARE,
+** however large the package.
+*/
+typedef struct stream_verify {
+    FILE* bpkg;                         // Package file, read up to and through the chunk table
+    int fd;                             // Data file
+    uint32_t nchunks;                   // Chunks the table declares
+    stream_slot_t* slots;
+    uint32_t nslots;
+    uint64_t filled;                    // Slots handed to hashers so far
+    uint64_t taken;                     // Slots claimed by hashers so far
+    bool read_done;                     // Reader has filled its last slot
+    bool table_error;                   // Chunk table was malformed or short
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // Signalled whenever a slot changes state
+} stream_verify_t;
+
+/**
+ * @brief Verifies every chunk of a package's data file, streaming it through a
+ * fixed number of buffers.
+ *
+ * Verified chunk hashes are written to out as they complete, in chunk table order.
+ * Failed chunks are reported on err.
+ *
+ * @param path Path to the .bpkg file.
+ * @param nhashers Hasher threads, 0 for one per online CPU.
+ * @param out Stream for verified chunk hashes.
+ * @param err Stream for failed chunks and errors.
+ * @param stats Output for the totals, may be NULL.
+ * @return 0 if every chunk verified, 1 if any failed, -1 if the package could not be read.
+ */
+int bpkg_stream_verify(const char* path, uint32_t nhashers, FILE* out, FILE* err, stream_stats_t* stats);
+
+#endif
@@ -35,6 +35,16 @@ enum search_mode {
  */
 bpkg_t* bpkg_load(const char* path);
 
+/**
+ * @brief Load only a package's metadata: its fields and the expected hashes of
+ * every node, in level order in mtree->nodes. The data file is neither opened
+ * nor created and the nodes are not linked.
+ *
+ * @param path Path to the package file.
+ * @return Package object, or NULL if it cannot be read or parsed.
+ */
+bpkg_t* bpkg_load_meta(const char* path);
+
 /**
  * @brief Check if the referenced filename in the package exists.
  *
@@ -99,6 +109,21 @@ bpkg_query_t* bpkg_qry_create(char** hashes, uint16_t len);
  */
 void bpkg_obj_destroy(bpkg_t* bobj);
 
+/**
+ * @brief Take an additional reference on a package object.
+ *
+ * @param bobj Package object.
+ * @return The same package object.
+ */
+bpkg_t* bpkg_retain(bpkg_t* bobj);
+
+/**
+ * @brief Drop a reference on a package object, destroying it with the last one.
+ *
+ * @param bobj Package object, may be NULL.
+ */
+void bpkg_release(bpkg_t* bobj);
+
 /**
  * @brief Update a chunk node with new data.
  *
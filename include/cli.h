@@ -1,4 +1,5 @@
 #include <chk/pkgchk.h>
+#include <peer_2_peer/fetch.h>
 #include <peer_2_peer/package.h>
 #include <peer_2_peer/packet.h>
 #include <peer_2_peer/peer_data_sync.h>
@@ -16,13 +17,13 @@
 #define MAX_COMMAND_LENGTH (5520)
 
 /**
- *@brief Execute command triggered peer connection: Try
+ *@brief Execute command triggered peer connection: Try every listed peer at once
  */
-void cli_connect(char* ip, int port, peers_t* peers,
+void cli_connect(char* args, peers_t* peers,
     bpkgs_t* bpkgs);
 
 /**
- * @brief Add a package to manage.
+ * @brief Add a package to manage and advertise it to connected peers.
  *
  *
  * @param filename, the name of the package to add.
@@ -31,14 +32,14 @@ void cli_connect(char* ip, int port, peers_t* peers,
  */
 void cli_disconnect(char* ip, int port, peers_t* peers);
 /**
- * @brief Add a package to manage.
+ * @brief Add a package to manage and advertise it to connected peers.
  *
  *
  * @param filename, the name of the package to add.
  *
  * @returns -1 if unsuccessful.
  */
-void cli_add_package(char* filename, bpkgs_t* bpkgs);
+void cli_add_package(char* filename, bpkgs_t* bpkgs, peers_t* peers);
 
 /**
  * @brief Remove a package that is being maintained.
@@ -63,10 +64,11 @@ void cli_report_packages(bpkgs_t* bpkgs);
 void cli_list_peers(peers_t* peers);
 
 /**
- * @brief Requests chunks related to a given hash.
+ * @brief Requests every missing chunk under a given hash, or the whole package
+ * when no hash is given, from one peer or from all connected peers.
  *
- * @param args: the string containging the hash, ip, port, offset, and
- * identifier.
+ * @param args: the string containging the optional ip and port, identifier, and
+ * optional hash and offset.
  *
  * @returns -1 if unsuccessful.
  */
@@ -17,6 +17,12 @@
 #define ERR_DIRECTORY (3)            // Error code for directory errors
 #define ERR_PEERS (4)                // Error code for peers errors
 #define ERR_PORT (5)                 // Error code for port errors
+#define ERR_IO_ENGINE (6)            // Error code for I/O engine errors
+#define ERR_WORKERS (7)              // Error code for worker count errors
+#define ERR_RATE_LIMIT (8)           // Error code for bandwidth limit errors
+#define ERR_AUTOLOAD (9)             // Error code for package autoload errors
+#define ERR_WATCH (10)               // Error code for package directory watch errors
+#define ERR_METRICS (11)             // Error code for metrics port errors
 
 /**
  * @brief Structure to hold configuration data.
@@ -25,6 +31,15 @@ typedef struct config_object {
      char directory[MAX_DIRECTORY_LENGTH];  // Directory path
      uint32_t max_peers;                    // Maximum number of peers
      uint32_t port;                         // Port number
+     uint8_t io_backend;                    // IoBackend for disk and socket I/O, optional
+     uint32_t workers;                      // Worker threads serving peers, optional, 0 for one per CPU
+     uint32_t upload_limit;                 // Total upload limit in KiB/s, optional, 0 for unlimited
+     uint32_t download_limit;               // Total download limit in KiB/s, optional, 0 for unlimited
+     uint32_t peer_upload_limit;            // Upload limit per peer in KiB/s, optional, 0 for unlimited
+     uint32_t peer_download_limit;          // Download limit per peer in KiB/s, optional, 0 for unlimited
+     bool autoload;                         // Load every package in directory at startup, optional
+     bool watch;                            // Follow changes to packages in directory, optional
+     uint32_t metrics_port;                 // Loopback port answering GET /metrics, optional, 0 for none
 } config_t;
 
 /**
@@ -4,8 +4,8 @@
 #define SHA256_CHUNK_SZ (64)
 #define SHA256_INT_SZ (8)
 
-#include <stdint.h>
 #include <tree/merkletree.h>
+#include <stdint.h>
 
 /**
  * @brief Structure to hold data for SHA-256 computation.
@@ -8,6 +8,7 @@
 #include <peer_2_peer/peer_data_sync.h>
 #include <peer_2_peer/peer_handler.h>
 #include <peer_2_peer/packet.h>
+#include <peer_2_peer/fetch.h>
 #include <peer_2_peer/package.h>
 #include <chk/pkgchk.h>
 #include <sys/socket.h>
@@ -21,14 +22,13 @@
 #include <string.h>
 
 /**
- * @brief Connect to a peer using IP and port
+ * @brief Connect to one or more peers at once
  *
- * @param ip Peer IP address
- * @param port Peer port number
+ * @param args String containing the peers as IP:port, separated by spaces or commas
  * @param peers Pointer to the peers list
  * @param bpkgs Pointer to the packages manager
  */
-void cli_connect(char* ip, int port, peers_t* peers, bpkgs_t* bpkgs);
+void cli_connect(char* args, peers_t* peers, bpkgs_t* bpkgs);
 
 /**
  * @brief Disconnect from a peer using IP and port
@@ -40,11 +40,13 @@ void cli_connect(char* ip, int port, peers_t* peers, bpkgs_t* bpkgs);
 void cli_disconnect(char* ip, int port, peers_t* peers);
 
 /**
- * @brief Add a package to manage
+ * @brief Add a package to manage and advertise it to connected peers
  *
  * @param filename Name of the package to add
+ * @param bpkgs Pointer to the packages manager
+ * @param peers Pointer to the peers list
  */
-void cli_add_package(char* filename, bpkgs_t* bpkgs);
+void cli_add_package(char* filename, bpkgs_t* bpkgs, peers_t* peers);
 
 /**
  * @brief Remove a managed package
@@ -66,14 +68,54 @@ void cli_report_packages(bpkgs_t* bpkgs);
 void cli_list_peers(peers_t* peers);
 
 /**
- * @brief Request chunks related to a given hash
+ * @brief Request every missing chunk under a hash, or the whole package without one,
+ * from one peer or spread across every connected peer
  *
- * @param args String containing the hash, IP, port, offset, and identifier
+ * @param args String containing the optional IP and port, identifier, and optional hash and offset
  * @param bpkgs Pointer to the packages manager
  * @param peers Pointer to the peers list
  */
 void cli_fetch(char* args, bpkgs_t* bpkgs, peers_t* peers);
 
+/**
+ * @brief Ask a peer for the inclusion proof of a chunk and check it against a root hash,
+ * given or taken from the managed package
+ *
+ * @param args String containing the IP:port, identifier, chunk index and optional root hash
+ * @param bpkgs Pointer to the packages manager
+ * @param peers Pointer to the peers list
+ */
+void cli_proof(char* args, bpkgs_t* bpkgs, peers_t* peers);
+
+/**
+ * @brief Report or change the bandwidth limits
+ *
+ * @param args String containing the direction, limit in KiB/s and optional IP:port, or NULL to report
+ * @param peers Pointer to the peers list
+ */
+void cli_limit(char* args, peers_t* peers);
+
+/**
+ * @brief Report traffic, serving and installing counters, and the state of each peer
+ *
+ * @param peers Pointer to the peers list
+ */
+void cli_stats(peers_t* peers);
+
+/**
+ * @brief Report p50, p99 and p999 latencies of fetching, serving, installing and queueing
+ *
+ * @param peers Pointer to the peers list
+ */
+void cli_latency(peers_t* peers);
+
+/**
+ * @brief Write the spans recorded by every thread to a Chrome trace JSON file
+ *
+ * @param args String containing the file to write
+ */
+void cli_trace(char* args);
+
 /**
  * @brief Parse and execute a command
  *
@@ -0,0 +1,180 @@
+#ifndef PEER_2_PEER_FETCH_H
+#define PEER_2_PEER_FETCH_H
+
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <tree/merkletree.h>
+
+#define FETCH_WINDOW (32)           // Max chunk requests in flight per peer
+#define FETCH_WINDOW_INIT (8)       // Window a peer starts with before it proves itself
+#define FETCH_REFILL_DIV (4)        // A window is refilled once 1/N of it is free
+#define FETCH_TIMEOUT_S (3)         // Seconds without a RES from the peer before a chunk request fails
+#define FETCH_MAX_TRIES (4)         // Failed attempts before a chunk is given up on
+#define FETCH_PROGRESS_STEPS (10)   // Number of progress reports over a fetch
+#define FETCH_ENDGAME_CHUNKS (64)   // Outstanding chunks at or below which endgame starts
+#define FETCH_ENDGAME_REQS (3)      // Max peers asked for one chunk during endgame
+#define FETCH_LAT_MAX_US (UINT32_MAX)   // Chunk latencies are clamped to this
+
+/* Scheduling state of one chunk within a fetch. */
+enum FetchChunkState {
+     CHUNK_PENDING = 0,
+     CHUNK_INFLIGHT = 1,
+     CHUNK_DONE = 2,
+     CHUNK_FAILED = 3,
+};
+
+/* A duplicate request issued for a chunk during endgame. */
+typedef struct fetch_dup {
+     uint32_t chk_slot;             // Chunk the duplicate is for
+     uint32_t peer_slot;            // Peer it was sent to
+} fetch_dup_t;
+
+/* One peer taking part in a fetch, with its own adaptive request window.
+** The window grows by one on each verified chunk and halves on each failure,
+** so slow or lossy peers are handed less of the remaining work.
+*/
+typedef struct fetch_peer {
+     char ip[INET_ADDRSTRLEN];      // Address of the peer
+     int port;                      // Port of the peer
+     bool live;                     // Peer was connected when last looked up
+     bool gone;                     // Peer disconnected and is no longer looked up
+     uint32_t window;               // Requests this peer may have in flight
+     uint32_t ninflight;            // Requests handed to this peer but not yet resolved
+     bool refill;                   // Enough of the window is free to top it up in one batch
+     uint32_t ndone;                // Chunks this peer delivered and verified
+     uint8_t* bits;                 // Snapshot of which chunks the peer holds
+     uint32_t avail_version;        // Version of the snapshot, see peer_avail_snapshot
+} fetch_peer_t;
+
+/* A batch of chunk requests for one package, spread across one or more peers.
+** Chunks held by the fewest peers are requested first, and each goes to the least
+** loaded peer that holds it. Once every remaining chunk is in flight and few are
+** left, the fetch enters endgame and asks further peers for the same chunks; the
+** first verified copy wins and the other requests are cancelled. Shared between the thread driving the fetch and the
+** peer threads answering it, so it is reference counted: one reference for the
+** driver and one for every request still queued or in flight.
+*/
+typedef struct fetch {
+     bpkg_t* bpkg;                  // Package the chunks are installed into, referenced
+     peers_t* peers;                // Peers list used to locate the serving peers
+
+     fetch_peer_t* fpeers;          // Peers the chunks are requested from
+     uint32_t npeers;               // Number of peers taking part
+
+     mtree_node_t** chk_nodes;      // Incomplete chunk nodes to request, in file order
+     uint8_t* chk_state;            // FetchChunkState of every chunk
+     uint8_t* chk_tries;            // Failed attempts of every chunk
+     uint8_t* chk_reqs;             // Requests outstanding for every chunk
+     uint32_t* chk_peer;            // Peer the latest regular request for every chunk went to
+     uint32_t* chk_rarity;          // Number of live peers holding every chunk
+     uint32_t* order;               // Chunk slots sorted rarest first
+     uint32_t* buckets;             // Counting sort scratch, npeers + 2 long
+     uint32_t cursor;               // Slots before this point in order are no longer pending
+     bool order_dirty;              // Availability changed since order was built
+     uint32_t nchunks;              // Number of chunks in the batch
+     uint32_t ninflight;            // Requests handed to peers but not yet resolved
+     uint32_t ndone;                // Chunks received and verified
+     uint32_t nfailed;              // Chunks no peer could deliver
+     uint32_t* chk_lat_us;          // Microseconds from request to verified chunk, in delivery order
+     uint32_t nlat;                 // Number of latencies recorded
+     latency_set_t* lat;            // Latency histograms of the package, see metrics.h
+
+     bool stopped;                  // Shutting down, the driver should exit
+     bool endgame;                  // Remaining chunks are requested from several peers
+     fetch_dup_t* dups;             // Endgame duplicates still outstanding
+     uint32_t ndups;                // Number of outstanding duplicates
+
+     int refs;                      // Reference count, see fetch_release
+     pthread_mutex_t lock;
+     pthread_cond_t cond;           // Signalled whenever a chunk resolves
+} fetch_t;
+
+/**
+ * @brief Creates a fetch for every incomplete chunk beneath a tree node.
+ * @param bpkg Package to fetch into.
+ * @param root Node to expand; the package root, an internal node or a chunk.
+ * @return Pointer to the fetch, or NULL if nothing under the node is missing.
+ */
+fetch_t* fetch_create(bpkg_t* bpkg, mtree_node_t* root);
+
+/**
+ * @brief Adds a peer to request chunks from. Only valid before fetch_start.
+ * @param fetch Pointer to the fetch.
+ * @param ip IP address of the peer.
+ * @param port Port of the peer.
+ */
+void fetch_add_peer(fetch_t* fetch, const char* ip, int port);
+
+/**
+ * @brief Runs a fetch on its own detached thread, reporting progress to stdout.
+ * @param fetch Pointer to the fetch; the caller's reference is handed over.
+ * @param peers Pointer to the peers list used to locate the serving peers.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int fetch_start(fetch_t* fetch, peers_t* peers);
+
+/**
+ * @brief Stops every running fetch and waits for their driver threads to exit.
+ * Must be called before the peers list they use is torn down.
+ */
+void fetch_stop_all();
+
+/**
+ * @brief Counts the fetches still running.
+ * @return Number of fetches whose driver thread has not finished.
+ */
+uint32_t fetch_count_active();
+
+/**
+ * @brief Keeps every peer's request window full and waits until every chunk resolves.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_run(fetch_t* fetch);
+
+/**
+ * @brief Records the outcome of one chunk request and wakes the fetch driver.
+ * @param fetch Pointer to the fetch.
+ * @param req Pointer to the resolved request.
+ * @param status SUCCESS, FAILED, MISSING if the peer does not hold the chunk, or
+ * CANCELLED if another peer delivered it first.
+ */
+void fetch_chunk_done(fetch_t* fetch, request_t* req, enum RequestStatus status);
+
+/**
+ * @brief Takes an additional reference on a fetch.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_retain(fetch_t* fetch);
+
+/**
+ * @brief Drops a reference on a fetch, freeing it with the last one.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_release(fetch_t* fetch);
+
+/**
+ * @brief Matches an incoming RES against the peer's in-flight chunk requests and
+ * installs its data, resolving the request once the chunk verifies.
+ * @param peer Pointer to the peer the packet came from.
+ * @param pkt_in Pointer to the RES packet.
+ * @param bpkg Output for a reference to the package of a completed chunk.
+ * @param index Output for the index of a completed chunk.
+ * @return 1 if the chunk completed, 0 if more data is expected, -1 on failure.
+ */
+int fetch_handle_res(peer_t* peer, pkt_t* pkt_in, bpkg_t** bpkg, uint32_t* index);
+
+/**
+ * @brief Fails every in-flight request of a peer that has waited too long, and
+ * cancels those whose chunk has since been verified through another peer.
+ * @param peer Pointer to the peer.
+ */
+void fetch_expire_inflight(peer_t* peer);
+
+/**
+ * @brief Drops a queued chunk request whose chunk was verified before it was sent.
+ * @param req Pointer to the request about to be sent.
+ * @return 1 if the request was resolved and destroyed, 0 if it should be sent.
+ */
+int fetch_skip_redundant(request_t* req);
+
+#endif
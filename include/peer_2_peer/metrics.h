@@ -0,0 +1,145 @@
+#ifndef PEER_2_PEER_METRICS_H
+#define PEER_2_PEER_METRICS_H
+
+#include <utilities/my_utils.h>
+#include <utilities/histogram.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Direction a packet travelled, relative to this node. */
+enum MetricDir {
+     METRIC_SENT = 0,
+     METRIC_RECV = 1,
+     METRIC_DIRS,
+};
+
+/* Message types counted apart, any other code counts as METRIC_MSG_OTHER. */
+enum MetricMsg {
+     METRIC_MSG_ACK = 0,
+     METRIC_MSG_ACP,
+     METRIC_MSG_DSN,
+     METRIC_MSG_REQ,
+     METRIC_MSG_BRQ,
+     METRIC_MSG_RES,
+     METRIC_MSG_HAV,
+     METRIC_MSG_CNL,
+     METRIC_MSG_PRQ,
+     METRIC_MSG_PRF,
+     METRIC_MSG_PNG,
+     METRIC_MSG_POG,
+     METRIC_MSG_OTHER,
+     METRIC_MSGS,
+};
+
+/* Stages whose latency is recorded, in nanoseconds. */
+enum LatencyKind {
+     LAT_ROUND_TRIP = 0,  // Chunk request sent until its chunk verified
+     LAT_SERVE,           // Answering one chunk request, from lookup to the last RES handed off
+     LAT_INSTALL,         // Writing one RES into a package and hashing the chunk again
+     LAT_QUEUE,           // Time a packet waited in a peer's request queue
+     LAT_KINDS,
+};
+
+/* One histogram per stage, kept for the node, for every peer and every package. */
+typedef struct latency_set {
+     histogram_t hist[LAT_KINDS];
+} latency_set_t;
+
+/* Traffic exchanged with one peer since it connected. Counted with relaxed
+** atomics from whichever thread sent or received, so readers see each counter
+** on its own and totals may be a packet apart from one another.
+*/
+typedef struct peer_stats {
+     _Atomic uint64_t bytes[METRIC_DIRS];
+     _Atomic uint64_t pkts[METRIC_DIRS][METRIC_MSGS];
+     latency_set_t lat;
+} peer_stats_t;
+
+/* Counters of the whole node, kept across peers connecting and leaving. */
+typedef struct metrics {
+     _Atomic uint64_t bytes[METRIC_DIRS];
+     _Atomic uint64_t pkts[METRIC_DIRS][METRIC_MSGS];
+     _Atomic uint64_t chunks_served;      // Chunks streamed in answer to REQ and BRQ
+     _Atomic uint64_t serve_errors;       // Chunk requests answered with an error
+     _Atomic uint64_t res_installed;      // RES packets written into a package
+     _Atomic uint64_t chunks_verified;    // Fetched chunks that matched their hash
+     _Atomic uint64_t hash_failures;      // Fetched chunks that did not match their hash
+     _Atomic uint64_t hash_bytes;         // Bytes hashed while installing
+     _Atomic uint64_t hash_ns;            // Time spent hashing while installing
+     latency_set_t lat;
+} metrics_t;
+
+struct peer;
+struct peers;
+
+/**
+ * @brief Returns the counters of this node.
+ * @return Pointer to the counters.
+ */
+metrics_t* metrics_global();
+
+/**
+ * @brief Maps a message code to the slot it is counted under.
+ * @param msg_code Message code of the packet.
+ * @return Slot of the message type.
+ */
+enum MetricMsg metrics_msg_slot(uint16_t msg_code);
+
+/**
+ * @brief Counts packets of one type sent to or received from a peer.
+ * @param stats Pointer to the peer's counters, may be NULL to count only the node's.
+ * @param dir Direction the packets travelled.
+ * @param msg_code Message code of the packets.
+ * @param npkts Number of packets.
+ * @param nbytes Bytes they took on the wire.
+ */
+void metrics_count_pkts(peer_stats_t* stats, enum MetricDir dir, uint16_t msg_code, uint64_t npkts, uint64_t nbytes);
+
+/**
+ * @brief Adds to a node counter.
+ * @param counter Pointer to a counter of metrics_global().
+ * @param n Amount to add.
+ */
+void metrics_add(_Atomic uint64_t* counter, uint64_t n);
+
+/**
+ * @brief Returns the latency histograms of a package, created on first use.
+ * Histograms are kept for every package seen until the node exits.
+ * @param ident Identifier of the package, compared up to PKGS_KEY_MAX characters.
+ * @return Pointer to the package's histograms.
+ */
+latency_set_t* metrics_pkg_latency(const char* ident);
+
+/**
+ * @brief Records how long a stage took, for the node, a peer and a package.
+ * @param stats Pointer to the peer's counters, may be NULL.
+ * @param pkg Pointer to the package's histograms, may be NULL.
+ * @param kind Stage that was timed.
+ * @param start When the stage started, on CLOCK_MONOTONIC.
+ */
+void metrics_record_latency(peer_stats_t* stats, latency_set_t* pkg, enum LatencyKind kind, const struct timespec* start);
+
+/**
+ * @brief Writes p50, p99 and p999 of every stage, for the node, each connected
+ * peer and each package, as shown by the LATENCY command.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list.
+ */
+void metrics_write_latency(FILE* out, struct peers* peers);
+
+/**
+ * @brief Writes every counter and gauge in the Prometheus text exposition format.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list, for per-peer series.
+ */
+void metrics_write_prometheus(FILE* out, struct peers* peers);
+
+/**
+ * @brief Writes a short human readable summary, as shown by the STATS command.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list, for per-peer lines.
+ */
+void metrics_write_summary(FILE* out, struct peers* peers);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef PEER_2_PEER_METRICS_SERVER_H
+#define PEER_2_PEER_METRICS_SERVER_H
+
+#include <peer_2_peer/peer_data_sync.h>
+
+#define METRICS_REQUEST_MAX (2048)     // Bytes of an HTTP request read before answering
+#define METRICS_READ_TIMEOUT_MS (1000) // Time a client has to send its request
+
+/* Answers GET /metrics on a loopback port with the counters of metrics.h in the
+** Prometheus text exposition format. A thread of its own accepts and answers one
+** connection at a time, which is all a scraper needs, and closes each after the
+** response.
+*/
+typedef struct metrics_server {
+     peers_t* peers;
+     int fd;                        // Listening socket
+     int stop_fd;                   // eventfd written to stop the thread
+     pthread_t thread;
+} metrics_server_t;
+
+/**
+ * @brief Starts answering metrics requests on 127.0.0.1.
+ * @param port Port to listen on.
+ * @param peers Pointer to the peers list reported on.
+ * @return Pointer to the server, or NULL if the port cannot be listened on.
+ */
+metrics_server_t* metrics_server_start(uint16_t port, peers_t* peers);
+
+/**
+ * @brief Stops answering, waiting for a response being written, and frees the server.
+ * @param server Pointer to the server, may be NULL.
+ */
+void metrics_server_stop(metrics_server_t* server);
+
+#endif
@@ -1,38 +1,95 @@
 #ifndef PEER_2_PEER_PACKAGE_H
 #define PEER_2_PEER_PACKAGE_H
 
+#include <utilities/my_utils.h>
 #include <chk/pkgchk.h>
 #include <peer_2_peer/packet.h>
 #include <peer_2_peer/peer_data_sync.h>
 #include <tree/merkletree.h>
 
+#define PKGS_BUCKETS_MIN (64)       // Buckets a package manager starts with
+#define PKGS_KEY_MAX (IDENT_MAX - 2)  // Ident characters a package is keyed by, as carried in packets
+
+/* A managed package. Entries hang off a bucket chain for lookup by ident, and off
+** a list in the order they were added, which is the order PACKAGES reports.
+*/
+typedef struct pkg_entry {
+    bpkg_t* bpkg;                // Reference owned by the manager
+    uint64_t hash;               // Hash of the key
+    size_t key_len;              // Characters of bpkg->ident forming the key
+    struct pkg_entry* chain;     // Next entry in the same bucket
+    struct pkg_entry* prev;      // Neighbours in the order added
+    struct pkg_entry* next;
+} pkg_entry_t;
+
+/* Package manager. A chained hash table keyed by package ident, guarded by a
+** reader/writer lock so lookups from peer threads run side by side and only
+** adding or removing a package excludes them. Lookups hand out a reference to
+** the package, which stays valid after it is removed until bpkg_release.
+*/
 typedef struct bpkgs {
-    queue_t* ls;  // Linked list of packages
-    uint8_t count;
-    pthread_mutex_t lock;
+    pkg_entry_t** buckets;
+    size_t nbuckets;             // Power of two, doubled once count exceeds it
+    size_t count;
+    pkg_entry_t* head;           // Oldest package
+    pkg_entry_t* tail;           // Newest package
+    pthread_rwlock_t lock;
     char* directory;
 } bpkgs_t;
 
 /* Packet fetching and handling for peer communication and package management */
 
 /**
- * @brief Fetch a packet from a specified peer.
+ * @brief Prepare a request packet for a chunk.
  *
- * @param peer Pointer to the peer
- * @param pkt Packet to fetch
- * @param bpkg Associated package
- * @return int 0 on success, -1 on failure
+ * @param bpkg Pointer to the package
+ * @param node Node in the Merkle tree
+ * @return pkt_t* Pointer to the prepared packet
  */
-int pkt_fetch_from_peer(peer_t* peer, pkt_t* pkt, bpkg_t* bpkg);
+pkt_t* pkt_prepare_request_pkt(bpkg_t* bpkg, mtree_node_t* node);
 
 /**
- * @brief Prepare a request packet for a chunk.
+ * @brief Prepare a CNL packet withdrawing an earlier request for a chunk.
  *
  * @param bpkg Pointer to the package
- * @param node Node in the Merkle tree
+ * @param node Chunk node in the Merkle tree
  * @return pkt_t* Pointer to the prepared packet
  */
-pkt_t* pkt_prepare_request_pkt(bpkg_t* bpkg, mtree_node_t* node);
+pkt_t* pkt_prepare_cancel_pkt(bpkg_t* bpkg, mtree_node_t* node);
+
+/**
+ * @brief Prepare a BRQ packet requesting many chunks of a package at once.
+ *
+ * Indices are sorted and consecutive ones merged into ranges, so the chunks are
+ * served in file order.
+ *
+ * @param bpkg Pointer to the package
+ * @param indices Chunk indices to request, sorted in place
+ * @param n Number of indices, at most BRQ_RANGES_MAX
+ * @return pkt_t* Pointer to the prepared packet, or NULL on failure
+ */
+pkt_t* pkt_prepare_batch_request_pkt(bpkg_t* bpkg, uint32_t* indices, uint32_t n);
+
+/**
+ * @brief Prepare the HAV packets advertising every chunk of a package held locally.
+ *
+ * Uniform runs of at least HAV_RUN_MIN chunks become a single SET or CLEAR range,
+ * so a complete or empty package of any size is advertised in one packet.
+ *
+ * @param bpkg Pointer to the package
+ * @param npkts Output for the number of packets prepared
+ * @return pkt_t** Array of prepared packets, or NULL on failure
+ */
+pkt_t** pkt_prepare_hav_pkts(bpkg_t* bpkg, uint32_t* npkts);
+
+/**
+ * @brief Prepare a HAV packet announcing one newly verified chunk.
+ *
+ * @param bpkg Pointer to the package
+ * @param index Index of the chunk within the package
+ * @return pkt_t* Pointer to the prepared packet
+ */
+pkt_t* pkt_prepare_have_pkt(bpkg_t* bpkg, uint32_t index);
 
 /**
  * @brief Get response payload for a request.
@@ -74,16 +131,25 @@ int pkt_chk_update_data(mtree_t* mtree, mtree_node_t* chk_node, payload_t payloa
 /* Functions for managing packages within shared thread resources */
 
 /**
- * @brief Find a package by its identifier.
+ * @brief Find a package by its identifier, as carried in a packet.
+ *
+ * @param bpkgs Package manager
+ * @param ident Identifier, compared up to PKGS_KEY_MAX characters
+ * @return bpkg_t* Reference to the package, to be released with bpkg_release, or NULL if not found
+ */
+bpkg_t* pkgs_get(bpkgs_t* bpkgs, const char* ident);
+
+/**
+ * @brief Find a package by its identifier or a prefix of it, as typed at the command line.
  *
  * @param bpkgs Package manager
- * @param ident_qry Identifier to search for
- * @return bpkg_t* Pointer to the found package, or NULL if not found
+ * @param ident_qry Identifier or prefix to search for
+ * @return bpkg_t* Reference to the package, to be released with bpkg_release, or NULL if not found
  */
 bpkg_t* pkg_find_by_ident(bpkgs_t* bpkgs, char* ident_qry);
 
 /**
- * @brief Add a package to the package manager.
+ * @brief Add a package to the package manager, which takes its own reference.
  *
  * @param bpkgs Package manager
  * @param bpkg Package to add
@@ -92,7 +158,27 @@ bpkg_t* pkg_find_by_ident(bpkgs_t* bpkgs, char* ident_qry);
 int pkgs_add(bpkgs_t* bpkgs, bpkg_t* bpkg);
 
 /**
- * @brief Remove a package by its identifier.
+ * @brief Add a package in place of any loaded earlier from the same .bpkg file,
+ * so peers never see the file's package missing in between.
+ *
+ * @param bpkgs Package manager
+ * @param bpkg Package to add, its path set
+ * @return int Number of packages replaced, or -1 on failure
+ */
+int pkgs_replace(bpkgs_t* bpkgs, bpkg_t* bpkg);
+
+/**
+ * @brief Remove every package loaded from a .bpkg file.
+ *
+ * @param bpkgs Package manager
+ * @param path Path of the .bpkg file
+ * @return int Number of packages removed
+ */
+int pkgs_rem_path(bpkgs_t* bpkgs, const char* path);
+
+/**
+ * @brief Remove a package by its identifier or a prefix of it. Transfers still
+ * holding a reference to it finish before it is freed.
  *
  * @param bpkgs Package manager
  * @param ident Identifier of the package to remove
@@ -100,6 +186,17 @@ int pkgs_add(bpkgs_t* bpkgs, bpkg_t* bpkg);
  */
 int pkgs_rem(bpkgs_t* bpkgs, char* ident);
 
+/**
+ * @brief Calls a function on every managed package in the order they were added,
+ * under the manager's read lock.
+ *
+ * @param bpkgs Package manager
+ * @param fn Function to call, which must not add or remove packages
+ * @param arg Argument passed to fn
+ * @return size_t Number of packages visited
+ */
+size_t pkgs_for_each(bpkgs_t* bpkgs, void (*fn)(bpkg_t* bpkg, void* arg), void* arg);
+
 /**
  * @brief Initialize the package manager.
  *
@@ -9,12 +9,18 @@
 #define PAYLOAD_MAX (4096)
 #define DATA_MAX (2998)
 #define REQUESTS_MAX (1024)
+#define PKT_POOL_MAX (1024)   // Freed packets kept for reuse instead of going back to the heap
 
 #define PKT_MSG_ACK 0x0c
 #define PKT_MSG_ACP 0x02
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_HAV 0x08
+#define PKT_MSG_CNL 0x09
+#define PKT_MSG_BRQ 0x0A
+#define PKT_MSG_PRQ 0x0B
+#define PKT_MSG_PRF 0x0D
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
@@ -38,9 +44,65 @@ typedef struct {
     char ident[IDENT_MAX - 2];
 } __attribute__(( packed )) req_t;
 
+#define HAV_BITS_MAX (DATA_MAX)           // Bitfield bytes carried by one HAV packet
+#define HAV_CHUNKS_MAX (HAV_BITS_MAX * 8) // Chunks one bitfield HAV packet can describe
+#define HAV_RUN_MIN (64)                  // Shortest uniform run sent as a SET/CLEAR range
+
+/* How a HAV packet describes its range of chunks. */
+enum hav_mode {
+    HAV_MODE_BITS = 0,   // One bit per chunk in bits
+    HAV_MODE_SET = 1,    // Every chunk in the range is held
+    HAV_MODE_CLEAR = 2,  // No chunk in the range is held
+};
+
+/* Availability advertisement. Describes which chunks of a package the sender holds
+** over the range [first, first + count). Long uniform runs are sent as a single
+** SET or CLEAR range and only mixed stretches carry a bitfield.
+*/
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t nchunks;
+    uint8_t mode;
+    uint8_t bits[HAV_BITS_MAX];
+    char ident[IDENT_MAX - 2];
+} __attribute__(( packed )) hav_t;
+
+/* A run of consecutive chunk indices, [first, first + count). */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} __attribute__(( packed )) brq_range_t;
+
+#define BRQ_RANGES_MAX (DATA_MAX / sizeof(brq_range_t)) // Ranges carried by one BRQ packet
+
+/* Batched chunk request. Names every wanted chunk of one package by index, as a
+** list of ranges in ascending order, and is answered with the RES packets of each
+** chunk in turn. Chunks the sender cannot serve get an error RES of their own.
+*/
+typedef struct {
+    uint32_t nchunks;
+    uint32_t nranges;
+    brq_range_t ranges[BRQ_RANGES_MAX];
+    char ident[IDENT_MAX - 2];
+} __attribute__(( packed )) brq_t;
+
+/* Inclusion proof request and answer. A PRQ names a package and a chunk index;
+** the PRF answering it carries the chunk's hash and its sibling path to the root,
+** so the requester can check the chunk hash against the root hash alone. A PRF
+** with the error flag set means the sender does not manage the package.
+*/
+typedef struct {
+    mtree_proof_t proof;
+    char ident[IDENT_MAX - 2];
+} __attribute__(( packed )) prf_t;
+
 typedef union payload_t {
     res_t res;
     req_t req;
+    hav_t hav;
+    brq_t brq;
+    prf_t prf;
 }payload_t;
 
 /* Packet data structure. This is dynamically allocated and contains details of
@@ -85,11 +147,48 @@ payload_t payload_create_res(uint32_t offset, uint16_t size, char* hash, char* i
 payload_t payload_create_req(uint32_t offset, uint32_t size, char* hash, char* ident, uint8_t* data);
 
 /**
- * @brief Free packet memory
+ * @brief Create a new availability payload
+ * @param first Index of the first chunk described
+ * @param count Number of chunks described
+ * @param nchunks Number of chunks in the package
+ * @param mode How the range is described, see enum hav_mode
+ * @param ident Identifier of the package
+ * @param bits Bitfield of count bits for HAV_MODE_BITS, otherwise NULL
+ * @return The new payload
+ */
+payload_t payload_create_hav(uint32_t first, uint32_t count, uint32_t nchunks, uint8_t mode, char* ident, uint8_t* bits);
+
+/**
+ * @brief Create a new batched request payload
+ * @param nchunks Number of chunks in the package
+ * @param ident Identifier of the package
+ * @param ranges Chunk ranges requested, in ascending order
+ * @param nranges Number of ranges, at most BRQ_RANGES_MAX
+ * @return The new payload
+ */
+payload_t payload_create_brq(uint32_t nchunks, char* ident, brq_range_t* ranges, uint32_t nranges);
+
+/**
+ * @brief Create a new inclusion proof payload
+ * @param ident Identifier of the package
+ * @param index Index of the chunk
+ * @param proof Proof to carry, or NULL for a request
+ * @return The new payload
+ */
+payload_t payload_create_prf(char* ident, uint32_t index, mtree_proof_t* proof);
+
+/**
+ * @brief Free packet memory, keeping it in the packet pool for reuse while there is room
  * @param pkt Pointer to the packet
  */
 void pkt_destroy(pkt_t* pkt);
 
+/**
+ * @brief Take an uninitialised packet from the packet pool, or the heap if it is empty
+ * @return Pointer to the packet, released with pkt_destroy
+ */
+pkt_t* pkt_alloc();
+
 /**
  * @brief Create a new packet
  * @param msg Message code
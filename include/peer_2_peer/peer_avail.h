@@ -0,0 +1,61 @@
+#ifndef PEER_2_PEER_PEER_AVAIL_H
+#define PEER_2_PEER_PEER_AVAIL_H
+
+#include <chk/pkgchk.h>
+#include <peer_2_peer/peer_data_sync.h>
+
+#define AVAIL_IDENT_LEN (IDENT_MAX - 2)              // Ident prefix carried by every packet type
+#define AVAIL_STALE (UINT32_MAX)                     // Snapshot version that forces a refresh
+#define AVAIL_BYTES(nchunks) ( ( (nchunks) + 7 ) / 8 ) // Bytes in a chunk bitfield
+#define AVAIL_GET(bits, i) ( ( (bits)[(i) / 8] >> ( (i) % 8 ) ) & 1 )
+#define AVAIL_SET(bits, i) ( (bits)[(i) / 8] |= (uint8_t)( 1 << ( (i) % 8 ) ) )
+#define AVAIL_CLR(bits, i) ( (bits)[(i) / 8] &= (uint8_t)~( 1 << ( (i) % 8 ) ) )
+
+/* What one peer is believed to hold of one package, one bit per chunk index.
+** Filled in from the HAV advertisements a peer sends on connect and after each
+** chunk it installs. A peer that never advertised a package is assumed to hold
+** every chunk, and bits are cleared as it answers requests with errors.
+*/
+typedef struct peer_avail {
+     char ident[IDENT_MAX];  // Identifier of the package
+     uint32_t nchunks;       // Number of chunks in the package
+     uint8_t* bits;          // Availability bitfield, AVAIL_BYTES(nchunks) long
+     uint32_t version;       // Bumped on every change so snapshots can tell they are stale
+} peer_avail_t;
+
+/**
+ * @brief Records whether a peer holds one chunk of a package.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package.
+ * @param nchunks Number of chunks in the package.
+ * @param index Index of the chunk within the package.
+ * @param has Whether the peer holds the chunk.
+ */
+void peer_avail_set(peer_t* peer, const char* ident, uint32_t nchunks, uint32_t index, bool has);
+
+/**
+ * @brief Applies a HAV advertisement received from a peer.
+ * @param peer Pointer to the peer that sent it.
+ * @param hav Pointer to the advertisement.
+ * @return 0 on success, -1 if the advertisement is malformed.
+ */
+int peer_avail_apply(peer_t* peer, hav_t* hav);
+
+/**
+ * @brief Copies a peer's availability bitfield for a package if it changed.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package.
+ * @param nchunks Number of chunks in the package.
+ * @param bits Destination bitfield, AVAIL_BYTES(nchunks) long.
+ * @param version In/out version of the caller's copy, AVAIL_STALE before the first call.
+ * @return 1 if bits was refreshed, 0 if the caller's copy is current.
+ */
+int peer_avail_snapshot(peer_t* peer, const char* ident, uint32_t nchunks, uint8_t* bits, uint32_t* version);
+
+/**
+ * @brief Frees every availability record held for a peer.
+ * @param peer Pointer to the peer.
+ */
+void peer_avail_destroy(peer_t* peer);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef PEER_2_PEER_PEER_CONNECTOR_H
+#define PEER_2_PEER_PEER_CONNECTOR_H
+
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <netinet/in.h>
+
+#define CONNECT_TIMEOUT_MS (3000)          // Time a connection attempt has before it fails
+#define CONNECT_BACKOFF_MIN_MS (250)       // Wait before the first attempt to restore a dropped peer
+#define CONNECT_BACKOFF_MAX_MS (30000)     // Longest wait between attempts to restore a dropped peer
+#define CONNECT_RETRIES_MAX (10)           // Failed attempts before a dropped peer is given up on
+
+/* Outcome of connecting to one address of a CONNECT. */
+enum ConnectResult {
+     CONNECT_WAITING = 0,     // The attempt is still running
+     CONNECT_OK = 1,          // Connected, the peer thread is running
+     CONNECT_ALREADY = 2,     // A connection to the address already exists or is being made
+     CONNECT_FAILED = -1,     // Refused, unreachable or timed out
+};
+
+/* Addresses of one CONNECT, connected to together. The caller waits until none
+** is left pending.
+*/
+typedef struct connect_batch {
+     uint32_t npending;                   // Attempts not yet resolved, under the connector lock
+     enum ConnectResult* results;         // Outcome of each address, in the order given
+} connect_batch_t;
+
+/* A peer the connector is connecting to, or keeps connected. */
+typedef struct connect_target {
+     char ip[INET_ADDRSTRLEN];
+     int port;
+     int fd;                              // Socket of the attempt in progress, -1 otherwise
+     bool pending;                        // An attempt is in progress and times out at due
+     bool scheduled;                      // The next attempt starts at due
+     bool retrying;                       // Dropped, attempts are made until it is back or given up on
+     bool forgotten;                      // Disconnected on purpose, freed by the connector thread
+     uint32_t attempts;                   // Failed attempts since it dropped
+     struct timespec due;
+     connect_batch_t* batch;              // CONNECT waiting on this attempt, NULL if none
+     uint32_t slot;                       // Index of the address in the batch
+} connect_target_t;
+
+/* Connects to peers without blocking the CLI on each one. A thread of its own
+** starts a non-blocking connect per address and waits on all of them at once,
+** failing any that outlive CONNECT_TIMEOUT_MS, so bringing up many peers takes
+** about as long as the slowest one. Peers it connected to are remembered: when
+** one drops without a DSN it is connected to again, backing off exponentially
+** between attempts until CONNECT_RETRIES_MAX of them have failed.
+*/
+typedef struct peer_connector {
+     peers_t* peers;
+     bpkgs_t* bpkgs;
+     connect_target_t** targets;
+     size_t ntargets;
+     size_t cap;
+     bool stopping;
+     unsigned int seed;                   // Spreads out the backoff of peers that dropped together
+     int wake_fd;                         // eventfd written when targets change or on stop
+     pthread_t thread;
+     pthread_mutex_t lock;
+     pthread_cond_t cond;                 // Signalled as attempts of a batch resolve
+} peer_connector_t;
+
+/**
+ * @brief Starts the connector and makes it the one returned by connector_shared.
+ * @param peers Pointer to the list of peers connections are added to.
+ * @param bpkgs Pointer to the package manager handed to peer threads.
+ * @return Pointer to the connector.
+ */
+peer_connector_t* connector_start(peers_t* peers, bpkgs_t* bpkgs);
+
+/**
+ * @brief Stops the connector, failing attempts still in progress, and frees it.
+ * @param connector Pointer to the connector, may be NULL.
+ */
+void connector_stop(peer_connector_t* connector);
+
+/**
+ * @brief Returns the running connector.
+ * @return Pointer to the connector, or NULL if none is running.
+ */
+peer_connector_t* connector_shared();
+
+/**
+ * @brief Connects to several peers at once, waiting until every attempt has
+ * connected, failed or timed out.
+ * @param connector Pointer to the connector.
+ * @param ips IP addresses of the peers.
+ * @param ports Port numbers of the peers.
+ * @param n Number of peers.
+ * @param results Output for the outcome of each peer, in the order given.
+ * @return Number of peers connected.
+ */
+uint32_t connector_connect(peer_connector_t* connector, char (*ips)[INET_ADDRSTRLEN], const int* ports, uint32_t n, enum ConnectResult* results);
+
+/**
+ * @brief Stops keeping a peer connected, so dropping it later is final.
+ * @param connector Pointer to the connector, may be NULL.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ */
+void connector_forget(peer_connector_t* connector, const char* ip, int port);
+
+/**
+ * @brief Reports a peer whose connection dropped without a DSN. It is connected
+ * to again after a backoff if the running connector made the connection.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ */
+void connector_peer_lost(const char* ip, int port);
+
+#endif
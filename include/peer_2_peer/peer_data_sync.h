@@ -1,23 +1,39 @@
 #ifndef PEER_2_PEER_PEER_DATA_SYNC_H
 #define PEER_2_PEER_PEER_DATA_SYNC_H
 
-#include "utilities/my_utils.h"
+#include <utilities/my_utils.h>
+#include <utilities/ring.h>
+#include <utilities/rate_limit.h>
 #include <peer_2_peer/packet.h>
+#include <peer_2_peer/metrics.h>
+
+// pthread_rwlock_t is hidden under -std=c2x unless my_utils.h set _GNU_SOURCE before
+// the first system header was read, which a later define cannot undo.
+#if !defined(__USE_XOPEN2K)
+#error "Include utilities/my_utils.h before any system header"
+#endif
+
+#define REQ_POOL_SIZE (4096)   // Requests preallocated up front, more spill to the heap
 
 /* Enumeration for request status */
 enum RequestStatus {
      WAITING = 0,
      FAILED = -1,
      SUCCESS = 1,
+     MISSING = -2,     // The peer answered that it does not hold the chunk.
+     CANCELLED = 2,    // The chunk was verified through another peer first.
 };
 
-/* Data structure for request queue communication */
+/* Data structure for request queue communication. Any thread may enqueue and only
+** the peer's own thread dequeues, through a bounded lock-free ring of REQUESTS_MAX.
+** While the consumer waits on its socket it also watches wake_fd, which enqueuers
+** signal so new requests go out without waiting for the poll to time out.
+*/
 typedef struct request_q {
-     queue_t* queue;
-     size_t count;
-     pthread_mutex_t lock;
-     pthread_cond_t cond;
-     int ready;
+     ring_t* ring;
+     _Atomic size_t ndropped;     // Requests refused because the ring was full.
+     int wake_fd;                 // eventfd signalled when requests arrive for a waiting consumer
+     atomic_bool waiting;         // Consumer is blocked, or about to block, on wake_fd
 } request_q_t;
 
 /* Structure representing each peer in the network */
@@ -27,22 +43,53 @@ typedef struct peer {
      uint16_t sock_fd;
      pthread_t thread;
      request_q_t* reqs_q;
+     queue_t* inflight;     // Sent chunk requests awaiting RES.
+     struct timespec last_res;    // When a RES last answered one of them, guarded by inflight_lock.
+     pthread_mutex_t inflight_lock;
+     queue_t* avail;        // Per-package chunk availability of this peer (peer_avail_t).
+     pthread_mutex_t avail_lock;
+     queue_t* proofs;       // Inclusion proofs asked of this peer and not yet answered (proof_wait_t).
+     pthread_mutex_t proof_lock;
+     queue_t* cancels;      // CNL packets received for chunks that may still be queued or streaming.
+     uint32_t ncancels;     // Number of packets in cancels.
+     pthread_mutex_t cancel_lock;
+     pthread_mutex_t send_lock;   // Recursive, held while a packet or a run of packets goes out.
+     struct strand* serve;        // Runs REQ and BRQ serving on the worker pool, in arrival order.
+     struct strand* install;      // Runs RES installs on the worker pool, in arrival order.
+     struct peer_io* io;    // Buffers BRQs are served from, created on first use by the serve strand.
+     token_bucket_t up;     // Limits bytes sent to this peer.
+     token_bucket_t down;   // Limits bytes read from this peer.
+     size_t slot;           // Index in the peers list while the peer is listed.
+     bool closed;           // The connection was closed or failed, seen by a receive.
+     peer_stats_t stats;    // Packets and bytes exchanged with this peer.
 }peer_t;
 
 /* Structure for managing peer communication requests */
 typedef struct request {
      struct pkt_t* pkt;
      enum RequestStatus status;
-     pthread_mutex_t lock;
-     pthread_cond_t cond;
+
+     struct fetch* fetch;          // Fetch this chunk request belongs to, if any.
+     struct mtree_node* chk_node;  // Chunk node being requested.
+     uint32_t chk_slot;            // Index of the chunk within its fetch.
+     uint32_t peer_slot;           // Index of the serving peer within its fetch.
+     uint32_t nbytes;              // Chunk bytes received so far.
+     struct timespec sent_at;      // When the request went out, for timeouts.
+     struct timespec queued_at;    // When the request was queued for its peer.
 } request_t;
 
-/* Structure for managing a dynamic array of peers */
+/* Structure for managing the connected peers. Live peers are kept packed at the
+** front of list for iteration, and indexed by ip:port in an open-addressed table
+** at most half full, so lookups and removals touch a couple of slots rather than
+** every one of npeers_max. Lookups and iteration only take the lock for reading.
+*/
 typedef struct peers {
-     struct peer** list;
+     struct peer** list;    // Connected peers, the first npeers_cur entries are used.
      size_t npeers_cur;     // Current number of peers.
      size_t npeers_max;     // Maximum number of peers.
-     pthread_mutex_t lock;  // Mutex for peer addition/removal.
+     struct peer** table;   // Hash index of list keyed on ip:port, NULL for an empty slot.
+     size_t table_mask;     // Table capacity - 1, the capacity is a power of two.
+     pthread_rwlock_t lock; // Written on addition/removal, read on lookup and iteration.
 } peers_t;
 
 /* Peer management functions */
@@ -54,6 +101,12 @@ typedef struct peers {
  */
 peers_t* peer_list_create(size_t max_peers);
 
+/**
+ * @brief Frees a peer list. The peers it held must already be gone.
+ * @param peers Pointer to peers_t.
+ */
+void peer_list_destroy(peers_t* peers);
+
 /**
  * @brief Creates a peer with specified IP and port.
  * @param ip IP address of the peer.
@@ -66,8 +119,10 @@ peer_t* peer_create(const char* ip, int port);
  * @brief Adds a new peer to the peers list.
  * @param peers Pointer to the peers_t structure.
  * @param new_peer Pointer to the new peer_t structure to add.
+ * @return 0 on success, -1 if the list is full or a peer with the same IP and port
+ * is already listed. The caller still owns a peer that was not added.
  */
-void peers_add(peers_t* peers, peer_t* new_peer);
+int peers_add(peers_t* peers, peer_t* new_peer);
 
 /**
  * @brief Removes a peer with specified IP and port from the peers list.
@@ -83,6 +138,12 @@ void peers_remove(peers_t* peers, char* ip, int port);
  */
 void peer_destroy(peer_t* peer);
 
+/**
+ * @brief Frees a peer whose handler thread was never started, closing its socket.
+ * @param peer Peer pointer.
+ */
+void peer_discard(peer_t* peer);
+
 /**
  * @brief Finds a peer with specified IP and port in the peers list.
  * @param peers Pointer to peers_t .
@@ -92,6 +153,26 @@ void peer_destroy(peer_t* peer);
  */
 peer_t* peers_find(peers_t* peers, const char* ip, uint16_t port);
 
+/**
+ * @brief Calls a function on the peer with specified IP and port, if connected,
+ * while holding the peers lock so it cannot be freed meanwhile.
+ * @param peers Pointer to peers_t.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ * @param fn Function to call with the peer and arg.
+ * @param arg Argument passed through to fn.
+ * @return true if the peer was found.
+ */
+bool peers_apply(peers_t* peers, const char* ip, uint16_t port, void (*fn)(peer_t* peer, void* arg), void* arg);
+
+/**
+ * @brief Calls a function on every connected peer while holding the peers lock.
+ * @param peers Pointer to peers_t.
+ * @param fn Function to call with each peer and arg.
+ * @param arg Argument passed through to fn.
+ */
+void peers_for_each(peers_t* peers, void (*fn)(peer_t* peer, void* arg), void* arg);
+
 /* Request queue management functions */
 
 /**
@@ -101,7 +182,8 @@ peer_t* peers_find(peers_t* peers, const char* ip, uint16_t port);
 request_q_t* reqs_create();
 
 /**
- * @brief Creates a request with a specified packet.
+ * @brief Creates a request with a specified packet, taken from the preallocated
+ * pool while it lasts.
  * @param pkt Pointer to the packet.
  * @return Pointer to the created request_t structure.
  */
@@ -127,11 +209,20 @@ void reqs_destroy(request_q_t* reqs_q);
 request_t* reqs_nextup(request_q_t* reqs_q);
 
 /**
- * @brief Enqueues a request into the request queue.
+ * @brief Enqueues a request into the request queue. Never blocks: if the queue is
+ * full the request is destroyed, which fails it back to its fetch if it has one.
  * @param reqs_q Pointer to the request queue.
  * @param request Pointer to the request.
+ * @return 0 on success, -1 if the queue was full.
  */
-void reqs_enqueue(request_q_t* reqs_q, request_t* request);
+int reqs_enqueue(request_q_t* reqs_q, request_t* request);
+
+/**
+ * @brief Wakes the consumer of a request queue if it is waiting. Only the first
+ * enqueuer after the consumer starts waiting pays for the system call.
+ * @param reqs_q Pointer to the request queue.
+ */
+void reqs_wake(request_q_t* reqs_q);
 
 /**
  * @brief Dequeues a request from the request queue.
@@ -140,4 +231,31 @@ void reqs_enqueue(request_q_t* reqs_q, request_t* request);
  */
 request_t* reqs_dequeue(request_q_t* reqs_q);
 
+/**
+ * @brief Enqueues several requests at once, so a consumer sees them together.
+ * Never blocks: requests that do not fit are left to the caller rather than
+ * destroyed, so it can fail them back without holding its own locks.
+ * @param reqs_q Pointer to the request queue.
+ * @param requests Array of requests.
+ * @param n Number of requests.
+ * @return Number of requests enqueued, always a prefix of the array.
+ */
+size_t reqs_enqueue_many(request_q_t* reqs_q, request_t** requests, size_t n);
+
+/**
+ * @brief Dequeues the request at the head of the queue only if it matches.
+ * @param reqs_q Pointer to the request queue.
+ * @param match Predicate called on the head request with arg.
+ * @param arg Argument passed through to match.
+ * @return Pointer to the dequeued request, or NULL if the queue is empty or the head does not match.
+ */
+request_t* reqs_dequeue_if(request_q_t* reqs_q, bool (*match)(request_t* req, void* arg), void* arg);
+
+/**
+ * @brief Counts the requests waiting in a request queue.
+ * @param reqs_q Pointer to the request queue, may be NULL.
+ * @return Number of requests queued, a snapshot while others enqueue.
+ */
+size_t reqs_depth(request_q_t* reqs_q);
+
 #endif
\ No newline at end of file
@@ -35,6 +35,33 @@ void peer_handler(void* args_void);
  */
 void peer_create_thread(peer_t* new_peer, peers_t* peers, bpkgs_t* bpkgs);
 
+#define PEER_POLL_MS (50)   // Max time the peer loop blocks on its socket per iteration
+#define PEER_SWEEP_MS (50)  // Min time between sweeps of a peer's in-flight requests
+#define PEER_RECV_BURST (64)   // Max buffered packets taken per pass of the peer loop
+#define PEER_CANCELS_MAX (256)   // Max cancels remembered per peer, the oldest are dropped
+#define PEER_EXIT_WAIT_S (2)     // Seconds shutdown waits for a peer thread to exit
+#define PEER_IO_WINDOW (256 * 1024)   // Bytes of a BRQ range read from disk into one buffer
+#define PEER_IO_SEGMENT (64 * 1024)   // Bytes read per disk operation
+#define PEER_IO_SEGMENTS_MAX (8)      // Max disk operations one buffer is filled with
+#define PEER_TX_PKTS (16)             // RES packets handed to the I/O engine per send
+
+/**
+ * @brief Waits briefly for a peer's socket to become readable.
+ * @param peer Pointer to the peer.
+ * @param timeout_ms Milliseconds to wait.
+ * @return 1 if data (or a hangup) is pending, 0 otherwise.
+ */
+int peer_poll_incoming(peer_t* peer, int timeout_ms);
+
+/**
+ * @brief Waits for a peer's socket to become readable or for a request to be queued
+ * for it, whichever comes first.
+ * @param peer Pointer to the peer.
+ * @param timeout_ms Milliseconds to wait at most.
+ * @return 1 if data (or a hangup) is pending on the socket, 0 otherwise.
+ */
+int peer_wait_event(peer_t* peer, int timeout_ms);
+
 /**
  * @brief Attempts to receive a packet from a peer.
  * @param peer Pointer to the peer.
@@ -79,18 +106,80 @@ void send_res(peer_t* peer, uint8_t err, payload_t payload);
 void send_res_pkts(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs);
 
 /**
- * @brief Sends a REQ packet to a peer.
+ * @brief Answers a BRQ by streaming every requested chunk in index order, with an
+ * error RES for each chunk not held locally. Cancels for chunks later in the batch
+ * are honoured as they arrive.
+ * @param peer Pointer to the peer.
+ * @param pkt_in Pointer to the BRQ packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+void send_res_batch(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs);
+
+/**
+ * @brief Sends a REQ packet to a peer. The packet remains owned by the caller.
  * @param peer Pointer to the peer.
  * @param pkt Pointer to the packet to send.
  */
 void send_req(peer_t* peer, pkt_t* pkt);
 
+/**
+ * @brief Sends a fetch's chunk request along with the requests queued right behind
+ * it for the same fetch, as one BRQ when there is more than one. All of them are
+ * then tracked as in flight.
+ * @param peer Pointer to the peer.
+ * @param req Pointer to the request leading the batch.
+ */
+void send_req_batch(peer_t* peer, request_t* req);
+
 /**
  * @brief Sends a PNG packet to a peer.
  * @param peer Pointer to the peer.
  */
 void send_png(peer_t* peer);
 
+/**
+ * @brief Remembers a CNL packet so a worker serving the peer skips the chunk it
+ * names. The oldest are dropped once PEER_CANCELS_MAX are held.
+ * @param peer Pointer to the peer.
+ * @param cnl Pointer to the CNL packet, owned by the peer from here on.
+ */
+void peer_record_cancel(peer_t* peer, pkt_t* cnl);
+
+/**
+ * @brief Sends the full availability advertisement of every managed package to a peer.
+ * @param peer Pointer to the peer.
+ * @param bpkgs Pointer to the package manager.
+ */
+void send_hav_pkgs(peer_t* peer, bpkgs_t* bpkgs);
+
+#define HAV_ALL (UINT32_MAX)   // send_hav_all index advertising the whole package
+
+/**
+ * @brief Queues availability of a package on every connected peer: the full
+ * advertisement, or a single HAVE for one newly verified chunk.
+ * @param peers Pointer to the list of peers.
+ * @param bpkg Pointer to the package.
+ * @param index Index of the newly verified chunk, or HAV_ALL for the whole package.
+ */
+void send_hav_all(peers_t* peers, bpkg_t* bpkg, uint32_t index);
+
+/**
+ * @brief Records an availability advertisement for a package this peer manages.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the HAV packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+void recv_hav(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs);
+
+/**
+ * @brief Answers a PRQ with the inclusion proof of the chunk it names, built from
+ * the expected hashes so a peer still fetching the package can answer too.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the PRQ packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+void send_prf(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs);
+
 /**
  * @brief Sends a POG packet to a peer.
  * @param peer Pointer to the peer.
@@ -121,9 +210,9 @@ int acp_wait_ack(peer_t* peer);
  * @param peer Pointer to the peer.
  * @param pkt_in Pointer to the incoming packet.
  * @param bpkgs Pointer to the package manager.
- * @param req_recent Pointer to the recent request.
+ * @param peers Pointer to the list of peers.
  */
-void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, request_t* req_recent, peers_t* peers);
+void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, peers_t* peers);
 
 /**
  * @brief Processes an outgoing packet for a peer.
@@ -135,9 +224,9 @@ void process_pkt_out(peer_t* peer, request_t* req);
 /**
  * @brief Processes a shared request for a peer.
  * @param peer Pointer to the peer.
- * @return Pointer to the processed request.
+ * @return 1 if a request was dequeued and processed, 0 if the queue was empty.
  */
-request_t* peer_process_request_shared(peer_t* peer);
+int peer_process_request_shared(peer_t* peer);
 
 /**
  * @brief Cancels all peer threads.
@@ -0,0 +1,43 @@
+#ifndef PEER_2_PEER_PEER_PROOF_H
+#define PEER_2_PEER_PEER_PROOF_H
+
+#include <chk/pkgchk.h>
+#include <peer_2_peer/peer_data_sync.h>
+
+/* An inclusion proof asked of a peer and the root hash it must lead to. The root
+** and chunk count are fixed when the PRQ is sent, from the command line or the
+** managed package, so nothing in the answer can change what it is checked against.
+*/
+typedef struct proof_wait {
+     char ident[IDENT_MAX];              // Identifier of the package
+     uint32_t index;                     // Index of the chunk
+     char root[SHA256_HEXLEN];           // Trusted root hash of the package
+     uint32_t nchunks;                   // Trusted number of chunks, fixing the proof's depth
+} proof_wait_t;
+
+/**
+ * @brief Records a proof requested from a peer, to be checked when its PRF arrives.
+ * @param peer Pointer to the peer asked.
+ * @param ident Identifier of the package.
+ * @param index Index of the chunk.
+ * @param root Trusted root hash of the package.
+ * @param nchunks Trusted number of chunks in the package.
+ */
+void peer_proof_expect(peer_t* peer, const char* ident, uint32_t index, const char* root, uint32_t nchunks);
+
+/**
+ * @brief Checks a PRF received from a peer against the root and chunk count recorded for it,
+ * and reports the outcome.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt Pointer to the PRF packet.
+ * @return 1 if the proof verified, 0 if it failed or the peer had none, -1 if it was not asked for.
+ */
+int peer_proof_check(peer_t* peer, pkt_t* pkt);
+
+/**
+ * @brief Frees every proof still awaited from a peer.
+ * @param peer Pointer to the peer.
+ */
+void peer_proof_destroy(peer_t* peer);
+
+#endif
@@ -5,6 +5,9 @@
 #include <peer_2_peer/peer_data_sync.h>
 #include <peer_2_peer/package.h>
 #include <stdint.h>
+#include <sys/socket.h>
+
+#define SERVER_BACKLOG (SOMAXCONN)   // Connections waiting to be accepted, many peers may connect at once
 
 /* Arguments for the server thread */
 typedef struct server_thr_args {
@@ -0,0 +1,58 @@
+#ifndef PEER_2_PEER_PKG_LOADER_H
+#define PEER_2_PEER_PKG_LOADER_H
+
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <utilities/work_pool.h>
+#include <stdatomic.h>
+
+#define LOAD_EXT ".bpkg"            // Suffix of the package files picked up by a scan
+#define LOAD_PROGRESS_STEPS (10)    // Number of progress reports over a scan
+#define LOAD_PROGRESS_MIN (20)      // Scans of fewer packages only report when done
+
+/* Loading of one package file found by a scan. Queued on the loader's pool. */
+typedef struct pkg_load_job {
+     work_t work;                   // Runs the load on a worker
+     struct pkg_loader* loader;
+     char* path;                    // Path of the .bpkg file
+} pkg_load_job_t;
+
+/* Loads every package file in the package directory in the background. Each
+** package is loaded and its data verified on a pool of its own, then added to
+** the package manager and advertised to connected peers straight away, so it is
+** served while the rest are still loading. A thread of its own waits for the
+** scan to finish, reports it and takes the pool down.
+*/
+typedef struct pkg_loader {
+     bpkgs_t* bpkgs;
+     peers_t* peers;
+     work_pool_t* pool;             // Runs the loads, NULL once the scan is over
+     pkg_load_job_t* jobs;
+     uint32_t njobs;
+     _Atomic uint32_t nloaded;      // Packages added to the manager
+     _Atomic uint32_t nfailed;      // Package files that could not be loaded
+     atomic_bool stopping;          // Loads not yet started are skipped
+     uint32_t last_step;            // Last progress step reported, under lock
+     struct timespec started;
+     pthread_t thread;              // Waits for the scan and reports it
+     pthread_mutex_t lock;
+     pthread_cond_t cond;           // Signalled as loads finish and on stop
+} pkg_loader_t;
+
+/**
+ * @brief Starts loading every package file in the package directory.
+ * @param bpkgs Pointer to the package manager, whose directory is scanned.
+ * @param peers Pointer to the list of peers to advertise loaded packages to.
+ * @param nthreads Number of loads run at once, 0 for one per online CPU.
+ * @return Pointer to the loader, or NULL if the directory holds no package files.
+ */
+pkg_loader_t* pkg_loader_start(bpkgs_t* bpkgs, peers_t* peers, uint32_t nthreads);
+
+/**
+ * @brief Stops a scan, waiting for loads already running, and frees the loader.
+ * Packages loaded so far stay managed.
+ * @param loader Pointer to the loader, may be NULL.
+ */
+void pkg_loader_stop(pkg_loader_t* loader);
+
+#endif
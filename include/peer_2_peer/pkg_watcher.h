@@ -0,0 +1,37 @@
+#ifndef PEER_2_PEER_PKG_WATCHER_H
+#define PEER_2_PEER_PKG_WATCHER_H
+
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/peer_data_sync.h>
+
+#define WATCH_BUF_SIZE (16384)      // Bytes of inotify events read at once
+
+/* Keeps the package manager in step with the package directory. A thread of its
+** own waits on inotify: a .bpkg file written or moved in is loaded in place of
+** any package loaded from it before, one deleted or moved out is unloaded, and
+** a data file written in place has only the chunks that changed hashed again.
+** A data file replaced by a rename has its packages loaded afresh.
+*/
+typedef struct pkg_watcher {
+     bpkgs_t* bpkgs;
+     peers_t* peers;
+     int fd;                        // inotify instance watching the package directory
+     int stop_fd;                   // eventfd written to stop the thread
+     pthread_t thread;
+} pkg_watcher_t;
+
+/**
+ * @brief Starts watching the package directory.
+ * @param bpkgs Pointer to the package manager, whose directory is watched.
+ * @param peers Pointer to the list of peers to advertise changes to.
+ * @return Pointer to the watcher, or NULL if the directory cannot be watched.
+ */
+pkg_watcher_t* pkg_watcher_start(bpkgs_t* bpkgs, peers_t* peers);
+
+/**
+ * @brief Stops watching, waiting for a change being applied, and frees the watcher.
+ * @param watcher Pointer to the watcher, may be NULL.
+ */
+void pkg_watcher_stop(pkg_watcher_t* watcher);
+
+#endif
@@ -5,14 +5,18 @@
 #define SHA256_HEXLEN (64)
 #define FILE_MAX (256)
 #define IDENTITY_MAX (4096)
+#define MTREE_PROOF_MAX (32)    // Sibling hashes in a proof at most, a path for up to 2^32 chunks
 
 #include <utilities/my_utils.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 typedef struct chunk_t {
     uint8_t* data;      ///< Pointer to the chunk data
     uint32_t size;      ///< Size of the chunk
     uint32_t offset;    ///< Offset of the chunk in the file
+    uint32_t index;     ///< Position of the chunk in the package's chunk list
+    uint64_t fp;        ///< Fingerprint of the data when last hashed, see chunk_fingerprint
 } chunk_t;
 
 typedef struct mtree_node {
@@ -47,8 +51,28 @@ typedef struct mtree {
 
     uint8_t* f_data;                  ///< File data
     uint32_t f_size;                  ///< File size
+    int f_fd;                         ///< Data file, kept open for reads and syncs beside the mapping
 } mtree_t;
 
+/* Inclusion proof of one chunk: its expected hash and the expected hash of every
+** sibling on the path to the root, lowest first. The tree is perfect, so the
+** chunk is the right child at level k exactly when bit k of its index is set,
+** and the proof needs no other shape information.
+*/
+typedef struct mtree_proof {
+    uint32_t index;                   ///< Index of the chunk in the package's chunk list
+    uint32_t nchunks;                 ///< Number of chunks in the tree, 1 << nsiblings
+    uint16_t nsiblings;               ///< Number of sibling hashes used
+    char chunk_hash[SHA256_HEXLEN];   ///< Expected hash of the chunk
+    char siblings[MTREE_PROOF_MAX][SHA256_HEXLEN];
+} mtree_proof_t;
+
+/* A run of consecutive chunk indices, [first, first + count). */
+typedef struct mtree_range {
+    uint32_t first;                   ///< Index of the first chunk
+    uint32_t count;                   ///< Number of chunks
+} mtree_range_t;
+
 enum hash_type {
     EXPECTED,                         ///< Expected hash type
     COMPUTED,                         ///< Computed hash type
@@ -60,10 +84,12 @@ enum hash_type {
 typedef struct bpkg_obj {
     char ident[IDENTITY_MAX];         ///< Identifier for the package
     char filename[FILE_MAX];          ///< Name of the package file
+    char path[FILE_MAX];              ///< Path of the .bpkg file it was loaded from
     char* pkg_data;                   ///< Pointer to the package data
     uint32_t pkg_size;                ///< Size of the package
 
     mtree_t* mtree;                   ///< Pointer to the Merkle tree
+    _Atomic uint32_t refs;            ///< References held, see bpkg_release
 } bpkg_t;
 
 /**
@@ -200,4 +226,72 @@ bool check_chunk(mtree_node_t* node);
  */
 void update_parent_hashes(mtree_node_t* node);
 
+/**
+ * @brief Computes a fingerprint of a chunk's data, far cheaper than its SHA-256.
+ * 
+ * @param chunk Pointer to the chunk.
+ * @return Fingerprint of the data.
+ */
+uint64_t chunk_fingerprint(const chunk_t* chunk);
+
+/**
+ * @brief Rehashes only the chunks whose data changed since they were last hashed,
+ * found by fingerprint, and brings their parents' hashes up to date.
+ * 
+ * @param mtree Pointer to the Merkle tree structure.
+ * @param changed Output for the indices of the rehashed chunks, room for nchunks, or NULL.
+ * @return Number of chunks rehashed, or -1 if the data file is now shorter than the tree.
+ */
+int mtree_reverify_changed(mtree_t* mtree, uint32_t* changed);
+
+/**
+ * @brief Builds the inclusion proof of a chunk from the tree's expected hashes,
+ * so it can be served whether or not the chunk's data is held.
+ * 
+ * @param mtree Pointer to the Merkle tree structure.
+ * @param index Index of the chunk.
+ * @param proof Output for the proof.
+ * @return 0 if successful, -1 if the index is out of range or the tree is not perfect.
+ */
+int mtree_get_proof(mtree_t* mtree, uint32_t index, mtree_proof_t* proof);
+
+/**
+ * @brief Computes the root hash an inclusion proof leads to.
+ * 
+ * @param proof Pointer to the proof.
+ * @param root Output for the root hash.
+ * @return 0 if successful, -1 if the proof is malformed.
+ */
+int mtree_proof_root(const mtree_proof_t* proof, char root[SHA256_HEXLEN]);
+
+/**
+ * @brief Verifies an inclusion proof against a trusted root hash and chunk count.
+ * The count fixes the proof's depth, so an internal node's hash cannot be passed
+ * off as a chunk's by a proof that stops short of the leaves.
+ * 
+ * @param proof Pointer to the proof.
+ * @param root_hash Trusted root hash of the package.
+ * @param nchunks Trusted number of chunks in the package.
+ * @return true if the proof has that depth and leads to root_hash, false otherwise.
+ */
+bool mtree_verify_proof(const mtree_proof_t* proof, const char* root_hash, uint32_t nchunks);
+
+/**
+ * @brief Finds the chunks of a new tree whose expected hashes differ from an old
+ * tree's, descending only into subtrees whose hashes differ. Both trees need only
+ * their metadata, see bpkg_load_meta.
+ * 
+ * Trees of different sizes are lined up from the first chunk: the smaller root is
+ * compared with the larger tree's leftmost node of the same height, and chunks the
+ * new tree has past the end of the old one count as changed.
+ * 
+ * @param old_tree Pointer to the tree of the version held.
+ * @param new_tree Pointer to the tree of the version wanted.
+ * @param ranges Output for the changed chunks of new_tree, as ascending ranges that
+ * never touch, freed by the caller. NULL when nothing changed.
+ * @param nranges Output for the number of ranges.
+ * @return Number of changed chunks, or -1 if either tree is not a complete perfect tree.
+ */
+int64_t mtree_diff(mtree_t* old_tree, mtree_t* new_tree, mtree_range_t** ranges, uint32_t* nranges);
+
 #endif
\ No newline at end of file
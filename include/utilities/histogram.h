@@ -0,0 +1,67 @@
+#ifndef UTILITIES_HISTOGRAM_H
+#define UTILITIES_HISTOGRAM_H
+
+#include <utilities/my_utils.h>
+#include <stdatomic.h>
+
+#define HIST_SUB_BITS (5)                                       // Sub-buckets per power of two, as bits
+#define HIST_SUB (1u << HIST_SUB_BITS)                          // Sub-buckets per power of two
+#define HIST_VALUE_BITS (40)                                    // Values up to 2^40 (18 minutes in ns) are told apart
+#define HIST_BUCKETS ( ( HIST_VALUE_BITS - HIST_SUB_BITS + 1 ) * HIST_SUB )
+
+/* Log-linear histogram after HdrHistogram. Each power of two is split into
+** HIST_SUB equal buckets, so a recorded value is known to within 1/HIST_SUB of
+** itself (about 3%) at any magnitude while the whole range fits in a few KiB.
+** Recording is one relaxed atomic increment, so any thread may record while
+** others read; a reader sees a snapshot that may be a value or two behind.
+*/
+typedef struct histogram {
+    _Atomic uint32_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;     // Values recorded
+    _Atomic uint64_t sum;       // Sum of the values recorded, after clamping
+    _Atomic uint64_t max;       // Largest value recorded, exact
+} histogram_t;
+
+/**
+ * @brief Records one value.
+ *
+ * @param hist Pointer to the histogram.
+ * @param value Value to record, clamped to the largest one told apart.
+ */
+void hist_record(histogram_t* hist, uint64_t value);
+
+/**
+ * @brief Counts the values recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Number of values.
+ */
+uint64_t hist_count(histogram_t* hist);
+
+/**
+ * @brief Finds the value a given fraction of the recorded values are at or below.
+ *
+ * @param hist Pointer to the histogram.
+ * @param quantile Fraction between 0 and 1, such as 0.99.
+ * @return Highest value of the bucket holding that rank, never above the maximum
+ * recorded, or 0 if the histogram is empty.
+ */
+uint64_t hist_quantile(histogram_t* hist, double quantile);
+
+/**
+ * @brief Sums the values recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Sum of the values.
+ */
+uint64_t hist_sum(histogram_t* hist);
+
+/**
+ * @brief Returns the largest value recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Largest value, or 0 if the histogram is empty.
+ */
+uint64_t hist_max(histogram_t* hist);
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef UTILITIES_IO_ENGINE_H
+#define UTILITIES_IO_ENGINE_H
+
+#include <utilities/my_utils.h>
+
+#define IO_DEPTH (32)   // Operations an engine can have submitted but not yet reaped
+
+/* Backends an engine can run on. */
+enum IoBackend {
+    IO_BLOCKING = 0,    // Each operation runs to completion as it is queued
+    IO_URING = 1,       // Operations are batched into an io_uring and run by the kernel
+};
+
+/* Result of one finished operation. */
+typedef struct io_result {
+    void* tag;          // Tag the operation was queued with
+    ssize_t res;        // Bytes transferred, or -errno on failure
+} io_result_t;
+
+/* One operation queued on an engine. Reads, writes and sends are carried through
+** short transfers by resubmitting the rest, so a result covers the whole buffer.
+*/
+typedef struct io_op {
+    uint8_t kind;       // IoOpKind of the operation
+    int fd;
+    uint8_t* buf;
+    size_t len;
+    uint64_t off;       // File offset, unused for sends
+    size_t done;        // Bytes transferred so far
+    void* tag;
+} io_op_t;
+
+/* Queue of disk and socket operations owned by a single thread. The blocking
+** backend carries each one out as it is queued; the io_uring backend hands a whole
+** batch to the kernel with one system call and gathers completions with another.
+** Either way finished operations are collected with io_wait, so callers are
+** written once for both. At most one send per socket should be outstanding, since
+** io_uring may run operations on the same socket in any order.
+*/
+typedef struct io_engine {
+    enum IoBackend backend;
+    io_op_t ops[IO_DEPTH];          // Slots of operations not yet reaped
+    uint32_t free_slots[IO_DEPTH];  // Stack of unused slots
+    uint32_t nfree;
+    io_result_t done[IO_DEPTH];     // Finished operations not yet handed to io_wait
+    uint32_t ndone;
+    uint32_t nqueued;               // Operations queued since the last submission
+
+    // io_uring state, unused by the blocking backend.
+    int ring_fd;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+} io_engine_t;
+
+/**
+ * @brief Creates an engine. Falls back to the blocking backend, with a message,
+ * if io_uring is asked for but the kernel refuses it.
+ *
+ * @param backend Backend to run on.
+ * @return Pointer to the engine.
+ */
+io_engine_t* io_engine_create(enum IoBackend backend);
+
+/**
+ * @brief Destroys an engine. Operations still outstanding are waited for first.
+ *
+ * @param engine Pointer to the engine.
+ */
+void io_engine_destroy(io_engine_t* engine);
+
+/**
+ * @brief Sets the backend of engines handed out by io_engine_thread from now on.
+ *
+ * @param backend Backend to use.
+ */
+void io_engine_set_default(enum IoBackend backend);
+
+/**
+ * @brief Returns the calling thread's engine, creating it on first use. It is
+ * destroyed when the thread exits.
+ *
+ * @return Pointer to the engine.
+ */
+io_engine_t* io_engine_thread();
+
+/**
+ * @brief Queues a read of a file into a buffer.
+ *
+ * @param engine Pointer to the engine.
+ * @param fd File to read.
+ * @param buf Buffer to fill, which must stay valid until the result is reaped.
+ * @param len Number of bytes to read.
+ * @param off File offset to read from.
+ * @param tag Tag reported with the result.
+ * @return 0 on success, -1 if IO_DEPTH operations are already outstanding.
+ */
+int io_read(io_engine_t* engine, int fd, void* buf, size_t len, uint64_t off, void* tag);
+
+/**
+ * @brief Queues a write of a buffer into a file.
+ *
+ * @param engine Pointer to the engine.
+ * @param fd File to write.
+ * @param buf Bytes to write, which must stay valid until the result is reaped.
+ * @param len Number of bytes to write.
+ * @param off File offset to write at.
+ * @param tag Tag reported with the result.
+ * @return 0 on success, -1 if IO_DEPTH operations are already outstanding.
+ */
+int io_write(io_engine_t* engine, int fd, const void* buf, size_t len, uint64_t off, void* tag);
+
+/**
+ * @brief Queues a send of a buffer on a connected socket.
+ *
+ * @param engine Pointer to the engine.
+ * @param sock Socket to send on.
+ * @param buf Bytes to send, which must stay valid until the result is reaped.
+ * @param len Number of bytes to send.
+ * @param tag Tag reported with the result.
+ * @return 0 on success, -1 if IO_DEPTH operations are already outstanding.
+ */
+int io_send(io_engine_t* engine, int sock, const void* buf, size_t len, void* tag);
+
+/**
+ * @brief Queues a flush of a file's data to disk.
+ *
+ * @param engine Pointer to the engine.
+ * @param fd File to flush.
+ * @param tag Tag reported with the result.
+ * @return 0 on success, -1 if IO_DEPTH operations are already outstanding.
+ */
+int io_fsync(io_engine_t* engine, int fd, void* tag);
+
+/**
+ * @brief Submits queued operations and collects finished ones.
+ *
+ * @param engine Pointer to the engine.
+ * @param results Array receiving the finished operations.
+ * @param min Number of results to wait for, capped at those outstanding.
+ * @param max Capacity of results.
+ * @return Number of results written.
+ */
+uint32_t io_wait(io_engine_t* engine, io_result_t* results, uint32_t min, uint32_t max);
+
+/**
+ * @brief Returns the number of operations queued or running and not yet reaped.
+ *
+ * @param engine Pointer to the engine.
+ * @return Number of outstanding operations.
+ */
+uint32_t io_outstanding(io_engine_t* engine);
+
+#endif
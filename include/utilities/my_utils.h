@@ -34,9 +34,13 @@ typedef struct q_node {
     struct q_node* next;
 } q_node_t;
 
+#define Q_SPARE_MAX (64)   // Unlinked nodes a queue keeps for reuse
+
 typedef struct {
     q_node_t* head;
     q_node_t* tail;
+    q_node_t* spare;   // Unlinked nodes reused by q_enqueue before allocating
+    size_t nspare;
 } queue_t;
 
 /**
@@ -149,6 +153,15 @@ void* q_dequeue(queue_t* qobj);
  */
 int q_empty(queue_t* qobj);
 
+/**
+ * @brief Removes the first element holding the given data pointer from the queue.
+ *
+ * @param qobj Pointer to the queue.
+ * @param data Pointer to the data to remove.
+ * @return 1 if an element was removed, 0 otherwise.
+ */
+int q_remove(queue_t* qobj, void* data);
+
 /**
  * @brief Destroys the queue and frees all allocated memory.
  *
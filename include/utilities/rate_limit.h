@@ -0,0 +1,114 @@
+#ifndef UTILITIES_RATE_LIMIT_H
+#define UTILITIES_RATE_LIMIT_H
+
+#include <utilities/my_utils.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define RATE_QUANTUM (4096)      // Bytes reserved at a time, one packet
+#define RATE_BURST_DIV (10)      // A bucket holds 1/N of a second of traffic at most
+#define RATE_KIB_MAX (4194304)   // Largest limit accepted, in KiB/s
+
+/* Direction of traffic a limit applies to. */
+enum RateDir {
+    RATE_UP = 0,     // Bytes sent to peers
+    RATE_DOWN = 1,   // Bytes received from peers
+};
+
+/* Token bucket metering one stream of bytes. Tokens accrue at rate bytes per second
+** up to a burst of 1/RATE_BURST_DIV of a second. Takers reserve tokens ahead of
+** time and the bucket may go into debt; the debt tells the taker how long to sleep
+** before its bytes are due. A rate of 0 means unlimited and skips the lock.
+*/
+typedef struct token_bucket {
+    pthread_mutex_t lock;
+    _Atomic uint64_t rate;    // Bytes per second, 0 for unlimited
+    double tokens;            // Bytes that may go out now, negative while in debt
+    struct timespec last;     // When tokens was last brought up to date
+} token_bucket_t;
+
+/**
+ * @brief Initialises a bucket, starting full.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void bucket_init(token_bucket_t* bucket, uint64_t rate);
+
+/**
+ * @brief Releases a bucket's lock.
+ *
+ * @param bucket Pointer to the bucket.
+ */
+void bucket_destroy(token_bucket_t* bucket);
+
+/**
+ * @brief Changes the rate of a bucket. Takers already sleeping keep their schedule.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void bucket_set_rate(token_bucket_t* bucket, uint64_t rate);
+
+/**
+ * @brief Returns the rate of a bucket.
+ *
+ * @param bucket Pointer to the bucket.
+ * @return Bytes per second, 0 for unlimited.
+ */
+uint64_t bucket_rate(token_bucket_t* bucket);
+
+/**
+ * @brief Takes tokens from a bucket, going into debt if it holds too few.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param n Number of bytes.
+ * @return Nanoseconds the caller must wait before its bytes are due.
+ */
+uint64_t bucket_reserve(token_bucket_t* bucket, size_t n);
+
+/**
+ * @brief Returns the process-wide bucket for one direction.
+ *
+ * @param dir Direction of traffic.
+ * @return Pointer to the bucket.
+ */
+token_bucket_t* rate_global(enum RateDir dir);
+
+/**
+ * @brief Sets the rate new peers' buckets start with.
+ *
+ * @param dir Direction of traffic.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void rate_set_peer_default(enum RateDir dir, uint64_t rate);
+
+/**
+ * @brief Returns the rate new peers' buckets start with.
+ *
+ * @param dir Direction of traffic.
+ * @return Bytes per second, 0 for unlimited.
+ */
+uint64_t rate_peer_default(enum RateDir dir);
+
+/**
+ * @brief Returns the most bytes a peer may move at once without running ahead of
+ * its limits, the smaller burst of its own bucket and the global one.
+ *
+ * @param peer_bucket Pointer to the peer's bucket.
+ * @param dir Direction of traffic.
+ * @return Bytes, SIZE_MAX if neither bucket is limited.
+ */
+size_t rate_burst(token_bucket_t* peer_bucket, enum RateDir dir);
+
+/**
+ * @brief Waits until a peer may move a number of bytes, charging its own bucket and
+ * then the global bucket of the direction.
+ *
+ * @param peer_bucket Pointer to the peer's bucket.
+ * @param dir Direction of traffic.
+ * @param n Number of bytes.
+ */
+void rate_limit(token_bucket_t* peer_bucket, enum RateDir dir, size_t n);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef UTILITIES_RING_H
+#define UTILITIES_RING_H
+
+#include <stdatomic.h>
+#include <utilities/my_utils.h>
+
+#define RING_PAD (64)   // Cache line size, keeps producer and consumer positions apart
+
+/* Objects parked in a ring-backed free pool are poisoned under ASan, so a use after
+** they were returned is still reported even though the memory is never freed.
+*/
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POOL_POISON(addr, size) ASAN_POISON_MEMORY_REGION((addr), (size))
+#define POOL_UNPOISON(addr, size) ASAN_UNPOISON_MEMORY_REGION((addr), (size))
+#else
+#define POOL_POISON(addr, size) ((void)( addr ), (void)( size ))
+#define POOL_UNPOISON(addr, size) ((void)( addr ), (void)( size ))
+#endif
+
+/* One slot of a ring. seq tells whose turn the slot is: equal to a position when a
+** producer may fill it for that position, one past it once it holds data.
+*/
+typedef struct ring_cell {
+    _Atomic size_t seq;
+    void* data;
+} ring_cell_t;
+
+/* Bounded lock-free queue of pointers, after Vyukov's MPMC array queue. Producers
+** claim a position with one compare-and-swap and publish through the slot's
+** sequence number, so they never block one another or the consumer.
+*/
+typedef struct ring {
+    ring_cell_t* cells;
+    size_t mask;                                 // Capacity - 1, capacity is a power of two
+    char pad0[RING_PAD];
+    _Atomic size_t head;                         // Next position to fill
+    char pad1[RING_PAD - sizeof(size_t)];
+    _Atomic size_t tail;                         // Next position to drain
+    char pad2[RING_PAD - sizeof(size_t)];
+} ring_t;
+
+/**
+ * @brief Creates an empty ring.
+ *
+ * @param capacity Number of slots, rounded up to a power of two.
+ * @return Pointer to the ring.
+ */
+ring_t* ring_create(size_t capacity);
+
+/**
+ * @brief Destroys a ring. Pointers still held are not freed.
+ *
+ * @param ring Pointer to the ring.
+ */
+void ring_destroy(ring_t* ring);
+
+/**
+ * @brief Adds a pointer to the back of the ring. Safe from any number of threads.
+ *
+ * @param ring Pointer to the ring.
+ * @param data Pointer to add.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int ring_push(ring_t* ring, void* data);
+
+/**
+ * @brief Adds several pointers so they sit next to each other in the ring, or
+ * none of them. Only valid on a ring with a single consumer.
+ *
+ * @param ring Pointer to the ring.
+ * @param data Array of pointers to add.
+ * @param n Number of pointers, at most the capacity.
+ * @return 0 on success, -1 if there is not room for all of them.
+ */
+int ring_push_many(ring_t* ring, void** data, size_t n);
+
+/**
+ * @brief Removes the pointer at the front of the ring. Safe from any number of threads.
+ *
+ * @param ring Pointer to the ring.
+ * @return The pointer, or NULL if the ring is empty.
+ */
+void* ring_pop(ring_t* ring);
+
+/**
+ * @brief Returns the pointer at the front of the ring without removing it. Only
+ * meaningful to the single consumer of a ring.
+ *
+ * @param ring Pointer to the ring.
+ * @return The pointer, or NULL if the ring is empty.
+ */
+void* ring_peek(ring_t* ring);
+
+/**
+ * @brief Counts the pointers in the ring. Producers and consumers may move while
+ * it is read, so the count is only a snapshot.
+ *
+ * @param ring Pointer to the ring.
+ * @return Number of claimed slots not yet drained.
+ */
+size_t ring_count(ring_t* ring);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef UTILITIES_TRACE_H
+#define UTILITIES_TRACE_H
+
+#include <utilities/my_utils.h>
+#include <stdatomic.h>
+
+/* Spans are recorded only in builds made with -DTRACE, such as make btide_trace.
+** Otherwise every macro below expands to nothing, so traced code costs nothing.
+** Names must be string literals; only the pointer is kept.
+*/
+#ifdef TRACE
+#define TRACE_BEGIN(name) trace_event((name), 'B')
+#define TRACE_END(name) trace_event((name), 'E')
+#define TRACE_THREAD(fmt, ...) trace_thread_name(fmt, ##__VA_ARGS__)
+#else
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_THREAD(fmt, ...) do {} while (0)
+#endif
+
+#define TRACE_RING_EVENTS (1u << 15)    // Events kept per thread, the oldest are overwritten
+#define TRACE_NAME_MAX (48)             // Characters of a thread name
+
+/* One begin or end of a span. */
+typedef struct trace_event {
+    uint64_t ts_ns;                     // CLOCK_MONOTONIC time of the event
+    const char* name;                   // Span name, a string literal
+    char phase;                         // 'B' or 'E', as in the Chrome trace format
+} trace_event_t;
+
+/* Events of one thread. Only the owning thread writes, publishing each event by
+** advancing head, so recording takes no lock. A dump copies the ring and then
+** drops whatever the writer may have overwritten meanwhile. Rings outlive their
+** threads, so spans of finished peers still show up in a dump.
+*/
+typedef struct trace_ring {
+    trace_event_t events[TRACE_RING_EVENTS];
+    _Atomic uint64_t head;              // Events ever written
+    uint32_t tid;                       // Kernel thread id of the writer
+    char thread_name[TRACE_NAME_MAX];
+    struct trace_ring* next;            // Next ring in the list of all rings
+} trace_ring_t;
+
+/**
+ * @brief Records the begin or end of a span on the calling thread.
+ *
+ * @param name Name of the span, a string literal.
+ * @param phase 'B' to begin or 'E' to end.
+ */
+void trace_event(const char* name, char phase);
+
+/**
+ * @brief Names the calling thread in dumps.
+ *
+ * @param fmt printf style format of the name.
+ */
+void trace_thread_name(const char* fmt, ...);
+
+/**
+ * @brief Writes the events of every thread as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto both open.
+ *
+ * @param path File to write.
+ * @return Number of events written, or -1 if the file could not be written.
+ */
+long trace_dump(const char* path);
+
+#endif
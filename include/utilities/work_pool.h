@@ -0,0 +1,119 @@
+#ifndef UTILITIES_WORK_POOL_H
+#define UTILITIES_WORK_POOL_H
+
+#include <stdatomic.h>
+#include <utilities/my_utils.h>
+#include <utilities/ring.h>
+
+#define POOL_WORKERS_MAX (256)     // Max worker threads in a pool
+#define POOL_QUEUE_MAX (4096)      // Work items each worker's queue holds
+#define STRAND_ITEMS_MAX (1024)    // Items a strand holds before posting waits
+#define STRAND_BATCH (64)          // Items a strand runs before yielding its worker
+#define STRAND_SLICE_US (2000)     // Time a strand runs before yielding its worker, whatever the count
+
+/* A unit of work. It is owned by the submitter, which must keep it alive until
+** it has run; the pool only passes the pointer around.
+*/
+typedef struct work {
+    void (*run)(struct work* work);
+} work_t;
+
+/* Fixed set of worker threads. Every worker has its own lock-free queue; a worker
+** that runs dry takes work from the others' queues before going to sleep, so a
+** burst submitted to one worker spreads across the pool.
+*/
+typedef struct work_pool {
+    uint32_t nworkers;
+    pthread_t* threads;
+    ring_t** queues;                 // One queue per worker
+    _Atomic uint32_t next;           // Queue the next outside submission goes to
+    _Atomic size_t pending;          // Items queued and not yet taken
+    _Atomic uint32_t nsleeping;      // Workers waiting on cond
+    atomic_bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;             // Signalled when work arrives or the pool stops
+} work_pool_t;
+
+/* Runs items on a pool one at a time and in the order they were posted, so work
+** for one peer never runs on two workers at once while different peers still
+** run in parallel. Posting is safe from any thread.
+*/
+typedef struct strand {
+    work_t work;                     // Scheduled on the pool while items are pending
+    work_pool_t* pool;               // Pool to run on, NULL to run items on the poster
+    ring_t* items;
+    void (*fn)(void* ctx, void* item);
+    void* ctx;
+    atomic_bool scheduled;           // Work is queued on the pool or running
+} strand_t;
+
+/**
+ * @brief Starts a pool.
+ *
+ * @param nworkers Number of worker threads, 0 for one per online CPU.
+ * @return Pointer to the pool.
+ */
+work_pool_t* work_pool_create(uint32_t nworkers);
+
+/**
+ * @brief Stops a pool, waiting for its workers to exit. Items still queued are dropped.
+ *
+ * @param pool Pointer to the pool.
+ */
+void work_pool_destroy(work_pool_t* pool);
+
+/**
+ * @brief Queues work on a pool. Runs it on the caller if every queue is full.
+ *
+ * @param pool Pointer to the pool.
+ * @param work Work to run.
+ */
+void work_pool_submit(work_pool_t* pool, work_t* work);
+
+/**
+ * @brief Sets the pool returned by work_pool_shared.
+ *
+ * @param pool Pointer to the pool, or NULL.
+ */
+void work_pool_set_shared(work_pool_t* pool);
+
+/**
+ * @brief Returns the process-wide pool.
+ *
+ * @return Pointer to the pool, or NULL if none is running.
+ */
+work_pool_t* work_pool_shared();
+
+/**
+ * @brief Creates a strand.
+ *
+ * @param pool Pool to run on, or NULL to run items on the poster.
+ * @param fn Function run for every item.
+ * @param ctx Context passed to fn.
+ * @return Pointer to the strand.
+ */
+strand_t* strand_create(work_pool_t* pool, void (*fn)(void* ctx, void* item), void* ctx);
+
+/**
+ * @brief Posts an item to a strand, waiting while the strand is full.
+ *
+ * @param strand Pointer to the strand.
+ * @param item Item passed to the strand's function.
+ */
+void strand_post(strand_t* strand, void* item);
+
+/**
+ * @brief Waits until every item posted to a strand has run.
+ *
+ * @param strand Pointer to the strand.
+ */
+void strand_drain(strand_t* strand);
+
+/**
+ * @brief Destroys a strand. It must be drained first.
+ *
+ * @param strand Pointer to the strand.
+ */
+void strand_destroy(strand_t* strand);
+
+#endif
@@ -0,0 +1,473 @@
+#include <utilities/my_utils.h>
+#include <chk/pkgchk.h>
+#include <chk/pkg_helper.h>
+#include <crypt/sha256.h>
+#include <peer_2_peer/packet.h>
+#include <tree/merkletree.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* Microbenchmarks of the hashing, tree and packet code every package load and
+** transfer goes through. Results are printed as one JSON document on stdout so
+** runs can be kept and compared; progress goes to stderr.
+**
+** Every case is first run with a growing number of operations until one
+** repetition takes BENCH_REP_MIN_NS, which also warms caches and the branch
+** predictors. It is then timed BENCH_REPS times and the median, fastest and
+** slowest repetition are reported.
+*/
+
+#define BENCH_REPS (5)                    // Timed repetitions per case, after warmup
+#define BENCH_REP_MIN_NS (50000000ULL)    // Shortest repetition, operations are added until it is reached
+#define BENCH_CASE_MAX_NS (10000000000ULL) // Repetitions are cut so a slow case stays within this
+#define BENCH_CHUNK_BYTES (256)           // Chunk size of the synthetic packages
+#define BENCH_CHUNKS_MIN (1024)           // Smallest synthetic package, in chunks
+#define BENCH_CHUNKS_MAX (8388608)        // Largest synthetic package by default, in chunks
+#define BENCH_QUERY_CHUNKS_MAX (131072)   // Largest package hash lookups are run on, they scan every node
+#define BENCH_PARTIAL_EVERY (64)          // One chunk in this many is missing from a partial package
+#define BENCH_TMP_TEMPLATE "/tmp/bench_mtree_XXXXXX"
+
+/* Options from the command line. */
+typedef struct bench_opts {
+    int reps;
+    uint32_t max_chunks;
+    const char* filter;     // Only cases whose name contains it are run, NULL for all
+} bench_opts_t;
+
+/* Runs a number of operations and returns the nanoseconds they took. */
+typedef uint64_t (*bench_fn_t)(void* ctx, uint64_t iters);
+
+/* A synthetic package: a full tree over a data file of numbered chunks. */
+typedef struct bench_tree {
+    bpkg_t* bpkg;
+    char path[sizeof(BENCH_TMP_TEMPLATE)];
+    uint32_t nchunks;
+    uint64_t size;
+    unsigned int seed;      // Picks the nodes looked up
+} bench_tree_t;
+
+typedef struct bench_sha {
+    uint8_t* buf;
+    uint32_t size;
+} bench_sha_t;
+
+static bool bench_first = true;       // No result has been printed yet
+static volatile uint64_t bench_sink;  // Keeps results the compiler could otherwise drop
+
+static uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return ( x > y ) - ( x < y );
+}
+
+/**
+ * @brief Prints the start of a result, separated from the one before.
+ *
+ * @param name Name of the case.
+ * @param params JSON members describing the case, without braces.
+ */
+static void bench_open(const char* name, const char* params) {
+    printf("%s\n    {\"name\": \"%s\", \"params\": {%s}", bench_first ? "" : ",", name, params);
+    bench_first = false;
+}
+
+/**
+ * @brief Prints a case that was not run, with the reason.
+ */
+static void bench_skip(const bench_opts_t* opts, const char* name, const char* params, const char* reason) {
+    if ( opts->filter && !strstr(name, opts->filter) ) {
+        return;
+    }
+    bench_open(name, params);
+    printf(", \"skipped\": \"%s\"}", reason);
+    fflush(stdout);
+    fprintf(stderr, "%-32s %-40s skipped: %s\n", name, params, reason);
+}
+
+/**
+ * @brief Calibrates, warms up and times a case, then prints its result.
+ *
+ * @param opts Options from the command line.
+ * @param name Name of the case.
+ * @param params JSON members describing the case, without braces.
+ * @param bytes Bytes processed by one operation, 0 if throughput means nothing.
+ * @param fn Runs the operations.
+ * @param ctx Passed to fn.
+ */
+static void bench_case(const bench_opts_t* opts, const char* name, const char* params, uint64_t bytes, bench_fn_t fn, void* ctx) {
+    if ( opts->filter && !strstr(name, opts->filter) ) {
+        return;
+    }
+
+    // Aim a little past the minimum so the next round usually gets there.
+    uint64_t iters = 1;
+    uint64_t ns = fn(ctx, iters);
+    while ( ns < BENCH_REP_MIN_NS ) {
+        uint64_t next = ns > 0 ? iters * BENCH_REP_MIN_NS / ns + iters / 4 : iters * 16;
+        iters = next > iters * 2 ? next : iters * 2;
+        ns = fn(ctx, iters);
+    }
+
+    int reps = opts->reps;
+    if ( ns * reps > BENCH_CASE_MAX_NS ) {
+        reps = ns >= BENCH_CASE_MAX_NS ? 1 : (int)( BENCH_CASE_MAX_NS / ns );
+    }
+    double per_op[reps];
+    for ( int r = 0; r < reps; r++ ) {
+        per_op[r] = (double)fn(ctx, iters) / iters;
+    }
+    qsort(per_op, reps, sizeof(double), bench_cmp_double);
+    double median = reps % 2 ? per_op[reps / 2] : ( per_op[reps / 2 - 1] + per_op[reps / 2] ) / 2;
+
+    bench_open(name, params);
+    printf(", \"iters\": %lu, \"reps\": %d, \"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, \"ns_per_op_max\": %.2f",
+        (unsigned long)iters, reps, median, per_op[0], per_op[reps - 1]);
+    if ( bytes ) {
+        // Bytes per nanosecond are GB/s.
+        printf(", \"bytes_per_op\": %lu, \"gb_per_s\": %.3f", (unsigned long)bytes, bytes / median);
+    }
+    printf("}");
+    fflush(stdout);
+    fprintf(stderr, "%-32s %-40s %14.2f ns/op\n", name, params, median);
+}
+
+static uint64_t bench_sha256_update(void* ctx, uint64_t iters) {
+    bench_sha_t* sha = (bench_sha_t*)ctx;
+    struct sha256_compute_data cdata;
+    sha256_compute_data_init(&cdata);
+
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        sha256_update(&cdata, sha->buf, sha->size);
+    }
+    uint64_t end = bench_now_ns();
+
+    uint8_t hashout[SHA256_INT_SZ];
+    sha256_finalize(&cdata, hashout);
+    bench_sink += cdata.hcomps[0];
+    return end - start;
+}
+
+static uint64_t bench_internal_hash(void* ctx, uint64_t iters) {
+    mtree_node_t* node = (mtree_node_t*)ctx;
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        sha256_compute_internal_hash(node);
+        // Feeding the result back in stops the calls being hoisted out of the loop.
+        node->left->computed_hash[0] = node->computed_hash[0];
+    }
+    uint64_t end = bench_now_ns();
+    bench_sink += node->computed_hash[1];
+    return end - start;
+}
+
+static uint64_t bench_mtree_build(void* ctx, uint64_t iters) {
+    bench_tree_t* tree = (bench_tree_t*)ctx;
+    mtree_t* mtree = tree->bpkg->mtree;
+    uint64_t total = 0;
+
+    // Only the build is timed, not taking the previous one down.
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        uint64_t start = bench_now_ns();
+        mtree_t* built = mtree_build(mtree, tree->path);
+        total += bench_now_ns() - start;
+        if ( !built ) {
+            fprintf(stderr, "Failed to build tree over %s\n", tree->path);
+            exit(EXIT_FAILURE);
+        }
+        munmap(mtree->f_data, mtree->f_size);
+        close(mtree->f_fd);
+        mtree->f_data = NULL;
+        mtree->f_fd = -1;
+    }
+    return total;
+}
+
+static uint64_t bench_find_hit(void* ctx, uint64_t iters) {
+    bench_tree_t* tree = (bench_tree_t*)ctx;
+    mtree_t* mtree = tree->bpkg->mtree;
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        mtree_node_t* want = mtree->nodes[rand_r(&tree->seed) % mtree->nnodes];
+        bench_sink += (uintptr_t)bpkg_find_node_from_hash(mtree, want->expected_hash, ALL);
+    }
+    return bench_now_ns() - start;
+}
+
+static uint64_t bench_find_miss(void* ctx, uint64_t iters) {
+    bench_tree_t* tree = (bench_tree_t*)ctx;
+    char missing[SHA256_HEXLEN + 1];
+    memset(missing, 'x', SHA256_HEXLEN);
+    missing[SHA256_HEXLEN] = '\0';
+
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        bench_sink += (uintptr_t)bpkg_find_node_from_hash(tree->bpkg->mtree, missing, ALL);
+    }
+    return bench_now_ns() - start;
+}
+
+static uint64_t bench_min_completed(void* ctx, uint64_t iters) {
+    bench_tree_t* tree = (bench_tree_t*)ctx;
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        bpkg_query_t* qry = bpkg_get_min_completed_hashes(tree->bpkg);
+        bench_sink += qry->len;
+        bpkg_query_destroy(qry);
+    }
+    return bench_now_ns() - start;
+}
+
+static uint64_t bench_marshall(void* ctx, uint64_t iters) {
+    pkt_t* pkt = (pkt_t*)ctx;
+    uint8_t buf[sizeof(pkt_t)];
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        pkt_marshall(pkt, buf);
+        pkt->payload.res.offset = buf[i % sizeof(buf)];
+    }
+    uint64_t end = bench_now_ns();
+    bench_sink += buf[0];
+    return end - start;
+}
+
+static uint64_t bench_unmarshall(void* ctx, uint64_t iters) {
+    uint8_t* buf = (uint8_t*)ctx;
+    pkt_t pkt;
+    uint64_t start = bench_now_ns();
+    for ( uint64_t i = 0; i < iters; i++ ) {
+        pkt_unmarshall(&pkt, buf);
+        buf[4] = (uint8_t)pkt.payload.res.data[i % DATA_MAX];
+    }
+    uint64_t end = bench_now_ns();
+    bench_sink += pkt.msg_code;
+    return end - start;
+}
+
+/**
+ * @brief Creates a synthetic package: a data file of numbered chunks, so every
+ * chunk hashes differently, and an unbuilt tree over it.
+ *
+ * @param nchunks Number of chunks, a power of two.
+ * @return The package, or NULL if the data file could not be made.
+ */
+static bench_tree_t* bench_tree_create(uint32_t nchunks) {
+    bench_tree_t* tree = (bench_tree_t*)my_malloc(sizeof(bench_tree_t));
+    strcpy(tree->path, BENCH_TMP_TEMPLATE);
+    tree->nchunks = nchunks;
+    tree->size = (uint64_t)nchunks * BENCH_CHUNK_BYTES;
+    tree->seed = nchunks;
+
+    int fd = mkstemp(tree->path);
+    if ( fd < 0 || ftruncate(fd, tree->size) < 0 ) {
+        perror("Failed to create benchmark data file");
+        if ( fd >= 0 ) close(fd);
+        free(tree);
+        return NULL;
+    }
+    uint8_t* data = (uint8_t*)mmap(NULL, tree->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED ) {
+        perror("Failed to map benchmark data file");
+        unlink(tree->path);
+        free(tree);
+        return NULL;
+    }
+    for ( uint32_t i = 0; i < nchunks; i++ ) {
+        memcpy(data + (uint64_t)i * BENCH_CHUNK_BYTES, &i, sizeof(i));
+    }
+    munmap(data, tree->size);
+
+    bpkg_t* bpkg = bpkg_create();
+    mtree_t* mtree = bpkg->mtree;
+    mtree->nchunks = nchunks;
+    mtree->nhashes = nchunks - 1;
+    mtree->f_size = (uint32_t)tree->size;
+    mtree->hsh_nodes = (mtree_node_t**)my_malloc(mtree->nhashes * sizeof(mtree_node_t*));
+    mtree->chk_nodes = (mtree_node_t**)my_malloc(mtree->nchunks * sizeof(mtree_node_t*));
+    for ( uint32_t i = 0; i < mtree->nhashes; i++ ) {
+        mtree->hsh_nodes[i] = mtree_node_create(NULL, 0, 0, NULL);
+    }
+    for ( uint32_t i = 0; i < nchunks; i++ ) {
+        chunk_t* chunk = chunk_create(NULL, BENCH_CHUNK_BYTES, i * BENCH_CHUNK_BYTES);
+        chunk->index = i;
+        mtree->chk_nodes[i] = mtree_node_create(NULL, 1, 0, chunk);
+    }
+    combine_nodes(mtree);
+    tree->bpkg = bpkg;
+    return tree;
+}
+
+/**
+ * @brief Frees a synthetic package and removes its data file.
+ */
+static void bench_tree_destroy(bench_tree_t* tree) {
+    bpkg_obj_destroy(tree->bpkg);
+    unlink(tree->path);
+    free(tree);
+}
+
+/**
+ * @brief Whether a synthetic package of some size fits comfortably in memory.
+ *
+ * @param nchunks Number of chunks.
+ * @return true if it needs less than half the memory available.
+ */
+static bool bench_tree_fits(uint32_t nchunks) {
+    // Each node and chunk is its own allocation, with the allocator's header.
+    uint64_t nnodes = 2ULL * nchunks - 1;
+    uint64_t need = nnodes * ( sizeof(mtree_node_t) + 16 + 2 * sizeof(mtree_node_t*) )
+        + (uint64_t)nchunks * ( sizeof(chunk_t) + 16 + BENCH_CHUNK_BYTES );
+    uint64_t avail = (uint64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    return need < avail / 2;
+}
+
+/**
+ * @brief Runs the tree build and package query cases on one synthetic package.
+ */
+static void bench_tree_cases(const bench_opts_t* opts, uint32_t nchunks) {
+    char params[128];
+    snprintf(params, sizeof(params), "\"chunks\": %u, \"chunk_bytes\": %u", nchunks, BENCH_CHUNK_BYTES);
+    if ( !bench_tree_fits(nchunks) ) {
+        bench_skip(opts, "mtree_build", params, "not enough memory");
+        return;
+    }
+    bool queries = !opts->filter || strstr("bpkg_find_node_from_hash", opts->filter) || strstr("bpkg_get_min_completed_hashes", opts->filter);
+    if ( opts->filter && !strstr("mtree_build", opts->filter) && !queries ) {
+        return;
+    }
+
+    fprintf(stderr, "Creating a synthetic package of %u chunks...\n", nchunks);
+    bench_tree_t* tree = bench_tree_create(nchunks);
+    if ( !tree ) {
+        bench_skip(opts, "mtree_build", params, "data file could not be created");
+        return;
+    }
+    mtree_t* mtree = tree->bpkg->mtree;
+    bench_case(opts, "mtree_build", params, tree->size, bench_mtree_build, tree);
+
+    // The queries run on a built tree whose every hash matches the data.
+    if ( !mtree_build(mtree, tree->path) ) {
+        bench_tree_destroy(tree);
+        return;
+    }
+    for ( uint32_t i = 0; i < mtree->nnodes; i++ ) {
+        memcpy(mtree->nodes[i]->expected_hash, mtree->nodes[i]->computed_hash, SHA256_HEXLEN);
+    }
+
+    char qparams[160];
+    if ( nchunks <= BENCH_QUERY_CHUNKS_MAX ) {
+        snprintf(qparams, sizeof(qparams), "\"nodes\": %u, \"found\": true", mtree->nnodes);
+        bench_case(opts, "bpkg_find_node_from_hash", qparams, 0, bench_find_hit, tree);
+        snprintf(qparams, sizeof(qparams), "\"nodes\": %u, \"found\": false", mtree->nnodes);
+        bench_case(opts, "bpkg_find_node_from_hash", qparams, 0, bench_find_miss, tree);
+    }
+
+    snprintf(qparams, sizeof(qparams), "\"chunks\": %u, \"complete\": true", nchunks);
+    bench_case(opts, "bpkg_get_min_completed_hashes", qparams, 0, bench_min_completed, tree);
+
+    // A missing chunk also leaves every subtree above it incomplete.
+    for ( uint32_t i = 0; i < nchunks; i += BENCH_PARTIAL_EVERY ) {
+        for ( mtree_node_t* node = mtree->chk_nodes[i]; node; node = node->parent ) {
+            node->expected_hash[0] = 'x';
+        }
+    }
+    snprintf(qparams, sizeof(qparams), "\"chunks\": %u, \"complete\": false, \"missing_every\": %u", nchunks, BENCH_PARTIAL_EVERY);
+    bench_case(opts, "bpkg_get_min_completed_hashes", qparams, 0, bench_min_completed, tree);
+
+    bench_tree_destroy(tree);
+}
+
+int main(int argc, char** argv) {
+    bench_opts_t opts = { .reps = BENCH_REPS, .max_chunks = BENCH_CHUNKS_MAX, .filter = NULL };
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "--reps") == 0 && i + 1 < argc ) {
+            opts.reps = atoi(argv[++i]);
+        }
+        else if ( strcmp(argv[i], "--max-chunks") == 0 && i + 1 < argc ) {
+            opts.max_chunks = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if ( strcmp(argv[i], "--filter") == 0 && i + 1 < argc ) {
+            opts.filter = argv[++i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [--reps N] [--max-chunks N] [--filter NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+    opts.reps = opts.reps > 0 ? opts.reps : 1;
+
+    printf("{\n  \"suite\": \"btide-micro\",\n  \"compiler\": \"%s\",\n  \"optimized\": %s,\n  \"reps\": %d,\n  \"results\": [",
+        __VERSION__,
+#ifdef __OPTIMIZE__
+        "true",
+#else
+        "false",
+#endif
+        opts.reps);
+
+    bench_sha_t sha;
+    uint32_t sizes[] = { 4096, 1024 * 1024 };
+    for ( size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ ) {
+        sha.size = sizes[i];
+        sha.buf = (uint8_t*)my_malloc(sha.size);
+        for ( uint32_t b = 0; b < sha.size; b++ ) {
+            sha.buf[b] = (uint8_t)( b * 131 );
+        }
+        char params[64];
+        snprintf(params, sizeof(params), "\"bytes\": %u", sha.size);
+        bench_case(&opts, "sha256_update", params, sha.size, bench_sha256_update, &sha);
+        free(sha.buf);
+    }
+
+    mtree_node_t* left = mtree_node_create(NULL, 1, 1, NULL);
+    mtree_node_t* right = mtree_node_create(NULL, 1, 1, NULL);
+    mtree_node_t* parent = mtree_node_create(NULL, 0, 0, NULL);
+    memset(left->computed_hash, 'a', SHA256_HEXLEN);
+    memset(right->computed_hash, 'b', SHA256_HEXLEN);
+    parent->left = left;
+    parent->right = right;
+    bench_case(&opts, "sha256_compute_internal_hash", "", 2 * SHA256_HEXLEN, bench_internal_hash, parent);
+    mtree_node_destroy(left);
+    mtree_node_destroy(right);
+    mtree_node_destroy(parent);
+
+    pkt_t* pkt = pkt_alloc();
+    memset(pkt, 0, sizeof(pkt_t));
+    pkt->msg_code = PKT_MSG_RES;
+    for ( uint32_t b = 0; b < DATA_MAX; b++ ) {
+        pkt->payload.res.data[b] = (uint8_t)b;
+    }
+    pkt->payload.res.size = DATA_MAX;
+    uint8_t* marshalled = (uint8_t*)my_malloc(sizeof(pkt_t));
+    pkt_marshall(pkt, marshalled);
+    char params[64];
+    snprintf(params, sizeof(params), "\"msg\": \"RES\"");
+    bench_case(&opts, "pkt_marshall", params, sizeof(pkt_t), bench_marshall, pkt);
+    bench_case(&opts, "pkt_unmarshall", params, sizeof(pkt_t), bench_unmarshall, marshalled);
+    free(marshalled);
+    pkt_destroy(pkt);
+
+    // Sizes grow eightfold, ending at the largest power of two within the limit.
+    for ( uint64_t nchunks = BENCH_CHUNKS_MIN; nchunks <= opts.max_chunks; nchunks *= 8 ) {
+        bench_tree_cases(&opts, (uint32_t)nchunks);
+        if ( nchunks * 8 > opts.max_chunks && nchunks < opts.max_chunks ) {
+            uint64_t last = nchunks;
+            while ( last * 2 <= opts.max_chunks ) {
+                last *= 2;
+            }
+            if ( last != nchunks ) {
+                bench_tree_cases(&opts, (uint32_t)last);
+            }
+            break;
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <peer_2_peer/peer_data_sync.h>
+#include <utilities/my_utils.h>
+#include <utilities/ring.h>
+#include <sched.h>
+#include <time.h>
+
+/* Compares the lock-free request queue against the mutex-guarded linked list it
+** replaced: several producer threads enqueue requests while one consumer drains
+** them, as the CLI, fetch drivers and peer threads do with a peer's queue.
+*/
+
+#define BENCH_OPS (2000000)   // Requests passed through the queue per run
+#define BENCH_RUNS (3)        // Runs per configuration, the best is reported
+
+/* The previous request queue: a queue_t under a mutex, one malloc per node. */
+typedef struct locked_q {
+    queue_t* queue;
+    pthread_mutex_t lock;
+} locked_q_t;
+
+typedef struct bench_args {
+    bool lockfree;
+    locked_q_t* locked;
+    request_q_t* reqs_q;
+    size_t nops;
+} bench_args_t;
+
+static struct pkt_t bench_pkt;   // Placeholder packet, never sent or freed
+
+static void* bench_producer(void* arg) {
+    bench_args_t* args = (bench_args_t*)arg;
+
+    for ( size_t i = 0; i < args->nops; i++ ) {
+        if ( args->lockfree ) {
+            request_t* req = req_create(&bench_pkt);
+            // Retry rather than drop when full, so every run moves the same work.
+            while ( ring_push(args->reqs_q->ring, req) < 0 ) {
+                sched_yield();
+            }
+        }
+        else {
+            request_t* req = (request_t*)my_malloc(sizeof(request_t));
+            memset(req, 0, sizeof(request_t));
+            req->pkt = &bench_pkt;
+            pthread_mutex_lock(&args->locked->lock);
+            q_enqueue(args->locked->queue, req);
+            pthread_mutex_unlock(&args->locked->lock);
+        }
+    }
+    return NULL;
+}
+
+static void bench_consume(bench_args_t* args, size_t total) {
+    size_t done = 0;
+    while ( done < total ) {
+        request_t* req;
+        if ( args->lockfree ) {
+            req = reqs_dequeue(args->reqs_q);
+        }
+        else {
+            pthread_mutex_lock(&args->locked->lock);
+            req = (request_t*)q_dequeue(args->locked->queue);
+            pthread_mutex_unlock(&args->locked->lock);
+        }
+
+        if ( !req ) {
+            sched_yield();
+            continue;
+        }
+        if ( args->lockfree ) {
+            req->pkt = NULL;
+            req_destroy(req);
+        }
+        else {
+            free(req);
+        }
+        done++;
+    }
+}
+
+static double bench_run(bool lockfree, int nproducers) {
+    locked_q_t locked = { .queue = q_init() };
+    pthread_mutex_init(&locked.lock, NULL);
+    request_q_t* reqs_q = reqs_create();
+
+    bench_args_t args = { .lockfree = lockfree, .locked = &locked, .reqs_q = reqs_q,
+                          .nops = BENCH_OPS / nproducers };
+    pthread_t threads[nproducers];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( int i = 0; i < nproducers; i++ ) {
+        pthread_create(&threads[i], NULL, bench_producer, &args);
+    }
+    bench_consume(&args, args.nops * nproducers);
+    for ( int i = 0; i < nproducers; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    reqs_destroy(reqs_q);
+    q_destroy(locked.queue);
+    pthread_mutex_destroy(&locked.lock);
+
+    double secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    return args.nops * nproducers / secs;
+}
+
+int main() {
+    int producers[] = { 1, 2, 4, 8 };
+
+    printf("%-10s %14s %14s %8s\n", "producers", "locked ops/s", "ring ops/s", "speedup");
+    for ( size_t p = 0; p < sizeof(producers) / sizeof(producers[0]); p++ ) {
+        double best_locked = 0, best_ring = 0;
+        for ( int run = 0; run < BENCH_RUNS; run++ ) {
+            double locked = bench_run(false, producers[p]);
+            double ring = bench_run(true, producers[p]);
+            best_locked = locked > best_locked ? locked : best_locked;
+            best_ring = ring > best_ring ? ring : best_ring;
+        }
+        printf("%-10d %14.0f %14.0f %7.2fx\n", producers[p], best_locked, best_ring, best_ring / best_locked);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -1,20 +1,33 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <signal.h>
 #include <cli.h>
 #include <config.h>
 #include <btide.h>
+#include <peer_2_peer/fetch.h>
+#include <peer_2_peer/metrics_server.h>
+#include <peer_2_peer/peer_connector.h>
 #include <peer_2_peer/peer_data_sync.h>
 #include <peer_2_peer/peer_handler.h>
 #include <peer_2_peer/peer_server.h>
+#include <peer_2_peer/pkg_loader.h>
+#include <peer_2_peer/pkg_watcher.h>
+#include <utilities/io_engine.h>
 #include <utilities/my_utils.h>
+#include <utilities/rate_limit.h>
+#include <utilities/work_pool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
 // Shared data structures
 peers_t* peers = NULL;
 bpkgs_t* bpkgs = NULL;
 config_t* config = NULL;
+work_pool_t* pool = NULL;
+pkg_loader_t* loader = NULL;
+pkg_watcher_t* watcher = NULL;
+peer_connector_t* connector = NULL;
+metrics_server_t* metrics_server = NULL;
 int server_fd = 0;
 pthread_t server_thread;
 
@@ -29,6 +42,23 @@ volatile sig_atomic_t stop = 0;
 void graceful_shutdown() {
      debug_print("Shutting btide down now...\n");
 
+     // Scrapes walk the peers list, so they stop before it is torn down.
+     metrics_server_stop(metrics_server);
+     metrics_server = NULL;
+
+     // Loads advertise to peers as they finish, so the scan stops before the peers go.
+     pkg_watcher_stop(watcher);
+     watcher = NULL;
+     pkg_loader_stop(loader);
+     loader = NULL;
+
+     // Peers dropping while they are cancelled must not be connected to again.
+     connector_stop(connector);
+     connector = NULL;
+
+     // Fetch threads look peers up, so they have to finish before the list goes.
+     fetch_stop_all();
+
      if ( peers ) {
           cancel_all_peers(peers);
      }
@@ -38,6 +68,13 @@ void graceful_shutdown() {
           pthread_join(server_thread, NULL);
      }
 
+     // Workers run peers' queued work, so they stop only once the peers are gone.
+     if ( pool ) {
+          work_pool_set_shared(NULL);
+          work_pool_destroy(pool);
+          pool = NULL;
+     }
+
      if ( bpkgs ) {
           pkgs_destroy(bpkgs);
      }
@@ -80,12 +117,34 @@ void init_server(char* config_filename) {
      uint32_t server_port = config->port;
      debug_print("Server port: %d\n", server_port);
 
+     io_engine_set_default((enum IoBackend)config->io_backend);
+     pool = work_pool_create(config->workers);
+     bucket_set_rate(rate_global(RATE_UP), (uint64_t)config->upload_limit * 1024);
+     bucket_set_rate(rate_global(RATE_DOWN), (uint64_t)config->download_limit * 1024);
+     rate_set_peer_default(RATE_UP, (uint64_t)config->peer_upload_limit * 1024);
+     rate_set_peer_default(RATE_DOWN, (uint64_t)config->peer_download_limit * 1024);
+     work_pool_set_shared(pool);
      bpkgs = pkgs_init(config->directory);
      peers = peer_list_create(config->max_peers);
 
      server_fd = p2p_setup_server(server_port);
 
      create_p2p_server_thread(server_fd, server_port, &server_thread, peers, bpkgs);
+     connector = connector_start(peers, bpkgs);
+
+     if ( config->metrics_port ) {
+          metrics_server = metrics_server_start(config->metrics_port, peers);
+     }
+
+     // The watch starts first so packages dropped in during the scan are not missed.
+     if ( config->watch ) {
+          watcher = pkg_watcher_start(bpkgs, peers);
+     }
+
+     // Packages are served one by one as they load, while the CLI is already up.
+     if ( config->autoload ) {
+          loader = pkg_loader_start(bpkgs, peers, config->workers);
+     }
 }
 
 /**
@@ -0,0 +1,245 @@
+#include <chk/pkg_batch.h>
+#include <chk/pkgchk.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Appends a path to a growing array.
+ *
+ * @param paths Array of paths, reallocated as needed.
+ * @param count Number of paths held.
+ * @param cap Number of paths the array can hold.
+ * @param path Path to copy in.
+ */
+static void batch_add_path(char*** paths, uint32_t* count, uint32_t* cap, const char* path) {
+    if ( *count == *cap ) {
+        *cap = *cap ? *cap * 2 : 64;
+        *paths = (char**)realloc(*paths, *cap * sizeof(char*));
+        if ( !*paths ) {
+            perror("Failed to grow package list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*paths)[( *count )++] = strdup(path);
+}
+
+/**
+ * @brief Orders paths by name.
+ *
+ * @param a Pointer to the first path.
+ * @param b Pointer to the second path.
+ * @return Negative, zero or positive as strcmp.
+ */
+static int batch_cmp_path(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * @brief Adds every .bpkg file under a directory, descending into subdirectories.
+ *
+ * @param dir Directory to search.
+ * @param paths Array of paths, reallocated as needed.
+ * @param count Number of paths held.
+ * @param cap Number of paths the array can hold.
+ */
+static void batch_scan_dir(const char* dir, char*** paths, uint32_t* count, uint32_t* cap) {
+    DIR* dp = opendir(dir);
+    if ( !dp ) {
+        perror("Cannot open package directory");
+        return;
+    }
+
+    uint32_t first = *count;
+    struct dirent* entry;
+    while ( ( entry = readdir(dp) ) != NULL ) {
+        if ( entry->d_name[0] == '.' ) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        struct stat st;
+        if ( stat(path, &st) != 0 ) {
+            continue;
+        }
+        if ( S_ISDIR(st.st_mode) ) {
+            batch_scan_dir(path, paths, count, cap);
+        }
+        else {
+            size_t len = strlen(entry->d_name);
+            if ( len > 5 && strcmp(entry->d_name + len - 5, ".bpkg") == 0 ) {
+                batch_add_path(paths, count, cap, path);
+            }
+        }
+    }
+    closedir(dp);
+    qsort(*paths + first, *count - first, sizeof(char*), batch_cmp_path);
+}
+
+/**
+ * @brief Expands arguments into package paths. Directories are searched recursively
+ * for .bpkg files, which are taken in name order.
+ *
+ * @param args Package paths and directories.
+ * @param nargs Number of arguments.
+ * @param count Output for the number of paths.
+ * @return Array of paths, freed with bpkg_batch_paths_destroy, or NULL if there are none.
+ */
+char** bpkg_batch_collect(char** args, int nargs, uint32_t* count) {
+    char** paths = NULL;
+    uint32_t cap = 0;
+    *count = 0;
+
+    for ( int i = 0; i < nargs; i++ ) {
+        struct stat st;
+        if ( stat(args[i], &st) == 0 && S_ISDIR(st.st_mode) ) {
+            // Trailing slashes would double up in the joined paths.
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s", args[i]);
+            for ( size_t len = strlen(dir); len > 1 && dir[len - 1] == '/'; len-- ) {
+                dir[len - 1] = '\0';
+            }
+            batch_scan_dir(dir, &paths, count, &cap);
+        }
+        else {
+            batch_add_path(&paths, count, &cap, args[i]);
+        }
+    }
+    return paths;
+}
+
+/**
+ * @brief Frees paths returned by bpkg_batch_collect.
+ *
+ * @param paths Array of paths.
+ * @param count Number of paths.
+ */
+void bpkg_batch_paths_destroy(char** paths, uint32_t count) {
+    for ( uint32_t i = 0; i < count; i++ ) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+/**
+ * @brief Loads one package and runs the batch's query on it, on a worker.
+ *
+ * @param work The job's work item.
+ */
+static void batch_job_run(work_t* work) {
+    batch_job_t* job = (batch_job_t*)work;
+    FILE* out = open_memstream(&job->output, &job->output_len);
+    if ( !out ) {
+        perror("Failed to buffer package result");
+        exit(EXIT_FAILURE);
+    }
+
+    // bpkg_load builds the tree, hashing every chunk of the data file.
+    bpkg_t* bpkg = bpkg_load(job->path);
+    if ( !bpkg ) {
+        fprintf(out, "%s: unable to load pkg and tree\n", job->path);
+    }
+    else {
+        mtree_t* mtree = bpkg->mtree;
+        job->loaded = true;
+        job->nchunks = mtree->nchunks;
+        job->bytes = mtree->f_size;
+        for ( uint32_t i = 0; i < mtree->nchunks; i++ ) {
+            job->ncomplete += mtree->chk_nodes[i] && check_chunk(mtree->chk_nodes[i]);
+        }
+        fprintf(out, "%s: %u/%u chunks complete\n", job->path, job->ncomplete, job->nchunks);
+
+        bpkg_query_t* qry = NULL;
+        switch ( job->mode ) {
+        case BATCH_FILE_CHECK:
+            qry = bpkg_file_check(bpkg);
+            break;
+        case BATCH_CHUNK_CHECK:
+            qry = bpkg_get_completed_chunks(bpkg);
+            break;
+        case BATCH_MIN_HASHES:
+            qry = bpkg_get_min_completed_hashes(bpkg);
+            break;
+        }
+        for ( size_t i = 0; qry && i < qry->len; i++ ) {
+            fprintf(out, "\t%.64s\n", qry->hashes[i]);
+        }
+        if ( qry ) {
+            bpkg_query_destroy(qry);
+        }
+        bpkg_obj_destroy(bpkg);
+    }
+    fclose(out);
+
+    batch_t* batch = job->batch;
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * @brief Runs one query over many packages on a pool, printing each package's
+ * result in input order as soon as it and those before it are done.
+ *
+ * @param paths Package paths.
+ * @param count Number of paths.
+ * @param mode Query to run.
+ * @param nworkers Worker threads, 0 for one per online CPU.
+ * @param out Stream for the results.
+ * @param stats Output for the totals, may be NULL.
+ * @return 0 if every package loaded, 1 otherwise.
+ */
+int bpkg_batch_run(char** paths, uint32_t count, enum BatchMode mode, uint32_t nworkers, FILE* out, batch_stats_t* stats) {
+    batch_t batch;
+    batch.njobs = count;
+    batch.jobs = (batch_job_t*)my_malloc(( count ? count : 1 ) * sizeof(batch_job_t));
+    memset(batch.jobs, 0, ( count ? count : 1 ) * sizeof(batch_job_t));
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    work_pool_t* pool = work_pool_create(nworkers);
+    // Results wait in memory until printed, so only a few packages run ahead.
+    uint32_t ahead = pool->nworkers * BATCH_AHEAD_PER_WORKER;
+
+    batch_stats_t totals = { .npkgs = count };
+    uint32_t submitted = 0;
+    for ( uint32_t i = 0; i < count; i++ ) {
+        for ( ; submitted < count && submitted < i + ahead; submitted++ ) {
+            batch_job_t* job = &batch.jobs[submitted];
+            job->work.run = batch_job_run;
+            job->path = paths[submitted];
+            job->mode = mode;
+            job->batch = &batch;
+            work_pool_submit(pool, &job->work);
+        }
+
+        batch_job_t* job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while ( !job->done ) {
+            pthread_cond_wait(&batch.cond, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        fwrite(job->output, 1, job->output_len, out);
+        fflush(out);
+        free(job->output);
+
+        totals.nfailed += !job->loaded;
+        totals.nchunks += job->nchunks;
+        totals.ncomplete += job->ncomplete;
+        totals.bytes += job->bytes;
+    }
+
+    work_pool_destroy(pool);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.cond);
+    free(batch.jobs);
+
+    if ( stats ) {
+        *stats = totals;
+    }
+    return totals.nfailed == 0 ? 0 : 1;
+}
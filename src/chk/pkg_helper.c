@@ -22,11 +22,15 @@ bpkg_t* bpkg_create() {
         return NULL;
     }
     bpkg->pkg_data = NULL;
+    bpkg->path[0] = '\0';
+    bpkg->path[FILE_MAX - 1] = '\0';
+    atomic_init(&bpkg->refs, 1);
     bpkg->mtree->root = NULL;
     bpkg->mtree->hsh_nodes = NULL;
     bpkg->mtree->chk_nodes = NULL;
     bpkg->mtree->nodes = NULL;
     bpkg->mtree->f_data = NULL;
+    bpkg->mtree->f_fd = -1;
     bpkg->mtree->height = 0;
     bpkg->mtree->nchunks = 0;
     bpkg->mtree->nnodes = 0;
@@ -54,13 +58,14 @@ int bpkg_unpack(bpkg_t* bpkg) {
 
     char* line;
     char* next_line;
+    char* saveptr = NULL;
     unsigned int i = 0;
 
     debug_print("Parsing package metadata...\n");
     debug_print("%s\n", data);
 
     // Tokenize data by lines
-    line = strtok(data, "\n");
+    line = strtok_r(data, "\n", &saveptr);
     while ( line != NULL ) {
 
         if ( strncmp(line, "ident:", 6) == 0 ) {
@@ -75,9 +80,11 @@ int bpkg_unpack(bpkg_t* bpkg) {
         else if ( strncmp(line, "nhashes:", 8) == 0 ) {
             sscanf(line, "nhashes:%u", &bpkg->mtree->nhashes);
             mtree->hsh_nodes = (mtree_node_t**)my_malloc(mtree->nhashes * sizeof(mtree_node_t*));
+            // A short package leaves entries NULL rather than uninitialised.
+            memset(mtree->hsh_nodes, 0, mtree->nhashes * sizeof(mtree_node_t*));
         }
         else if ( strncmp(line, "hashes:", 7) == 0 && mtree->nhashes > 0 ) {
-            for ( i = 0; i < mtree->nhashes && ( next_line = strtok(NULL, "\n") ); i++ ) {
+            for ( i = 0; i < mtree->nhashes && ( next_line = strtok_r(NULL, "\n", &saveptr) ); i++ ) {
                 next_line = trim_whitespace(next_line);
                 mtree->hsh_nodes[i] = mtree_node_create(next_line, 0, 0, NULL);
             }
@@ -86,11 +93,12 @@ int bpkg_unpack(bpkg_t* bpkg) {
             sscanf(line, "nchunks:%u", &bpkg->mtree->nchunks);
             mtree->nnodes = bpkg->mtree->nhashes + bpkg->mtree->nchunks;
             mtree->chk_nodes = (mtree_node_t**)my_malloc(mtree->nchunks * sizeof(mtree_node_t*));
+            memset(mtree->chk_nodes, 0, mtree->nchunks * sizeof(mtree_node_t*));
         }
         else if ( strncmp(line, "chunks:", 7) == 0 ) {
             debug_print("Chunks section found, nchunks: %u\n", mtree->nchunks);
             for ( i = 0; i < mtree->nchunks; i++ ) {
-                line = strtok(NULL, "\n");
+                line = strtok_r(NULL, "\n", &saveptr);
                 if ( line != NULL ) {
                     line = trim_whitespace(line);
                     char hash[SHA256_HEXLEN + 1]; // Ensure there's space for null-termination
@@ -105,12 +113,13 @@ int bpkg_unpack(bpkg_t* bpkg) {
                     }
 
                     chunk_t* chunk = chunk_create(NULL, size, offset);
+                    chunk->index = i;
                     mtree_node_t* node_curr = mtree_node_create(hash, 1, 0, chunk);
                     mtree->chk_nodes[i] = node_curr;
                 }
             }
         }
-        line = strtok(NULL, "\n");
+        line = strtok_r(NULL, "\n", &saveptr);
     }
 
     debug_print("Finished parsing package data. Now merging arrays...\n");
@@ -223,6 +232,36 @@ char** bpkg_get_subtree_chunks(mtree_node_t* root, int* total_chunks) {
 }
 
 
+static void collect_incomplete_chunks(mtree_node_t* node, mtree_node_t** out, uint32_t* count) {
+    if ( node == NULL || check_chunk(node) ) {
+        return;  // Verified subtrees need nothing fetched beneath them
+    }
+
+    if ( node->is_leaf ) {
+        out[( *count )++] = node;
+        return;
+    }
+
+    collect_incomplete_chunks(node->left, out, count);
+    collect_incomplete_chunks(node->right, out, count);
+}
+
+mtree_node_t** bpkg_get_incomplete_chunk_nodes(mtree_t* mtree, mtree_node_t* root, uint32_t* count) {
+    *count = 0;
+    if ( mtree == NULL || root == NULL || mtree->nchunks == 0 ) {
+        return NULL;
+    }
+
+    mtree_node_t** nodes = (mtree_node_t**)my_malloc(mtree->nchunks * sizeof(mtree_node_t*));
+    collect_incomplete_chunks(root, nodes, count);
+
+    if ( *count == 0 ) {
+        free(nodes);
+        return NULL;
+    }
+    return nodes;
+}
+
 int bpkg_validate_node_completion(mtree_node_t* node) {
     if ( strncmp(node->expected_hash, node->computed_hash, SHA256_HEXLEN) == 0 ) {
         return 1;
@@ -232,26 +271,21 @@ int bpkg_validate_node_completion(mtree_node_t* node) {
 
 mtree_node_t* bpkg_find_node_from_hash(mtree_t* mtree, char* query_hash, int mode)
 {
-    mtree_node_t** nodes;
-    uint16_t count = 0;
-    if ( mode == ALL )
+    mtree_node_t** nodes = mtree->nodes;
+    uint32_t count = mtree->nnodes;
+    if ( mode == INTERNAL )
     {
-        nodes = mtree->nodes;
-        count = mtree->nnodes;
-    }
-    else if ( mode == INTERNAL )
-    {
-        nodes = mtree->nodes;
+        nodes = mtree->hsh_nodes;
         count = mtree->nhashes;
     }
     else if ( mode == CHUNK )
     {
-        nodes = mtree->nodes;
+        nodes = mtree->chk_nodes;
         count = mtree->nchunks;
     }
 
     mtree_node_t* current_node;
-    for ( int i = 0; i < count; i++ )
+    for ( uint32_t i = 0; i < count; i++ )
     {
         current_node = nodes[i];
 
@@ -328,9 +362,9 @@ void extract_directory(const char* filepath, char* filename, size_t max_len) {
     const char* last_slash = strrchr(filepath, '/');
 
 
+    // A bare file name lives in the working directory.
     if ( last_slash == NULL ) {
-        strncpy(filename, filepath, max_len - 1);
-        filename[max_len - 1] = '\0';
+        filename[0] = '\0';
         return;
     }
 
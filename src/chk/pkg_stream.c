@@ -0,0 +1,347 @@
+#include <chk/pkg_helper.h>
+#include <chk/pkg_stream.h>
+#include <crypt/sha256.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Reads the next chunk table entry from the package file.
+ *
+ * @param bpkg Package file, positioned inside the chunk table.
+ * @param line getline buffer.
+ * @param linecap Size of the getline buffer.
+ * @param chunk Output for the entry.
+ * @return 0 on success, -1 at the end of the file or on a malformed entry.
+ */
+static int stream_next_chunk(FILE* bpkg, char** line, size_t* linecap, stream_chunk_t* chunk) {
+    while ( getline(line, linecap, bpkg) >= 0 ) {
+        char* entry = trim_whitespace(*line);
+        if ( *entry == '\0' ) {
+            continue;
+        }
+        return sscanf(entry, "%64s,%" SCNu64 ",%" SCNu32, chunk->hash, &chunk->offset, &chunk->size) == 3 ? 0 : -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Reads a range of the data file, stopping early at its end.
+ *
+ * @param fd Data file.
+ * @param buf Buffer to read into.
+ * @param len Bytes wanted.
+ * @param offset File offset to read from.
+ * @return Bytes read.
+ */
+static size_t stream_read_range(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+    size_t got = 0;
+    while ( got < len ) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t)( offset + got ));
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n <= 0 ) {
+            if ( n < 0 ) {
+                perror("Failed to read data file");
+            }
+            break;
+        }
+        got += (size_t)n;
+    }
+    return got;
+}
+
+/**
+ * @brief Reader thread: fills slots with contiguous runs of chunks, in table order.
+ *
+ * @param arg Pointer to the verify state.
+ * @return NULL.
+ */
+static void* stream_read(void* arg) {
+    stream_verify_t* sv = (stream_verify_t*)arg;
+    char* line = NULL;
+    size_t linecap = 0;
+    stream_chunk_t pending;
+    bool have_pending = false;
+    uint32_t index = 0;
+
+    for ( uint64_t seq = 0; ; seq++ ) {
+        stream_slot_t* slot = &sv->slots[seq % sv->nslots];
+        pthread_mutex_lock(&sv->lock);
+        while ( slot->state != SLOT_FREE ) {
+            pthread_cond_wait(&sv->cond, &sv->lock);
+        }
+        pthread_mutex_unlock(&sv->lock);
+
+        // A slot ends where the chunks stop being contiguous or no longer fit.
+        size_t span = 0;
+        slot->nchunks = 0;
+        while ( slot->nchunks < STREAM_SLOT_CHUNKS ) {
+            if ( !have_pending ) {
+                if ( index >= sv->nchunks ) {
+                    break;
+                }
+                if ( stream_next_chunk(sv->bpkg, &line, &linecap, &pending) < 0 ) {
+                    sv->table_error = true;
+                    break;
+                }
+                pending.index = index++;
+                have_pending = true;
+            }
+
+            if ( slot->nchunks == 0 ) {
+                slot->base = pending.offset;
+                if ( pending.size > slot->cap ) {
+                    slot->buf = (uint8_t*)realloc(slot->buf, pending.size);
+                    if ( !slot->buf ) {
+                        perror("Failed to grow read buffer");
+                        exit(EXIT_FAILURE);
+                    }
+                    slot->cap = pending.size;
+                }
+            }
+            else if ( pending.offset != slot->base + span || span + pending.size > slot->cap ) {
+                break;
+            }
+            slot->chunks[slot->nchunks++] = pending;
+            span += pending.size;
+            have_pending = false;
+        }
+        if ( slot->nchunks == 0 ) {
+            break;
+        }
+
+        slot->len = stream_read_range(sv->fd, slot->buf, span, slot->base);
+
+        pthread_mutex_lock(&sv->lock);
+        slot->state = SLOT_FILLED;
+        sv->filled++;
+        pthread_cond_broadcast(&sv->cond);
+        pthread_mutex_unlock(&sv->lock);
+        if ( sv->table_error ) {
+            break;
+        }
+    }
+
+    free(line);
+    pthread_mutex_lock(&sv->lock);
+    sv->read_done = true;
+    pthread_cond_broadcast(&sv->cond);
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
+
+/**
+ * @brief Hasher thread: hashes the chunks of filled slots, whichever comes next.
+ *
+ * @param arg Pointer to the verify state.
+ * @return NULL.
+ */
+static void* stream_hash(void* arg) {
+    stream_verify_t* sv = (stream_verify_t*)arg;
+    pthread_mutex_lock(&sv->lock);
+    while ( true ) {
+        while ( sv->taken == sv->filled && !sv->read_done ) {
+            pthread_cond_wait(&sv->cond, &sv->lock);
+        }
+        if ( sv->taken == sv->filled ) {
+            break;
+        }
+        stream_slot_t* slot = &sv->slots[sv->taken % sv->nslots];
+        sv->taken++;
+        pthread_mutex_unlock(&sv->lock);
+
+        for ( uint32_t i = 0; i < slot->nchunks; i++ ) {
+            stream_chunk_t* chunk = &slot->chunks[i];
+            size_t rel = (size_t)( chunk->offset - slot->base );
+            chunk->ok = false;
+            if ( rel + chunk->size > slot->len ) {
+                continue;   // Past the end of the data file
+            }
+
+            struct sha256_compute_data cdata;
+            uint8_t hashout[SHA256_INT_SZ];
+            char computed[SHA256_HEXLEN + 1] = { 0 };
+            sha256_compute_data_init(&cdata);
+            sha256_update(&cdata, slot->buf + rel, chunk->size);
+            sha256_finalize(&cdata, hashout);
+            sha256_output_hex(&cdata, computed);
+            chunk->ok = strncmp(computed, chunk->hash, SHA256_HEXLEN) == 0;
+        }
+
+        pthread_mutex_lock(&sv->lock);
+        slot->state = SLOT_HASHED;
+        pthread_cond_broadcast(&sv->cond);
+    }
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
+
+/**
+ * @brief Reads the package header up to the chunk table and opens the data file.
+ *
+ * @param sv Pointer to the verify state, its bpkg already open.
+ * @param path Path to the .bpkg file, which the data file is relative to.
+ * @param err Stream for errors.
+ * @return 0 on success, -1 on failure.
+ */
+static int stream_open(stream_verify_t* sv, const char* path, FILE* err) {
+    char filename[FILE_MAX] = { 0 };
+    char* line = NULL;
+    size_t linecap = 0;
+    bool have_file = false;
+    bool in_table = false;
+
+    extract_directory(path, filename, FILE_MAX);
+    while ( !in_table && getline(&line, &linecap, sv->bpkg) >= 0 ) {
+        char* entry = trim_whitespace(line);
+        if ( strncmp(entry, "filename:", 9) == 0 ) {
+            process_filename(entry, filename, FILE_MAX);
+            have_file = true;
+        }
+        else if ( strncmp(entry, "nchunks:", 8) == 0 ) {
+            sscanf(entry, "nchunks:%u", &sv->nchunks);
+        }
+        else if ( strncmp(entry, "chunks:", 7) == 0 ) {
+            in_table = true;
+        }
+    }
+    free(line);
+
+    if ( !have_file || !in_table ) {
+        fprintf(err, "Package %s has no %s\n", path, have_file ? "chunk table" : "filename");
+        return -1;
+    }
+
+    sv->fd = open(filename, O_RDONLY);
+    if ( sv->fd < 0 ) {
+        fprintf(err, "Cannot open data file %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    // The file is read once front to back, so the kernel can read far ahead.
+    posix_fadvise(sv->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+/**
+ * @brief Verifies every chunk of a package's data file, streaming it through a
+ * fixed number of buffers.
+ *
+ * Verified chunk hashes are written to out as they complete, in chunk table order.
+ * Failed chunks are reported on err.
+ *
+ * @param path Path to the .bpkg file.
+ * @param nhashers Hasher threads, 0 for one per online CPU.
+ * @param out Stream for verified chunk hashes.
+ * @param err Stream for failed chunks and errors.
+ * @param stats Output for the totals, may be NULL.
+ * @return 0 if every chunk verified, 1 if any failed, -1 if the package could not be read.
+ */
+int bpkg_stream_verify(const char* path, uint32_t nhashers, FILE* out, FILE* err, stream_stats_t* stats) {
+    stream_verify_t* sv = (stream_verify_t*)my_malloc(sizeof(stream_verify_t));
+    memset(sv, 0, sizeof(stream_verify_t));
+    sv->fd = -1;
+
+    sv->bpkg = fopen(path, "r");
+    if ( !sv->bpkg ) {
+        fprintf(err, "Cannot open package %s: %s\n", path, strerror(errno));
+        free(sv);
+        return -1;
+    }
+    if ( stream_open(sv, path, err) < 0 ) {
+        fclose(sv->bpkg);
+        free(sv);
+        return -1;
+    }
+
+    if ( nhashers == 0 ) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nhashers = ncpus > 0 ? (uint32_t)ncpus : 1;
+    }
+    nhashers = nhashers > STREAM_HASHERS_MAX ? STREAM_HASHERS_MAX : nhashers;
+
+    sv->nslots = nhashers + STREAM_SLOTS_SPARE;
+    sv->slots = (stream_slot_t*)my_malloc(sv->nslots * sizeof(stream_slot_t));
+    memset(sv->slots, 0, sv->nslots * sizeof(stream_slot_t));
+    for ( uint32_t i = 0; i < sv->nslots; i++ ) {
+        sv->slots[i].buf = (uint8_t*)my_malloc(STREAM_SLOT_BYTES);
+        sv->slots[i].cap = STREAM_SLOT_BYTES;
+    }
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->cond, NULL);
+
+    pthread_t reader;
+    pthread_t hashers[STREAM_HASHERS_MAX];
+    if ( pthread_create(&reader, NULL, stream_read, sv) != 0 ) {
+        perror("Failed to start reader thread");
+        exit(EXIT_FAILURE);
+    }
+    for ( uint32_t i = 0; i < nhashers; i++ ) {
+        if ( pthread_create(&hashers[i], NULL, stream_hash, sv) != 0 ) {
+            perror("Failed to start hasher thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Slots are written in the order they were read, each as soon as it is hashed.
+    stream_stats_t totals = { .nchunks = sv->nchunks };
+    for ( uint64_t seq = 0; ; seq++ ) {
+        stream_slot_t* slot = &sv->slots[seq % sv->nslots];
+        pthread_mutex_lock(&sv->lock);
+        while ( !( seq < sv->filled && slot->state == SLOT_HASHED ) && !( sv->read_done && seq >= sv->filled ) ) {
+            pthread_cond_wait(&sv->cond, &sv->lock);
+        }
+        bool finished = seq >= sv->filled;
+        pthread_mutex_unlock(&sv->lock);
+        if ( finished ) {
+            break;
+        }
+
+        for ( uint32_t i = 0; i < slot->nchunks; i++ ) {
+            stream_chunk_t* chunk = &slot->chunks[i];
+            if ( chunk->ok ) {
+                fprintf(out, "%.64s\n", chunk->hash);
+                totals.verified++;
+                totals.bytes += chunk->size;
+            }
+            else {
+                fprintf(err, "Chunk %u failed: %.64s at offset %" PRIu64 "\n", chunk->index, chunk->hash, chunk->offset);
+                totals.failed++;
+            }
+        }
+        fflush(out);
+
+        pthread_mutex_lock(&sv->lock);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&sv->cond);
+        pthread_mutex_unlock(&sv->lock);
+    }
+
+    pthread_join(reader, NULL);
+    for ( uint32_t i = 0; i < nhashers; i++ ) {
+        pthread_join(hashers[i], NULL);
+    }
+
+    // Entries the table promised but never listed count as failed.
+    if ( sv->table_error ) {
+        fprintf(err, "Chunk table of %s is malformed or shorter than %u entries\n", path, sv->nchunks);
+    }
+    totals.failed = totals.nchunks - totals.verified;
+
+    for ( uint32_t i = 0; i < sv->nslots; i++ ) {
+        free(sv->slots[i].buf);
+    }
+    free(sv->slots);
+    pthread_mutex_destroy(&sv->lock);
+    pthread_cond_destroy(&sv->cond);
+    close(sv->fd);
+    fclose(sv->bpkg);
+    free(sv);
+
+    if ( stats ) {
+        *stats = totals;
+    }
+    return totals.failed == 0 ? 0 : 1;
+}
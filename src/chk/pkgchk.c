@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <tree/merkletree.h>
 #include <utilities/my_utils.h>
+#include <utilities/trace.h>
 
 // Part 1 Source Code
 
@@ -20,6 +21,25 @@
  * @return Loaded package object.
  */
 bpkg_t* bpkg_load(const char* path) {
+    bpkg_t* bpkg = bpkg_load_meta(path);
+    if ( !bpkg ) {
+        return NULL;
+    }
+
+    bpkg_query_t* qry = bpkg_file_check(bpkg);
+    bpkg_query_destroy(qry);
+
+    // A tree that fails to build is still owned by bpkg, so it goes with it.
+    if ( mtree_build(bpkg->mtree, bpkg->filename) == NULL ) {
+        bpkg_obj_destroy(bpkg);
+        return NULL;
+    }
+
+    debug_print("Successfully loaded package file!");
+    return bpkg;
+}
+
+bpkg_t* bpkg_load_meta(const char* path) {
     char* sanitizedpath = sanitize_path(path);
 
     bpkg_t* bpkg = bpkg_create();
@@ -63,37 +83,29 @@ bpkg_t* bpkg_load(const char* path) {
 
     bpkg->pkg_size = statbuf.st_size;
     close(fd);
+    strncpy(bpkg->path, sanitizedpath, FILE_MAX - 1);
     extract_directory(sanitizedpath, bpkg->filename, 256);
     free(sanitizedpath);
 
     if ( bpkg_unpack(bpkg) != 0 ) {
-        munmap(bpkg->pkg_data, statbuf.st_size);
         bpkg_obj_destroy(bpkg);
-        free(sanitizedpath);
         return NULL;
     }
 
     debug_print("Successfully unpacked package file!\n");
-
-    bpkg_query_t* qry = bpkg_file_check(bpkg);
-    bpkg_query_destroy(qry);
-
-    bpkg->mtree = mtree_build(bpkg->mtree, bpkg->filename);
-
-    if ( bpkg->mtree == NULL ) {
-        munmap(bpkg->pkg_data, statbuf.st_size);
-        bpkg_obj_destroy(bpkg);
-        return NULL;
-    }
-
-    debug_print("Successfully loaded package file!");
     return bpkg;
 }
 
 bpkg_query_t* bpkg_file_check(bpkg_t* bpkg) {
     char** hashes = my_malloc(sizeof(char*));
 
-    if ( access(bpkg->filename, F_OK) == 0 ) {
+    struct stat statbuf;
+    if ( stat(bpkg->filename, &statbuf) == 0 ) {
+        // Data left by an older, smaller version of the package is grown to fit,
+        // since chunks past its end could not be mapped.
+        if ( (uint64_t)statbuf.st_size < bpkg->mtree->f_size && truncate(bpkg->filename, bpkg->mtree->f_size) != 0 ) {
+            perror("Failed to grow bpkg data file");
+        }
         hashes[0] = "File Exists";
     }
     else {
@@ -253,6 +265,28 @@ void bpkg_obj_destroy(bpkg_t* bobj) {
     }
 }
 
+/**
+ * @brief Take an additional reference on a package object.
+ *
+ * @param bobj Package object.
+ * @return The same package object.
+ */
+bpkg_t* bpkg_retain(bpkg_t* bobj) {
+    atomic_fetch_add(&bobj->refs, 1);
+    return bobj;
+}
+
+/**
+ * @brief Drop a reference on a package object, destroying it with the last one.
+ *
+ * @param bobj Package object, may be NULL.
+ */
+void bpkg_release(bpkg_t* bobj) {
+    if ( bobj && atomic_fetch_sub(&bobj->refs, 1) == 1 ) {
+        bpkg_obj_destroy(bobj);
+    }
+}
+
 /**
  * @brief Destroy the package object, freeing allocated memory.
  *
@@ -274,22 +308,34 @@ bpkg_query_t* bpkg_qry_create(char** hashes, uint16_t len) {
  * @return 0 on success, -1 on failure.
  */
 int update_chunk_node(mtree_t* mtree, mtree_node_t* chunk_node, uint8_t* newdata, uint16_t data_size, uint32_t offset) {
-    if ( chunk_node->is_leaf != 1 ) {
+    if ( chunk_node == NULL || chunk_node->is_leaf != 1 || chunk_node->chunk == NULL ) {
+        return -1;
+    }
+
+    // Reject data that would spill outside of the chunk it claims to belong to:
+    chunk_t* chk = chunk_node->chunk;
+    if ( offset < chk->offset || offset - chk->offset >= chk->size ) {
         return -1;
     }
 
     pthread_mutex_lock(&chunk_node->lock);
 
-    size_t copy_size = ( data_size < chunk_node->chunk->size ) ? data_size : chunk_node->chunk->size;
+    uint32_t room = chk->size - ( offset - chk->offset );
+    size_t copy_size = ( data_size < room ) ? data_size : room;
 
     // Copy given data into node data:
     memcpy(mtree->f_data + offset, newdata, copy_size);
+    TRACE_BEGIN("hash chunk");
     sha256_compute_chunk_hash(chunk_node);
+    chk->fp = chunk_fingerprint(chk);
+    TRACE_END("hash chunk");
 
     pthread_mutex_unlock(&chunk_node->lock);
 
     // Update parent hashes to ensure they reflect the new data:
+    TRACE_BEGIN("update tree");
     update_parent_hashes(chunk_node);
+    TRACE_END("update tree");
 
     return 0;
 }
\ No newline at end of file
@@ -3,7 +3,10 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <utilities/io_engine.h>
 #include <utilities/my_utils.h>
+#include <utilities/rate_limit.h>
+#include <utilities/work_pool.h>
 
 
 /**
@@ -41,6 +44,24 @@ int check_directory(char* pathname) {
      }
 }
 
+/**
+ * @brief Parses a bandwidth limit in KiB/s.
+ *
+ * @param key Name of the entry, for the error message.
+ * @param value Text of the limit.
+ * @param limit Output for the limit, 0 for unlimited.
+ * @return 0 on success, ERR_RATE_LIMIT if the limit is out of range.
+ */
+static int parse_limit(const char* key, const char* value, uint32_t* limit) {
+     long kib = atol(value);
+     if ( kib < 0 || kib > RATE_KIB_MAX ) {
+          fprintf(stderr, "%s (%ld) outside of permitted range (0 - %d KiB/s)\n", key, kib, RATE_KIB_MAX);
+          return ERR_RATE_LIMIT;
+     }
+     *limit = (uint32_t)kib;
+     return 0;
+}
+
 /**
  * @brief Parses a single line of the configuration file.
  *
@@ -82,6 +103,70 @@ int parse_entry(char* line, config_t* c_obj) {
           }
           c_obj->port = port;
      }
+     else if ( strcmp(key, "workers") == 0 ) {
+          int workers = atoi(value);
+          if ( workers < 1 || workers > POOL_WORKERS_MAX ) {
+               fprintf(stderr, "Workers (%d) outside of permitted range (1 - %d)\n", workers, POOL_WORKERS_MAX);
+               return ERR_WORKERS;
+          }
+          c_obj->workers = workers;
+     }
+     else if ( strcmp(key, "upload_limit") == 0 ) {
+          return parse_limit(key, value, &c_obj->upload_limit);
+     }
+     else if ( strcmp(key, "download_limit") == 0 ) {
+          return parse_limit(key, value, &c_obj->download_limit);
+     }
+     else if ( strcmp(key, "peer_upload_limit") == 0 ) {
+          return parse_limit(key, value, &c_obj->peer_upload_limit);
+     }
+     else if ( strcmp(key, "peer_download_limit") == 0 ) {
+          return parse_limit(key, value, &c_obj->peer_download_limit);
+     }
+     else if ( strcmp(key, "autoload") == 0 ) {
+          if ( strcmp(value, "on") == 0 ) {
+               c_obj->autoload = true;
+          }
+          else if ( strcmp(value, "off") == 0 ) {
+               c_obj->autoload = false;
+          }
+          else {
+               fprintf(stderr, "Unknown autoload (%s), expected on or off\n", value);
+               return ERR_AUTOLOAD;
+          }
+     }
+     else if ( strcmp(key, "watch") == 0 ) {
+          if ( strcmp(value, "on") == 0 ) {
+               c_obj->watch = true;
+          }
+          else if ( strcmp(value, "off") == 0 ) {
+               c_obj->watch = false;
+          }
+          else {
+               fprintf(stderr, "Unknown watch (%s), expected on or off\n", value);
+               return ERR_WATCH;
+          }
+     }
+     else if ( strcmp(key, "metrics_port") == 0 ) {
+          int port = atoi(value);
+          if ( port < MIN_PORT || port > MAX_PORT ) {
+               fprintf(stderr, "Metrics port (%d) outside of permitted range (%d - %d)\n", port, MIN_PORT, MAX_PORT);
+               return ERR_METRICS;
+          }
+          c_obj->metrics_port = port;
+     }
+     else if ( strcmp(key, "io_engine") == 0 ) {
+          if ( strcmp(value, "blocking") == 0 ) {
+               c_obj->io_backend = IO_BLOCKING;
+          }
+          else if ( strcmp(value, "uring") == 0 ) {
+               c_obj->io_backend = IO_URING;
+          }
+          else {
+               fprintf(stderr, "Unknown io_engine (%s), expected blocking or uring\n", value);
+               return ERR_IO_ENGINE;
+          }
+     }
      else {
           return -1;  // Unknown configuration key
      }
@@ -97,6 +182,8 @@ int parse_entry(char* line, config_t* c_obj) {
  */
 config_t* config_load(char* filename) {
      config_t* c_obj = (config_t*)my_malloc(sizeof(config_t));
+     memset(c_obj, 0, sizeof(config_t));
+     c_obj->io_backend = IO_BLOCKING;
      FILE* f_ptr = fopen(filename, "r");
      if ( !f_ptr ) {
           perror("Failed to open config");
@@ -1,13 +1,20 @@
 #include <chk/pkgchk.h>
 #include <chk/pkg_helper.h>
 #include <cli.h>
+#include <peer_2_peer/fetch.h>
+#include <peer_2_peer/metrics.h>
 #include <peer_2_peer/package.h>
 #include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_connector.h>
 #include <peer_2_peer/peer_data_sync.h>
 #include <peer_2_peer/peer_handler.h>
+#include <peer_2_peer/peer_proof.h>
 #include <sys/socket.h>
 #include <tree/merkletree.h>
 #include <utilities/my_utils.h>
+#include <utilities/rate_limit.h>
+#include <utilities/trace.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -15,65 +22,74 @@
 #include <string.h>
 
 /**
- * @brief Connect to a peer using IP and port
+ * @brief Connect to one or more peers at once
  *
- * @param ip Peer IP address
- * @param port Peer port number
+ * @param args String containing the peers as IP:port, separated by spaces or commas
  * @param peers Pointer to the peers list
  * @param bpkgs Pointer to the packages manager
  */
-void cli_connect(char* ip, int port, peers_t* peers, bpkgs_t* bpkgs) {
-     debug_print("Attempting to connect to %s:%d\n", ip, port);
-     if ( !ip || port <= 0 ) {
-          debug_print("Missing address or invalid port argument\n");
+void cli_connect(char* args, peers_t* peers, bpkgs_t* bpkgs) {
+     debug_print("Attempting to connect to %s\n", args);
+     peer_connector_t* connector = connector_shared();
+     if ( !connector ) {
+          debug_print("No connector running\n");
           return;
      }
 
-     peer_t* pcheck = peers_find(peers, ip, port);
-     if ( pcheck != NULL )
-     {
-          printf("Already connected to peer\n");
-          fflush(stdout);
-          return;
+     uint32_t cap = 1;
+     for ( const char* c = args; *c; c++ ) {
+          cap += *c == ' ' || *c == ',';
      }
+     char (*ips)[INET_ADDRSTRLEN] = (char (*)[INET_ADDRSTRLEN])my_malloc(cap * INET_ADDRSTRLEN);
+     int* ports = (int*)my_malloc(cap * sizeof(int));
+     enum ConnectResult* results = (enum ConnectResult*)my_malloc(cap * sizeof(enum ConnectResult));
 
-     // Initialize the peer
-
-     peer_t* peer = peer_create(ip, port);
-     if ( !peer ) {
-          perror("Memory allocation failed for peer structure\n");
-          return;
+     uint32_t n = 0;
+     char* saveptr = NULL;
+     for ( char* tok = strtok_r(args, " ,\t", &saveptr); tok; tok = strtok_r(NULL, " ,\t", &saveptr) ) {
+          uint32_t port;
+          if ( sscanf(tok, "%15[^:]:%u", ips[n], &port) == 2 && port > 0 && port <= UINT16_MAX ) {
+               ports[n++] = (int)port;
+          }
+          else {
+               printf("Invalid peer address %s\n", tok);
+          }
      }
 
-     peer->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-     if ( peer->sock_fd < 0 ) {
-          perror("Socket creation failed...");
-          free(peer);
-          return;
+     if ( n == 0 ) {
+          printf("Missing address and port argument\n");
      }
-
-     // Attempt to connect to the peer:
-     struct sockaddr_in peer_addr = { .sin_family = AF_INET,
-                                      .sin_port = htons(peer->port),
-                                      .sin_addr.s_addr = inet_addr(ip) };
-
-     if ( connect(peer->sock_fd, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0 ) {
-          fprintf(stdout, "Could not connect to request peer");
-          fflush(stdout);
-          close(peer->sock_fd);
-          reqs_destroy(peer->reqs_q);
-          free(peer);
-          return;
+     else {
+          // Every address is attempted at once, so this waits for the slowest one only.
+          uint32_t nconnected = connector_connect(connector, ips, ports, n, results);
+          for ( uint32_t i = 0; i < n; i++ ) {
+               const char* prefix = n > 1 ? ips[i] : NULL;
+               if ( prefix ) {
+                    printf("%s:%d: ", prefix, ports[i]);
+               }
+               switch ( results[i] ) {
+               case CONNECT_OK:
+                    printf("Connection established with peer\n");
+                    break;
+               case CONNECT_ALREADY:
+                    printf("Already connected to peer\n");
+                    break;
+               default:
+                    printf("Could not connect to request peer\n");
+                    break;
+               }
+          }
+          if ( n > 1 ) {
+               printf("Connected to %u/%u peers\n", nconnected, n);
+          }
      }
-
-     debug_print("Successfully connected to peer %s:%d\n", ip, port);
-
-     // Create the peer handling thread to handle bilateral communication with this peer concurrently.
-     // Also add the peer to the shared list of managed peers on the heap.
-     peers_add(peers, peer);
-     peer_create_thread(peer, peers, bpkgs);
-     printf("Connection established with peer\n");
      fflush(stdout);
+
+     free(ips);
+     free(ports);
+     free(results);
+     (void)peers;
+     (void)bpkgs;
 }
 
 /**
@@ -105,6 +121,8 @@ void cli_disconnect(char* ip, int port, peers_t* peers) {
      // Creating a request for disconnection
      request_t* req = req_create(dsn_pkt);
 
+     // Disconnecting on purpose ends any attempt to keep the peer connected.
+     connector_forget(connector_shared(), ip, port);
      peers_remove(peers, ip, port);
      reqs_enqueue(peer_target->reqs_q, req);
 
@@ -115,11 +133,13 @@ void cli_disconnect(char* ip, int port, peers_t* peers) {
 }
 
 /**
- * @brief Add a package to manage
+ * @brief Add a package to manage and advertise it to connected peers
  *
  * @param filename Name of the package to add
+ * @param bpkgs Pointer to the packages manager
+ * @param peers Pointer to the peers list
  */
-void cli_add_package(char* filename, bpkgs_t* bpkgs) {
+void cli_add_package(char* filename, bpkgs_t* bpkgs, peers_t* peers) {
      debug_print("Adding package: %s\n", filename);
      if ( !filename || strlen(filename) <= 1 ) {
           printf("Missing file argument\n");
@@ -140,7 +160,10 @@ void cli_add_package(char* filename, bpkgs_t* bpkgs) {
 
      if ( pkgs_add(bpkgs, bpkg) < 0 ) {
           perror("Failed to add new package to shared package resource manager\n");
+          return;
      }
+     send_hav_all(peers, bpkg, HAV_ALL);
+     bpkg_release(bpkg);
 }
 
 /**
@@ -169,40 +192,36 @@ void cli_rem_package(char* ident, bpkgs_t* bpkgs) {
 }
 
 /**
- * @brief Report the statuses of the loaded packages
+ * @brief Prints one line of the PACKAGES report.
+ *
+ * @param bpkg Pointer to the package
+ * @param arg Pointer to the number of lines printed so far
  */
-void cli_report_packages(bpkgs_t* bpkgs) {
-     debug_print("Reporting packages...\n");
-     pthread_mutex_lock(&bpkgs->lock);
-
-     if ( bpkgs->count == 0 ) {
-          printf("No packages managed\n");
+static void cli_report_package(bpkg_t* bpkg, void* arg) {
+     int* i = (int*)arg;
+     if ( !bpkg->mtree || !bpkg->mtree->root ) {
+          printf("Invalid package data\n");
           fflush(stdout);
-          pthread_mutex_unlock(&bpkgs->lock);
           return;
      }
+     mtree_node_t* root = bpkg->mtree->root;
 
-     //Iterate through linked list of packages, and print details of each one.
-     q_node_t* current = bpkgs->ls->head;
-     int i = 1;
+     const char* status = ( strncmp(root->expected_hash, root->computed_hash, SHA256_HEXLEN) == 0 ) ? "COMPLETED" : "INCOMPLETE";
+     printf("%d. %.32s, %s : %s\n", ++*i, bpkg->ident, bpkg->filename, status);
+     fflush(stdout);
+}
 
-     while ( current != NULL ) {
-          bpkg_t* bpkg_curr = (bpkg_t*)current->data;
-          if ( !bpkg_curr || !bpkg_curr->mtree || !bpkg_curr->mtree->root ) {
-               printf("Invalid package data\n");
-               fflush(stdout);
-               current = current->next;
-               continue;
-          }
-          mtree_node_t* root = bpkg_curr->mtree->root;
+/**
+ * @brief Report the statuses of the loaded packages
+ */
+void cli_report_packages(bpkgs_t* bpkgs) {
+     debug_print("Reporting packages...\n");
 
-          const char* status = ( strncmp(root->expected_hash, root->computed_hash, SHA256_HEXLEN) == 0 ) ? "COMPLETED" : "INCOMPLETE";
-          printf("%d. %.32s, %s : %s\n", i, bpkg_curr->ident, bpkg_curr->filename, status);
+     int i = 0;
+     if ( pkgs_for_each(bpkgs, cli_report_package, &i) == 0 ) {
+          printf("No packages managed\n");
           fflush(stdout);
-          current = current->next;
-          i++;
      }
-     pthread_mutex_unlock(&bpkgs->lock);
 }
 
 /**
@@ -212,7 +231,7 @@ void cli_report_packages(bpkgs_t* bpkgs) {
  */
 void cli_list_peers(peers_t* peers) {
      debug_print("Listing peers...\n");
-     pthread_mutex_lock(&peers->lock);
+     pthread_rwlock_rdlock(&peers->lock);
 
      if ( peers->npeers_cur <= 0 ) {
           printf("Not connected to any peers\n");
@@ -226,73 +245,366 @@ void cli_list_peers(peers_t* peers) {
           pkt_t* pkt;
           request_t* req;
 
-          // Iterate through dynamic array of peers, and print each existing peer.`
-          int j = 1;
-          for ( size_t i = 0; i < peers->npeers_max; i++ ) {
+          // Iterate through the packed array of peers, and print each one.
+          for ( size_t i = 0; i < peers->npeers_cur; i++ ) {
                peer_t* current = peers->list[i];
-               if ( current != NULL ) {
-                    printf("%d. %s:%d\n", j, current->ip, current->port);
-
-                    pkt = pkt_create(PKT_MSG_PNG, 0, pl);
-                    req = req_create(pkt);
-                    reqs_enqueue(peers->list[i]->reqs_q, req);
-                    fflush(stdout);
-                    j++;
-               }
+               printf("%zu. %s:%d\n", i + 1, current->ip, current->port);
+
+               pkt = pkt_create(PKT_MSG_PNG, 0, pl);
+               req = req_create(pkt);
+               reqs_enqueue(current->reqs_q, req);
+               fflush(stdout);
           }
      }
 
-     pthread_mutex_unlock(&peers->lock);
+     pthread_rwlock_unlock(&peers->lock);
+}
+
+/**
+ * @brief Enlists a connected peer in a swarm fetch.
+ *
+ * @param peer Pointer to the connected peer
+ * @param arg Pointer to the fetch
+ */
+static void cli_fetch_enlist(peer_t* peer, void* arg) {
+     fetch_add_peer((fetch_t*)arg, peer->ip, peer->port);
 }
 
 /**
- * @brief Request chunks related to a given hash
+ * @brief Request every missing chunk related to a given hash
  *
- * @param args String containing the hash, IP, port, offset, and identifier
+ * The hash may name a chunk, any internal node, or be omitted to fetch the whole
+ * package. The node is expanded into its incomplete chunks, which are requested
+ * as one pipelined batch on a background thread. Without an IP:port the chunks
+ * are spread across every connected peer, rarest first.
+ *
+ * @param args String containing the optional IP:port, identifier, and optional hash and offset
  * @param bpkgs Pointer to the packages manager
  * @param peers Pointer to the peers list
  */
 void cli_fetch(char* args, bpkgs_t* bpkgs, peers_t* peers) {
-     char ip[INET_ADDRSTRLEN];
-     uint32_t port;
+     char ip[INET_ADDRSTRLEN] = { 0 };
+     uint32_t port = 0;
      char ident[IDENT_MAX + 1] = { 0 };
      char hash[SHA256_HEXLEN + 1] = { 0 };
-     uint32_t offset = -1;
+     uint32_t offset = 0;
+
+     // A first argument without a port selects the swarm form.
+     char first[IDENT_MAX + 1] = { 0 };
+     bool swarm = sscanf(args, "%1024s", first) == 1 && strchr(first, ':') == NULL;
+
+     int nargs = 0;
+     if ( swarm ) {
+          nargs = sscanf(args, "%1024s %64s %u", ident, hash, &offset) + 2;
+     }
+     else {
+          nargs = sscanf(args, "%15[^:]:%u %1024s %64s %u", ip, &port, ident, hash, &offset);
+     }
+     if ( nargs < 3 ) {
+          printf("Missing or incorrect arguments from command\n");
+          fflush(stdout);
+          return;
+     }
+
+     if ( !swarm && !peers_find(peers, ip, port) ) {
+          printf("Unable to request chunk, peer not in list\n");
+          fflush(stdout);
+          return;
+     }
+     if ( swarm && peers->npeers_cur == 0 ) {
+          printf("Unable to request chunk, no peers connected\n");
+          fflush(stdout);
+          return;
+     }
+
+     bpkg_t* bpkg = pkg_find_by_ident(bpkgs, ident);
+     if ( !bpkg ) {
+          printf("Unable to request chunk, package is not managed\n");
+          fflush(stdout);
+          return;
+     }
+
+     // Resolve the node to expand: the whole package, a node at a known offset, or any node.
+     mtree_node_t* node = NULL;
+     if ( nargs == 3 ) {
+          node = bpkg->mtree->root;
+     }
+     else if ( nargs == 5 ) {
+          node = bpkg_find_node_from_hash_offset(bpkg->mtree->root, hash, offset);
+     }
+     else {
+          node = bpkg_find_node_from_hash(bpkg->mtree, hash, ALL);
+     }
+
+     if ( !node ) {
+          printf("Unable to request chunk, chunk hash does not belong to package\n");
+          fflush(stdout);
+          bpkg_release(bpkg);
+          return;
+     }
+
+     fetch_t* fetch = fetch_create(bpkg, node);
+     bpkg_release(bpkg);
+     if ( !fetch ) {
+          printf("Requested chunks are already complete\n");
+          fflush(stdout);
+          return;
+     }
+
+     if ( swarm ) {
+          peers_for_each(peers, cli_fetch_enlist, fetch);
+     }
+     else {
+          fetch_add_peer(fetch, ip, port);
+     }
+
+     debug_print("Requesting %u chunks from %u peers...\n", fetch->nchunks, fetch->npeers);
+     fetch_start(fetch, peers);
+}
+
+/* A limit being applied to every connected peer. */
+typedef struct cli_limit_arg {
+     enum RateDir dir;
+     uint64_t rate;
+} cli_limit_arg_t;
+
+/**
+ * @brief Prints a limit in KiB/s.
+ *
+ * @param rate Bytes per second, 0 for unlimited
+ */
+static void cli_print_rate(uint64_t rate) {
+     if ( rate == 0 ) {
+          printf("unlimited");
+     }
+     else {
+          printf("%lu KiB/s", (unsigned long)( rate / 1024 ));
+     }
+}
 
-     if ( sscanf(args, "%[^:]:%i %1024s %64s %i", ip, &port, ident, hash, &offset) < 4 ) {
+/**
+ * @brief Applies a limit to one connected peer.
+ *
+ * @param peer Pointer to the connected peer
+ * @param arg Pointer to the limit
+ */
+static void cli_limit_apply(peer_t* peer, void* arg) {
+     cli_limit_arg_t* limit = (cli_limit_arg_t*)arg;
+     bucket_set_rate(limit->dir == RATE_UP ? &peer->up : &peer->down, limit->rate);
+}
+
+/**
+ * @brief Prints the limits of one connected peer.
+ *
+ * @param peer Pointer to the connected peer
+ * @param arg Unused
+ */
+static void cli_limit_report(peer_t* peer, void* arg) {
+     (void)arg;
+     printf("%s:%d up ", peer->ip, peer->port);
+     cli_print_rate(bucket_rate(&peer->up));
+     printf(", down ");
+     cli_print_rate(bucket_rate(&peer->down));
+     printf("\n");
+}
+
+/**
+ * @brief Report or change the bandwidth limits
+ *
+ * Without arguments every limit is reported. Otherwise the arguments are a
+ * direction, a limit in KiB/s with 0 for unlimited, and an optional IP:port.
+ * up and down set the totals across all peers, or one peer's limit when an
+ * address is given. peer_up and peer_down set the limit every peer starts with,
+ * applying it to the peers already connected.
+ *
+ * @param args String containing the direction, limit and optional IP:port, or NULL
+ * @param peers Pointer to the peers list
+ */
+void cli_limit(char* args, peers_t* peers) {
+     if ( !args ) {
+          printf("Upload: ");
+          cli_print_rate(bucket_rate(rate_global(RATE_UP)));
+          printf(" total, ");
+          cli_print_rate(rate_peer_default(RATE_UP));
+          printf(" per peer\nDownload: ");
+          cli_print_rate(bucket_rate(rate_global(RATE_DOWN)));
+          printf(" total, ");
+          cli_print_rate(rate_peer_default(RATE_DOWN));
+          printf(" per peer\n");
+          peers_for_each(peers, cli_limit_report, NULL);
+          fflush(stdout);
+          return;
+     }
+
+     char which[16] = { 0 };
+     long kib = -1;
+     char ip[INET_ADDRSTRLEN] = { 0 };
+     uint32_t port = 0;
+     int nargs = sscanf(args, "%15s %ld %15[^:]:%u", which, &kib, ip, &port);
+     if ( nargs != 2 && nargs != 4 ) {
           printf("Missing or incorrect arguments from command\n");
           fflush(stdout);
           return;
+     }
+     if ( kib < 0 || kib > RATE_KIB_MAX ) {
+          printf("Limit outside of permitted range (0 - %d KiB/s)\n", RATE_KIB_MAX);
+          fflush(stdout);
+          return;
+     }
 
+     cli_limit_arg_t limit = { .rate = (uint64_t)kib * 1024 };
+     bool per_peer = false;
+     if ( strcmp(which, "up") == 0 || strcmp(which, "down") == 0 ) {
+          limit.dir = which[0] == 'u' ? RATE_UP : RATE_DOWN;
+     }
+     else if ( nargs == 2 && ( strcmp(which, "peer_up") == 0 || strcmp(which, "peer_down") == 0 ) ) {
+          limit.dir = which[5] == 'u' ? RATE_UP : RATE_DOWN;
+          per_peer = true;
+     }
+     else {
+          printf("Unknown limit, expected up, down, peer_up or peer_down\n");
+          fflush(stdout);
+          return;
+     }
 
-          peer_t* peer = peers_find(peers, ip, port);
-          if ( !peer ) {
-               printf("Unable to request chunk, peer not in list\n");
+     if ( per_peer ) {
+          rate_set_peer_default(limit.dir, limit.rate);
+          peers_for_each(peers, cli_limit_apply, &limit);
+     }
+     else if ( nargs == 4 ) {
+          if ( !peers_apply(peers, ip, port, cli_limit_apply, &limit) ) {
+               printf("Unknown peer, not connected\n");
                fflush(stdout);
                return;
           }
+     }
+     else {
+          bucket_set_rate(rate_global(limit.dir), limit.rate);
+     }
 
-          bpkg_t* bpkg = pkg_find_by_ident(bpkgs, ident);
-          if ( !bpkg ) {
-               printf("Unable to request chunk, package is not managed\n");
-               fflush(stdout);
-               return;
+     printf("Limit set\n");
+     fflush(stdout);
+}
+
+/**
+ * @brief Report traffic, serving and installing counters, and the state of each peer
+ *
+ * @param peers Pointer to the peers list
+ */
+void cli_stats(peers_t* peers) {
+     metrics_write_summary(stdout, peers);
+     fflush(stdout);
+}
+
+/**
+ * @brief Report p50, p99 and p999 latencies of fetching, serving, installing and queueing
+ *
+ * @param peers Pointer to the peers list
+ */
+void cli_latency(peers_t* peers) {
+     metrics_write_latency(stdout, peers);
+     fflush(stdout);
+}
+
+/**
+ * @brief Write the spans recorded by every thread to a Chrome trace JSON file
+ *
+ * @param args String containing the file to write
+ */
+void cli_trace(char* args) {
+#ifdef TRACE
+     char path[PATH_MAX];
+     if ( !args || sscanf(args, "%4095s", path) != 1 ) {
+          printf("Missing file argument\n");
+     }
+     else {
+          long n = trace_dump(path);
+          if ( n < 0 ) {
+               printf("Cannot write trace to %s\n", path);
           }
+          else {
+               printf("Wrote %ld trace events to %s\n", n, path);
+          }
+     }
+#else
+     (void)args;
+     printf("Tracing is not built in, build with make btide_trace\n");
+#endif
+     fflush(stdout);
+}
+
+/* A proof being requested from one connected peer. */
+typedef struct cli_proof_arg {
+     char* ident;
+     uint32_t index;
+     char* root;
+     uint32_t nchunks;
+} cli_proof_arg_t;
+
+/**
+ * @brief Records the awaited proof and queues its PRQ on one connected peer.
+ *
+ * @param peer Pointer to the connected peer
+ * @param arg Pointer to the proof
+ */
+static void cli_proof_apply(peer_t* peer, void* arg) {
+     cli_proof_arg_t* proof = (cli_proof_arg_t*)arg;
+     peer_proof_expect(peer, proof->ident, proof->index, proof->root, proof->nchunks);
+     reqs_enqueue(peer->reqs_q, req_create(pkt_create(PKT_MSG_PRQ, 0, payload_create_prf(proof->ident, proof->index, NULL))));
+}
 
-          debug_print("Requesting packet from peer...\n");
+/**
+ * @brief Ask a peer for the inclusion proof of a chunk and check it against a root hash
+ *
+ * The root and chunk count are taken from the command, or from the managed package of
+ * that identifier when omitted, so a node holding only the root can verify chunk hashes.
+ * The outcome is printed once the peer answers.
+ *
+ * @param args String containing the IP:port, identifier, chunk index and optional root hash and chunk count
+ * @param bpkgs Pointer to the packages manager
+ * @param peers Pointer to the peers list
+ */
+void cli_proof(char* args, bpkgs_t* bpkgs, peers_t* peers) {
+     char ip[INET_ADDRSTRLEN] = { 0 };
+     uint32_t port = 0;
+     char ident[IDENT_MAX + 1] = { 0 };
+     uint32_t index = 0;
+     char root[SHA256_HEXLEN + 1] = { 0 };
+     uint32_t nchunks = 0;
 
-          mtree_node_t* chk_node = bpkg_find_node_from_hash(bpkg->mtree, hash, 1);
+     int nargs = args ? sscanf(args, "%15[^:]:%u %1024s %u %64s %u", ip, &port, ident, &index, root, &nchunks) : 0;
+     if ( nargs < 4 ) {
+          printf("Missing or incorrect arguments from command\n");
+          fflush(stdout);
+          return;
+     }
 
-          if ( !chk_node ) {
-               printf("Unable to request chunk, chunk hash does not belong to package\n");
+     if ( nargs == 4 ) {
+          bpkg_t* bpkg = pkgs_get(bpkgs, ident);
+          if ( !bpkg ) {
+               printf("Unable to request proof, no root hash given and package is not managed\n");
                fflush(stdout);
                return;
           }
+          memcpy(root, bpkg->mtree->root->expected_hash, SHA256_HEXLEN);
+          nchunks = bpkg->mtree->nchunks;
+          bpkg_release(bpkg);
+     }
+     else if ( strlen(root) != SHA256_HEXLEN ) {
+          printf("Unable to request proof, root hash must be %d hex characters\n", SHA256_HEXLEN);
+          fflush(stdout);
+          return;
+     }
+     else if ( nargs == 5 || nchunks == 0 || ( nchunks & ( nchunks - 1 ) ) != 0 ) {
+          printf("Unable to request proof, a root hash needs the package's chunk count, a power of two\n");
+          fflush(stdout);
+          return;
+     }
 
-          // Create a request packet based on the chunk metadata, and enqueue it.
-          pkt_t* pkt_tofind = pkt_prepare_request_pkt(bpkg, chk_node);
-          debug_print("Requesting packet from peer...\n");
-          pkt_fetch_from_peer(peer, pkt_tofind, bpkg);
+     cli_proof_arg_t proof = { .ident = ident, .index = index, .root = root, .nchunks = nchunks };
+     if ( !peers_apply(peers, ip, port, cli_proof_apply, &proof) ) {
+          printf("Unable to request proof, peer not in list\n");
+          fflush(stdout);
      }
 }
 
@@ -315,10 +627,8 @@ int cli_process_command(char* input, peers_t* peers, bpkgs_t* bpkgs) {
      }
 
      if ( strcmp(command, "CONNECT") == 0 ) {
-          char ip[INET_ADDRSTRLEN];
-          uint32_t port;
-          if ( arguments && sscanf(arguments, "%15[^:]:%u", ip, &port) == 2 ) {
-               cli_connect(ip, port, peers, bpkgs);
+          if ( arguments ) {
+               cli_connect(arguments, peers, bpkgs);
           }
           else {
                printf("Missing address and port argument\n");
@@ -338,7 +648,7 @@ int cli_process_command(char* input, peers_t* peers, bpkgs_t* bpkgs) {
      }
      else if ( strcmp(command, "ADDPACKAGE") == 0 ) {
           if ( arguments ) {
-               cli_add_package(arguments, bpkgs);
+               cli_add_package(arguments, bpkgs, peers);
           }
           else {
                printf("Missing file argument\n");
@@ -369,6 +679,21 @@ int cli_process_command(char* input, peers_t* peers, bpkgs_t* bpkgs) {
                fflush(stdout);
           }
      }
+     else if ( strcmp(command, "PROOF") == 0 ) {
+          cli_proof(arguments, bpkgs, peers);
+     }
+     else if ( strcmp(command, "LIMIT") == 0 ) {
+          cli_limit(arguments, peers);
+     }
+     else if ( strcmp(command, "STATS") == 0 ) {
+          cli_stats(peers);
+     }
+     else if ( strcmp(command, "LATENCY") == 0 ) {
+          cli_latency(peers);
+     }
+     else if ( strcmp(command, "TRACE") == 0 ) {
+          cli_trace(arguments);
+     }
      else if ( strcmp(command, "QUIT") == 0 ) {
           return 0;
      }
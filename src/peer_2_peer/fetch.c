@@ -0,0 +1,922 @@
+#include <chk/pkg_helper.h>
+#include <chk/pkgchk.h>
+#include <peer_2_peer/fetch.h>
+#include <peer_2_peer/metrics.h>
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_avail.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <tree/merkletree.h>
+#include <utilities/io_engine.h>
+#include <utilities/my_utils.h>
+#include <utilities/trace.h>
+
+// Fetches whose driver thread is still running, so shutdown can stop them first.
+static queue_t* fetch_active = NULL;
+static bool fetch_stopping = false;
+static pthread_mutex_t fetch_active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_active_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Creates a fetch for every incomplete chunk beneath a tree node.
+ * @param bpkg Package to fetch into.
+ * @param root Node to expand; the package root, an internal node or a chunk.
+ * @return Pointer to the fetch, or NULL if nothing under the node is missing.
+ */
+fetch_t* fetch_create(bpkg_t* bpkg, mtree_node_t* root) {
+     if ( !bpkg || !root ) {
+          return NULL;
+     }
+
+     uint32_t nchunks = 0;
+     mtree_node_t** chk_nodes = bpkg_get_incomplete_chunk_nodes(bpkg->mtree, root, &nchunks);
+     if ( !chk_nodes ) {
+          debug_print("No incomplete chunks below requested node...\n");
+          return NULL;
+     }
+
+     fetch_t* fetch = (fetch_t*)my_malloc(sizeof(fetch_t));
+     memset(fetch, 0, sizeof(fetch_t));
+     fetch->bpkg = bpkg_retain(bpkg);
+     fetch->lat = metrics_pkg_latency(bpkg->ident);
+     fetch->chk_nodes = chk_nodes;
+     fetch->nchunks = nchunks;
+     fetch->chk_state = (uint8_t*)my_malloc(nchunks);
+     fetch->chk_tries = (uint8_t*)my_malloc(nchunks);
+     fetch->chk_rarity = (uint32_t*)my_malloc(nchunks * sizeof(uint32_t));
+     fetch->order = (uint32_t*)my_malloc(nchunks * sizeof(uint32_t));
+     fetch->chk_reqs = (uint8_t*)my_malloc(nchunks);
+     fetch->chk_peer = (uint32_t*)my_malloc(nchunks * sizeof(uint32_t));
+     fetch->chk_lat_us = (uint32_t*)my_malloc(nchunks * sizeof(uint32_t));
+     fetch->dups = (fetch_dup_t*)my_malloc(FETCH_ENDGAME_CHUNKS * FETCH_ENDGAME_REQS * sizeof(fetch_dup_t));
+     memset(fetch->chk_state, CHUNK_PENDING, nchunks);
+     memset(fetch->chk_tries, 0, nchunks);
+     memset(fetch->chk_reqs, 0, nchunks);
+     fetch->order_dirty = true;
+     fetch->refs = 1;
+
+     pthread_mutex_init(&fetch->lock, NULL);
+     pthread_cond_init(&fetch->cond, NULL);
+     return fetch;
+}
+
+/**
+ * @brief Adds a peer to request chunks from. Only valid before fetch_start.
+ * @param fetch Pointer to the fetch.
+ * @param ip IP address of the peer.
+ * @param port Port of the peer.
+ */
+void fetch_add_peer(fetch_t* fetch, const char* ip, int port) {
+     if ( !fetch || !ip ) {
+          return;
+     }
+
+     fetch->fpeers = (fetch_peer_t*)realloc(fetch->fpeers, ( fetch->npeers + 1 ) * sizeof(fetch_peer_t));
+     if ( !fetch->fpeers ) {
+          perror("Failed to grow fetch peers");
+          exit(EXIT_FAILURE);
+     }
+
+     fetch_peer_t* fpeer = &fetch->fpeers[fetch->npeers++];
+     memset(fpeer, 0, sizeof(fetch_peer_t));
+     strncpy(fpeer->ip, ip, INET_ADDRSTRLEN - 1);
+     fpeer->port = port;
+     fpeer->window = FETCH_WINDOW_INIT;
+     fpeer->bits = (uint8_t*)my_malloc(AVAIL_BYTES(fetch->bpkg->mtree->nchunks));
+     fpeer->avail_version = AVAIL_STALE;
+}
+
+/**
+ * @brief Takes an additional reference on a fetch.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_retain(fetch_t* fetch) {
+     pthread_mutex_lock(&fetch->lock);
+     fetch->refs++;
+     pthread_mutex_unlock(&fetch->lock);
+}
+
+/**
+ * @brief Drops a reference on a fetch, freeing it with the last one.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_release(fetch_t* fetch) {
+     if ( !fetch ) return;
+
+     pthread_mutex_lock(&fetch->lock);
+     int refs = --fetch->refs;
+     pthread_mutex_unlock(&fetch->lock);
+
+     if ( refs > 0 ) {
+          return;
+     }
+
+     pthread_mutex_destroy(&fetch->lock);
+     pthread_cond_destroy(&fetch->cond);
+     for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+          free(fetch->fpeers[i].bits);
+     }
+     free(fetch->fpeers);
+     free(fetch->chk_nodes);
+     free(fetch->chk_state);
+     free(fetch->chk_tries);
+     free(fetch->chk_rarity);
+     free(fetch->order);
+     free(fetch->chk_reqs);
+     free(fetch->chk_peer);
+     free(fetch->chk_lat_us);
+     free(fetch->dups);
+     free(fetch->buckets);
+     bpkg_release(fetch->bpkg);
+     free(fetch);
+}
+
+/**
+ * @brief Forgets an endgame duplicate once it resolves. The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ * @param chk_slot Chunk the duplicate was for.
+ * @param peer_slot Peer the duplicate was sent to.
+ */
+static void fetch_drop_dup(fetch_t* fetch, uint32_t chk_slot, uint32_t peer_slot) {
+     for ( uint32_t d = 0; d < fetch->ndups; d++ ) {
+          if ( fetch->dups[d].chk_slot == chk_slot && fetch->dups[d].peer_slot == peer_slot ) {
+               fetch->dups[d] = fetch->dups[--fetch->ndups];
+               return;
+          }
+     }
+}
+
+/**
+ * @brief Records the outcome of one chunk request and wakes the fetch driver.
+ * A chunk that failed is handed back to the scheduler until it runs out of tries;
+ * one the peer does not hold is handed back without using a try. While other
+ * requests for the chunk are still out, a failure leaves it to them.
+ * @param fetch Pointer to the fetch.
+ * @param req Pointer to the resolved request.
+ * @param status SUCCESS, FAILED, MISSING if the peer does not hold the chunk, or
+ * CANCELLED if another peer delivered it first.
+ */
+void fetch_chunk_done(fetch_t* fetch, request_t* req, enum RequestStatus status) {
+     pthread_mutex_lock(&fetch->lock);
+     fetch_peer_t* fpeer = &fetch->fpeers[req->peer_slot];
+     uint32_t slot = req->chk_slot;
+
+     fetch->ninflight--;
+     fpeer->ninflight--;
+     fetch->chk_reqs[slot]--;
+     if ( fetch->endgame ) {
+          fetch_drop_dup(fetch, slot, req->peer_slot);
+     }
+
+     if ( fetch->chk_state[slot] != CHUNK_INFLIGHT ) {
+          // Another request for this chunk already settled it.
+     }
+     else if ( status == SUCCESS ) {
+          fetch->chk_state[slot] = CHUNK_DONE;
+          fetch->ndone++;
+          fpeer->ndone++;
+          if ( req->sent_at.tv_sec != 0 ) {
+               struct timespec now;
+               clock_gettime(CLOCK_MONOTONIC, &now);
+               int64_t us = ( now.tv_sec - req->sent_at.tv_sec ) * 1000000LL + ( now.tv_nsec - req->sent_at.tv_nsec ) / 1000;
+               fetch->chk_lat_us[fetch->nlat++] = us < 0 ? 0 : us > FETCH_LAT_MAX_US ? FETCH_LAT_MAX_US : (uint32_t)us;
+          }
+          if ( fpeer->window < FETCH_WINDOW ) {
+               fpeer->window++;
+          }
+     }
+     else if ( status != CANCELLED ) {
+          if ( status == FAILED ) {
+               fetch->chk_tries[slot]++;
+               fpeer->window = fpeer->window > 1 ? fpeer->window / 2 : 1;
+          }
+
+          if ( fetch->chk_reqs[slot] > 0 ) {
+               // Still requested from another peer during endgame.
+          }
+          else if ( fetch->chk_tries[slot] >= FETCH_MAX_TRIES ) {
+               fetch->chk_state[slot] = CHUNK_FAILED;
+               fetch->nfailed++;
+          }
+          else {
+               fetch->chk_state[slot] = CHUNK_PENDING;
+               fetch->order_dirty = true;
+          }
+     }
+     pthread_cond_signal(&fetch->cond);
+     pthread_mutex_unlock(&fetch->lock);
+}
+
+/* Arguments for taking a peer's availability snapshot under the peers lock. */
+typedef struct fetch_snapshot_arg {
+     fetch_t* fetch;
+     fetch_peer_t* fpeer;
+} fetch_snapshot_arg_t;
+
+/**
+ * @brief Copies what a peer holds of the fetch's package into its snapshot.
+ * Called through peers_apply, so the peer cannot be freed meanwhile.
+ * @param peer Pointer to the peer.
+ * @param arg Pointer to a fetch_snapshot_arg_t.
+ */
+static void fetch_snapshot_apply(peer_t* peer, void* arg) {
+     fetch_snapshot_arg_t* snap = (fetch_snapshot_arg_t*)arg;
+     fetch_t* fetch = snap->fetch;
+     if ( peer_avail_snapshot(peer, fetch->bpkg->ident, fetch->bpkg->mtree->nchunks,
+          snap->fpeer->bits, &snap->fpeer->avail_version) ) {
+          fetch->order_dirty = true;
+     }
+}
+
+/**
+ * @brief Looks up every peer of the fetch, dropping those that disconnected and
+ * refreshing what the rest hold. The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ */
+static void fetch_refresh_peers(fetch_t* fetch) {
+     for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+          fetch_peer_t* fpeer = &fetch->fpeers[i];
+          if ( fpeer->gone ) {
+               continue;
+          }
+
+          fetch_snapshot_arg_t snap = { .fetch = fetch, .fpeer = fpeer };
+          fpeer->live = peers_apply(fetch->peers, fpeer->ip, fpeer->port, fetch_snapshot_apply, &snap);
+          if ( !fpeer->live ) {
+               // Its queued and in-flight requests come back through req_destroy.
+               debug_print("Peer %s:%d left mid-fetch...\n", fpeer->ip, fpeer->port);
+               fpeer->gone = true;
+               fetch->order_dirty = true;
+          }
+     }
+}
+
+/**
+ * @brief Counts the live holders of every chunk and sorts the chunks rarest first.
+ * Chunks nobody holds any more are failed. The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ */
+static void fetch_rank_chunks(fetch_t* fetch) {
+     if ( !fetch->buckets ) {
+          fetch->buckets = (uint32_t*)my_malloc(( fetch->npeers + 2 ) * sizeof(uint32_t));
+     }
+     uint32_t* buckets = fetch->buckets;
+     memset(buckets, 0, ( fetch->npeers + 2 ) * sizeof(uint32_t));
+
+     for ( uint32_t c = 0; c < fetch->nchunks; c++ ) {
+          uint32_t index = fetch->chk_nodes[c]->chunk->index;
+          uint32_t rarity = 0;
+          for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+               if ( fetch->fpeers[i].live && AVAIL_GET(fetch->fpeers[i].bits, index) ) {
+                    rarity++;
+               }
+          }
+          fetch->chk_rarity[c] = rarity;
+
+          if ( rarity == 0 && fetch->chk_state[c] == CHUNK_PENDING ) {
+               debug_print("No connected peer holds chunk %u...\n", index);
+               fetch->chk_state[c] = CHUNK_FAILED;
+               fetch->nfailed++;
+          }
+          buckets[rarity + 1]++;
+     }
+
+     // Counting sort on rarity, stable so equally rare chunks keep file order.
+     for ( uint32_t r = 1; r <= fetch->npeers + 1; r++ ) {
+          buckets[r] += buckets[r - 1];
+     }
+     for ( uint32_t c = 0; c < fetch->nchunks; c++ ) {
+          fetch->order[buckets[fetch->chk_rarity[c]]++] = c;
+     }
+
+     fetch->cursor = 0;
+     fetch->order_dirty = false;
+}
+
+/**
+ * @brief Checks whether a peer already has a request out for a chunk. Only the
+ * latest regular request and the endgame duplicates are tracked, which is all the
+ * endgame needs. The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ * @param slot Chunk slot.
+ * @param p Peer index.
+ * @return true if the peer is already serving the chunk.
+ */
+static bool fetch_peer_serving(fetch_t* fetch, uint32_t slot, uint32_t p) {
+     if ( fetch->chk_peer[slot] == p ) {
+          return true;
+     }
+     for ( uint32_t d = 0; d < fetch->ndups; d++ ) {
+          if ( fetch->dups[d].chk_slot == slot && fetch->dups[d].peer_slot == p ) {
+               return true;
+          }
+     }
+     return false;
+}
+
+/**
+ * @brief Picks the least loaded live peer due a refill (or, for duplicates, with any room)
+ * that holds a chunk.
+ * The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ * @param slot Chunk slot to place.
+ * @param dup Whether this is an endgame duplicate, skipping peers already serving it.
+ * @return Index of the chosen peer, or -1 if every holder is busy.
+ */
+static int fetch_pick_peer(fetch_t* fetch, uint32_t slot, bool dup) {
+     uint32_t index = fetch->chk_nodes[slot]->chunk->index;
+     int best = -1;
+
+     for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+          fetch_peer_t* fpeer = &fetch->fpeers[i];
+          if ( !fpeer->live || fpeer->ninflight >= fpeer->window || !AVAIL_GET(fpeer->bits, index) ) {
+               continue;
+          }
+          if ( !dup && !fpeer->refill ) {
+               continue;
+          }
+          if ( dup && fetch_peer_serving(fetch, slot, i) ) {
+               continue;
+          }
+
+          // Compare load as ninflight / window without dividing.
+          if ( best < 0 || (uint64_t)fpeer->ninflight * fetch->fpeers[best].window
+               < (uint64_t)fetch->fpeers[best].ninflight * fpeer->window ) {
+               best = (int)i;
+          }
+     }
+     return best;
+}
+
+/**
+ * @brief Builds a request for a chunk on a peer and accounts for it. The fetch lock
+ * must be held.
+ * @param fetch Pointer to the fetch.
+ * @param slot Chunk slot to request.
+ * @param p Index of the peer to request it from.
+ * @return Pointer to the request, or NULL on failure.
+ */
+static request_t* fetch_issue(fetch_t* fetch, uint32_t slot, uint32_t p) {
+     pkt_t* pkt = pkt_prepare_request_pkt(fetch->bpkg, fetch->chk_nodes[slot]);
+     request_t* req = req_create(pkt);
+     if ( !req ) {
+          pkt_destroy(pkt);
+          return NULL;
+     }
+     req->fetch = fetch;
+     req->chk_node = fetch->chk_nodes[slot];
+     req->chk_slot = slot;
+     req->peer_slot = p;
+
+     fetch->chk_state[slot] = CHUNK_INFLIGHT;
+     fetch->chk_reqs[slot]++;
+     fetch->refs++;
+     fetch->ninflight++;
+     fetch->fpeers[p].ninflight++;
+     return req;
+}
+
+/**
+ * @brief Hands pending chunks, rarest first, to peers with room in their windows.
+ * In endgame, outstanding chunks are also asked of further peers holding them.
+ * Requests are built under the fetch lock and collected so they can be enqueued
+ * after it is dropped. The fetch lock must be held.
+ * @param fetch Pointer to the fetch.
+ * @param batch Output array for the built requests.
+ * @param max Capacity of batch.
+ * @return Number of requests built.
+ */
+static uint32_t fetch_schedule(fetch_t* fetch, request_t** batch, uint32_t max) {
+     // A window is topped up only once a share of it is free, so the peer thread finds
+     // several requests at once and sends them as one BRQ.
+     uint32_t room = 0;
+     for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+          fetch_peer_t* fpeer = &fetch->fpeers[i];
+          uint32_t free_slots = fpeer->ninflight < fpeer->window ? fpeer->window - fpeer->ninflight : 0;
+          fpeer->refill = fpeer->live && free_slots > 0 && free_slots >= ( fpeer->window + FETCH_REFILL_DIV - 1 ) / FETCH_REFILL_DIV;
+          room += fpeer->live ? free_slots : 0;
+     }
+     if ( room > max ) {
+          room = max;
+     }
+
+     while ( fetch->cursor < fetch->nchunks && fetch->chk_state[fetch->order[fetch->cursor]] != CHUNK_PENDING ) {
+          fetch->cursor++;
+     }
+
+     uint32_t nbuilt = 0;
+     for ( uint32_t o = fetch->cursor; o < fetch->nchunks && nbuilt < room; o++ ) {
+          uint32_t slot = fetch->order[o];
+          if ( fetch->chk_state[slot] != CHUNK_PENDING ) {
+               continue;
+          }
+
+          int p = fetch_pick_peer(fetch, slot, false);
+          if ( p < 0 ) {
+               continue;
+          }
+
+          request_t* req = fetch_issue(fetch, slot, (uint32_t)p);
+          if ( !req ) {
+               break;
+          }
+          fetch->chk_peer[slot] = (uint32_t)p;
+          batch[nbuilt] = req;
+          nbuilt++;
+     }
+
+     // Endgame starts once nothing is left waiting and only a few chunks are still out.
+     uint32_t remaining = fetch->nchunks - fetch->ndone - fetch->nfailed;
+     if ( !fetch->endgame && fetch->npeers > 1 && fetch->cursor >= fetch->nchunks
+          && remaining <= FETCH_ENDGAME_CHUNKS ) {
+          debug_print("Fetch entering endgame with %u chunks outstanding...\n", remaining);
+          fetch->endgame = true;
+     }
+     if ( !fetch->endgame ) {
+          return nbuilt;
+     }
+
+     for ( uint32_t o = 0; o < fetch->nchunks && nbuilt < room; o++ ) {
+          uint32_t slot = fetch->order[o];
+          if ( fetch->chk_state[slot] != CHUNK_INFLIGHT || fetch->chk_reqs[slot] >= FETCH_ENDGAME_REQS
+               || fetch->ndups >= FETCH_ENDGAME_CHUNKS * FETCH_ENDGAME_REQS ) {
+               continue;
+          }
+
+          int p = fetch_pick_peer(fetch, slot, true);
+          if ( p < 0 ) {
+               continue;
+          }
+
+          request_t* req = fetch_issue(fetch, slot, (uint32_t)p);
+          if ( !req ) {
+               break;
+          }
+          fetch->dups[fetch->ndups].chk_slot = slot;
+          fetch->dups[fetch->ndups].peer_slot = (uint32_t)p;
+          fetch->ndups++;
+          batch[nbuilt] = req;
+          nbuilt++;
+     }
+     return nbuilt;
+}
+
+/* A run of built requests for one peer, enqueued under the peers lock. */
+typedef struct fetch_enqueue_arg {
+     request_t** requests;
+     uint32_t n;
+     uint32_t nadded;               // Requests the queue took
+} fetch_enqueue_arg_t;
+
+/**
+ * @brief Adds a run of requests to a peer's queue. Called through peers_apply, so
+ * the peer cannot be freed meanwhile.
+ * @param peer Pointer to the peer.
+ * @param arg Pointer to a fetch_enqueue_arg_t.
+ */
+static void fetch_enqueue_apply(peer_t* peer, void* arg) {
+     fetch_enqueue_arg_t* run = (fetch_enqueue_arg_t*)arg;
+     run->nadded = (uint32_t)reqs_enqueue_many(peer->reqs_q, run->requests, run->n);
+}
+
+/**
+ * @brief Enqueues built requests with each peer's share added in one go, so the
+ * peer thread finds them together and can send them as a single BRQ. Each peer is
+ * looked up again by address. Requests for a peer that has since left, or that its
+ * full queue could not take, are destroyed once the peers lock is released, since
+ * failing a chunk takes the fetch lock. The fetch lock must not be held.
+ * @param fetch Pointer to the fetch.
+ * @param batch Built requests; reordered so each peer's share is contiguous.
+ * @param nbuilt Number of requests.
+ */
+static void fetch_enqueue_by_peer(fetch_t* fetch, request_t** batch, uint32_t nbuilt) {
+     uint32_t start = 0;
+     while ( start < nbuilt ) {
+          // Pull every later request for the same peer up behind the first.
+          uint32_t end = start + 1;
+          for ( uint32_t i = end; i < nbuilt; i++ ) {
+               if ( batch[i]->peer_slot == batch[start]->peer_slot ) {
+                    request_t* req = batch[i];
+                    batch[i] = batch[end];
+                    batch[end] = req;
+                    end++;
+               }
+          }
+
+          fetch_peer_t* fpeer = &fetch->fpeers[batch[start]->peer_slot];
+          fetch_enqueue_arg_t run = { .requests = &batch[start], .n = end - start };
+          peers_apply(fetch->peers, fpeer->ip, fpeer->port, fetch_enqueue_apply, &run);
+          for ( uint32_t i = start + run.nadded; i < end; i++ ) {
+               req_destroy(batch[i]);
+          }
+          start = end;
+     }
+}
+
+/**
+ * @brief Prints a progress line each time another step of the batch resolves.
+ * @param fetch Pointer to the fetch, locked by the caller.
+ * @param last_step Pointer to the last reported step.
+ */
+static void fetch_report_progress(fetch_t* fetch, uint32_t* last_step) {
+     uint32_t resolved = fetch->ndone + fetch->nfailed;
+     if ( fetch->nchunks < FETCH_PROGRESS_STEPS || resolved >= fetch->nchunks ) {
+          return;
+     }
+
+     uint32_t step = (uint32_t)( (uint64_t)resolved * FETCH_PROGRESS_STEPS / fetch->nchunks );
+     if ( step > *last_step ) {
+          *last_step = step;
+          printf("Fetch progress: %u/%u chunks\n", resolved, fetch->nchunks);
+          fflush(stdout);
+     }
+}
+
+static int fetch_cmp_u32(const void* a, const void* b) {
+     uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+     return ( x > y ) - ( x < y );
+}
+
+/**
+ * @brief Prints percentiles of the time chunks took from request to verification.
+ * @param fetch Pointer to the fetch, whose latencies are sorted in place.
+ */
+static void fetch_report_latency(fetch_t* fetch) {
+     pthread_mutex_lock(&fetch->lock);
+     uint32_t n = fetch->nlat;
+     if ( n == 0 ) {
+          pthread_mutex_unlock(&fetch->lock);
+          return;
+     }
+     qsort(fetch->chk_lat_us, n, sizeof(uint32_t), fetch_cmp_u32);
+     // Nearest rank, so p99 of a small fetch is one of its slowest chunks.
+     uint32_t* lat = fetch->chk_lat_us;
+     printf("Chunk latency: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms over %u chunks\n",
+          lat[( n - 1 ) * 50 / 100] / 1000.0, lat[( n - 1 ) * 90 / 100] / 1000.0,
+          lat[( n - 1 ) * 99 / 100] / 1000.0, lat[n - 1] / 1000.0, n);
+     pthread_mutex_unlock(&fetch->lock);
+}
+
+/**
+ * @brief Keeps every peer's request window full and waits until every chunk resolves.
+ * @param fetch Pointer to the fetch.
+ */
+void fetch_run(fetch_t* fetch) {
+     uint32_t last_step = 0;
+     struct timespec started, finished;
+     clock_gettime(CLOCK_MONOTONIC, &started);
+     uint32_t max = fetch->npeers * FETCH_WINDOW;
+     request_t** batch = (request_t**)my_malloc(( max ? max : 1 ) * sizeof(request_t*));
+
+     if ( fetch->npeers == 1 ) {
+          printf("Fetching %u chunks from %s:%d\n", fetch->nchunks, fetch->fpeers[0].ip, fetch->fpeers[0].port);
+     }
+     else {
+          printf("Fetching %u chunks from %u peers\n", fetch->nchunks, fetch->npeers);
+     }
+     fflush(stdout);
+
+     pthread_mutex_lock(&fetch->lock);
+     while ( !fetch->stopped && fetch->ndone + fetch->nfailed < fetch->nchunks ) {
+          fetch_refresh_peers(fetch);
+          if ( fetch->order_dirty ) {
+               fetch_rank_chunks(fetch);
+          }
+
+          // Enqueue with the lock dropped so a peer thread tearing down its queue can
+          // still resolve our requests.
+          uint32_t nbuilt = fetch_schedule(fetch, batch, max);
+          if ( nbuilt > 0 ) {
+               pthread_mutex_unlock(&fetch->lock);
+               fetch_enqueue_by_peer(fetch, batch, nbuilt);
+               pthread_mutex_lock(&fetch->lock);
+          }
+
+          fetch_report_progress(fetch, &last_step);
+          if ( fetch->ndone + fetch->nfailed >= fetch->nchunks ) {
+               break;
+          }
+
+          struct timespec ts;
+          clock_gettime(CLOCK_REALTIME, &ts);
+          ts.tv_sec += 1;
+          pthread_cond_timedwait(&fetch->cond, &fetch->lock, &ts);
+     }
+
+     uint32_t ndone = fetch->ndone;
+     uint32_t nfailed = fetch->nfailed;
+     bool stopped = fetch->stopped;
+     pthread_mutex_unlock(&fetch->lock);
+     free(batch);
+
+     // Chunks were installed through the mapping; push them to disk before reporting.
+     if ( ndone > 0 && !stopped && fetch->bpkg->mtree->f_fd >= 0 ) {
+          io_engine_t* io = io_engine_thread();
+          io_result_t result;
+          if ( io_fsync(io, fetch->bpkg->mtree->f_fd, NULL) == 0 && io_wait(io, &result, 1, 1) == 1 && result.res < 0 ) {
+               fprintf(stderr, "Failed to sync %s: %s\n", fetch->bpkg->filename, strerror(-result.res));
+          }
+     }
+
+     clock_gettime(CLOCK_MONOTONIC, &finished);
+     double elapsed = ( finished.tv_sec - started.tv_sec ) + ( finished.tv_nsec - started.tv_nsec ) / 1e9;
+
+     if ( stopped ) {
+          printf("Fetch stopped: %u/%u chunks installed\n", ndone, fetch->nchunks);
+     }
+     else if ( nfailed == 0 ) {
+          printf("Fetch complete: %u/%u chunks installed in %.2fs\n", ndone, fetch->nchunks, elapsed);
+     }
+     else {
+          printf("Fetch finished: %u/%u chunks installed, %u failed in %.2fs\n", ndone, fetch->nchunks, nfailed, elapsed);
+     }
+     if ( fetch->npeers > 1 ) {
+          for ( uint32_t i = 0; i < fetch->npeers; i++ ) {
+               printf("  %s:%d delivered %u chunks\n", fetch->fpeers[i].ip, fetch->fpeers[i].port,
+                    fetch->fpeers[i].ndone);
+          }
+     }
+     if ( !stopped ) {
+          fetch_report_latency(fetch);
+     }
+     fflush(stdout);
+}
+
+/**
+ * @brief Thread entry point driving a fetch to completion.
+ * @param args_void Pointer to the fetch.
+ * @return NULL
+ */
+static void* fetch_thread_handler(void* args_void) {
+     fetch_t* fetch = (fetch_t*)args_void;
+     TRACE_THREAD("fetch %.16s", fetch->bpkg->ident);
+     fetch_run(fetch);
+
+     pthread_mutex_lock(&fetch_active_lock);
+     q_remove(fetch_active, fetch);
+     pthread_cond_broadcast(&fetch_active_cond);
+     pthread_mutex_unlock(&fetch_active_lock);
+
+     fetch_release(fetch);
+     return NULL;
+}
+
+/**
+ * @brief Runs a fetch on its own detached thread, reporting progress to stdout.
+ * @param fetch Pointer to the fetch; the caller's reference is handed over.
+ * @param peers Pointer to the peers list used to locate the serving peers.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int fetch_start(fetch_t* fetch, peers_t* peers) {
+     fetch->peers = peers;
+
+     pthread_mutex_lock(&fetch_active_lock);
+     if ( fetch_stopping ) {
+          pthread_mutex_unlock(&fetch_active_lock);
+          fetch_release(fetch);
+          return -1;
+     }
+     if ( !fetch_active ) {
+          fetch_active = q_init();
+     }
+     q_enqueue(fetch_active, fetch);
+
+     pthread_t thread;
+     if ( pthread_create(&thread, NULL, fetch_thread_handler, fetch) != 0 ) {
+          perror("Fetch thread creation failed...");
+          q_remove(fetch_active, fetch);
+          pthread_mutex_unlock(&fetch_active_lock);
+          fetch_release(fetch);
+          return -1;
+     }
+     pthread_detach(thread);
+     pthread_mutex_unlock(&fetch_active_lock);
+     return 0;
+}
+
+/**
+ * @brief Stops every running fetch and waits for their driver threads to exit.
+ * Must be called before the peers list they use is torn down.
+ */
+void fetch_stop_all() {
+     pthread_mutex_lock(&fetch_active_lock);
+     fetch_stopping = true;
+
+     if ( fetch_active ) {
+          for ( q_node_t* curr = fetch_active->head; curr != NULL; curr = curr->next ) {
+               fetch_t* fetch = (fetch_t*)curr->data;
+               pthread_mutex_lock(&fetch->lock);
+               fetch->stopped = true;
+               pthread_cond_signal(&fetch->cond);
+               pthread_mutex_unlock(&fetch->lock);
+          }
+          while ( !q_empty(fetch_active) ) {
+               pthread_cond_wait(&fetch_active_cond, &fetch_active_lock);
+          }
+     }
+     pthread_mutex_unlock(&fetch_active_lock);
+}
+
+/**
+ * @brief Counts the fetches still running.
+ * @return Number of fetches whose driver thread has not finished.
+ */
+uint32_t fetch_count_active() {
+     uint32_t n = 0;
+     pthread_mutex_lock(&fetch_active_lock);
+     if ( fetch_active ) {
+          for ( q_node_t* curr = fetch_active->head; curr != NULL; curr = curr->next ) {
+               n++;
+          }
+     }
+     pthread_mutex_unlock(&fetch_active_lock);
+     return n;
+}
+
+/**
+ * @brief Removes a request from the peer's in-flight list and resolves it.
+ * @param peer Pointer to the peer.
+ * @param req Pointer to the in-flight request.
+ * @param status Final status of the request.
+ */
+static void fetch_resolve_inflight(peer_t* peer, request_t* req, enum RequestStatus status) {
+     q_remove(peer->inflight, req);
+     req->status = status;
+     fetch_chunk_done(req->fetch, req, status);
+     req_destroy(req);
+}
+
+/**
+ * @brief Withdraws an in-flight request whose chunk was verified through another
+ * peer, queueing a CNL so the peer can stop serving it.
+ * @param peer Pointer to the peer.
+ * @param req Pointer to the in-flight request.
+ */
+static void fetch_cancel_inflight(peer_t* peer, request_t* req) {
+     debug_print("Cancelling redundant chunk request to peer at port %d...\n", peer->port);
+     pkt_t* pkt = pkt_prepare_cancel_pkt(req->fetch->bpkg, req->chk_node);
+     if ( pkt ) {
+          reqs_enqueue(peer->reqs_q, req_create(pkt));
+     }
+     fetch_resolve_inflight(peer, req, CANCELLED);
+}
+
+/**
+ * @brief Matches a RES against the peer's in-flight requests and installs its data.
+ * The caller holds the peer's inflight_lock.
+ * @param peer Pointer to the peer the packet came from.
+ * @param pkt_in Pointer to the RES packet.
+ * @param bpkg Output for a reference to the package of a completed chunk.
+ * @param index Output for the index of a completed chunk.
+ * @return 1 if the chunk completed, 0 if more data is expected, -1 on failure.
+ */
+static int fetch_install_res(peer_t* peer, pkt_t* pkt_in, bpkg_t** bpkg, uint32_t* index) {
+     res_t* res = &pkt_in->payload.res;
+     request_t* req = NULL;
+
+     // Responses for a chunk are matched by hash and by the offset falling inside it,
+     // which keeps duplicate chunk hashes within a package apart.
+     for ( q_node_t* curr = peer->inflight->head; curr != NULL; curr = curr->next ) {
+          request_t* cand = (request_t*)curr->data;
+          chunk_t* chk = cand->chk_node->chunk;
+          if ( strncmp(cand->chk_node->expected_hash, res->hash, SHA256_HEXLEN) == 0
+               && res->offset >= chk->offset && res->offset - chk->offset < chk->size ) {
+               req = cand;
+               break;
+          }
+     }
+
+     if ( !req ) {
+          debug_print("Unsolicited RES from peer at port %d, dropping...\n", peer->port);
+          return -1;
+     }
+     clock_gettime(CLOCK_MONOTONIC, &peer->last_res);
+
+     // Never write over a chunk another peer already delivered and verified.
+     if ( check_chunk(req->chk_node) ) {
+          fetch_cancel_inflight(peer, req);
+          return 0;
+     }
+
+     if ( pkt_in->error != 0 ) {
+          debug_print("Peer on Port[%d] does not have the requested chunk...\n", peer->port);
+          mtree_t* mtree = req->fetch->bpkg->mtree;
+          peer_avail_set(peer, req->fetch->bpkg->ident, mtree->nchunks, req->chk_node->chunk->index, false);
+          fetch_resolve_inflight(peer, req, MISSING);
+          return -1;
+     }
+
+     struct timespec install_start;
+     clock_gettime(CLOCK_MONOTONIC, &install_start);
+     if ( pkt_chk_update_data(req->fetch->bpkg->mtree, req->chk_node, pkt_in->payload) < 0 ) {
+          fetch_resolve_inflight(peer, req, FAILED);
+          return -1;
+     }
+     metrics_record_latency(&peer->stats, req->fetch->lat, LAT_INSTALL, &install_start);
+
+     req->nbytes += res->size;
+     metrics_add(&metrics_global()->res_installed, 1);
+     if ( check_chunk(req->chk_node) ) {
+          metrics_add(&metrics_global()->chunks_verified, 1);
+          metrics_record_latency(&peer->stats, req->fetch->lat, LAT_ROUND_TRIP, &req->sent_at);
+          *bpkg = bpkg_retain(req->fetch->bpkg);
+          *index = req->chk_node->chunk->index;
+          fetch_resolve_inflight(peer, req, SUCCESS);
+          return 1;
+     }
+     if ( req->nbytes >= req->chk_node->chunk->size ) {
+          debug_print("Chunk from peer at port %d failed verification...\n", peer->port);
+          metrics_add(&metrics_global()->hash_failures, 1);
+          fetch_resolve_inflight(peer, req, FAILED);
+          return -1;
+     }
+     return 0;
+}
+
+/**
+ * @brief Matches an incoming RES against the peer's in-flight chunk requests and
+ * installs its data, resolving the request once the chunk verifies.
+ * @param peer Pointer to the peer the packet came from.
+ * @param pkt_in Pointer to the RES packet.
+ * @param bpkg Output for a reference to the package of a completed chunk.
+ * @param index Output for the index of a completed chunk.
+ * @return 1 if the chunk completed, 0 if more data is expected, -1 on failure.
+ */
+int fetch_handle_res(peer_t* peer, pkt_t* pkt_in, bpkg_t** bpkg, uint32_t* index) {
+     if ( !peer || !peer->inflight || !pkt_in ) {
+          return -1;
+     }
+
+     pthread_mutex_lock(&peer->inflight_lock);
+     int status = fetch_install_res(peer, pkt_in, bpkg, index);
+     pthread_mutex_unlock(&peer->inflight_lock);
+     return status;
+}
+
+/**
+ * @brief Gets how long an in-flight request has gone without progress from its peer.
+ * The caller holds the peer's inflight_lock.
+ * @param peer Pointer to the peer.
+ * @param req Pointer to the request.
+ * @param now Current monotonic time.
+ * @return Nanoseconds since the later of the request's send and the peer's last RES.
+ */
+static int64_t fetch_waited_ns(peer_t* peer, request_t* req, const struct timespec* now) {
+     const struct timespec* since = &req->sent_at;
+     if ( peer->last_res.tv_sec > since->tv_sec
+          || ( peer->last_res.tv_sec == since->tv_sec && peer->last_res.tv_nsec > since->tv_nsec ) ) {
+          since = &peer->last_res;
+     }
+     return ( now->tv_sec - since->tv_sec ) * 1000000000LL + ( now->tv_nsec - since->tv_nsec );
+}
+
+/**
+ * @brief Fails every in-flight request of a peer that has waited too long, and
+ * cancels those whose chunk has since been verified through another peer.
+ * A request waits from when it was sent or from the peer's last RES, whichever is
+ * later: requests queue behind each other on a rate-limited link, so one is only
+ * stalled once the peer stops answering any of them.
+ * @param peer Pointer to the peer.
+ */
+void fetch_expire_inflight(peer_t* peer) {
+     if ( !peer || !peer->inflight ) {
+          return;
+     }
+
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+
+     pthread_mutex_lock(&peer->inflight_lock);
+     q_node_t* curr = peer->inflight->head;
+     while ( curr != NULL ) {
+          request_t* req = (request_t*)curr->data;
+          curr = curr->next;
+          if ( check_chunk(req->chk_node) ) {
+               fetch_cancel_inflight(peer, req);
+          }
+          else if ( fetch_waited_ns(peer, req, &now) >= FETCH_TIMEOUT_S * 1000000000LL ) {
+               debug_print("Chunk request to peer at port %d timed out...\n", peer->port);
+               fetch_resolve_inflight(peer, req, FAILED);
+          }
+     }
+     pthread_mutex_unlock(&peer->inflight_lock);
+}
+
+/**
+ * @brief Drops a queued chunk request whose chunk was verified before it was sent.
+ * @param req Pointer to the request about to be sent.
+ * @return 1 if the request was resolved and destroyed, 0 if it should be sent.
+ */
+int fetch_skip_redundant(request_t* req) {
+     if ( !req || !req->fetch || !check_chunk(req->chk_node) ) {
+          return 0;
+     }
+
+     req->status = CANCELLED;
+     fetch_chunk_done(req->fetch, req, CANCELLED);
+     req_destroy(req);
+     return 1;
+}
@@ -0,0 +1,454 @@
+#include <utilities/my_utils.h>
+#include <peer_2_peer/fetch.h>
+#include <peer_2_peer/metrics.h>
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <string.h>
+
+static metrics_t metrics = { 0 };
+
+static const char* metric_msg_names[METRIC_MSGS] = {
+     "ack", "acp", "dsn", "req", "brq", "res", "hav", "cnl", "prq", "prf", "png", "pog", "other",
+};
+
+static const char* metric_msg_labels[METRIC_MSGS] = {
+     "ACK", "ACP", "DSN", "REQ", "BRQ", "RES", "HAV", "CNL", "PRQ", "PRF", "PNG", "POG", "other",
+};
+
+static const char* metric_dir_names[METRIC_DIRS] = { "sent", "received" };
+
+static const char* latency_names[LAT_KINDS] = { "round_trip", "serve", "install", "queue_wait" };
+
+static const char* latency_labels[LAT_KINDS] = { "round trip", "serve", "install", "queue wait" };
+
+static const double latency_quantiles[] = { 0.5, 0.99, 0.999 };
+
+/* Latency histograms of one package. */
+typedef struct pkg_latency {
+     char ident[PKGS_KEY_MAX + 1];
+     latency_set_t lat;
+} pkg_latency_t;
+
+static queue_t* pkg_lats = NULL;
+static pthread_mutex_t pkg_lats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-peer series written in one pass over the peers. */
+enum PeerSeries {
+     SERIES_PKTS,
+     SERIES_BYTES,
+     SERIES_QUEUE,
+     SERIES_INFLIGHT,
+     SERIES_DROPPED,
+};
+
+/* Arguments of a pass over the peers. */
+typedef struct metrics_pass {
+     FILE* out;
+     enum PeerSeries series;
+} metrics_pass_t;
+
+/**
+ * @brief Returns the counters of this node.
+ * @return Pointer to the counters.
+ */
+metrics_t* metrics_global() {
+     return &metrics;
+}
+
+/**
+ * @brief Maps a message code to the slot it is counted under.
+ * @param msg_code Message code of the packet.
+ * @return Slot of the message type.
+ */
+enum MetricMsg metrics_msg_slot(uint16_t msg_code) {
+     switch ( msg_code ) {
+     case PKT_MSG_ACK: return METRIC_MSG_ACK;
+     case PKT_MSG_ACP: return METRIC_MSG_ACP;
+     case PKT_MSG_DSN: return METRIC_MSG_DSN;
+     case PKT_MSG_REQ: return METRIC_MSG_REQ;
+     case PKT_MSG_BRQ: return METRIC_MSG_BRQ;
+     case PKT_MSG_RES: return METRIC_MSG_RES;
+     case PKT_MSG_HAV: return METRIC_MSG_HAV;
+     case PKT_MSG_CNL: return METRIC_MSG_CNL;
+     case PKT_MSG_PRQ: return METRIC_MSG_PRQ;
+     case PKT_MSG_PRF: return METRIC_MSG_PRF;
+     case PKT_MSG_PNG: return METRIC_MSG_PNG;
+     case PKT_MSG_POG: return METRIC_MSG_POG;
+     default: return METRIC_MSG_OTHER;
+     }
+}
+
+/**
+ * @brief Adds to a node counter.
+ * @param counter Pointer to a counter of metrics_global().
+ * @param n Amount to add.
+ */
+void metrics_add(_Atomic uint64_t* counter, uint64_t n) {
+     atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/**
+ * @brief Counts packets of one type sent to or received from a peer.
+ * @param stats Pointer to the peer's counters, may be NULL to count only the node's.
+ * @param dir Direction the packets travelled.
+ * @param msg_code Message code of the packets.
+ * @param npkts Number of packets.
+ * @param nbytes Bytes they took on the wire.
+ */
+void metrics_count_pkts(peer_stats_t* stats, enum MetricDir dir, uint16_t msg_code, uint64_t npkts, uint64_t nbytes) {
+     enum MetricMsg slot = metrics_msg_slot(msg_code);
+     metrics_add(&metrics.pkts[dir][slot], npkts);
+     metrics_add(&metrics.bytes[dir], nbytes);
+     if ( stats ) {
+          metrics_add(&stats->pkts[dir][slot], npkts);
+          metrics_add(&stats->bytes[dir], nbytes);
+     }
+}
+
+/**
+ * @brief Returns the latency histograms of a package, created on first use.
+ * Histograms are kept for every package seen until the node exits.
+ * @param ident Identifier of the package, compared up to PKGS_KEY_MAX characters.
+ * @return Pointer to the package's histograms.
+ */
+latency_set_t* metrics_pkg_latency(const char* ident) {
+     pthread_mutex_lock(&pkg_lats_lock);
+     if ( !pkg_lats ) {
+          pkg_lats = q_init();
+     }
+     for ( q_node_t* curr = pkg_lats->head; curr != NULL; curr = curr->next ) {
+          pkg_latency_t* entry = (pkg_latency_t*)curr->data;
+          if ( strncmp(entry->ident, ident, PKGS_KEY_MAX) == 0 ) {
+               pthread_mutex_unlock(&pkg_lats_lock);
+               return &entry->lat;
+          }
+     }
+
+     pkg_latency_t* entry = (pkg_latency_t*)my_malloc(sizeof(pkg_latency_t));
+     memset(entry, 0, sizeof(pkg_latency_t));
+     strncpy(entry->ident, ident, PKGS_KEY_MAX);
+     q_enqueue(pkg_lats, entry);
+     pthread_mutex_unlock(&pkg_lats_lock);
+     return &entry->lat;
+}
+
+/**
+ * @brief Records how long a stage took, for the node, a peer and a package.
+ * @param stats Pointer to the peer's counters, may be NULL.
+ * @param pkg Pointer to the package's histograms, may be NULL.
+ * @param kind Stage that was timed.
+ * @param start When the stage started, on CLOCK_MONOTONIC.
+ */
+void metrics_record_latency(peer_stats_t* stats, latency_set_t* pkg, enum LatencyKind kind, const struct timespec* start) {
+     if ( start->tv_sec == 0 && start->tv_nsec == 0 ) {
+          return;
+     }
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     int64_t ns = ( now.tv_sec - start->tv_sec ) * 1000000000LL + ( now.tv_nsec - start->tv_nsec );
+     uint64_t value = ns < 0 ? 0 : (uint64_t)ns;
+
+     hist_record(&metrics.lat.hist[kind], value);
+     if ( stats ) {
+          hist_record(&stats->lat.hist[kind], value);
+     }
+     if ( pkg ) {
+          hist_record(&pkg->hist[kind], value);
+     }
+}
+
+/**
+ * @brief Reads a counter.
+ * @param counter Pointer to the counter.
+ * @return Its value.
+ */
+static uint64_t metrics_get(_Atomic uint64_t* counter) {
+     return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * @brief Counts a peer's chunk requests awaiting a response.
+ * @param peer Pointer to the peer.
+ * @return Number of requests in flight.
+ */
+static size_t metrics_peer_inflight(peer_t* peer) {
+     size_t n = 0;
+     pthread_mutex_lock(&peer->inflight_lock);
+     for ( q_node_t* curr = peer->inflight ? peer->inflight->head : NULL; curr != NULL; curr = curr->next ) {
+          n++;
+     }
+     pthread_mutex_unlock(&peer->inflight_lock);
+     return n;
+}
+
+/**
+ * @brief Writes the samples of one per-peer series for a peer.
+ * @param peer Pointer to the peer.
+ * @param arg Pointer to the pass.
+ */
+static void metrics_write_peer(peer_t* peer, void* arg) {
+     metrics_pass_t* pass = (metrics_pass_t*)arg;
+     FILE* out = pass->out;
+     peer_stats_t* stats = &peer->stats;
+
+     switch ( pass->series ) {
+     case SERIES_PKTS:
+          for ( int d = 0; d < METRIC_DIRS; d++ ) {
+               for ( int m = 0; m < METRIC_MSGS; m++ ) {
+                    uint64_t n = metrics_get(&stats->pkts[d][m]);
+                    if ( n > 0 ) {
+                         fprintf(out, "btide_peer_packets_total{peer=\"%s:%d\",direction=\"%s\",type=\"%s\"} %lu\n",
+                              peer->ip, peer->port, metric_dir_names[d], metric_msg_names[m], n);
+                    }
+               }
+          }
+          break;
+     case SERIES_BYTES:
+          for ( int d = 0; d < METRIC_DIRS; d++ ) {
+               fprintf(out, "btide_peer_bytes_total{peer=\"%s:%d\",direction=\"%s\"} %lu\n",
+                    peer->ip, peer->port, metric_dir_names[d], metrics_get(&stats->bytes[d]));
+          }
+          break;
+     case SERIES_QUEUE:
+          fprintf(out, "btide_peer_queue_depth{peer=\"%s:%d\"} %zu\n", peer->ip, peer->port, reqs_depth(peer->reqs_q));
+          break;
+     case SERIES_INFLIGHT:
+          fprintf(out, "btide_peer_inflight_requests{peer=\"%s:%d\"} %zu\n", peer->ip, peer->port, metrics_peer_inflight(peer));
+          break;
+     case SERIES_DROPPED:
+          fprintf(out, "btide_peer_requests_dropped_total{peer=\"%s:%d\"} %zu\n", peer->ip, peer->port,
+               peer->reqs_q ? atomic_load(&peer->reqs_q->ndropped) : 0);
+          break;
+     }
+}
+
+/**
+ * @brief Writes the header of a metric family.
+ * @param out Stream to write to.
+ * @param name Name of the metric.
+ * @param type counter or gauge.
+ * @param help Description of the metric.
+ */
+static void metrics_family(FILE* out, const char* name, const char* type, const char* help) {
+     fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Writes a family with a single unlabelled sample.
+ * @param out Stream to write to.
+ * @param name Name of the metric.
+ * @param type counter or gauge.
+ * @param help Description of the metric.
+ * @param value Value of the sample.
+ */
+static void metrics_single(FILE* out, const char* name, const char* type, const char* help, uint64_t value) {
+     metrics_family(out, name, type, help);
+     fprintf(out, "%s %lu\n", name, value);
+}
+
+/**
+ * @brief Writes one per-peer family.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list.
+ * @param series Series to write.
+ * @param name Name of the metric.
+ * @param type counter or gauge.
+ * @param help Description of the metric.
+ */
+static void metrics_peer_family(FILE* out, peers_t* peers, enum PeerSeries series, const char* name,
+     const char* type, const char* help) {
+     metrics_family(out, name, type, help);
+     metrics_pass_t pass = { .out = out, .series = series };
+     peers_for_each(peers, metrics_write_peer, &pass);
+}
+
+/**
+ * @brief Writes every counter and gauge in the Prometheus text exposition format.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list, for per-peer series.
+ */
+void metrics_write_prometheus(FILE* out, peers_t* peers) {
+     metrics_family(out, "btide_packets_total", "counter", "Packets exchanged with peers.");
+     for ( int d = 0; d < METRIC_DIRS; d++ ) {
+          for ( int m = 0; m < METRIC_MSGS; m++ ) {
+               fprintf(out, "btide_packets_total{direction=\"%s\",type=\"%s\"} %lu\n",
+                    metric_dir_names[d], metric_msg_names[m], metrics_get(&metrics.pkts[d][m]));
+          }
+     }
+     metrics_family(out, "btide_bytes_total", "counter", "Bytes exchanged with peers.");
+     for ( int d = 0; d < METRIC_DIRS; d++ ) {
+          fprintf(out, "btide_bytes_total{direction=\"%s\"} %lu\n", metric_dir_names[d], metrics_get(&metrics.bytes[d]));
+     }
+
+     metrics_single(out, "btide_chunks_served_total", "counter", "Chunks streamed in answer to REQ and BRQ.",
+          metrics_get(&metrics.chunks_served));
+     metrics_single(out, "btide_serve_errors_total", "counter", "Chunk requests answered with an error.",
+          metrics_get(&metrics.serve_errors));
+     metrics_single(out, "btide_res_installed_total", "counter", "RES packets written into a package.",
+          metrics_get(&metrics.res_installed));
+     metrics_single(out, "btide_chunks_verified_total", "counter", "Fetched chunks that matched their hash.",
+          metrics_get(&metrics.chunks_verified));
+     metrics_single(out, "btide_hash_failures_total", "counter", "Fetched chunks that did not match their hash.",
+          metrics_get(&metrics.hash_failures));
+     metrics_single(out, "btide_hash_bytes_total", "counter", "Bytes hashed while installing.",
+          metrics_get(&metrics.hash_bytes));
+     metrics_family(out, "btide_hash_seconds_total", "counter", "Time spent hashing while installing.");
+     fprintf(out, "btide_hash_seconds_total %.6f\n", metrics_get(&metrics.hash_ns) / 1e9);
+
+     metrics_family(out, "btide_latency_seconds", "summary", "Time taken by each stage since the node started.");
+     for ( int k = 0; k < LAT_KINDS; k++ ) {
+          histogram_t* hist = &metrics.lat.hist[k];
+          for ( size_t q = 0; q < sizeof(latency_quantiles) / sizeof(latency_quantiles[0]); q++ ) {
+               fprintf(out, "btide_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", latency_names[k],
+                    latency_quantiles[q], hist_quantile(hist, latency_quantiles[q]) / 1e9);
+          }
+          fprintf(out, "btide_latency_seconds_sum{stage=\"%s\"} %.9f\n", latency_names[k], hist_sum(hist) / 1e9);
+          fprintf(out, "btide_latency_seconds_count{stage=\"%s\"} %lu\n", latency_names[k], hist_count(hist));
+     }
+
+     metrics_single(out, "btide_fetches_active", "gauge", "Fetches still running.", fetch_count_active());
+     pthread_rwlock_rdlock(&peers->lock);
+     size_t npeers = peers->npeers_cur;
+     pthread_rwlock_unlock(&peers->lock);
+     metrics_single(out, "btide_peers_connected", "gauge", "Peers connected.", npeers);
+
+     metrics_peer_family(out, peers, SERIES_PKTS, "btide_peer_packets_total", "counter",
+          "Packets exchanged with a peer since it connected.");
+     metrics_peer_family(out, peers, SERIES_BYTES, "btide_peer_bytes_total", "counter",
+          "Bytes exchanged with a peer since it connected.");
+     metrics_peer_family(out, peers, SERIES_QUEUE, "btide_peer_queue_depth", "gauge",
+          "Packets queued to go out to a peer.");
+     metrics_peer_family(out, peers, SERIES_INFLIGHT, "btide_peer_inflight_requests", "gauge",
+          "Chunk requests sent to a peer awaiting a response.");
+     metrics_peer_family(out, peers, SERIES_DROPPED, "btide_peer_requests_dropped_total", "counter",
+          "Packets dropped because a peer's queue was full.");
+}
+
+/**
+ * @brief Writes the packet counts of one direction that are not zero.
+ * @param out Stream to write to.
+ * @param label Text leading the line.
+ * @param pkts Counters of the direction, one per message type.
+ */
+static void metrics_write_types(FILE* out, const char* label, _Atomic uint64_t* pkts) {
+     fprintf(out, "  %s:", label);
+     bool any = false;
+     for ( int m = 0; m < METRIC_MSGS; m++ ) {
+          uint64_t n = metrics_get(&pkts[m]);
+          if ( n > 0 ) {
+               fprintf(out, "%s %s %lu", any ? "," : "", metric_msg_labels[m], n);
+               any = true;
+          }
+     }
+     fprintf(out, "%s\n", any ? "" : " none");
+}
+
+/**
+ * @brief Writes the STATS line of one peer.
+ * @param peer Pointer to the peer.
+ * @param arg Stream to write to.
+ */
+static void metrics_summary_peer(peer_t* peer, void* arg) {
+     FILE* out = (FILE*)arg;
+     peer_stats_t* stats = &peer->stats;
+     uint64_t pkts[METRIC_DIRS] = { 0 };
+     for ( int d = 0; d < METRIC_DIRS; d++ ) {
+          for ( int m = 0; m < METRIC_MSGS; m++ ) {
+               pkts[d] += metrics_get(&stats->pkts[d][m]);
+          }
+     }
+     fprintf(out, "Peer %s:%d: sent %lu packets (%.2f MB), received %lu (%.2f MB), queued %zu, in flight %zu\n",
+          peer->ip, peer->port, pkts[METRIC_SENT], metrics_get(&stats->bytes[METRIC_SENT]) / 1e6,
+          pkts[METRIC_RECV], metrics_get(&stats->bytes[METRIC_RECV]) / 1e6,
+          reqs_depth(peer->reqs_q), metrics_peer_inflight(peer));
+}
+
+/**
+ * @brief Writes a short human readable summary, as shown by the STATS command.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list, for per-peer lines.
+ */
+void metrics_write_summary(FILE* out, peers_t* peers) {
+     uint64_t pkts[METRIC_DIRS] = { 0 };
+     for ( int d = 0; d < METRIC_DIRS; d++ ) {
+          for ( int m = 0; m < METRIC_MSGS; m++ ) {
+               pkts[d] += metrics_get(&metrics.pkts[d][m]);
+          }
+     }
+     fprintf(out, "Packets sent: %lu (%.2f MB), received: %lu (%.2f MB)\n",
+          pkts[METRIC_SENT], metrics_get(&metrics.bytes[METRIC_SENT]) / 1e6,
+          pkts[METRIC_RECV], metrics_get(&metrics.bytes[METRIC_RECV]) / 1e6);
+     metrics_write_types(out, "sent", metrics.pkts[METRIC_SENT]);
+     metrics_write_types(out, "received", metrics.pkts[METRIC_RECV]);
+
+     fprintf(out, "Chunks served: %lu, serve errors: %lu\n",
+          metrics_get(&metrics.chunks_served), metrics_get(&metrics.serve_errors));
+     fprintf(out, "RES installed: %lu, chunks verified: %lu, hash failures: %lu\n",
+          metrics_get(&metrics.res_installed), metrics_get(&metrics.chunks_verified),
+          metrics_get(&metrics.hash_failures));
+
+     uint64_t hash_bytes = metrics_get(&metrics.hash_bytes);
+     double hash_s = metrics_get(&metrics.hash_ns) / 1e9;
+     fprintf(out, "Hashing: %.2f MB in %.2fs (%.1f MB/s)\n", hash_bytes / 1e6, hash_s,
+          hash_s > 0 ? hash_bytes / 1e6 / hash_s : 0.0);
+     fprintf(out, "Fetches in flight: %u\n", fetch_count_active());
+     peers_for_each(peers, metrics_summary_peer, out);
+}
+
+/**
+ * @brief Writes the lines of a set of histograms that hold values, under a heading.
+ * @param out Stream to write to.
+ * @param heading Text naming whose latencies they are.
+ * @param lat Pointer to the histograms.
+ */
+static void metrics_write_latency_set(FILE* out, const char* heading, latency_set_t* lat) {
+     bool any = false;
+     for ( int k = 0; k < LAT_KINDS; k++ ) {
+          histogram_t* hist = &lat->hist[k];
+          uint64_t n = hist_count(hist);
+          if ( n == 0 ) {
+               continue;
+          }
+          if ( !any ) {
+               fprintf(out, "%s\n", heading);
+               any = true;
+          }
+          fprintf(out, "  %-11s %9lu %10.3f %10.3f %10.3f %10.3f\n", latency_labels[k], n,
+               hist_quantile(hist, 0.5) / 1e6, hist_quantile(hist, 0.99) / 1e6,
+               hist_quantile(hist, 0.999) / 1e6, hist_max(hist) / 1e6);
+     }
+}
+
+/**
+ * @brief Writes the latencies of one peer.
+ * @param peer Pointer to the peer.
+ * @param arg Stream to write to.
+ */
+static void metrics_latency_peer(peer_t* peer, void* arg) {
+     char heading[INET_ADDRSTRLEN + 16];
+     snprintf(heading, sizeof(heading), "Peer %s:%d", peer->ip, peer->port);
+     metrics_write_latency_set((FILE*)arg, heading, &peer->stats.lat);
+}
+
+/**
+ * @brief Writes p50, p99 and p999 of every stage, for the node, each connected
+ * peer and each package, as shown by the LATENCY command.
+ * @param out Stream to write to.
+ * @param peers Pointer to the peers list.
+ */
+void metrics_write_latency(FILE* out, peers_t* peers) {
+     fprintf(out, "Latency in ms       count        p50        p99       p999        max\n");
+     metrics_write_latency_set(out, "All", &metrics.lat);
+     peers_for_each(peers, metrics_latency_peer, out);
+
+     pthread_mutex_lock(&pkg_lats_lock);
+     for ( q_node_t* curr = pkg_lats ? pkg_lats->head : NULL; curr != NULL; curr = curr->next ) {
+          pkg_latency_t* entry = (pkg_latency_t*)curr->data;
+          char heading[32];
+          // Idents are long; the first characters are enough to tell packages apart.
+          snprintf(heading, sizeof(heading), "Package %.16s", entry->ident);
+          metrics_write_latency_set(out, heading, &entry->lat);
+     }
+     pthread_mutex_unlock(&pkg_lats_lock);
+}
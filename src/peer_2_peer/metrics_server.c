@@ -0,0 +1,206 @@
+#include <utilities/my_utils.h>
+#include <peer_2_peer/metrics.h>
+#include <peer_2_peer/metrics_server.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+/**
+ * @brief Writes a whole buffer to a socket.
+ * @param fd Socket to write to.
+ * @param buf Bytes to write.
+ * @param len Number of bytes.
+ * @return 0 on success, -1 if the client went away.
+ */
+static int metrics_write_all(int fd, const char* buf, size_t len) {
+     while ( len > 0 ) {
+          ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+          if ( n < 0 ) {
+               if ( errno == EINTR ) continue;
+               return -1;
+          }
+          buf += n;
+          len -= (size_t)n;
+     }
+     return 0;
+}
+
+/**
+ * @brief Sends an HTTP response and its body.
+ * @param fd Socket of the client.
+ * @param status Status line after the version, such as "200 OK".
+ * @param body Body of the response.
+ * @param len Bytes in the body.
+ */
+static void metrics_respond(int fd, const char* status, const char* body, size_t len) {
+     char head[256];
+     int n = snprintf(head, sizeof(head),
+          "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+          status, METRICS_CONTENT_TYPE, len);
+     if ( metrics_write_all(fd, head, n) == 0 ) {
+          metrics_write_all(fd, body, len);
+     }
+}
+
+/**
+ * @brief Reads the head of a request, giving up on a client that is too slow.
+ * @param fd Socket of the client.
+ * @param buf Buffer for the request, METRICS_REQUEST_MAX long.
+ * @return Bytes read, or -1 if no request line arrived.
+ */
+static ssize_t metrics_read_request(int fd, char* buf) {
+     size_t got = 0;
+     struct pollfd pfd = { .fd = fd, .events = POLLIN };
+     while ( got < METRICS_REQUEST_MAX - 1 ) {
+          if ( poll(&pfd, 1, METRICS_READ_TIMEOUT_MS) <= 0 ) {
+               break;
+          }
+          ssize_t n = recv(fd, buf + got, METRICS_REQUEST_MAX - 1 - got, 0);
+          if ( n <= 0 ) {
+               break;
+          }
+          got += (size_t)n;
+          buf[got] = '\0';
+          if ( strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n") ) {
+               break;
+          }
+     }
+     buf[got] = '\0';
+     return strchr(buf, '\n') ? (ssize_t)got : -1;
+}
+
+/**
+ * @brief Answers one client.
+ * @param server Pointer to the server.
+ * @param fd Socket of the client, closed by the caller.
+ */
+static void metrics_serve(metrics_server_t* server, int fd) {
+     char request[METRICS_REQUEST_MAX];
+     if ( metrics_read_request(fd, request) < 0 ) {
+          return;
+     }
+
+     char method[8] = { 0 };
+     char path[64] = { 0 };
+     if ( sscanf(request, "%7s %63s", method, path) != 2 ) {
+          const char* body = "Bad request\n";
+          metrics_respond(fd, "400 Bad Request", body, strlen(body));
+          return;
+     }
+     if ( strcmp(method, "GET") != 0 ) {
+          const char* body = "Only GET is supported\n";
+          metrics_respond(fd, "405 Method Not Allowed", body, strlen(body));
+          return;
+     }
+     // A query string is ignored, as scrapers sometimes add one.
+     path[strcspn(path, "?")] = '\0';
+     if ( strcmp(path, "/metrics") != 0 ) {
+          const char* body = "Not found, try /metrics\n";
+          metrics_respond(fd, "404 Not Found", body, strlen(body));
+          return;
+     }
+
+     char* body = NULL;
+     size_t len = 0;
+     FILE* out = open_memstream(&body, &len);
+     if ( !out ) {
+          perror("Failed to render metrics");
+          return;
+     }
+     metrics_write_prometheus(out, server->peers);
+     fclose(out);
+     metrics_respond(fd, "200 OK", body, len);
+     free(body);
+}
+
+/**
+ * @brief Accepts and answers clients until stopped.
+ * @param arg Pointer to the server.
+ * @return NULL.
+ */
+static void* metrics_run(void* arg) {
+     metrics_server_t* server = (metrics_server_t*)arg;
+     struct pollfd fds[2] = {
+          { .fd = server->fd, .events = POLLIN },
+          { .fd = server->stop_fd, .events = POLLIN },
+     };
+
+     while ( true ) {
+          if ( poll(fds, 2, -1) < 0 ) {
+               if ( errno == EINTR ) continue;
+               perror("Failed to wait on metrics socket");
+               break;
+          }
+          if ( fds[1].revents & POLLIN ) {
+               break;
+          }
+
+          int client = accept(server->fd, NULL, NULL);
+          if ( client < 0 ) {
+               continue;
+          }
+          metrics_serve(server, client);
+          close(client);
+     }
+     return NULL;
+}
+
+/**
+ * @brief Starts answering metrics requests on 127.0.0.1.
+ * @param port Port to listen on.
+ * @param peers Pointer to the peers list reported on.
+ * @return Pointer to the server, or NULL if the port cannot be listened on.
+ */
+metrics_server_t* metrics_server_start(uint16_t port, peers_t* peers) {
+     int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if ( fd < 0 ) {
+          perror("Failed to create metrics socket");
+          return NULL;
+     }
+
+     int reuse = 1;
+     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+     // Only local scrapers are answered; the counters name every connected peer.
+     struct sockaddr_in addr = {
+         .sin_family = AF_INET,
+         .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+         .sin_port = htons(port),
+     };
+     if ( bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0 ) {
+          perror("Failed to listen for metrics requests");
+          close(fd);
+          return NULL;
+     }
+
+     metrics_server_t* server = (metrics_server_t*)my_malloc(sizeof(metrics_server_t));
+     server->peers = peers;
+     server->fd = fd;
+     server->stop_fd = eventfd(0, EFD_CLOEXEC);
+     if ( server->stop_fd < 0 || pthread_create(&server->thread, NULL, metrics_run, server) != 0 ) {
+          perror("Failed to start metrics thread");
+          exit(EXIT_FAILURE);
+     }
+     return server;
+}
+
+/**
+ * @brief Stops answering, waiting for a response being written, and frees the server.
+ * @param server Pointer to the server, may be NULL.
+ */
+void metrics_server_stop(metrics_server_t* server) {
+     if ( !server ) return;
+
+     uint64_t one = 1;
+     if ( write(server->stop_fd, &one, sizeof(one)) < 0 ) {
+          perror("Failed to stop metrics thread");
+     }
+     pthread_join(server->thread, NULL);
+     close(server->stop_fd);
+     close(server->fd);
+     free(server);
+}
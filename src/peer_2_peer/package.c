@@ -1,5 +1,6 @@
 #include <chk/pkg_helper.h>
 #include <chk/pkgchk.h>
+#include <peer_2_peer/metrics.h>
 #include <peer_2_peer/package.h>
 #include <peer_2_peer/packet.h>
 #include <peer_2_peer/peer_data_sync.h>
@@ -13,83 +14,176 @@
 /* Packet fetching and handling for peer communication and package management */
 
 /**
- * @brief Fetch a packet from a specified peer.
+ * @brief Prepare a request packet for a chunk.
  *
- * @param peer Pointer to the peer
- * @param pkt Packet to fetch
- * @param bpkg Associated package
- * @return int 0 on success, -1 on failure
+ * @param bpkg Pointer to the package
+ * @param node Node in the Merkle tree
+ * @return pkt_t* Pointer to the prepared packet
  */
-int pkt_fetch_from_peer(peer_t* peer, pkt_t* pkt, bpkg_t* bpkg) {
-     bool pkt_found = false;
-     request_q_t* reqs = peer->reqs_q;
-
-     if ( !pkt ) {
-          debug_print("Failed to prepare Peer[%i]'s pkt...", peer->port);
-          return -1;
+pkt_t* pkt_prepare_request_pkt(bpkg_t* bpkg, mtree_node_t* node) {
+     if ( !bpkg || !node ) {
+          return NULL;
      }
 
-     request_t* req = req_create(pkt);
-     if ( !req ) {
-          debug_print("Failed to create request...");
-          return -1;
+
+     chunk_t* chk = (chunk_t*)node->chunk;
+     if ( !chk ) {
+          return NULL;
      }
 
-     debug_print("Enqueuing request for Peer[%i]...", peer->port);
-     pthread_mutex_lock(&reqs->lock);
-     reqs_enqueue(reqs, req);
-     pthread_mutex_unlock(&reqs->lock);
+     // Prepare a request for package chunk:
+     payload_t payload = payload_create_req(chk->offset, chk->size, node->expected_hash, bpkg->ident, NULL);
 
-     // Wait 3s for the peer handler recieve ACP packet:
-     struct timespec ts;
-     clock_gettime(CLOCK_REALTIME, &ts);
-     ts.tv_sec += 3;
+     pkt_t* pkt = pkt_create(PKT_MSG_REQ, 0, payload);
+     return pkt;
+}
 
-     pthread_mutex_lock(&req->lock);
-     int rc = 0;
-     while ( req->status == WAITING && rc != ETIMEDOUT ) {
-          rc = pthread_cond_timedwait(&req->cond, &req->lock, &ts);
+/**
+ * @brief Prepare a CNL packet withdrawing an earlier request for a chunk.
+ *
+ * @param bpkg Pointer to the package
+ * @param node Chunk node in the Merkle tree
+ * @return pkt_t* Pointer to the prepared packet
+ */
+pkt_t* pkt_prepare_cancel_pkt(bpkg_t* bpkg, mtree_node_t* node) {
+     pkt_t* pkt = pkt_prepare_request_pkt(bpkg, node);
+     if ( pkt ) {
+          pkt->msg_code = PKT_MSG_CNL;
      }
-     pthread_mutex_unlock(&req->lock);
+     return pkt;
+}
 
-     // Check connection success status:
-     if ( req->status == SUCCESS ) {
-          pkt_found = true;
-          debug_print("Request for Peer[%i] completed successfully.", peer->port);
-     }
-     else {
-          debug_print("Request for Peer[%i] timed out or failed.", peer->port);
+/**
+ * @brief Orders chunk indices ascending for qsort.
+ */
+static int cmp_index(const void* a, const void* b) {
+     uint32_t x = *(const uint32_t*)a;
+     uint32_t y = *(const uint32_t*)b;
+     return ( x > y ) - ( x < y );
+}
+
+/**
+ * @brief Prepare a BRQ packet requesting many chunks of a package at once.
+ *
+ * @param bpkg Pointer to the package
+ * @param indices Chunk indices to request, sorted in place
+ * @param n Number of indices, at most BRQ_RANGES_MAX
+ * @return pkt_t* Pointer to the prepared packet, or NULL on failure
+ */
+pkt_t* pkt_prepare_batch_request_pkt(bpkg_t* bpkg, uint32_t* indices, uint32_t n) {
+     if ( !bpkg || !bpkg->mtree || !indices || n == 0 || n > BRQ_RANGES_MAX ) {
+          return NULL;
      }
 
-     req_destroy(req);
+     qsort(indices, n, sizeof(uint32_t), cmp_index);
 
-     return pkt_found ? 0 : -1;
+     brq_range_t ranges[BRQ_RANGES_MAX];
+     uint32_t nranges = 0;
+     for ( uint32_t i = 0; i < n; i++ ) {
+          brq_range_t* last = nranges > 0 ? &ranges[nranges - 1] : NULL;
+          if ( last && indices[i] < last->first + last->count ) {
+               continue;  // Duplicate index
+          }
+          if ( last && indices[i] == last->first + last->count ) {
+               last->count++;
+               continue;
+          }
+          ranges[nranges].first = indices[i];
+          ranges[nranges].count = 1;
+          nranges++;
+     }
+
+     payload_t payload = payload_create_brq(bpkg->mtree->nchunks, bpkg->ident, ranges, nranges);
+     return pkt_create(PKT_MSG_BRQ, 0, payload);
 }
 
+/**
+ * @brief Measure the run of chunks sharing the completion state of the first.
+ *
+ * @param mtree Pointer to the package's Merkle tree
+ * @param first Index of the first chunk of the run
+ * @return uint32_t Length of the run
+ */
+static uint32_t hav_run_length(mtree_t* mtree, uint32_t first) {
+     bool has = check_chunk(mtree->chk_nodes[first]);
+     uint32_t end = first + 1;
+     while ( end < mtree->nchunks && check_chunk(mtree->chk_nodes[end]) == has ) {
+          end++;
+     }
+     return end - first;
+}
 
 /**
- * @brief Prepare a request packet for a chunk.
+ * @brief Prepare the HAV packets advertising every chunk of a package held locally.
  *
  * @param bpkg Pointer to the package
- * @param node Node in the Merkle tree
- * @return pkt_t* Pointer to the prepared packet
+ * @param npkts Output for the number of packets prepared
+ * @return pkt_t** Array of prepared packets, or NULL on failure
  */
-pkt_t* pkt_prepare_request_pkt(bpkg_t* bpkg, mtree_node_t* node) {
-     if ( !bpkg || !node ) {
+pkt_t** pkt_prepare_hav_pkts(bpkg_t* bpkg, uint32_t* npkts) {
+     *npkts = 0;
+     if ( !bpkg || !bpkg->mtree || bpkg->mtree->nchunks == 0 ) {
           return NULL;
      }
 
+     mtree_t* mtree = bpkg->mtree;
+     uint32_t cap = 4;
+     pkt_t** pkts = (pkt_t**)my_malloc(cap * sizeof(pkt_t*));
+     uint8_t bits[HAV_BITS_MAX];
+
+     uint32_t i = 0;
+     while ( i < mtree->nchunks ) {
+          uint32_t first = i;
+          uint32_t run = hav_run_length(mtree, i);
+          payload_t payload;
+
+          if ( run >= HAV_RUN_MIN || run == mtree->nchunks ) {
+               uint8_t mode = check_chunk(mtree->chk_nodes[i]) ? HAV_MODE_SET : HAV_MODE_CLEAR;
+               payload = payload_create_hav(first, run, mtree->nchunks, mode, bpkg->ident, NULL);
+               i += run;
+          }
+          else {
+               // Pack mixed chunks until the window fills or a long uniform run begins.
+               memset(bits, 0, sizeof(bits));
+               while ( i < mtree->nchunks && i - first < HAV_CHUNKS_MAX ) {
+                    if ( i > first && hav_run_length(mtree, i) >= HAV_RUN_MIN ) {
+                         break;
+                    }
+                    if ( check_chunk(mtree->chk_nodes[i]) ) {
+                         bits[( i - first ) / 8] |= (uint8_t)( 1 << ( ( i - first ) % 8 ) );
+                    }
+                    i++;
+               }
+               payload = payload_create_hav(first, i - first, mtree->nchunks, HAV_MODE_BITS, bpkg->ident, bits);
+          }
 
-     chunk_t* chk = (chunk_t*)node->chunk;
-     if ( !chk ) {
-          return NULL;
+          if ( *npkts == cap ) {
+               cap *= 2;
+               pkts = (pkt_t**)realloc(pkts, cap * sizeof(pkt_t*));
+               if ( !pkts ) {
+                    perror("Failed to grow HAV packets");
+                    exit(EXIT_FAILURE);
+               }
+          }
+          pkts[( *npkts )++] = pkt_create(PKT_MSG_HAV, 0, payload);
      }
+     return pkts;
+}
 
-     // Prepare a request for package chunk:
-     payload_t payload = payload_create_req(chk->offset, chk->size, node->expected_hash, bpkg->ident, NULL);
+/**
+ * @brief Prepare a HAV packet announcing one newly verified chunk.
+ *
+ * @param bpkg Pointer to the package
+ * @param index Index of the chunk within the package
+ * @return pkt_t* Pointer to the prepared packet
+ */
+pkt_t* pkt_prepare_have_pkt(bpkg_t* bpkg, uint32_t index) {
+     if ( !bpkg || !bpkg->mtree || index >= bpkg->mtree->nchunks ) {
+          return NULL;
+     }
 
-     pkt_t* pkt = pkt_create(PKT_MSG_REQ, 0, payload);
-     return pkt;
+     payload_t payload = payload_create_hav(index, 1, bpkg->mtree->nchunks, HAV_MODE_SET, bpkg->ident, NULL);
+     return pkt_create(PKT_MSG_HAV, 0, payload);
 }
 
 /**
@@ -127,19 +221,22 @@ int pkg_try_install_payload(bpkg_t* bpkg, payload_t payload) {
  * @return int 1 on success, -1 on failure
  */
 int pkt_install(pkt_t* pkt_in, peer_t* peer, bpkgs_t* bpkgs) {
-     bpkg_t* bpkg = pkg_find_by_ident(bpkgs, pkt_in->payload.res.ident);
+     bpkg_t* bpkg = pkgs_get(bpkgs, pkt_in->payload.res.ident);
 
      if ( bpkg == NULL ) {
           debug_print("Specified package for installation not found on local disc...\n");
           return -1;
      }
 
-     if ( pkt_in->error < 0 ) {
+     if ( pkt_in->error != 0 ) {
           debug_print("Peer on Port[%d] does not have the requested chunk...\n", peer->port);
+          bpkg_release(bpkg);
           return -1;
      }
 
-     if ( pkg_try_install_payload(bpkg, pkt_in->payload) < 0 ) {
+     int status = pkg_try_install_payload(bpkg, pkt_in->payload);
+     bpkg_release(bpkg);
+     if ( status < 0 ) {
           return -1;
      }
      debug_print("Chunk installed successfully!\n");
@@ -154,9 +251,16 @@ int pkt_install(pkt_t* pkt_in, peer_t* peer, bpkgs_t* bpkgs) {
  * @return int 0 on success, -1 on failure
  */
 int pkt_chk_update_data(mtree_t* mtree, mtree_node_t* chk_node, payload_t payload) {
-     if ( update_chunk_node(mtree, chk_node, payload.res.data, payload.res.size, payload.res.offset) ) {
-          ;
-
+     // Every packet hashes the whole chunk again, which is what the rate is measured over.
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     int status = update_chunk_node(mtree, chk_node, payload.res.data, payload.res.size, payload.res.offset);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+
+     if ( status == 0 ) {
+          metrics_t* metrics = metrics_global();
+          metrics_add(&metrics->hash_bytes, chk_node->chunk->size);
+          metrics_add(&metrics->hash_ns, ( end.tv_sec - start.tv_sec ) * 1000000000LL + ( end.tv_nsec - start.tv_nsec ));
           debug_print("Successfully updated chunk data!\n");
           return 0;
      }
@@ -169,85 +273,343 @@ int pkt_chk_update_data(mtree_t* mtree, mtree_node_t* chk_node, payload_t payloa
 /* Functions for managing packages within shared thread resources */
 
 /**
- * @brief Find a package by its identifier.
+ * @brief Length of the key a package ident is stored and looked up under.
+ *
+ * Packets carry at most PKGS_KEY_MAX characters of an ident, so longer idents are
+ * keyed by that prefix alone.
+ *
+ * @param ident Package identifier
+ * @return size_t Characters in the key
+ */
+static size_t pkgs_key_len(const char* ident) {
+     return strnlen(ident, PKGS_KEY_MAX);
+}
+
+/**
+ * @brief Hashes a key with FNV-1a.
+ *
+ * @param key Start of the key
+ * @param len Characters in the key
+ * @return uint64_t Hash of the key
+ */
+static uint64_t pkgs_key_hash(const char* key, size_t len) {
+     uint64_t hash = 14695981039346656037ULL;
+     for ( size_t i = 0; i < len; i++ ) {
+          hash ^= (uint8_t)key[i];
+          hash *= 1099511628211ULL;
+     }
+     return hash;
+}
+
+/**
+ * @brief Finds the oldest entry stored under a key. The lock must be held.
  *
  * @param bpkgs Package manager
- * @param ident_qry Identifier to search for
- * @return bpkg_t* Pointer to the found package, or NULL if not found
+ * @param key Start of the key
+ * @param len Characters in the key
+ * @return pkg_entry_t* Matching entry, or NULL if none
  */
-bpkg_t* pkg_find_by_ident(bpkgs_t* bpkgs, char* ident_qry) {
-     q_node_t* curr = bpkgs->ls->head;
+static pkg_entry_t* pkgs_lookup(bpkgs_t* bpkgs, const char* key, size_t len) {
+     uint64_t hash = pkgs_key_hash(key, len);
+     pkg_entry_t* entry = bpkgs->buckets[hash & ( bpkgs->nbuckets - 1 )];
+     for ( ; entry != NULL; entry = entry->chain ) {
+          if ( entry->hash == hash && entry->key_len == len && memcmp(entry->bpkg->ident, key, len) == 0 ) {
+               return entry;
+          }
+     }
+     return NULL;
+}
 
-     size_t ident_len = strlen(ident_qry);
-     bpkg_t* res = NULL;
+/**
+ * @brief Finds the entry an ident or a prefix of it names, trying the whole key
+ * before scanning for a prefix. The lock must be held.
+ *
+ * @param bpkgs Package manager
+ * @param ident_qry Identifier or prefix
+ * @return pkg_entry_t* Matching entry, or NULL if none
+ */
+static pkg_entry_t* pkgs_lookup_prefix(bpkgs_t* bpkgs, const char* ident_qry) {
+     size_t len = pkgs_key_len(ident_qry);
+     pkg_entry_t* entry = pkgs_lookup(bpkgs, ident_qry, len);
+     if ( entry ) {
+          return entry;
+     }
 
-     while ( curr != NULL ) {
-          bpkg_t* bpkg = (bpkg_t*)curr->data;
-          if ( strncmp(ident_qry, bpkg->ident, ident_len) == 0 ) {
+     for ( entry = bpkgs->head; entry != NULL; entry = entry->next ) {
+          if ( entry->key_len >= len && strncmp(ident_qry, entry->bpkg->ident, len) == 0 ) {
                debug_print("Matching ident found!\n");
-               res = bpkg;
-               break;
+               return entry;
           }
+     }
+     return NULL;
+}
 
-          curr = curr->next;
+/**
+ * @brief Doubles the bucket array. The write lock must be held.
+ *
+ * Entries are rechained newest first, so every chain stays oldest first and a
+ * lookup of a shared key keeps returning the package added first.
+ *
+ * @param bpkgs Package manager
+ */
+static void pkgs_grow(bpkgs_t* bpkgs) {
+     size_t nbuckets = bpkgs->nbuckets * 2;
+     pkg_entry_t** buckets = (pkg_entry_t**)calloc(nbuckets, sizeof(pkg_entry_t*));
+     if ( !buckets ) {
+          return;  // Chains just grow longer.
+     }
+
+     for ( pkg_entry_t* entry = bpkgs->tail; entry != NULL; entry = entry->prev ) {
+          size_t b = entry->hash & ( nbuckets - 1 );
+          entry->chain = buckets[b];
+          buckets[b] = entry;
+     }
+     free(bpkgs->buckets);
+     bpkgs->buckets = buckets;
+     bpkgs->nbuckets = nbuckets;
+}
+
+/**
+ * @brief Find a package by its identifier, as carried in a packet.
+ *
+ * @param bpkgs Package manager
+ * @param ident Identifier, compared up to PKGS_KEY_MAX characters
+ * @return bpkg_t* Reference to the package, to be released with bpkg_release, or NULL if not found
+ */
+bpkg_t* pkgs_get(bpkgs_t* bpkgs, const char* ident) {
+     pthread_rwlock_rdlock(&bpkgs->lock);
+     pkg_entry_t* entry = pkgs_lookup(bpkgs, ident, pkgs_key_len(ident));
+     bpkg_t* bpkg = entry ? bpkg_retain(entry->bpkg) : NULL;
+     pthread_rwlock_unlock(&bpkgs->lock);
+     return bpkg;
+}
+
+/**
+ * @brief Find a package by its identifier or a prefix of it, as typed at the command line.
+ *
+ * @param bpkgs Package manager
+ * @param ident_qry Identifier or prefix to search for
+ * @return bpkg_t* Reference to the package, to be released with bpkg_release, or NULL if not found
+ */
+bpkg_t* pkg_find_by_ident(bpkgs_t* bpkgs, char* ident_qry) {
+     pthread_rwlock_rdlock(&bpkgs->lock);
+     pkg_entry_t* entry = pkgs_lookup_prefix(bpkgs, ident_qry);
+     bpkg_t* bpkg = entry ? bpkg_retain(entry->bpkg) : NULL;
+     pthread_rwlock_unlock(&bpkgs->lock);
+     return bpkg;
+}
+
+/**
+ * @brief Links an entry into its bucket chain and the end of the order list.
+ * The write lock must be held.
+ *
+ * @param bpkgs Package manager
+ * @param entry Entry to link
+ */
+static void pkgs_link(bpkgs_t* bpkgs, pkg_entry_t* entry) {
+     if ( bpkgs->count >= bpkgs->nbuckets ) {
+          pkgs_grow(bpkgs);
+     }
+
+     // Appended to its chain so packages sharing an ident are found oldest first.
+     pkg_entry_t** link = &bpkgs->buckets[entry->hash & ( bpkgs->nbuckets - 1 )];
+     while ( *link != NULL ) {
+          link = &( *link )->chain;
+     }
+     *link = entry;
+
+     entry->prev = bpkgs->tail;
+     if ( bpkgs->tail ) {
+          bpkgs->tail->next = entry;
+     }
+     else {
+          bpkgs->head = entry;
+     }
+     bpkgs->tail = entry;
+     bpkgs->count++;
+}
+
+/**
+ * @brief Unlinks an entry from its bucket chain and the order list. The write
+ * lock must be held.
+ *
+ * @param bpkgs Package manager
+ * @param entry Entry to unlink
+ */
+static void pkgs_unlink(bpkgs_t* bpkgs, pkg_entry_t* entry) {
+     pkg_entry_t** link = &bpkgs->buckets[entry->hash & ( bpkgs->nbuckets - 1 )];
+     while ( *link != entry ) {
+          link = &( *link )->chain;
+     }
+     *link = entry->chain;
+
+     if ( entry->prev ) {
+          entry->prev->next = entry->next;
+     }
+     else {
+          bpkgs->head = entry->next;
+     }
+     if ( entry->next ) {
+          entry->next->prev = entry->prev;
+     }
+     else {
+          bpkgs->tail = entry->prev;
+     }
+     bpkgs->count--;
+}
+
+/**
+ * @brief Unlinks every entry loaded from a package file. The write lock must be held.
+ *
+ * @param bpkgs Package manager
+ * @param path Path of the .bpkg file
+ * @return pkg_entry_t* The unlinked entries, chained through next, to be freed after unlocking
+ */
+static pkg_entry_t* pkgs_unlink_path(bpkgs_t* bpkgs, const char* path) {
+     pkg_entry_t* removed = NULL;
+     pkg_entry_t* entry = bpkgs->head;
+     while ( entry != NULL ) {
+          pkg_entry_t* next = entry->next;
+          if ( entry->bpkg->path[0] != '\0' && strcmp(entry->bpkg->path, path) == 0 ) {
+               pkgs_unlink(bpkgs, entry);
+               entry->next = removed;
+               removed = entry;
+          }
+          entry = next;
      }
-     return res;
+     return removed;
 }
 
 /**
- * @brief Add a package to the package manager. Mutexed to ensure thread safety
+ * @brief Frees unlinked entries, dropping the manager's references.
+ *
+ * @param removed Entries chained through next
+ * @return int Number of entries freed
+ */
+static int pkgs_free_entries(pkg_entry_t* removed) {
+     int n = 0;
+     while ( removed != NULL ) {
+          pkg_entry_t* next = removed->next;
+          bpkg_release(removed->bpkg);
+          free(removed);
+          removed = next;
+          n++;
+     }
+     return n;
+}
+
+/**
+ * @brief Creates the entry a package is stored in, taking a reference to it.
+ *
+ * @param bpkg Package to store
+ * @return pkg_entry_t* The unlinked entry
+ */
+static pkg_entry_t* pkgs_entry_create(bpkg_t* bpkg) {
+     pkg_entry_t* entry = (pkg_entry_t*)my_malloc(sizeof(pkg_entry_t));
+     entry->bpkg = bpkg_retain(bpkg);
+     entry->key_len = pkgs_key_len(bpkg->ident);
+     entry->hash = pkgs_key_hash(bpkg->ident, entry->key_len);
+     entry->chain = NULL;
+     entry->next = NULL;
+     return entry;
+}
+
+/**
+ * @brief Add a package to the package manager, which takes its own reference.
  *
  * @param bpkgs Package manager
  * @param bpkg Package to add
  * @return int 1 on success, -1 on failure
  */
 int pkgs_add(bpkgs_t* bpkgs, bpkg_t* bpkg) {
-     pthread_mutex_lock(&bpkgs->lock);
-     q_enqueue(bpkgs->ls, bpkg);
-     bpkgs->count++;
-     pthread_mutex_unlock(&bpkgs->lock);
+     if ( !bpkg ) {
+          return -1;
+     }
+
+     pkg_entry_t* entry = pkgs_entry_create(bpkg);
+     pthread_rwlock_wrlock(&bpkgs->lock);
+     pkgs_link(bpkgs, entry);
+     pthread_rwlock_unlock(&bpkgs->lock);
      return 1;
 }
 
 /**
- * @brief Remove a package by its identifier.
+ * @brief Add a package in place of any loaded earlier from the same .bpkg file,
+ * so peers never see the file's package missing in between.
+ *
+ * @param bpkgs Package manager
+ * @param bpkg Package to add, its path set
+ * @return int Number of packages replaced, or -1 on failure
+ */
+int pkgs_replace(bpkgs_t* bpkgs, bpkg_t* bpkg) {
+     if ( !bpkg ) {
+          return -1;
+     }
+
+     pkg_entry_t* entry = pkgs_entry_create(bpkg);
+     pthread_rwlock_wrlock(&bpkgs->lock);
+     pkg_entry_t* removed = pkgs_unlink_path(bpkgs, bpkg->path);
+     pkgs_link(bpkgs, entry);
+     pthread_rwlock_unlock(&bpkgs->lock);
+     return pkgs_free_entries(removed);
+}
+
+/**
+ * @brief Remove every package loaded from a .bpkg file.
+ *
+ * @param bpkgs Package manager
+ * @param path Path of the .bpkg file
+ * @return int Number of packages removed
+ */
+int pkgs_rem_path(bpkgs_t* bpkgs, const char* path) {
+     pthread_rwlock_wrlock(&bpkgs->lock);
+     pkg_entry_t* removed = pkgs_unlink_path(bpkgs, path);
+     pthread_rwlock_unlock(&bpkgs->lock);
+     return pkgs_free_entries(removed);
+}
+
+/**
+ * @brief Remove a package by its identifier or a prefix of it. Transfers still
+ * holding a reference to it finish before it is freed.
  *
  * @param bpkgs Package manager
  * @param ident Identifier of the package to remove
  * @return int 1 on success, -1 on failure
  */
 int pkgs_rem(bpkgs_t* bpkgs, char* ident) {
-     pthread_mutex_lock(&bpkgs->lock);
-     q_node_t* current = bpkgs->ls->head;
-     q_node_t* previous = NULL;
+     pthread_rwlock_wrlock(&bpkgs->lock);
+     pkg_entry_t* entry = pkgs_lookup_prefix(bpkgs, ident);
+     if ( !entry ) {
+          pthread_rwlock_unlock(&bpkgs->lock);
+          return -1;  // Indicate failure if no match found
+     }
 
-     int ident_len = strlen(ident);
+     pkgs_unlink(bpkgs, entry);
+     pthread_rwlock_unlock(&bpkgs->lock);
 
-     while ( current != NULL ) {
-          bpkg_t* bpkg_curr = (bpkg_t*)current->data;
+     bpkg_release(entry->bpkg);
+     free(entry);
+     return 1;
+}
 
-          if ( strlen(bpkg_curr->ident) >= ident_len && strncmp(ident, bpkg_curr->ident, ident_len) == 0 ) {
-               if ( previous != NULL ) {
-                    previous->next = current->next;
-               }
-               else {
-                    bpkgs->ls->head = current->next;
-               }
-               if ( current == bpkgs->ls->tail ) {
-                    bpkgs->ls->tail = previous;
-               }
-               bpkg_obj_destroy(bpkg_curr);
-               free(current);
-               bpkgs->count--;  // Decrement the package count
-               pthread_mutex_unlock(&bpkgs->lock);
-               return 1;  // Indicate success
-          }
-          previous = current;
-          current = current->next;
+/**
+ * @brief Calls a function on every managed package in the order they were added,
+ * under the manager's read lock.
+ *
+ * @param bpkgs Package manager
+ * @param fn Function to call, which must not add or remove packages
+ * @param arg Argument passed to fn
+ * @return size_t Number of packages visited
+ */
+size_t pkgs_for_each(bpkgs_t* bpkgs, void (*fn)(bpkg_t* bpkg, void* arg), void* arg) {
+     pthread_rwlock_rdlock(&bpkgs->lock);
+     size_t n = 0;
+     for ( pkg_entry_t* entry = bpkgs->head; entry != NULL; entry = entry->next ) {
+          fn(entry->bpkg, arg);
+          n++;
      }
-
-     pthread_mutex_unlock(&bpkgs->lock);
-     return -1;  // Indicate failure if no match found
+     pthread_rwlock_unlock(&bpkgs->lock);
+     return n;
 }
 
 /**
@@ -264,20 +626,23 @@ bpkgs_t* pkgs_init(char* directory) {
           return NULL;
      }
 
-     if ( pthread_mutex_init(&bpkgs->lock, NULL) < 0 ) {
-          perror("Failed to initialize mutex for shared package manager...\n");
+     if ( pthread_rwlock_init(&bpkgs->lock, NULL) != 0 ) {
+          perror("Failed to initialize lock for shared package manager...\n");
           free(bpkgs);  // Free allocated memory on failure
           return NULL;
      }
 
-     bpkgs->ls = q_init();
-     if ( !bpkgs->ls ) {
-          perror("Failed to initialize package list...\n");
-          pthread_mutex_destroy(&bpkgs->lock);
+     bpkgs->buckets = (pkg_entry_t**)calloc(PKGS_BUCKETS_MIN, sizeof(pkg_entry_t*));
+     if ( !bpkgs->buckets ) {
+          perror("Failed to initialize package table...\n");
+          pthread_rwlock_destroy(&bpkgs->lock);
           free(bpkgs);
           return NULL;
      }
 
+     bpkgs->nbuckets = PKGS_BUCKETS_MIN;
+     bpkgs->head = NULL;
+     bpkgs->tail = NULL;
      bpkgs->directory = directory;
      bpkgs->count = 0;
      return bpkgs;  // Return the initialized structure
@@ -291,20 +656,16 @@ bpkgs_t* pkgs_init(char* directory) {
 void pkgs_destroy(bpkgs_t* bpkgs) {
      if ( !bpkgs ) return;
 
-     pthread_mutex_lock(&bpkgs->lock);
-
-     q_node_t* current = bpkgs->ls->head;
-     while ( current != NULL ) {
-          q_node_t* next = current->next;
-          bpkg_t* bpkg_curr = (bpkg_t*)current->data;
-
-          bpkg_obj_destroy(bpkg_curr);
-          bpkg_curr = NULL;
-
-          current = next;
+     pthread_rwlock_wrlock(&bpkgs->lock);
+     pkg_entry_t* entry = bpkgs->head;
+     while ( entry != NULL ) {
+          pkg_entry_t* next = entry->next;
+          bpkg_release(entry->bpkg);
+          free(entry);
+          entry = next;
      }
-     q_destroy(bpkgs->ls);
-     pthread_mutex_unlock(&bpkgs->lock);
-     pthread_mutex_destroy(&bpkgs->lock);
+     free(bpkgs->buckets);
+     pthread_rwlock_unlock(&bpkgs->lock);
+     pthread_rwlock_destroy(&bpkgs->lock);
      free(bpkgs);
 }
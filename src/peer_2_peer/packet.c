@@ -1,18 +1,25 @@
-#include <string.h> 
 #include <peer_2_peer/packet.h>
 #include <utilities/my_utils.h>
+#include <string.h>
+#include <utilities/ring.h>
 #include <stdlib.h>
 #include <math.h>
 
 #define PAYLOAD_MAX  (4096)
 #define DATA_MAX (2998)
 #define REQUESTS_MAX (1024)
+#define PKT_POOL_MAX (1024)
 
 #define PKT_MSG_ACK 0x0c
 #define PKT_MSG_ACP 0x02
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_HAV 0x08
+#define PKT_MSG_CNL 0x09
+#define PKT_MSG_BRQ 0x0A
+#define PKT_MSG_PRQ 0x0B
+#define PKT_MSG_PRF 0x0D
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
@@ -33,7 +40,7 @@ void pkt_marshall(pkt_t* pkt, uint8_t* data_marshalled) {
      memcpy(data_marshalled + offset, &pkt->error, sizeof(pkt->error));
      offset += sizeof(pkt->error);
 
-     if ( pkt->msg_code == PKT_MSG_REQ ) {
+     if ( pkt->msg_code == PKT_MSG_REQ || pkt->msg_code == PKT_MSG_CNL ) {
           // Copy payload offset
           memcpy(data_marshalled + offset, &pkt->payload.req.offset, sizeof(pkt->payload.req.offset));
           offset += sizeof(pkt->payload.req.offset);
@@ -53,6 +60,36 @@ void pkt_marshall(pkt_t* pkt, uint8_t* data_marshalled) {
           // Copy payload hash
           memcpy(data_marshalled + offset, pkt->payload.req.hash, sizeof(pkt->payload.req.hash));
      }
+     else if ( pkt->msg_code == PKT_MSG_HAV ) {
+          // Copy the described range, its mode and bitfield, then the identifier
+          memcpy(data_marshalled + offset, &pkt->payload.hav.first, sizeof(pkt->payload.hav.first));
+          offset += sizeof(pkt->payload.hav.first);
+          memcpy(data_marshalled + offset, &pkt->payload.hav.count, sizeof(pkt->payload.hav.count));
+          offset += sizeof(pkt->payload.hav.count);
+          memcpy(data_marshalled + offset, &pkt->payload.hav.nchunks, sizeof(pkt->payload.hav.nchunks));
+          offset += sizeof(pkt->payload.hav.nchunks);
+          memcpy(data_marshalled + offset, &pkt->payload.hav.mode, sizeof(pkt->payload.hav.mode));
+          offset += sizeof(pkt->payload.hav.mode);
+          memcpy(data_marshalled + offset, pkt->payload.hav.bits, sizeof(pkt->payload.hav.bits));
+          offset += sizeof(pkt->payload.hav.bits);
+          memcpy(data_marshalled + offset, pkt->payload.hav.ident, sizeof(pkt->payload.hav.ident));
+     }
+     else if ( pkt->msg_code == PKT_MSG_BRQ ) {
+          // Copy the package size and range count, the ranges, then the identifier
+          memcpy(data_marshalled + offset, &pkt->payload.brq.nchunks, sizeof(pkt->payload.brq.nchunks));
+          offset += sizeof(pkt->payload.brq.nchunks);
+          memcpy(data_marshalled + offset, &pkt->payload.brq.nranges, sizeof(pkt->payload.brq.nranges));
+          offset += sizeof(pkt->payload.brq.nranges);
+          memcpy(data_marshalled + offset, pkt->payload.brq.ranges, sizeof(pkt->payload.brq.ranges));
+          offset += sizeof(pkt->payload.brq.ranges);
+          memcpy(data_marshalled + offset, pkt->payload.brq.ident, sizeof(pkt->payload.brq.ident));
+     }
+     else if ( pkt->msg_code == PKT_MSG_PRQ || pkt->msg_code == PKT_MSG_PRF ) {
+          // Copy the proof, then the identifier
+          memcpy(data_marshalled + offset, &pkt->payload.prf.proof, sizeof(pkt->payload.prf.proof));
+          offset += sizeof(pkt->payload.prf.proof);
+          memcpy(data_marshalled + offset, pkt->payload.prf.ident, sizeof(pkt->payload.prf.ident));
+     }
      else {
           // Copy payload offset
           memcpy(data_marshalled + offset, &pkt->payload.res.offset, sizeof(pkt->payload.res.offset));
@@ -90,7 +127,7 @@ void pkt_unmarshall(pkt_t* pkt_i, uint8_t* data_marshalled) {
      memcpy(&pkt_i->error, data_marshalled + offset, sizeof(pkt_i->error));
      offset += sizeof(pkt_i->error);
 
-     if ( pkt_i->msg_code == PKT_MSG_REQ ) {
+     if ( pkt_i->msg_code == PKT_MSG_REQ || pkt_i->msg_code == PKT_MSG_CNL ) {
           // Extract payload offset
           memcpy(&pkt_i->payload.req.offset, data_marshalled + offset, sizeof(pkt_i->payload.req.offset));
           offset += sizeof(pkt_i->payload.req.offset);
@@ -110,6 +147,36 @@ void pkt_unmarshall(pkt_t* pkt_i, uint8_t* data_marshalled) {
           // Extract payload hash
           memcpy(pkt_i->payload.req.hash, data_marshalled + offset, sizeof(pkt_i->payload.req.hash));
      }
+     else if ( pkt_i->msg_code == PKT_MSG_HAV ) {
+          // Extract the described range, its mode and bitfield, then the identifier
+          memcpy(&pkt_i->payload.hav.first, data_marshalled + offset, sizeof(pkt_i->payload.hav.first));
+          offset += sizeof(pkt_i->payload.hav.first);
+          memcpy(&pkt_i->payload.hav.count, data_marshalled + offset, sizeof(pkt_i->payload.hav.count));
+          offset += sizeof(pkt_i->payload.hav.count);
+          memcpy(&pkt_i->payload.hav.nchunks, data_marshalled + offset, sizeof(pkt_i->payload.hav.nchunks));
+          offset += sizeof(pkt_i->payload.hav.nchunks);
+          memcpy(&pkt_i->payload.hav.mode, data_marshalled + offset, sizeof(pkt_i->payload.hav.mode));
+          offset += sizeof(pkt_i->payload.hav.mode);
+          memcpy(pkt_i->payload.hav.bits, data_marshalled + offset, sizeof(pkt_i->payload.hav.bits));
+          offset += sizeof(pkt_i->payload.hav.bits);
+          memcpy(pkt_i->payload.hav.ident, data_marshalled + offset, sizeof(pkt_i->payload.hav.ident));
+     }
+     else if ( pkt_i->msg_code == PKT_MSG_BRQ ) {
+          // Extract the package size and range count, the ranges, then the identifier
+          memcpy(&pkt_i->payload.brq.nchunks, data_marshalled + offset, sizeof(pkt_i->payload.brq.nchunks));
+          offset += sizeof(pkt_i->payload.brq.nchunks);
+          memcpy(&pkt_i->payload.brq.nranges, data_marshalled + offset, sizeof(pkt_i->payload.brq.nranges));
+          offset += sizeof(pkt_i->payload.brq.nranges);
+          memcpy(pkt_i->payload.brq.ranges, data_marshalled + offset, sizeof(pkt_i->payload.brq.ranges));
+          offset += sizeof(pkt_i->payload.brq.ranges);
+          memcpy(pkt_i->payload.brq.ident, data_marshalled + offset, sizeof(pkt_i->payload.brq.ident));
+     }
+     else if ( pkt_i->msg_code == PKT_MSG_PRQ || pkt_i->msg_code == PKT_MSG_PRF ) {
+          // Extract the proof, then the identifier
+          memcpy(&pkt_i->payload.prf.proof, data_marshalled + offset, sizeof(pkt_i->payload.prf.proof));
+          offset += sizeof(pkt_i->payload.prf.proof);
+          memcpy(pkt_i->payload.prf.ident, data_marshalled + offset, sizeof(pkt_i->payload.prf.ident));
+     }
      else {
           // Extract payload offset
           memcpy(&pkt_i->payload.res.offset, data_marshalled + offset, sizeof(pkt_i->payload.res.offset));
@@ -131,6 +198,31 @@ void pkt_unmarshall(pkt_t* pkt_i, uint8_t* data_marshalled) {
           memcpy(pkt_i->payload.res.hash, data_marshalled + offset, sizeof(pkt_i->payload.res.hash));
      }
 }
+// Packets freed by any thread wait here to be handed out again by pkt_alloc.
+static ring_t* pkt_pool = NULL;
+static pthread_once_t pkt_pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Creates the shared packet pool.
+ */
+static void pkt_pool_init() {
+     pkt_pool = ring_create(PKT_POOL_MAX);
+}
+
+/**
+ * @brief Take an uninitialised packet from the packet pool, or the heap if it is empty
+ * @return Pointer to the packet, released with pkt_destroy
+ */
+pkt_t* pkt_alloc() {
+     pthread_once(&pkt_pool_once, pkt_pool_init);
+     pkt_t* pkt = (pkt_t*)ring_pop(pkt_pool);
+     if ( pkt ) {
+          POOL_UNPOISON(pkt, sizeof(pkt_t));
+          return pkt;
+     }
+     return (pkt_t*)my_malloc(sizeof(pkt_t));
+}
+
 /**
  * @brief Create a new packet
  * @param msg Message code
@@ -139,11 +231,11 @@ void pkt_unmarshall(pkt_t* pkt_i, uint8_t* data_marshalled) {
  * @return Pointer to the new packet
  */
 pkt_t* pkt_create(uint16_t msg, uint16_t err, payload_t payload) {
-     pkt_t* pkt = (pkt_t*)my_malloc(sizeof(pkt_t));
+     pkt_t* pkt = pkt_alloc();
      if ( !pkt ) {
           return NULL;
      }
-     memset(pkt, 0, sizeof(pkt_t)); // Zero out the memory
+     // Every byte is assigned below, so the packet needs no clearing first.
      pkt->msg_code = msg;
      pkt->error = err;
      pkt->payload = payload;
@@ -203,11 +295,86 @@ payload_t payload_create_req(uint32_t offset, uint32_t size, char* hash, char* i
 }
 
 /**
- * @brief Free packet memory
+ * @brief Create a new availability payload
+ * @param first Index of the first chunk described
+ * @param count Number of chunks described
+ * @param nchunks Number of chunks in the package
+ * @param mode How the range is described, see enum hav_mode
+ * @param ident Identifier string
+ * @param bits Bitfield of count bits for HAV_MODE_BITS, otherwise NULL
+ * @return New payload
+ */
+payload_t payload_create_hav(uint32_t first, uint32_t count, uint32_t nchunks, uint8_t mode, char* ident, uint8_t* bits) {
+     payload_t pl;
+     memset(&pl, 0, sizeof(payload_t)); // Default payload content is 0.
+     pl.hav.first = first;
+     pl.hav.count = count;
+     pl.hav.nchunks = nchunks;
+     pl.hav.mode = mode;
+     if ( ident ) {
+          memcpy(pl.hav.ident, ident, strnlen(ident, sizeof(pl.hav.ident)));
+     }
+     if ( bits && count <= HAV_CHUNKS_MAX ) {
+          memcpy(pl.hav.bits, bits, ( count + 7 ) / 8);
+     }
+     return pl;
+}
+
+/**
+ * @brief Create a new batched request payload
+ * @param nchunks Number of chunks in the package
+ * @param ident Identifier string
+ * @param ranges Chunk ranges requested, in ascending order
+ * @param nranges Number of ranges, at most BRQ_RANGES_MAX
+ * @return New payload
+ */
+payload_t payload_create_brq(uint32_t nchunks, char* ident, brq_range_t* ranges, uint32_t nranges) {
+     payload_t pl;
+     memset(&pl, 0, sizeof(payload_t)); // Default payload content is 0.
+     pl.brq.nchunks = nchunks;
+     if ( ident ) {
+          memcpy(pl.brq.ident, ident, strnlen(ident, sizeof(pl.brq.ident)));
+     }
+     if ( ranges && nranges <= BRQ_RANGES_MAX ) {
+          pl.brq.nranges = nranges;
+          memcpy(pl.brq.ranges, ranges, nranges * sizeof(brq_range_t));
+     }
+     return pl;
+}
+
+/**
+ * @brief Create a new inclusion proof payload
+ * @param ident Identifier string
+ * @param index Index of the chunk
+ * @param proof Proof to carry, or NULL for a request
+ * @return New payload
+ */
+payload_t payload_create_prf(char* ident, uint32_t index, mtree_proof_t* proof) {
+     payload_t pl;
+     memset(&pl, 0, sizeof(payload_t)); // Default payload content is 0.
+     if ( proof ) {
+          pl.prf.proof = *proof;
+     }
+     pl.prf.proof.index = index;
+     if ( ident ) {
+          memcpy(pl.prf.ident, ident, strnlen(ident, sizeof(pl.prf.ident)));
+     }
+     return pl;
+}
+
+/**
+ * @brief Free packet memory, keeping it in the packet pool for reuse while there is room
  * @param pkt Pointer to the packet
  */
 void pkt_destroy(pkt_t* pkt) {
-     if ( pkt ) {
+     if ( !pkt ) {
+          return;
+     }
+
+     pthread_once(&pkt_pool_once, pkt_pool_init);
+     POOL_POISON(pkt, sizeof(pkt_t));
+     if ( ring_push(pkt_pool, pkt) < 0 ) {
+          POOL_UNPOISON(pkt, sizeof(pkt_t));
           free(pkt);
      }
 }
@@ -0,0 +1,152 @@
+#include <peer_2_peer/peer_avail.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <string.h>
+#include <utilities/my_utils.h>
+
+/**
+ * @brief Finds a peer's record for a package, creating a "has everything" record if
+ * none exists yet. The peer's availability lock must be held.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package.
+ * @param nchunks Number of chunks in the package.
+ * @param create Whether to create a missing record.
+ * @return Pointer to the record, or NULL if absent and not created.
+ */
+static peer_avail_t* avail_find(peer_t* peer, const char* ident, uint32_t nchunks, bool create) {
+     for ( q_node_t* curr = peer->avail->head; curr != NULL; curr = curr->next ) {
+          peer_avail_t* avail = (peer_avail_t*)curr->data;
+          if ( avail->nchunks == nchunks && strncmp(avail->ident, ident, AVAIL_IDENT_LEN) == 0 ) {
+               return avail;
+          }
+     }
+
+     if ( !create ) {
+          return NULL;
+     }
+
+     peer_avail_t* avail = (peer_avail_t*)my_malloc(sizeof(peer_avail_t));
+     memset(avail, 0, sizeof(peer_avail_t));
+     strncpy(avail->ident, ident, IDENT_MAX - 1);
+     avail->nchunks = nchunks;
+     avail->bits = (uint8_t*)my_malloc(AVAIL_BYTES(nchunks));
+     memset(avail->bits, 0xFF, AVAIL_BYTES(nchunks));
+     avail->version = 1;
+     q_enqueue(peer->avail, avail);
+     return avail;
+}
+
+/**
+ * @brief Records whether a peer holds one chunk of a package.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package.
+ * @param nchunks Number of chunks in the package.
+ * @param index Index of the chunk within the package.
+ * @param has Whether the peer holds the chunk.
+ */
+void peer_avail_set(peer_t* peer, const char* ident, uint32_t nchunks, uint32_t index, bool has) {
+     if ( !peer || !peer->avail || !ident || index >= nchunks ) {
+          return;
+     }
+
+     pthread_mutex_lock(&peer->avail_lock);
+     peer_avail_t* avail = avail_find(peer, ident, nchunks, true);
+     if ( AVAIL_GET(avail->bits, index) != has ) {
+          if ( has ) {
+               AVAIL_SET(avail->bits, index);
+          }
+          else {
+               AVAIL_CLR(avail->bits, index);
+          }
+          avail->version++;
+     }
+     pthread_mutex_unlock(&peer->avail_lock);
+}
+
+/**
+ * @brief Applies a HAV advertisement received from a peer.
+ * @param peer Pointer to the peer that sent it.
+ * @param hav Pointer to the advertisement.
+ * @return 0 on success, -1 if the advertisement is malformed.
+ */
+int peer_avail_apply(peer_t* peer, hav_t* hav) {
+     if ( !peer || !peer->avail || !hav ) {
+          return -1;
+     }
+
+     // Reject ranges past the end of the package, or bitfields longer than a packet.
+     if ( hav->count == 0 || hav->first >= hav->nchunks || hav->count > hav->nchunks - hav->first
+          || ( hav->mode == HAV_MODE_BITS && hav->count > HAV_CHUNKS_MAX ) || hav->mode > HAV_MODE_CLEAR ) {
+          debug_print("Malformed HAV from peer at port %d...\n", peer->port);
+          return -1;
+     }
+
+     pthread_mutex_lock(&peer->avail_lock);
+     peer_avail_t* avail = avail_find(peer, hav->ident, hav->nchunks, true);
+     for ( uint32_t k = 0; k < hav->count; k++ ) {
+          uint32_t i = hav->first + k;
+          bool has = hav->mode == HAV_MODE_SET || ( hav->mode == HAV_MODE_BITS && AVAIL_GET(hav->bits, k) );
+          if ( has ) {
+               AVAIL_SET(avail->bits, i);
+          }
+          else {
+               AVAIL_CLR(avail->bits, i);
+          }
+     }
+     avail->version++;
+     pthread_mutex_unlock(&peer->avail_lock);
+     return 0;
+}
+
+/**
+ * @brief Copies a peer's availability bitfield for a package if it changed.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package.
+ * @param nchunks Number of chunks in the package.
+ * @param bits Destination bitfield, AVAIL_BYTES(nchunks) long.
+ * @param version In/out version of the caller's copy.
+ * @return 1 if bits was refreshed, 0 if the caller's copy is current.
+ */
+int peer_avail_snapshot(peer_t* peer, const char* ident, uint32_t nchunks, uint8_t* bits, uint32_t* version) {
+     if ( !peer || !peer->avail || !ident || !bits ) {
+          return 0;
+     }
+
+     int refreshed = 0;
+     pthread_mutex_lock(&peer->avail_lock);
+     peer_avail_t* avail = avail_find(peer, ident, nchunks, false);
+     uint32_t current = avail ? avail->version : 0;
+
+     if ( current != *version ) {
+          if ( avail ) {
+               memcpy(bits, avail->bits, AVAIL_BYTES(nchunks));
+          }
+          else {
+               memset(bits, 0xFF, AVAIL_BYTES(nchunks));
+          }
+          *version = current;
+          refreshed = 1;
+     }
+     pthread_mutex_unlock(&peer->avail_lock);
+     return refreshed;
+}
+
+/**
+ * @brief Frees every availability record held for a peer.
+ * @param peer Pointer to the peer.
+ */
+void peer_avail_destroy(peer_t* peer) {
+     if ( !peer || !peer->avail ) {
+          return;
+     }
+
+     pthread_mutex_lock(&peer->avail_lock);
+     while ( !q_empty(peer->avail) ) {
+          peer_avail_t* avail = (peer_avail_t*)q_dequeue(peer->avail);
+          free(avail->bits);
+          free(avail);
+     }
+     q_destroy(peer->avail);
+     peer->avail = NULL;
+     pthread_mutex_unlock(&peer->avail_lock);
+     pthread_mutex_destroy(&peer->avail_lock);
+}
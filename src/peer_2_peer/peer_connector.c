@@ -0,0 +1,518 @@
+#include <utilities/my_utils.h>
+#include <peer_2_peer/peer_connector.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <peer_2_peer/peer_handler.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static peer_connector_t* shared_connector = NULL;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;   // Held while a dropped peer is reported
+
+/**
+ * @brief Milliseconds from now until a point in time, rounded up.
+ * @param due Point in time.
+ * @param now Current time.
+ * @return Milliseconds left, 0 or less once it has passed.
+ */
+static int64_t connect_ms_until(const struct timespec* due, const struct timespec* now) {
+     int64_t ns = ( due->tv_sec - now->tv_sec ) * 1000000000LL + ( due->tv_nsec - now->tv_nsec );
+     return ns <= 0 ? 0 : ( ns + 999999 ) / 1000000;
+}
+
+/**
+ * @brief Sets a point in time some milliseconds after another.
+ * @param out Output for the point in time.
+ * @param from Point in time to start from.
+ * @param ms Milliseconds to add.
+ */
+static void connect_after(struct timespec* out, const struct timespec* from, uint32_t ms) {
+     out->tv_sec = from->tv_sec + ms / 1000;
+     out->tv_nsec = from->tv_nsec + ( ms % 1000 ) * 1000000L;
+     if ( out->tv_nsec >= 1000000000L ) {
+          out->tv_sec++;
+          out->tv_nsec -= 1000000000L;
+     }
+}
+
+/**
+ * @brief Picks the wait before another attempt to restore a dropped peer. It
+ * doubles with every failed attempt up to CONNECT_BACKOFF_MAX_MS, and half of it
+ * is random so peers that dropped together do not all come back at once.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param attempts Failed attempts so far.
+ * @return Milliseconds to wait.
+ */
+static uint32_t connect_backoff_ms(peer_connector_t* connector, uint32_t attempts) {
+     uint64_t delay = CONNECT_BACKOFF_MIN_MS;
+     for ( uint32_t i = 0; i < attempts && delay < CONNECT_BACKOFF_MAX_MS; i++ ) {
+          delay *= 2;
+     }
+     delay = delay > CONNECT_BACKOFF_MAX_MS ? CONNECT_BACKOFF_MAX_MS : delay;
+     return (uint32_t)( delay / 2 + rand_r(&connector->seed) % ( delay / 2 + 1 ) );
+}
+
+/**
+ * @brief Wakes the connector thread so it looks at its targets again.
+ * @param connector Pointer to the connector.
+ */
+static void connect_wake(peer_connector_t* connector) {
+     uint64_t one = 1;
+     if ( write(connector->wake_fd, &one, sizeof(one)) < 0 ) {
+          perror("Failed to wake connector");
+     }
+}
+
+/**
+ * @brief Finds the target for an address.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ * @return Pointer to the target, or NULL if there is none.
+ */
+static connect_target_t* connect_find(peer_connector_t* connector, const char* ip, int port) {
+     for ( size_t i = 0; i < connector->ntargets; i++ ) {
+          connect_target_t* target = connector->targets[i];
+          if ( !target->forgotten && target->port == port && strcmp(target->ip, ip) == 0 ) {
+               return target;
+          }
+     }
+     return NULL;
+}
+
+/**
+ * @brief Adds a target for an address.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ * @return Pointer to the target.
+ */
+static connect_target_t* connect_target_add(peer_connector_t* connector, const char* ip, int port) {
+     if ( connector->ntargets == connector->cap ) {
+          connector->cap = connector->cap ? connector->cap * 2 : 16;
+          connector->targets = (connect_target_t**)realloc(connector->targets, connector->cap * sizeof(connect_target_t*));
+          if ( !connector->targets ) {
+               perror("Failed to grow connection targets");
+               exit(EXIT_FAILURE);
+          }
+     }
+
+     connect_target_t* target = (connect_target_t*)my_malloc(sizeof(connect_target_t));
+     memset(target, 0, sizeof(connect_target_t));
+     strncpy(target->ip, ip, INET_ADDRSTRLEN - 1);
+     target->port = port;
+     target->fd = -1;
+     connector->targets[connector->ntargets++] = target;
+     return target;
+}
+
+/**
+ * @brief Hands the outcome of an attempt to the CONNECT waiting on it, if any.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param target Pointer to the target.
+ * @param result Outcome of the attempt.
+ */
+static void connect_resolve(peer_connector_t* connector, connect_target_t* target, enum ConnectResult result) {
+     if ( !target->batch ) {
+          return;
+     }
+     target->batch->results[target->slot] = result;
+     target->batch->npending--;
+     target->batch = NULL;
+     pthread_cond_broadcast(&connector->cond);
+}
+
+/**
+ * @brief Frees targets that are no longer connected to or kept, packing the rest.
+ * @param connector Pointer to the connector, locked by the caller.
+ */
+static void connect_reap(peer_connector_t* connector) {
+     size_t kept = 0;
+     for ( size_t i = 0; i < connector->ntargets; i++ ) {
+          connect_target_t* target = connector->targets[i];
+          if ( !target->forgotten ) {
+               connector->targets[kept++] = target;
+               continue;
+          }
+          if ( target->fd >= 0 ) {
+               close(target->fd);
+          }
+          connect_resolve(connector, target, CONNECT_FAILED);
+          free(target);
+     }
+     connector->ntargets = kept;
+}
+
+/**
+ * @brief Ends a failed attempt. A dropped peer is tried again after a backoff
+ * until it has failed CONNECT_RETRIES_MAX times, any other target is dropped.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param target Pointer to the target.
+ * @param now Current time.
+ */
+static void connect_failed(peer_connector_t* connector, connect_target_t* target, const struct timespec* now) {
+     debug_print("Connection attempt to %s:%d failed\n", target->ip, target->port);
+     if ( target->fd >= 0 ) {
+          close(target->fd);
+          target->fd = -1;
+     }
+     target->pending = false;
+     connect_resolve(connector, target, CONNECT_FAILED);
+
+     if ( !target->retrying ) {
+          target->forgotten = true;
+          return;
+     }
+     if ( ++target->attempts >= CONNECT_RETRIES_MAX ) {
+          printf("Gave up reconnecting to peer %s:%d\n", target->ip, target->port);
+          fflush(stdout);
+          target->forgotten = true;
+          return;
+     }
+     target->scheduled = true;
+     connect_after(&target->due, now, connect_backoff_ms(connector, target->attempts));
+}
+
+/**
+ * @brief Ends a successful attempt by handing the socket to a new peer thread.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param target Pointer to the target.
+ */
+static void connect_established(peer_connector_t* connector, connect_target_t* target) {
+     target->pending = false;
+
+     // Peer threads read and write with blocking calls.
+     int flags = fcntl(target->fd, F_GETFL);
+     fcntl(target->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+     if ( peers_find(connector->peers, target->ip, target->port) != NULL ) {
+          close(target->fd);
+          target->fd = -1;
+          connect_resolve(connector, target, CONNECT_ALREADY);
+          return;
+     }
+
+     peer_t* peer = peer_create(target->ip, target->port);
+     if ( !peer ) {
+          close(target->fd);
+          target->fd = -1;
+          connect_resolve(connector, target, CONNECT_FAILED);
+          return;
+     }
+     peer->sock_fd = target->fd;
+     target->fd = -1;
+
+     // The list may have filled, or the address connected in, since the check above.
+     if ( peers_add(connector->peers, peer) != 0 ) {
+          peer_discard(peer);
+          connect_resolve(connector, target, CONNECT_FAILED);
+          return;
+     }
+
+     debug_print("Successfully connected to peer %s:%d\n", target->ip, target->port);
+     peer_create_thread(peer, connector->peers, connector->bpkgs);
+
+     if ( target->retrying && !target->batch ) {
+          printf("Reconnected to peer %s:%d\n", target->ip, target->port);
+          fflush(stdout);
+     }
+     target->retrying = false;
+     target->attempts = 0;
+     connect_resolve(connector, target, CONNECT_OK);
+}
+
+/**
+ * @brief Starts a non-blocking connect to a target.
+ * @param connector Pointer to the connector, locked by the caller.
+ * @param target Pointer to the target.
+ * @param now Current time.
+ */
+static void connect_begin(peer_connector_t* connector, connect_target_t* target, const struct timespec* now) {
+     target->scheduled = false;
+     struct sockaddr_in peer_addr = { .sin_family = AF_INET,
+                                      .sin_port = htons(target->port),
+                                      .sin_addr.s_addr = inet_addr(target->ip) };
+     if ( peer_addr.sin_addr.s_addr == INADDR_NONE ) {
+          connect_failed(connector, target, now);
+          return;
+     }
+
+     target->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+     if ( target->fd < 0 ) {
+          perror("Socket creation failed...");
+          connect_failed(connector, target, now);
+          return;
+     }
+
+     if ( connect(target->fd, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == 0 ) {
+          connect_established(connector, target);
+     }
+     else if ( errno == EINPROGRESS ) {
+          target->pending = true;
+          connect_after(&target->due, now, CONNECT_TIMEOUT_MS);
+     }
+     else {
+          connect_failed(connector, target, now);
+     }
+}
+
+/**
+ * @brief Starts attempts that are due, fails ones that timed out, and waits on
+ * the rest together until one finishes or the next is due.
+ * @param arg Pointer to the connector.
+ * @return NULL.
+ */
+static void* connect_run(void* arg) {
+     peer_connector_t* connector = (peer_connector_t*)arg;
+     struct pollfd* fds = NULL;
+     connect_target_t** polled = NULL;    // Target waited on by each entry of fds after the first
+     size_t cap = 0;
+
+     pthread_mutex_lock(&connector->lock);
+     while ( !connector->stopping ) {
+          connect_reap(connector);
+          if ( cap < connector->ntargets + 1 ) {
+               cap = connector->ntargets + 1;
+               fds = (struct pollfd*)realloc(fds, cap * sizeof(struct pollfd));
+               polled = (connect_target_t**)realloc(polled, cap * sizeof(connect_target_t*));
+               if ( !fds || !polled ) {
+                    perror("Failed to grow connection poll set");
+                    exit(EXIT_FAILURE);
+               }
+          }
+
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          fds[0] = (struct pollfd){ .fd = connector->wake_fd, .events = POLLIN };
+          nfds_t nfds = 1;
+          int64_t timeout_ms = -1;
+          for ( size_t i = 0; i < connector->ntargets; i++ ) {
+               connect_target_t* target = connector->targets[i];
+               if ( target->scheduled && connect_ms_until(&target->due, &now) == 0 ) {
+                    connect_begin(connector, target, &now);
+               }
+               if ( target->pending && connect_ms_until(&target->due, &now) == 0 ) {
+                    connect_failed(connector, target, &now);
+               }
+               if ( target->pending ) {
+                    fds[nfds] = (struct pollfd){ .fd = target->fd, .events = POLLOUT };
+                    polled[nfds++] = target;
+               }
+               if ( target->pending || target->scheduled ) {
+                    int64_t left = connect_ms_until(&target->due, &now);
+                    timeout_ms = timeout_ms < 0 || left < timeout_ms ? left : timeout_ms;
+               }
+          }
+          pthread_mutex_unlock(&connector->lock);
+
+          int ready = poll(fds, nfds, (int)timeout_ms);
+
+          pthread_mutex_lock(&connector->lock);
+          if ( ready <= 0 ) {
+               continue;
+          }
+          if ( fds[0].revents & POLLIN ) {
+               uint64_t count;
+               ssize_t n = read(connector->wake_fd, &count, sizeof(count));
+               (void)n;
+          }
+          // Targets are only freed by this thread, so those polled are still there,
+          // though they may have been forgotten meanwhile.
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          for ( nfds_t i = 1; i < nfds; i++ ) {
+               connect_target_t* target = polled[i];
+               if ( fds[i].revents == 0 || !target->pending || target->forgotten ) {
+                    continue;
+               }
+               int err = 0;
+               socklen_t len = sizeof(err);
+               if ( getsockopt(target->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0 ) {
+                    connect_established(connector, target);
+               }
+               else {
+                    connect_failed(connector, target, &now);
+               }
+          }
+     }
+
+     // Attempts still running when the connector stops fail.
+     for ( size_t i = 0; i < connector->ntargets; i++ ) {
+          connector->targets[i]->forgotten = true;
+     }
+     connect_reap(connector);
+     pthread_mutex_unlock(&connector->lock);
+     free(fds);
+     free(polled);
+     return NULL;
+}
+
+/**
+ * @brief Starts the connector and makes it the one returned by connector_shared.
+ * @param peers Pointer to the list of peers connections are added to.
+ * @param bpkgs Pointer to the package manager handed to peer threads.
+ * @return Pointer to the connector.
+ */
+peer_connector_t* connector_start(peers_t* peers, bpkgs_t* bpkgs) {
+     peer_connector_t* connector = (peer_connector_t*)my_malloc(sizeof(peer_connector_t));
+     memset(connector, 0, sizeof(peer_connector_t));
+     connector->peers = peers;
+     connector->bpkgs = bpkgs;
+     connector->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+     pthread_mutex_init(&connector->lock, NULL);
+     pthread_cond_init(&connector->cond, NULL);
+
+     connector->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+     if ( connector->wake_fd < 0 || pthread_create(&connector->thread, NULL, connect_run, connector) != 0 ) {
+          perror("Failed to start connector thread");
+          exit(EXIT_FAILURE);
+     }
+
+     pthread_mutex_lock(&shared_lock);
+     shared_connector = connector;
+     pthread_mutex_unlock(&shared_lock);
+     return connector;
+}
+
+/**
+ * @brief Stops the connector, failing attempts still in progress, and frees it.
+ * @param connector Pointer to the connector, may be NULL.
+ */
+void connector_stop(peer_connector_t* connector) {
+     if ( !connector ) return;
+
+     // Peers dropping from here on are not reported to it.
+     pthread_mutex_lock(&shared_lock);
+     if ( shared_connector == connector ) {
+          shared_connector = NULL;
+     }
+     pthread_mutex_unlock(&shared_lock);
+
+     pthread_mutex_lock(&connector->lock);
+     connector->stopping = true;
+     pthread_mutex_unlock(&connector->lock);
+     connect_wake(connector);
+     pthread_join(connector->thread, NULL);
+
+     close(connector->wake_fd);
+     free(connector->targets);
+     pthread_mutex_destroy(&connector->lock);
+     pthread_cond_destroy(&connector->cond);
+     free(connector);
+}
+
+/**
+ * @brief Returns the running connector.
+ * @return Pointer to the connector, or NULL if none is running.
+ */
+peer_connector_t* connector_shared() {
+     return shared_connector;
+}
+
+/**
+ * @brief Connects to several peers at once, waiting until every attempt has
+ * connected, failed or timed out.
+ * @param connector Pointer to the connector.
+ * @param ips IP addresses of the peers.
+ * @param ports Port numbers of the peers.
+ * @param n Number of peers.
+ * @param results Output for the outcome of each peer, in the order given.
+ * @return Number of peers connected.
+ */
+uint32_t connector_connect(peer_connector_t* connector, char (*ips)[INET_ADDRSTRLEN], const int* ports, uint32_t n, enum ConnectResult* results) {
+     connect_batch_t batch = { .npending = 0, .results = results };
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+
+     pthread_mutex_lock(&connector->lock);
+     for ( uint32_t i = 0; i < n; i++ ) {
+          results[i] = CONNECT_WAITING;
+          if ( peers_find(connector->peers, ips[i], ports[i]) != NULL ) {
+               results[i] = CONNECT_ALREADY;
+               continue;
+          }
+
+          connect_target_t* target = connect_find(connector, ips[i], ports[i]);
+          if ( target && target->batch ) {
+               results[i] = CONNECT_ALREADY;
+               continue;
+          }
+          if ( !target ) {
+               target = connect_target_add(connector, ips[i], ports[i]);
+          }
+          // A peer waiting out a backoff is tried straight away.
+          if ( !target->pending ) {
+               target->scheduled = true;
+               target->due = now;
+          }
+          target->batch = &batch;
+          target->slot = i;
+          batch.npending++;
+     }
+
+     if ( batch.npending > 0 ) {
+          connect_wake(connector);
+     }
+     while ( batch.npending > 0 && !connector->stopping ) {
+          pthread_cond_wait(&connector->cond, &connector->lock);
+     }
+
+     uint32_t nconnected = 0;
+     for ( uint32_t i = 0; i < n; i++ ) {
+          if ( results[i] == CONNECT_WAITING ) {
+               results[i] = CONNECT_FAILED;
+          }
+          nconnected += results[i] == CONNECT_OK;
+     }
+     pthread_mutex_unlock(&connector->lock);
+     return nconnected;
+}
+
+/**
+ * @brief Stops keeping a peer connected, so dropping it later is final.
+ * @param connector Pointer to the connector, may be NULL.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ */
+void connector_forget(peer_connector_t* connector, const char* ip, int port) {
+     if ( !connector ) return;
+
+     pthread_mutex_lock(&connector->lock);
+     connect_target_t* target = connect_find(connector, ip, port);
+     if ( target ) {
+          target->forgotten = true;
+          connect_wake(connector);
+     }
+     pthread_mutex_unlock(&connector->lock);
+}
+
+/**
+ * @brief Reports a peer whose connection dropped without a DSN. It is connected
+ * to again after a backoff if the running connector made the connection.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ */
+void connector_peer_lost(const char* ip, int port) {
+     pthread_mutex_lock(&shared_lock);
+     peer_connector_t* connector = shared_connector;
+     if ( connector ) {
+          pthread_mutex_lock(&connector->lock);
+          connect_target_t* target = connect_find(connector, ip, port);
+          if ( target && !target->pending && !target->scheduled ) {
+               struct timespec now;
+               clock_gettime(CLOCK_MONOTONIC, &now);
+               target->retrying = true;
+               target->attempts = 0;
+               target->scheduled = true;
+               connect_after(&target->due, &now, connect_backoff_ms(connector, 0));
+               printf("Reconnecting to peer %s:%d\n", ip, port);
+               fflush(stdout);
+               connect_wake(connector);
+          }
+          pthread_mutex_unlock(&connector->lock);
+     }
+     pthread_mutex_unlock(&shared_lock);
+}
@@ -1,13 +1,53 @@
 #include "peer_2_peer/peer_data_sync.h"
+#include <peer_2_peer/fetch.h>
 #include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_avail.h>
+#include <peer_2_peer/peer_proof.h>
 #include "utilities/my_utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 /* Peer management functions to manage local memory of currently connected peers and their threads/requests: */
 
+/**
+ * @brief Hashes an ip:port pair, FNV-1a over the address text and the port.
+ * @param ip IP address.
+ * @param port Port number.
+ * @return Hash of the pair.
+ */
+static size_t peer_key_hash(const char* ip, uint16_t port) {
+    uint64_t hash = 14695981039346656037ULL;
+    for ( const char* c = ip; *c; c++ ) {
+        hash = ( hash ^ (uint8_t)*c ) * 1099511628211ULL;
+    }
+    hash = ( hash ^ ( port & 0xff ) ) * 1099511628211ULL;
+    hash = ( hash ^ ( port >> 8 ) ) * 1099511628211ULL;
+    return (size_t)hash;
+}
+
+/**
+ * @brief Finds the table slot holding a peer, or the empty slot ending its probe.
+ * The peers lock must be held.
+ * @param peers Pointer to peers_t.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ * @return Index of the slot.
+ */
+static size_t peers_probe(peers_t* peers, const char* ip, uint16_t port) {
+    size_t i = peer_key_hash(ip, port) & peers->table_mask;
+    while ( peers->table[i] != NULL ) {
+        peer_t* peer = peers->table[i];
+        if ( peer->port == port && strcmp(peer->ip, ip) == 0 ) {
+            break;
+        }
+        i = ( i + 1 ) & peers->table_mask;
+    }
+    return i;
+}
+
 /**
  * @brief Creates a peer list with a specified maximum number of peers.
  * @param max_peers Maximum number of peers.
@@ -22,27 +62,49 @@ peers_t* peer_list_create(size_t max_peers) {
     peers->npeers_cur = 0;
     peers->npeers_max = max_peers;
 
-    if ( pthread_mutex_init(&peers->lock, NULL) != 0 ) {
-        perror("Mutex init failed");
+    if ( pthread_rwlock_init(&peers->lock, NULL) != 0 ) {
+        perror("Rwlock init failed");
         free(peers);
         return NULL;
     }
 
+    // At least twice as many slots as peers keeps probe sequences short.
+    size_t capacity = 1;
+    while ( capacity < max_peers * 2 ) {
+        capacity <<= 1;
+    }
+    peers->table_mask = capacity - 1;
     peers->list = (peer_t**)my_malloc(sizeof(peer_t*) * max_peers);
-    if ( !peers->list ) {
+    peers->table = (peer_t**)my_malloc(sizeof(peer_t*) * capacity);
+    if ( !peers->list || !peers->table ) {
         perror("Failed to allocate memory for peer list array");
-        pthread_mutex_destroy(&peers->lock);
+        free(peers->list);
+        free(peers->table);
+        pthread_rwlock_destroy(&peers->lock);
         free(peers);
         return NULL;
     }
 
-    for ( size_t i = 0; i < max_peers; i++ ) {
-        peers->list[i] = NULL;
+    for ( size_t i = 0; i < capacity; i++ ) {
+        peers->table[i] = NULL;
     }
 
     return peers;
 }
 
+/**
+ * @brief Frees a peer list. The peers it held must already be gone.
+ * @param peers Pointer to peers_t.
+ */
+void peer_list_destroy(peers_t* peers) {
+    if ( !peers ) return;
+
+    pthread_rwlock_destroy(&peers->lock);
+    free(peers->table);
+    free(peers->list);
+    free(peers);
+}
+
 /**
  * @brief Creates a peer with specified IP and port.
  * @param ip IP address of the peer.
@@ -58,7 +120,29 @@ peer_t* peer_create(const char* ip, int port) {
     strncpy(peer->ip, ip, INET_ADDRSTRLEN);
     peer->port = port;
     peer->sock_fd = -1;
+    peer->closed = false;
+    memset(&peer->stats, 0, sizeof(peer_stats_t));
     peer->reqs_q = reqs_create();
+    peer->inflight = q_init();
+    peer->last_res = (struct timespec){ 0 };
+    pthread_mutex_init(&peer->inflight_lock, NULL);
+    peer->cancels = q_init();
+    peer->ncancels = 0;
+    pthread_mutex_init(&peer->cancel_lock, NULL);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&peer->send_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    peer->serve = NULL;
+    peer->install = NULL;
+    peer->io = NULL;
+    bucket_init(&peer->up, rate_peer_default(RATE_UP));
+    bucket_init(&peer->down, rate_peer_default(RATE_DOWN));
+    peer->avail = q_init();
+    pthread_mutex_init(&peer->avail_lock, NULL);
+    peer->proofs = q_init();
+    pthread_mutex_init(&peer->proof_lock, NULL);
     return peer;
 }
 
@@ -83,30 +167,60 @@ void peer_destroy(peer_t* peer) {
     }
 }
 
+/**
+ * @brief Frees a peer whose handler thread was never started, closing its socket.
+ * @param peer Peer pointer.
+ */
+void peer_discard(peer_t* peer) {
+    if ( !peer ) return;
+
+    if ( peer->sock_fd >= 0 ) {
+        close(peer->sock_fd);
+    }
+    reqs_destroy(peer->reqs_q);
+    q_destroy(peer->inflight);
+    q_destroy(peer->cancels);
+    peer_avail_destroy(peer);
+    peer_proof_destroy(peer);
+    bucket_destroy(&peer->up);
+    bucket_destroy(&peer->down);
+    pthread_mutex_destroy(&peer->inflight_lock);
+    pthread_mutex_destroy(&peer->cancel_lock);
+    pthread_mutex_destroy(&peer->send_lock);
+    free(peer);
+}
+
 /**
  * @brief Adds a new peer to the peers list.
  * @param peers Pointer to the peers_t structure.
  * @param new_peer Pointer to the new peer_t structure to add.
+ * @return 0 on success, -1 if the list is full or a peer with the same IP and port
+ * is already listed. The caller still owns a peer that was not added.
  */
-void peers_add(peers_t* peers, peer_t* new_peer) {
+int peers_add(peers_t* peers, peer_t* new_peer) {
     if ( !peers || !new_peer ) {
-        return;
+        return -1;
     }
 
-    pthread_mutex_lock(&peers->lock);
+    int result = -1;
+    pthread_rwlock_wrlock(&peers->lock);
     if ( peers->npeers_cur >= peers->npeers_max ) {
         printf("Cannot add peer: max peers connected...\n");
     }
     else {
-        for ( size_t i = 0; i < peers->npeers_max; i++ ) {
-            if ( peers->list[i] == NULL ) {
-                peers->list[i] = new_peer;
-                peers->npeers_cur++;
-                break;
-            }
+        size_t i = peers_probe(peers, new_peer->ip, new_peer->port);
+        if ( peers->table[i] == NULL ) {
+            peers->table[i] = new_peer;
+            new_peer->slot = peers->npeers_cur;
+            peers->list[peers->npeers_cur++] = new_peer;
+            result = 0;
+        }
+        else {
+            debug_print("Peer %s:%d is already listed...\n", new_peer->ip, new_peer->port);
         }
     }
-    pthread_mutex_unlock(&peers->lock);
+    pthread_rwlock_unlock(&peers->lock);
+    return result;
 }
 
 /**
@@ -121,16 +235,36 @@ void peers_remove(peers_t* peers, char* ip, int port) {
         return;
     }
 
-    pthread_mutex_lock(&peers->lock);
-
-    for ( size_t i = 0; i < peers->npeers_max; i++ ) {
-        if ( peers->list[i] != NULL && strcmp(peers->list[i]->ip, ip) == 0 && peers->list[i]->port == port ) {
-            peers->list[i] = NULL;
-            peers->npeers_cur -= 1;
-            break;
+    pthread_rwlock_wrlock(&peers->lock);
+    size_t i = peers_probe(peers, ip, port);
+    peer_t* peer = peers->table[i];
+    if ( peer != NULL ) {
+        // The last listed peer moves into the hole so the list stays packed.
+        peer_t* last = peers->list[--peers->npeers_cur];
+        peers->list[peer->slot] = last;
+        last->slot = peer->slot;
+        peers->list[peers->npeers_cur] = NULL;
+
+        // Entries further along the probe sequence shift back over the hole, so
+        // lookups never need tombstones to get past it.
+        peers->table[i] = NULL;
+        size_t j = i;
+        while ( true ) {
+            j = ( j + 1 ) & peers->table_mask;
+            peer_t* next = peers->table[j];
+            if ( next == NULL ) {
+                break;
+            }
+            size_t home = peer_key_hash(next->ip, next->port) & peers->table_mask;
+            // Move next back only if its home slot is not in the run (i, j].
+            if ( ( ( j - home ) & peers->table_mask ) >= ( ( j - i ) & peers->table_mask ) ) {
+                peers->table[i] = next;
+                peers->table[j] = NULL;
+                i = j;
+            }
         }
     }
-    pthread_mutex_unlock(&peers->lock);
+    pthread_rwlock_unlock(&peers->lock);
 }
 
 /**
@@ -146,38 +280,89 @@ peer_t* peers_find(peers_t* peers, const char* ip, uint16_t port) {
         return NULL;
     }
 
-    peer_t* peer_target = NULL;
-    pthread_mutex_lock(&peers->lock);
+    pthread_rwlock_rdlock(&peers->lock);
+    peer_t* peer_target = peers->table[peers_probe(peers, ip, port)];
+    pthread_rwlock_unlock(&peers->lock);
+    return peer_target;
+}
 
-    for ( size_t i = 0; i < peers->npeers_max; i++ ) {
-        if ( peers->list[i] != NULL && peers->list[i]->port == port && strcmp(peers->list[i]->ip, ip) == 0 ) {
-            peer_target = peers->list[i];
-            break;
-        }
+/**
+ * @brief Calls a function on the peer with specified IP and port, if connected,
+ * while holding the peers lock so it cannot be freed meanwhile.
+ * @param peers Pointer to peers_t.
+ * @param ip IP address of the peer.
+ * @param port Port number of the peer.
+ * @param fn Function to call with the peer and arg.
+ * @param arg Argument passed through to fn.
+ * @return true if the peer was found.
+ */
+bool peers_apply(peers_t* peers, const char* ip, uint16_t port, void (*fn)(peer_t* peer, void* arg), void* arg) {
+    if ( !peers || !ip || !fn ) {
+        return false;
     }
 
-    pthread_mutex_unlock(&peers->lock);
-    return peer_target;
+    pthread_rwlock_rdlock(&peers->lock);
+    peer_t* peer = peers->table[peers_probe(peers, ip, port)];
+    if ( peer ) {
+        fn(peer, arg);
+    }
+    pthread_rwlock_unlock(&peers->lock);
+    return peer != NULL;
+}
+
+/**
+ * @brief Calls a function on every connected peer while holding the peers lock.
+ * @param peers Pointer to peers_t.
+ * @param fn Function to call with each peer and arg.
+ * @param arg Argument passed through to fn.
+ */
+void peers_for_each(peers_t* peers, void (*fn)(peer_t* peer, void* arg), void* arg) {
+    if ( !peers || !fn ) {
+        return;
+    }
+
+    pthread_rwlock_rdlock(&peers->lock);
+    for ( size_t i = 0; i < peers->npeers_cur; i++ ) {
+        fn(peers->list[i], arg);
+    }
+    pthread_rwlock_unlock(&peers->lock);
+}
+
+// Preallocated requests, handed out by req_create and returned by req_destroy.
+static request_t* req_pool = NULL;
+static ring_t* req_pool_free = NULL;
+static pthread_once_t req_pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Allocates the request pool and marks every request in it free.
+ */
+static void req_pool_init() {
+    req_pool = (request_t*)my_malloc(REQ_POOL_SIZE * sizeof(request_t));
+    req_pool_free = ring_create(REQ_POOL_SIZE);
+    for ( size_t i = 0; i < REQ_POOL_SIZE; i++ ) {
+        POOL_POISON(&req_pool[i], sizeof(request_t));
+        ring_push(req_pool_free, &req_pool[i]);
+    }
 }
 
 /**
- * @brief Destroys the peers list and frees all associated resources.
- * @param peers Pointer to the peers_t.
+ * @brief Creates a request queue.
+ * @return Pointer to the created request_q_t structure.
  */
 request_q_t* reqs_create() {
     request_q_t* req_queue = my_malloc(sizeof(request_q_t));
 
-    req_queue->queue = q_init();
-    pthread_mutex_init(&req_queue->lock, NULL);
-    pthread_cond_init(&req_queue->cond, NULL);
-    req_queue->count = 0;
-    req_queue->ready = 1;
+    req_queue->ring = ring_create(REQUESTS_MAX);
+    atomic_init(&req_queue->ndropped, 0);
+    req_queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    atomic_init(&req_queue->waiting, false);
 
     return req_queue;
 }
 
 /**
- * @brief Creates a request with a specified packet.
+ * @brief Creates a request with a specified packet, taken from the preallocated
+ * pool while it lasts.
  * @param pkt Pointer to the packet.
  * @return Pointer to the created request_t structure.
  */
@@ -186,13 +371,18 @@ request_t* req_create(struct pkt_t* pkt) {
         return NULL;
     }
 
-    request_t* req = my_malloc(sizeof(request_t));
+    pthread_once(&req_pool_once, req_pool_init);
+    request_t* req = (request_t*)ring_pop(req_pool_free);
+    if ( req ) {
+        POOL_UNPOISON(req, sizeof(request_t));
+    }
+    else {
+        req = my_malloc(sizeof(request_t));
+    }
+    memset(req, 0, sizeof(request_t));
     req->pkt = pkt;
     req->status = WAITING;
 
-    pthread_mutex_init(&req->lock, NULL);
-    pthread_cond_init(&req->cond, NULL);
-
     return req;
 }
 
@@ -204,13 +394,24 @@ void req_destroy(request_t* req) {
     if ( !req ) return;
 
     if ( req->pkt ) {
-        // If pkt_t has dynamically allocated members, they should be freed here.
-        free(req->pkt);
+        pkt_destroy(req->pkt);
+    }
+
+    // A chunk request dropped before it resolved counts as a failed chunk for its fetch.
+    if ( req->fetch ) {
+        if ( req->status == WAITING ) {
+            fetch_chunk_done(req->fetch, req, FAILED);
+        }
+        fetch_release(req->fetch);
     }
 
-    pthread_mutex_destroy(&req->lock);
-    pthread_cond_destroy(&req->cond);
-    free(req);
+    if ( req >= req_pool && req < req_pool + REQ_POOL_SIZE ) {
+        POOL_POISON(req, sizeof(request_t));
+        ring_push(req_pool_free, req);
+    }
+    else {
+        free(req);
+    }
 }
 
 /**
@@ -222,15 +423,15 @@ void reqs_destroy(request_q_t* reqs_q) {
         return;
     }
 
-    pthread_mutex_lock(&reqs_q->lock);
-    while ( !q_empty(reqs_q->queue) ) {
-        request_t* req = (request_t*)q_dequeue(reqs_q->queue);
+    // Outstanding requests may call back into a fetch as they are destroyed.
+    request_t* req;
+    while ( ( req = (request_t*)ring_pop(reqs_q->ring) ) != NULL ) {
         req_destroy(req);
     }
-    q_destroy(reqs_q->queue);
-    pthread_cond_destroy(&reqs_q->cond);
-    pthread_mutex_unlock(&reqs_q->lock);
-    pthread_mutex_destroy(&reqs_q->lock);
+    ring_destroy(reqs_q->ring);
+    if ( reqs_q->wake_fd >= 0 ) {
+        close(reqs_q->wake_fd);
+    }
     free(reqs_q);
 }
 
@@ -240,29 +441,44 @@ void reqs_destroy(request_q_t* reqs_q) {
  * @return Pointer to the next request_t structure, or NULL if the queue is empty.
  */
 request_t* reqs_nextup(request_q_t* reqs_q) {
-    if ( reqs_q == NULL || reqs_q->queue->head == NULL ) {
+    if ( reqs_q == NULL ) {
         return NULL;
     }
-
-    pthread_mutex_lock(&reqs_q->lock);
-    request_t* next_request = (request_t*)reqs_q->queue->head->data;
-    pthread_mutex_unlock(&reqs_q->lock);
-
-    return next_request;
+    return (request_t*)ring_peek(reqs_q->ring);
 }
 
 /**
- * @brief Enqueues a request into the request queue.
+ * @brief Enqueues a request into the request queue. Never blocks: if the queue is
+ * full the request is destroyed, which fails it back to its fetch if it has one.
  * @param reqs_q Pointer to the request queue.
  * @param request Pointer to the request.
+ * @return 0 on success, -1 if the queue was full.
  */
-void reqs_enqueue(request_q_t* reqs_q, request_t* request) {
-    if ( reqs_q == NULL || request == NULL ) return;
+int reqs_enqueue(request_q_t* reqs_q, request_t* request) {
+    if ( reqs_q == NULL || request == NULL ) return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &request->queued_at);
+    if ( ring_push(reqs_q->ring, request) < 0 ) {
+        debug_print("Request queue full, dropping request...\n");
+        atomic_fetch_add(&reqs_q->ndropped, 1);
+        req_destroy(request);
+        return -1;
+    }
+    reqs_wake(reqs_q);
+    return 0;
+}
 
-    pthread_mutex_lock(&reqs_q->lock);
-    q_enqueue(reqs_q->queue, (void*)request);
-    reqs_q->count += 1;
-    pthread_mutex_unlock(&reqs_q->lock);
+/**
+ * @brief Wakes the consumer of a request queue if it is waiting. Only the first
+ * enqueuer after the consumer starts waiting pays for the system call.
+ * @param reqs_q Pointer to the request queue.
+ */
+void reqs_wake(request_q_t* reqs_q) {
+    if ( reqs_q->wake_fd >= 0 && atomic_exchange(&reqs_q->waiting, false) ) {
+        uint64_t one = 1;
+        ssize_t n = write(reqs_q->wake_fd, &one, sizeof(one));
+        (void)n;
+    }
 }
 
 /**
@@ -274,13 +490,73 @@ request_t* reqs_dequeue(request_q_t* reqs_q) {
     if ( reqs_q == NULL ) {
         return NULL;
     }
+    return (request_t*)ring_pop(reqs_q->ring);
+}
 
-    pthread_mutex_lock(&reqs_q->lock);
-    request_t* req = (request_t*)q_dequeue(reqs_q->queue);
-    if ( req != NULL ) {
-        reqs_q->count -= 1;
+/**
+ * @brief Enqueues several requests at once, so a consumer sees them together.
+ * Never blocks: requests that do not fit are left to the caller rather than
+ * destroyed, so it can fail them back without holding its own locks.
+ * @param reqs_q Pointer to the request queue.
+ * @param requests Array of requests.
+ * @param n Number of requests.
+ * @return Number of requests enqueued, always a prefix of the array.
+ */
+size_t reqs_enqueue_many(request_q_t* reqs_q, request_t** requests, size_t n) {
+    if ( reqs_q == NULL || requests == NULL ) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for ( size_t i = 0; i < n; i++ ) {
+        requests[i]->queued_at = now;
+    }
+    size_t nadded = 0;
+    if ( ring_push_many(reqs_q->ring, (void**)requests, n) == 0 ) {
+        nadded = n;
     }
-    pthread_mutex_unlock(&reqs_q->lock);
+    else {
+        while ( nadded < n && ring_push(reqs_q->ring, requests[nadded]) == 0 ) {
+            nadded++;
+        }
+        if ( nadded < n ) {
+            debug_print("Request queue full, leaving %zu requests...\n", n - nadded);
+            atomic_fetch_add(&reqs_q->ndropped, n - nadded);
+        }
+    }
+    if ( nadded > 0 ) {
+        reqs_wake(reqs_q);
+    }
+    return nadded;
+}
 
-    return req;
+/**
+ * @brief Dequeues the request at the head of the queue only if it matches.
+ * @param reqs_q Pointer to the request queue.
+ * @param match Predicate called on the head request with arg.
+ * @param arg Argument passed through to match.
+ * @return Pointer to the dequeued request, or NULL if the queue is empty or the head does not match.
+ */
+request_t* reqs_dequeue_if(request_q_t* reqs_q, bool (*match)(request_t* req, void* arg), void* arg) {
+    if ( reqs_q == NULL || match == NULL ) {
+        return NULL;
+    }
+
+    // Only the consumer dequeues, so the head cannot change between the peek and the pop.
+    request_t* req = (request_t*)ring_peek(reqs_q->ring);
+    if ( req == NULL || !match(req, arg) ) {
+        return NULL;
+    }
+    return (request_t*)ring_pop(reqs_q->ring);
+}
+
+/**
+ * @brief Counts the requests waiting in a request queue.
+ * @param reqs_q Pointer to the request queue, may be NULL.
+ * @return Number of requests queued, a snapshot while others enqueue.
+ */
+size_t reqs_depth(request_q_t* reqs_q) {
+    if ( reqs_q == NULL ) {
+        return 0;
+    }
+    return ring_count(reqs_q->ring);
 }
@@ -1,9 +1,52 @@
+#include <utilities/my_utils.h>
+#include <peer_2_peer/fetch.h>
+#include <peer_2_peer/metrics.h>
 #include <peer_2_peer/package.h>
 #include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_avail.h>
+#include <peer_2_peer/peer_proof.h>
+#include <peer_2_peer/peer_connector.h>
 #include <peer_2_peer/peer_data_sync.h>
 #include <peer_2_peer/peer_handler.h>
+#include <utilities/io_engine.h>
+#include <utilities/trace.h>
+#include <utilities/work_pool.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 
+/* Buffers a peer thread serves BRQs from. Reads and sends are both double
+** buffered: the next stretch of a range comes off disk and the next packets are
+** marshalled while the previous ones go out on the socket.
+*/
+typedef struct peer_io {
+     uint8_t* win_buf[2];                         // Read buffers, alternated between windows
+     size_t win_cap[2];                           // Capacity of each read buffer
+     uint8_t tx[2][PEER_TX_PKTS * PAYLOAD_MAX];   // Marshalled RES packets, one half filling, one sending
+     int txi;                                     // Half of tx being filled
+     uint32_t ntx;                                // Packets in the half being filled
+     size_t tx_max;                               // Bytes sent at once, less than a half on a limited link
+     bool sending;                                // A send of the other half is outstanding
+     size_t send_len;                             // Bytes of the outstanding send
+     pthread_mutex_t* send_lock;                  // Peer's send lock, held until the send completes
+     bool failed;                                 // A send failed, the rest of the batch is dropped
+} peer_io_t;
+
+/* A run of whole chunks of one BRQ range, read into one buffer. */
+typedef struct serve_win {
+     uint32_t first;        // First chunk index in the window
+     uint32_t end;          // One past the last chunk index
+     uint64_t base;         // File offset of the first byte of the buffer
+     uint8_t* buf;
+     size_t len;            // Bytes the window covers
+     size_t got;            // Bytes read so far
+     uint32_t pending;      // Reads still outstanding
+     bool failed;           // A read failed or came up short
+} serve_win_t;
+
+static void serve_item(void* ctx, void* item);
+static void install_item(void* ctx, void* item);
+
 /**
  * @brief Main function for the peer handler thread.
  * @param args_void Pointer to the arguments for the peer handler thread.
@@ -15,32 +58,141 @@ void peer_handler(void* args_void) {
      peer_t* peer = args->peer;
      peers_t* peers = args->peers;
      bpkgs_t* bpkgs = args->bpkgs;
+     TRACE_THREAD("peer %s:%d", peer->ip, peer->port);
 
+     // Serving and installing run on the worker pool; this thread only frames packets.
+     work_pool_t* pool = work_pool_shared();
+     peer->serve = strand_create(pool, serve_item, args);
+     peer->install = strand_create(pool, install_item, args);
 
      acp_wait_ack(peer);
+     send_hav_pkgs(peer, bpkgs);
+     struct timespec last_sweep = { 0 };
      // Continuously check whether a request has been enqueued or a peer has sent a packet:
 
      while ( true ) {
 
-          // Request queue check:
-          request_t* req = peer_process_request_shared(peer);
-
-          // Incoming packet chacket:
-          pkt_t* pkt = peer_try_receive(peer);
+          // Request queue check, flushing everything queued so fetches stay pipelined.
+          // Skipped while a worker is streaming to the peer so this thread keeps
+          // reading; two peers serving each other could otherwise both stop reading.
+          bool drained = false;
+          if ( pthread_mutex_trylock(&peer->send_lock) == 0 ) {
+               drained = true;
+               int cancel_state;
+               pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+               TRACE_BEGIN("drain requests");
+               while ( peer_process_request_shared(peer) ) {
+               }
+               TRACE_END("drain requests");
+               pthread_mutex_unlock(&peer->send_lock);
+               pthread_setcancelstate(cancel_state, NULL);
+          }
 
-          if ( pkt != NULL ) {
-               debug_print("Received packet from peer. Processing now...\n");
-               process_pkt_in(peer, pkt, bpkgs, req, peers);
+          // Incoming packet check, also woken as soon as new requests are queued. While
+          // a worker holds the send lock queued requests cannot go out, so only the
+          // socket is watched and the lock retried shortly.
+          TRACE_BEGIN("wait");
+          int readable = drained ? peer_wait_event(peer, PEER_POLL_MS) : peer_poll_incoming(peer, 1);
+          TRACE_END("wait");
+          // Every whole packet already buffered is taken before going round again, so
+          // work reaches the pool in bursts rather than one wakeup per packet.
+          for ( int n = 0; readable && n < PEER_RECV_BURST; n++ ) {
+               TRACE_BEGIN("receive");
+               pkt_t* pkt = peer_try_receive(peer);
+               TRACE_END("receive");
+
+               if ( pkt != NULL ) {
+                    debug_print("Received packet from peer. Processing now...\n");
+                    TRACE_BEGIN("process");
+                    process_pkt_in(peer, pkt, bpkgs, peers);
+                    TRACE_END("process");
+               }
+               else {
+                    debug_print("Could not process packet from peer.\n");
+                    break;
+               }
+               int buffered = 0;
+               readable = ioctl(peer->sock_fd, FIONREAD, &buffered) == 0 && buffered >= (int)sizeof(pkt_t);
           }
-          else {
-               debug_print("Could not process packet from peer.\n");
+
+          // A connection that went away without a DSN is handed to the connector,
+          // which brings it back if it was made from here.
+          if ( peer->closed ) {
+               printf("Disconnected from peer\n");
+               fflush(stdout);
+               peers_remove(peers, peer->ip, peer->port);
+               connector_peer_lost(peer->ip, peer->port);
+               peer_destroy(peer);
           }
 
+          // Workers install into the same in-flight list, so it is swept on a timer
+          // rather than after every packet.
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          if ( ( now.tv_sec - last_sweep.tv_sec ) * 1000 + ( now.tv_nsec - last_sweep.tv_nsec ) / 1000000 >= PEER_SWEEP_MS ) {
+               TRACE_BEGIN("sweep inflight");
+               fetch_expire_inflight(peer);
+               TRACE_END("sweep inflight");
+               last_sweep = now;
+          }
           pthread_testcancel();
      }
      pthread_cleanup_pop(1);
 }
 
+/**
+ * @brief Waits briefly for a peer's socket to become readable.
+ * @param peer Pointer to the peer.
+ * @param timeout_ms Milliseconds to wait.
+ * @return 1 if data (or a hangup) is pending, 0 otherwise.
+ */
+int peer_poll_incoming(peer_t* peer, int timeout_ms) {
+     if ( !peer || peer->sock_fd < 0 ) {
+          return 0;
+     }
+
+     struct pollfd pfd = { .fd = peer->sock_fd, .events = POLLIN };
+     return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+/**
+ * @brief Waits for a peer's socket to become readable or for a request to be queued
+ * for it, whichever comes first.
+ * @param peer Pointer to the peer.
+ * @param timeout_ms Milliseconds to wait at most.
+ * @return 1 if data (or a hangup) is pending on the socket, 0 otherwise.
+ */
+int peer_wait_event(peer_t* peer, int timeout_ms) {
+     request_q_t* reqs_q = peer->reqs_q;
+     if ( !reqs_q || reqs_q->wake_fd < 0 ) {
+          return peer_poll_incoming(peer, timeout_ms);
+     }
+
+     // Announce the wait before checking the queue; an enqueuer that pushes after the
+     // check sees the flag and signals the eventfd, so no request is left waiting.
+     atomic_store(&reqs_q->waiting, true);
+     if ( reqs_nextup(reqs_q) != NULL ) {
+          timeout_ms = 0;
+     }
+
+     struct pollfd pfds[2] = {
+          { .fd = peer->sock_fd, .events = POLLIN },
+          { .fd = reqs_q->wake_fd, .events = POLLIN },
+     };
+     int ready = poll(pfds, 2, timeout_ms);
+     atomic_store(&reqs_q->waiting, false);
+     if ( ready <= 0 ) {
+          return 0;
+     }
+
+     if ( pfds[1].revents & POLLIN ) {
+          uint64_t count;
+          ssize_t n = read(reqs_q->wake_fd, &count, sizeof(count));
+          (void)n;
+     }
+     return ( pfds[0].revents & ( POLLIN | POLLHUP | POLLERR ) ) != 0;
+}
+
 /**
  * @brief Attempts to receive a packet from a peer.
  * @param peer Pointer to the peer.
@@ -68,10 +220,14 @@ pkt_t* peer_try_receive(peer_t* peer) {
           n = recv(peer->sock_fd, buffer + received, sizeof(pkt_t) - received, 0);
           if ( n < 0 ) {
                debug_print("Receive failed or timed out\n");
+               if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                    peer->closed = true;
+               }
                return NULL;
           }
           if ( n == 0 ) {
                debug_print("Connection closed by peer.\n");
+               peer->closed = true;
                return NULL;
           }
           received += n;
@@ -80,26 +236,91 @@ pkt_t* peer_try_receive(peer_t* peer) {
 
      debug_print("Data received successfully. Unmarshalling packet...\n");
 
-     pkt_t* pkt = malloc(sizeof(pkt_t));
-     if ( !pkt ) {
-          perror("Failed to allocate packet\n");
-          return NULL;
-     }
+     // Holding off the next read lets the socket fill up, so TCP slows the sender.
+     rate_limit(&peer->down, RATE_DOWN, sizeof(pkt_t));
+
+     pkt_t* pkt = pkt_alloc();
 
      pkt_unmarshall(pkt, buffer);
+     metrics_count_pkts(&peer->stats, METRIC_RECV, pkt->msg_code, 1, sizeof(pkt_t));
 
      debug_print("Packet unmarshalled successfully. Msg code: %d\n", pkt->msg_code);
      return pkt;
 }
 
+/**
+ * @brief Answers a REQ or BRQ packet.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the request packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+static void serve_pkt(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs) {
+     if ( pkt_in->msg_code == PKT_MSG_BRQ ) {
+          send_res_batch(peer, pkt_in, bpkgs);
+          debug_print("Responses sent to BRQ from peer at port %d.\n", peer->port);
+     }
+     else {
+          send_res_pkts(peer, pkt_in, bpkgs);
+          debug_print("Response sent to REQ from peer at port %d.\n", peer->port);
+     }
+}
+
+/**
+ * @brief Installs the data of a RES packet, announcing the chunk if it completed.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the RES packet.
+ * @param peers Pointer to the list of peers.
+ */
+static void install_res(peer_t* peer, pkt_t* pkt_in, peers_t* peers) {
+     bpkg_t* bpkg = NULL;
+     uint32_t index = 0;
+     int status = fetch_handle_res(peer, pkt_in, &bpkg, &index);
+     if ( status < 0 ) {
+          debug_print("Failed to install packet from peer at port %d.\n", peer->port);
+     }
+     else {
+          debug_print("Successfully received and installed packet from peer at port %d.\n", peer->port);
+     }
+     if ( status == 1 ) {
+          send_hav_all(peers, bpkg, index);
+          bpkg_release(bpkg);
+     }
+}
+
+/**
+ * @brief Runs one request packet from a peer's serve strand on a worker.
+ * @param ctx Arguments of the peer's thread.
+ * @param item The REQ or BRQ packet, destroyed once answered.
+ */
+static void serve_item(void* ctx, void* item) {
+     peer_thr_args_t* args = (peer_thr_args_t*)ctx;
+     TRACE_BEGIN("serve");
+     serve_pkt(args->peer, (pkt_t*)item, args->bpkgs);
+     TRACE_END("serve");
+     pkt_destroy((pkt_t*)item);
+}
+
+/**
+ * @brief Runs one RES packet from a peer's install strand on a worker.
+ * @param ctx Arguments of the peer's thread.
+ * @param item The RES packet, destroyed once installed.
+ */
+static void install_item(void* ctx, void* item) {
+     peer_thr_args_t* args = (peer_thr_args_t*)ctx;
+     TRACE_BEGIN("install");
+     install_res(args->peer, (pkt_t*)item, args->peers);
+     TRACE_END("install");
+     pkt_destroy((pkt_t*)item);
+}
+
 /**
  * @brief Processes an incoming packet from a peer.
  * @param peer Pointer to the peer.
  * @param pkt_in Pointer to the incoming packet.
  * @param bpkgs Pointer to the package manager.
- * @param req_recent Pointer to the recent request.
+ * @param peers Pointer to the list of peers.
  */
-void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, request_t* req_recent, peers_t* peers) {
+void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, peers_t* peers) {
      if ( !peer || !pkt_in || !bpkgs ) {
           debug_print("Invalid input to process_pkt_in: NULL peer, packet, or package manager.\n");
           return;
@@ -118,8 +339,12 @@ void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, request_t* req_
           break;
 
      case PKT_MSG_REQ: //Request packet:
-          send_res_pkts(peer, pkt_in, bpkgs);
-          debug_print("Response sent to REQ from peer at port %d with error status.\n", peer->port);
+     case PKT_MSG_BRQ: //Batched request packet:
+          if ( peer->serve ) {
+               strand_post(peer->serve, pkt_in);
+               return;
+          }
+          serve_pkt(peer, pkt_in, bpkgs);
           break;
 
      case PKT_MSG_DSN: //Peer disconnecting:
@@ -131,15 +356,27 @@ void process_pkt_in(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs, request_t* req_
           break;
 
      case PKT_MSG_RES: //Response packet:
-          if ( pkt_install(pkt_in, peer, bpkgs) < 0 ) {
-               req_recent->status = FAILED;
-               debug_print("Failed to install packet from peer at port %d.\n", peer->port);
-          }
-          else {
-               req_recent->status = SUCCESS;
-               pthread_cond_signal(&req_recent->cond);
-               debug_print("Successfully received and installed packet from peer at port %d.\n", peer->port);
+          if ( peer->install ) {
+               strand_post(peer->install, pkt_in);
+               return;
           }
+          install_res(peer, pkt_in, peers);
+          break;
+
+     case PKT_MSG_HAV: //Availability advertisement:
+          recv_hav(peer, pkt_in, bpkgs);
+          break;
+
+     case PKT_MSG_CNL: //Cancelled request:
+          peer_record_cancel(peer, pkt_in);
+          return;
+
+     case PKT_MSG_PRQ: //Inclusion proof request:
+          send_prf(peer, pkt_in, bpkgs);
+          break;
+
+     case PKT_MSG_PRF: //Inclusion proof:
+          peer_proof_check(peer, pkt_in);
           break;
 
      default:
@@ -161,8 +398,20 @@ void process_pkt_out(peer_t* peer, request_t* req) {
           send_png(peer);
           break;
      case PKT_MSG_REQ:
+          if ( fetch_skip_redundant(req) ) {
+               return;
+          }
+          if ( req->fetch ) {
+               send_req_batch(peer, req);
+               return;
+          }
           send_req(peer, pkt);
           break;
+     case PKT_MSG_HAV:
+     case PKT_MSG_CNL:
+     case PKT_MSG_PRQ:
+          try_send(peer, pkt);
+          break;
      case PKT_MSG_DSN:
           send_dsn(peer);
           req_destroy(req);
@@ -178,12 +427,12 @@ void process_pkt_out(peer_t* peer, request_t* req) {
 /**
  * @brief Processes a shared request for a peer.
  * @param peer Pointer to the peer.
- * @return Pointer to the processed request.
+ * @return 1 if a request was dequeued and processed, 0 if the queue was empty.
  */
-request_t* peer_process_request_shared(peer_t* peer) {
+int peer_process_request_shared(peer_t* peer) {
      if ( !peer || !peer->reqs_q ) {
           debug_print("Invalid arguments to peer_process_request_shared.\n");
-          return NULL;
+          return 0;
      }
 
      // Try to dequeue and then process the request.
@@ -197,6 +446,7 @@ request_t* peer_process_request_shared(peer_t* peer) {
      }
 
      if ( req != NULL ) {
+          metrics_record_latency(&peer->stats, req->fetch ? req->fetch->lat : NULL, LAT_QUEUE, &req->queued_at);
           process_pkt_out(peer, req);
           debug_print("Request processed successfully for peer at port %d and IP %s.\n", peer->port, peer->ip);
      }
@@ -204,9 +454,7 @@ request_t* peer_process_request_shared(peer_t* peer) {
           debug_print("No request found for peer at port %d and IP %s.\n", peer->port, peer->ip);
      }
 
-
-
-     return req;
+     return req != NULL;
 }
 
 /**
@@ -228,7 +476,22 @@ void peer_cleanup_handler(void* arg) {
           free(args);
           return;
      }
-     else if ( peer->sock_fd >= 0 ) {
+
+     // Shutting the socket down fails any send a worker is blocked in, so work queued
+     // for the peer runs out quickly; it must finish before the state it uses is freed.
+     shutdown(peer->sock_fd, SHUT_RDWR);
+     if ( peer->serve ) {
+          strand_drain(peer->serve);
+          strand_destroy(peer->serve);
+          peer->serve = NULL;
+     }
+     if ( peer->install ) {
+          strand_drain(peer->install);
+          strand_destroy(peer->install);
+          peer->install = NULL;
+     }
+
+     if ( peer->sock_fd >= 0 ) {
           close(peer->sock_fd);
           peer->sock_fd = -1;
      }
@@ -238,6 +501,33 @@ void peer_cleanup_handler(void* arg) {
           pthread_join(peer->thread, (void**)0);
      }
 
+     // Any chunk requests still awaiting a response fail with the connection.
+     if ( peer->inflight ) {
+          while ( !q_empty(peer->inflight) ) {
+               req_destroy((request_t*)q_dequeue(peer->inflight));
+          }
+          q_destroy(peer->inflight);
+          peer->inflight = NULL;
+     }
+     peer_avail_destroy(peer);
+     peer_proof_destroy(peer);
+
+     if ( peer->cancels ) {
+          while ( !q_empty(peer->cancels) ) {
+               pkt_destroy((pkt_t*)q_dequeue(peer->cancels));
+          }
+          q_destroy(peer->cancels);
+          peer->cancels = NULL;
+     }
+     if ( peer->io ) {
+          free(peer->io->win_buf[0]);
+          free(peer->io->win_buf[1]);
+          free(peer->io);
+          peer->io = NULL;
+     }
+     bucket_destroy(&peer->up);
+     bucket_destroy(&peer->down);
+
      free(args);
      free(peer);
      peer = NULL;
@@ -280,6 +570,16 @@ void try_send(peer_t* peer, pkt_t* pkt_out) {
      uint8_t buffer[4096];
      pkt_marshall(pkt_out, buffer);
 
+     // Waiting out the limits before taking the lock leaves the socket to others meanwhile.
+     rate_limit(&peer->up, RATE_UP, sizeof(pkt_t));
+
+     // Packets from the peer thread and from workers must not interleave on the wire,
+     // and a thread cancelled mid-send would leave the lock held.
+     int cancel_state;
+     pthread_mutex_lock(&peer->send_lock);
+     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+     TRACE_BEGIN("send");
+
      int total = 0;
      int bytesleft = sizeof(pkt_t);
      int n;
@@ -291,14 +591,18 @@ void try_send(peer_t* peer, pkt_t* pkt_out) {
           if ( n == -1 ) {
                perror("Failed to send packet");
                debug_print("Failed to send packet to peer at port %d after %d bytes.\n", peer->port, total);
-               return;
+               break;
           }
           total += n;
           bytesleft -= n;
      }
+     TRACE_END("send");
+     pthread_setcancelstate(cancel_state, NULL);
+     pthread_mutex_unlock(&peer->send_lock);
 
      // If a full packet was recieved:
      if ( total == PAYLOAD_MAX ) {
+          metrics_count_pkts(&peer->stats, METRIC_SENT, pkt_out->msg_code, 1, PAYLOAD_MAX);
           debug_print("Successfully sent entire packet to peer at port %d.\n", peer->port);
      }
      else {
@@ -306,14 +610,122 @@ void try_send(peer_t* peer, pkt_t* pkt_out) {
      }
 }
 
+/**
+ * @brief Checks whether a CNL packet withdraws a given request.
+ * @param cnl Pointer to the CNL packet.
+ * @param req Pointer to the request payload.
+ * @return true if the cancel names the same chunk of the same package.
+ */
+static bool cnl_matches(pkt_t* cnl, req_t* req) {
+     req_t* c = &cnl->payload.req;
+     return c->offset == req->offset && strncmp(c->hash, req->hash, SHA256_HEXLEN) == 0
+          && strncmp(c->ident, req->ident, sizeof(req->ident)) == 0;
+}
+
+/**
+ * @brief Remembers a CNL packet so a worker serving the peer skips the chunk it
+ * names. The oldest are dropped once PEER_CANCELS_MAX are held.
+ * @param peer Pointer to the peer.
+ * @param cnl Pointer to the CNL packet, owned by the peer from here on.
+ */
+void peer_record_cancel(peer_t* peer, pkt_t* cnl) {
+     pthread_mutex_lock(&peer->cancel_lock);
+     q_enqueue(peer->cancels, cnl);
+     if ( ++peer->ncancels > PEER_CANCELS_MAX ) {
+          pkt_destroy((pkt_t*)q_dequeue(peer->cancels));
+          peer->ncancels--;
+     }
+     pthread_mutex_unlock(&peer->cancel_lock);
+}
+
+/**
+ * @brief Removes a recorded cancel naming a chunk, if there is one.
+ * @param peer Pointer to the peer.
+ * @param req Request for the chunk.
+ * @return true if the chunk was cancelled.
+ */
+static bool peer_take_cancel(peer_t* peer, req_t* req) {
+     bool found = false;
+     pthread_mutex_lock(&peer->cancel_lock);
+     for ( q_node_t* curr = peer->cancels->head; curr != NULL; curr = curr->next ) {
+          pkt_t* cnl = (pkt_t*)curr->data;
+          if ( cnl_matches(cnl, req) ) {
+               q_remove(peer->cancels, cnl);
+               peer->ncancels--;
+               pkt_destroy(cnl);
+               found = true;
+               break;
+          }
+     }
+     pthread_mutex_unlock(&peer->cancel_lock);
+     return found;
+}
+
+/**
+ * @brief Streams one locally verified chunk to a peer in RES packets of at most
+ * DATA_MAX bytes, stopping early if the peer cancels it.
+ * @param peer Pointer to the peer.
+ * @param bpkg Package the chunk belongs to.
+ * @param chk_node Chunk node to send.
+ * @param req Request being served, matched against incoming cancels.
+ */
+static void send_chunk_res(peer_t* peer, bpkg_t* bpkg, mtree_node_t* chk_node, req_t* req) {
+     chunk_t* chk = chk_node->chunk;
+     uint32_t curr_offset = chk->offset;
+     uint32_t remaining_size = chk->size;
+
+     // One packet on the stack is reused for the whole chunk, copying straight from
+     // the mapped file, so streaming does no allocation.
+     pkt_t pkt;
+     pkt.msg_code = PKT_MSG_RES;
+     pkt.error = 0;
+     res_t* res = &pkt.payload.res;
+     memset(res, 0, sizeof(res_t));
+     strncpy(res->hash, chk_node->expected_hash, SHA256_HEXLEN);
+     memcpy(res->ident, bpkg->ident, strnlen(bpkg->ident, sizeof(res->ident)));
+
+     while ( remaining_size > 0 ) {
+          uint32_t chunk_size = ( remaining_size > DATA_MAX ) ? DATA_MAX : remaining_size;
+
+          res->offset = curr_offset;
+          res->size = chunk_size;
+          memcpy(res->data, bpkg->mtree->f_data + curr_offset, chunk_size);
+          if ( chunk_size < DATA_MAX ) {
+               memset(res->data + chunk_size, 0, DATA_MAX - chunk_size);
+          }
+
+          try_send(peer, &pkt);
+
+          curr_offset += chunk_size;
+          remaining_size -= chunk_size;
+
+          if ( remaining_size > 0 && peer_take_cancel(peer, req) ) {
+               debug_print("Request cancelled mid-chunk by peer at port %d.\n", peer->port);
+               break;
+          }
+     }
+}
+
 void send_res_pkts(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs)
 {
-     bpkg_t* bpkg = pkg_find_by_ident(bpkgs, pkt_in->payload.req.ident);
+     struct timespec start;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+
+     // The ident field fills the end of the packet, so terminate a local copy of it.
+     req_t* req = &pkt_in->payload.req;
+     char ident[sizeof(req->ident) + 1] = { 0 };
+     memcpy(ident, req->ident, sizeof(req->ident));
+
+     bpkg_t* bpkg = pkgs_get(bpkgs, ident);
      uint16_t err = 0;
 
+     // Error responses echo what was asked for so the requester can match them up.
+     payload_t err_payload = payload_create_res(req->offset, 0, req->hash, ident, NULL);
+
      if ( !bpkg ) {
           err = -1;
-          send_res(peer, err, ( payload_t ) { 0 });
+          send_res(peer, err, err_payload);
+          metrics_add(&metrics_global()->serve_errors, 1);
           return;
      }
 
@@ -330,28 +742,291 @@ void send_res_pkts(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs)
      if ( !chk_node || strncmp(chk_node->expected_hash, chk_node->computed_hash, SHA256_HEXLEN) != 0 ) {
           debug_print("Local copy of requested chunk is incomplete or not found...\n");
           err = -1;
-          send_res(peer, err, ( payload_t ) { 0 });
+          send_res(peer, err, err_payload);
+          metrics_add(&metrics_global()->serve_errors, 1);
+          bpkg_release(bpkg);
+          return;
+     }
+
+     if ( peer_take_cancel(peer, req) ) {
+          debug_print("Request cancelled while queued by peer at port %d.\n", peer->port);
+          bpkg_release(bpkg);
+          return;
+     }
+     send_chunk_res(peer, bpkg, chk_node, req);
+     metrics_add(&metrics_global()->chunks_served, 1);
+     metrics_record_latency(&peer->stats, metrics_pkg_latency(bpkg->ident), LAT_SERVE, &start);
+     bpkg_release(bpkg);
+}
+
+/**
+ * @brief Collects finished I/O of a BRQ being served.
+ * @param pio Pointer to the peer's serving buffers.
+ * @param io Pointer to the thread's I/O engine.
+ * @param min Results to wait for.
+ */
+static void serve_reap(peer_io_t* pio, io_engine_t* io, uint32_t min) {
+     io_result_t results[IO_DEPTH];
+     uint32_t n = io_wait(io, results, min, IO_DEPTH);
+
+     for ( uint32_t i = 0; i < n; i++ ) {
+          if ( results[i].tag == pio ) {
+               pio->sending = false;
+               pthread_mutex_unlock(pio->send_lock);
+               if ( results[i].res < (ssize_t)pio->send_len ) {
+                    debug_print("Engine send failed: %s\n", strerror(results[i].res < 0 ? -results[i].res : EPIPE));
+                    pio->failed = true;
+               }
+               continue;
+          }
+
+          serve_win_t* win = (serve_win_t*)results[i].tag;
+          win->pending--;
+          if ( results[i].res < 0 ) {
+               win->failed = true;
+          }
+          else {
+               win->got += (size_t)results[i].res;
+          }
+          if ( win->pending == 0 && win->got != win->len ) {
+               win->failed = true;
+          }
+     }
+}
+
+/**
+ * @brief Waits until the outstanding send has gone out.
+ * @param pio Pointer to the peer's serving buffers.
+ * @param io Pointer to the thread's I/O engine.
+ */
+static void serve_tx_wait(peer_io_t* pio, io_engine_t* io) {
+     while ( pio->sending ) {
+          serve_reap(pio, io, 1);
+     }
+}
+
+/**
+ * @brief Hands the packets marshalled so far to the I/O engine once the previous
+ * send has gone out, and switches to filling the other half of the send buffer.
+ * @param peer Pointer to the peer.
+ * @param io Pointer to the thread's I/O engine.
+ */
+static void serve_tx_flush(peer_t* peer, io_engine_t* io) {
+     peer_io_t* pio = peer->io;
+     if ( pio->ntx == 0 ) {
           return;
      }
+     TRACE_BEGIN("send wait");
+     serve_tx_wait(pio, io);
+     TRACE_END("send wait");
+
+     pio->send_len = pio->ntx * PAYLOAD_MAX;
+     rate_limit(&peer->up, RATE_UP, pio->send_len);
+     pio->send_lock = &peer->send_lock;
+     pthread_mutex_lock(pio->send_lock);
+     if ( io_send(io, peer->sock_fd, pio->tx[pio->txi], pio->send_len, pio) == 0 ) {
+          pio->sending = true;
+          metrics_count_pkts(&peer->stats, METRIC_SENT, PKT_MSG_RES, pio->ntx, pio->send_len);
+     }
+     else {
+          pthread_mutex_unlock(pio->send_lock);
+          pio->failed = true;
+     }
+     pio->txi ^= 1;
+     pio->ntx = 0;
+}
+
+/**
+ * @brief Starts reading the next window of a range, as many whole chunks as fit in
+ * one buffer.
+ * @param peer Pointer to the peer.
+ * @param io Pointer to the thread's I/O engine.
+ * @param mtree Pointer to the package's Merkle tree.
+ * @param win Window to fill.
+ * @param slot Read buffer to use.
+ * @param next First chunk index not yet read.
+ * @param end One past the last chunk index of the range.
+ * @return One past the last chunk index the window covers.
+ */
+static uint32_t serve_win_read(peer_t* peer, io_engine_t* io, mtree_t* mtree, serve_win_t* win, int slot, uint32_t next, uint32_t end) {
+     peer_io_t* pio = peer->io;
+     chunk_t* first = mtree->chk_nodes[next]->chunk;
+
+     // A chunk larger than the buffer grows it rather than being split across windows.
+     size_t cap = first->size > PEER_IO_WINDOW ? first->size : PEER_IO_WINDOW;
+     if ( pio->win_cap[slot] < cap ) {
+          free(pio->win_buf[slot]);
+          pio->win_buf[slot] = (uint8_t*)my_malloc(cap);
+          pio->win_cap[slot] = cap;
+     }
+
+     memset(win, 0, sizeof(serve_win_t));
+     win->first = next;
+     win->base = first->offset;
+     win->buf = pio->win_buf[slot];
+     win->end = next;
+     while ( win->end < end ) {
+          chunk_t* chk = mtree->chk_nodes[win->end]->chunk;
+          size_t chk_end = (size_t)chk->offset + chk->size - win->base;
+          if ( win->end > next && chk_end > pio->win_cap[slot] ) {
+               break;
+          }
+          win->len = chk_end;
+          win->end++;
+     }
 
+     size_t seg = PEER_IO_SEGMENT;
+     if ( win->len > seg * PEER_IO_SEGMENTS_MAX ) {
+          seg = ( win->len + PEER_IO_SEGMENTS_MAX - 1 ) / PEER_IO_SEGMENTS_MAX;
+     }
+     for ( size_t off = 0; off < win->len; off += seg ) {
+          size_t len = win->len - off < seg ? win->len - off : seg;
+          if ( io_read(io, mtree->f_fd, win->buf + off, len, win->base + off, win) < 0 ) {
+               win->failed = true;
+               break;
+          }
+          win->pending++;
+     }
+     return win->end;
+}
 
-     // Continuously send packets of max size DATA_MAX until entire chunk has been sent.
+/**
+ * @brief Marshalls one chunk of a filled window into RES packets and sends them,
+ * stopping early if the peer cancels it.
+ * @param peer Pointer to the peer.
+ * @param io Pointer to the thread's I/O engine.
+ * @param win Window holding the chunk.
+ * @param bpkg Package the chunk belongs to.
+ * @param chk_node Chunk node to send.
+ * @param req Request being served, matched against incoming cancels.
+ */
+static void serve_chunk(peer_t* peer, io_engine_t* io, serve_win_t* win, bpkg_t* bpkg,
+     mtree_node_t* chk_node, req_t* req) {
+     peer_io_t* pio = peer->io;
      chunk_t* chk = chk_node->chunk;
      uint32_t curr_offset = chk->offset;
      uint32_t remaining_size = chk->size;
-     uint8_t data[DATA_MAX];
 
-     while ( remaining_size > 0 ) {
+     pkt_t pkt;
+     pkt.msg_code = PKT_MSG_RES;
+     pkt.error = 0;
+     res_t* res = &pkt.payload.res;
+     memset(res, 0, sizeof(res_t));
+     strncpy(res->hash, chk_node->expected_hash, SHA256_HEXLEN);
+     memcpy(res->ident, bpkg->ident, strnlen(bpkg->ident, sizeof(res->ident)));
+
+     while ( remaining_size > 0 && !pio->failed ) {
           uint32_t chunk_size = ( remaining_size > DATA_MAX ) ? DATA_MAX : remaining_size;
 
-          memcpy(data, bpkg->mtree->f_data + curr_offset, chunk_size);
-          payload_t payload = payload_create_res(curr_offset, chunk_size, chk_node->expected_hash, bpkg->ident, data);
+          res->offset = curr_offset;
+          res->size = chunk_size;
+          memcpy(res->data, win->buf + ( curr_offset - win->base ), chunk_size);
+          if ( chunk_size < DATA_MAX ) {
+               memset(res->data + chunk_size, 0, DATA_MAX - chunk_size);
+          }
 
-          send_res(peer, err, payload);
+          pkt_marshall(&pkt, pio->tx[pio->txi] + pio->ntx * PAYLOAD_MAX);
+          pio->ntx++;
 
           curr_offset += chunk_size;
           remaining_size -= chunk_size;
+
+          if ( pio->ntx == PEER_TX_PKTS || pio->ntx * PAYLOAD_MAX >= pio->tx_max ) {
+               serve_tx_flush(peer, io);
+               if ( remaining_size > 0 && peer_take_cancel(peer, req) ) {
+                    debug_print("Request cancelled mid-chunk by peer at port %d.\n", peer->port);
+                    break;
+               }
+          }
+     }
+}
+
+void send_res_batch(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs) {
+     brq_t* brq = &pkt_in->payload.brq;
+     char ident[sizeof(brq->ident) + 1] = { 0 };
+     memcpy(ident, brq->ident, sizeof(brq->ident));
+
+     bpkg_t* bpkg = pkgs_get(bpkgs, ident);
+     if ( !bpkg || bpkg->mtree->nchunks != brq->nchunks || brq->nranges > BRQ_RANGES_MAX ) {
+          // Without the package there is nothing to echo per chunk; the requester times out.
+          debug_print("Ignoring BRQ for unmanaged package from peer at port %d.\n", peer->port);
+          bpkg_release(bpkg);
+          return;
      }
+
+     mtree_t* mtree = bpkg->mtree;
+     latency_set_t* lat = metrics_pkg_latency(bpkg->ident);
+     io_engine_t* io = io_engine_thread();
+     if ( !peer->io ) {
+          peer->io = (peer_io_t*)my_malloc(sizeof(peer_io_t));
+          memset(peer->io, 0, sizeof(peer_io_t));
+     }
+     peer_io_t* pio = peer->io;
+     pio->failed = false;
+     // A rate-limited link sends a burst at a time, so RES arrive steadily rather than
+     // in a few large sends with long gaps the requester would time out across.
+     pio->tx_max = rate_burst(&peer->up, RATE_UP);
+
+     serve_win_t wins[2];
+     for ( uint32_t r = 0; r < brq->nranges && !pio->failed; r++ ) {
+          brq_range_t* range = &brq->ranges[r];
+          if ( range->count == 0 || range->first >= mtree->nchunks || range->count > mtree->nchunks - range->first ) {
+               debug_print("Skipping out of range BRQ entry from peer at port %d.\n", peer->port);
+               continue;
+          }
+
+          // While one window is sent, the next is read into the other buffer.
+          uint32_t end = range->first + range->count;
+          int cur = 0;
+          uint32_t next = serve_win_read(peer, io, mtree, &wins[cur], cur, range->first, end);
+          while ( true ) {
+               serve_win_t* win = &wins[cur];
+               while ( win->pending > 0 ) {
+                    serve_reap(pio, io, 1);
+               }
+               if ( next < end ) {
+                    next = serve_win_read(peer, io, mtree, &wins[cur ^ 1], cur ^ 1, next, end);
+               }
+
+               for ( uint32_t i = win->first; i < win->end && !pio->failed; i++ ) {
+                    mtree_node_t* chk_node = mtree->chk_nodes[i];
+                    payload_t cur_req = payload_create_req(chk_node->chunk->offset, chk_node->chunk->size,
+                         chk_node->expected_hash, bpkg->ident, NULL);
+
+                    if ( peer_take_cancel(peer, &cur_req.req) ) {
+                         continue;
+                    }
+
+                    if ( win->failed || !check_chunk(chk_node) ) {
+                         // Error responses go out directly, after the packets queued ahead of them.
+                         serve_tx_flush(peer, io);
+                         serve_tx_wait(pio, io);
+                         payload_t err_payload = payload_create_res(chk_node->chunk->offset, 0, chk_node->expected_hash, bpkg->ident, NULL);
+                         send_res(peer, -1, err_payload);
+                         metrics_add(&metrics_global()->serve_errors, 1);
+                         continue;
+                    }
+                    // The window was read ahead of time, so a chunk's serve time covers its sends alone.
+                    struct timespec start;
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    serve_chunk(peer, io, win, bpkg, chk_node, &cur_req.req);
+                    metrics_add(&metrics_global()->chunks_served, 1);
+                    metrics_record_latency(&peer->stats, lat, LAT_SERVE, &start);
+               }
+
+               if ( win->end >= end || pio->failed ) {
+                    break;
+               }
+               cur ^= 1;
+          }
+     }
+
+     serve_tx_flush(peer, io);
+     while ( io_outstanding(io) > 0 ) {
+          serve_reap(pio, io, 1);
+     }
+     pio->ntx = 0;
+     bpkg_release(bpkg);
 }
 
 /**
@@ -383,9 +1058,8 @@ void send_ack(peer_t* peer) {
  * @param payload Payload to send.
  */
 void send_res(peer_t* peer, uint8_t err, payload_t payload) {
-     pkt_t* pkt = pkt_create(PKT_MSG_RES, err, payload);
-     try_send(peer, pkt);
-     pkt_destroy(pkt);
+     pkt_t pkt = { .msg_code = PKT_MSG_RES, .error = err, .payload = payload };
+     try_send(peer, &pkt);
 }
 
 /**
@@ -395,6 +1069,64 @@ void send_res(peer_t* peer, uint8_t err, payload_t payload) {
  */
 void send_req(peer_t* peer, pkt_t* pkt) {
      try_send(peer, pkt);
+}
+
+/**
+ * @brief Checks whether a queued request is a chunk request of the same fetch.
+ * @param req Request at the head of the queue.
+ * @param arg Request leading the batch.
+ * @return true if it can join the batch.
+ */
+static bool req_joins_batch(request_t* req, void* arg) {
+     request_t* lead = (request_t*)arg;
+     return req->fetch == lead->fetch && req->pkt && req->pkt->msg_code == PKT_MSG_REQ;
+}
+
+/**
+ * @brief Sends a fetch's chunk request along with the requests queued right behind
+ * it for the same fetch, as one BRQ when there is more than one.
+ * @param peer Pointer to the peer.
+ * @param req Pointer to the request leading the batch.
+ */
+void send_req_batch(peer_t* peer, request_t* req) {
+     request_t* reqs[BRQ_RANGES_MAX];
+     uint32_t indices[BRQ_RANGES_MAX];
+     uint32_t n = 0;
+
+     reqs[n++] = req;
+     while ( n < BRQ_RANGES_MAX ) {
+          request_t* next = reqs_dequeue_if(peer->reqs_q, req_joins_batch, req);
+          if ( !next ) {
+               break;
+          }
+          metrics_record_latency(&peer->stats, next->fetch->lat, LAT_QUEUE, &next->queued_at);
+          if ( !fetch_skip_redundant(next) ) {
+               reqs[n++] = next;
+          }
+     }
+
+     pkt_t* pkt = NULL;
+     if ( n > 1 ) {
+          for ( uint32_t i = 0; i < n; i++ ) {
+               indices[i] = reqs[i]->chk_node->chunk->index;
+          }
+          pkt = pkt_prepare_batch_request_pkt(req->fetch->bpkg, indices, n);
+     }
+     else {
+          pkt = pkt_alloc();
+          memcpy(pkt, req->pkt, sizeof(pkt_t));
+     }
+
+     // Chunk requests stay alive until their RES arrives or they time out. They are
+     // registered before sending, as a worker may install the answer straight away.
+     pthread_mutex_lock(&peer->inflight_lock);
+     for ( uint32_t i = 0; i < n; i++ ) {
+          clock_gettime(CLOCK_MONOTONIC, &reqs[i]->sent_at);
+          q_enqueue(peer->inflight, reqs[i]);
+     }
+     pthread_mutex_unlock(&peer->inflight_lock);
+
+     try_send(peer, pkt);
      pkt_destroy(pkt);
 }
 
@@ -408,11 +1140,9 @@ void send_png(peer_t* peer) {
 
 void send_png_all(peers_t* peers)
 {
-     pthread_mutex_lock(&peers->lock);
-     for ( int i = 0; i < peers->npeers_cur; i++ )
+     pthread_rwlock_rdlock(&peers->lock);
+     for ( size_t i = 0; i < peers->npeers_cur; i++ )
      {
-          if ( !peers->list[i] ) continue;
-
           payload_t empty_payload = { 0 };
           if ( peers->list[i]->reqs_q ) {
                pkt_t* pkt = pkt_create(PKT_MSG_PNG, 0, empty_payload);
@@ -420,7 +1150,122 @@ void send_png_all(peers_t* peers)
                reqs_enqueue(peers->list[i]->reqs_q, req);
           }
      }
-     pthread_mutex_unlock(&peers->lock);
+     pthread_rwlock_unlock(&peers->lock);
+}
+
+/**
+ * @brief Queues the availability advertisement of one package.
+ * @param bpkg Pointer to the package.
+ * @param arg Pointer to the queue of packets to send.
+ */
+static void hav_pkgs_prepare(bpkg_t* bpkg, void* arg) {
+     uint32_t npkts = 0;
+     pkt_t** pkts = pkt_prepare_hav_pkts(bpkg, &npkts);
+     for ( uint32_t i = 0; i < npkts; i++ ) {
+          q_enqueue((queue_t*)arg, pkts[i]);
+     }
+     free(pkts);
+}
+
+/**
+ * @brief Sends the full availability advertisement of every managed package to a peer.
+ * @param peer Pointer to the peer.
+ * @param bpkgs Pointer to the package manager.
+ */
+void send_hav_pkgs(peer_t* peer, bpkgs_t* bpkgs) {
+     if ( !peer || !bpkgs ) {
+          return;
+     }
+
+     // Prepare under the package lock, send after releasing it.
+     queue_t* pending = q_init();
+     pkgs_for_each(bpkgs, hav_pkgs_prepare, pending);
+
+     while ( !q_empty(pending) ) {
+          pkt_t* pkt = (pkt_t*)q_dequeue(pending);
+          try_send(peer, pkt);
+          pkt_destroy(pkt);
+     }
+     q_destroy(pending);
+}
+
+/**
+ * @brief Queues availability of a package on every connected peer: the full
+ * advertisement, or a single HAVE for one newly verified chunk.
+ * @param peers Pointer to the list of peers.
+ * @param bpkg Pointer to the package.
+ * @param index Index of the newly verified chunk, or HAV_ALL for the whole package.
+ */
+void send_hav_all(peers_t* peers, bpkg_t* bpkg, uint32_t index) {
+     if ( !peers || !bpkg ) {
+          return;
+     }
+
+     pthread_rwlock_rdlock(&peers->lock);
+     for ( size_t i = 0; i < peers->npeers_cur; i++ ) {
+          if ( !peers->list[i]->reqs_q ) continue;
+
+          if ( index != HAV_ALL ) {
+               reqs_enqueue(peers->list[i]->reqs_q, req_create(pkt_prepare_have_pkt(bpkg, index)));
+               continue;
+          }
+
+          uint32_t npkts = 0;
+          pkt_t** pkts = pkt_prepare_hav_pkts(bpkg, &npkts);
+          for ( uint32_t j = 0; j < npkts; j++ ) {
+               reqs_enqueue(peers->list[i]->reqs_q, req_create(pkts[j]));
+          }
+          free(pkts);
+     }
+     pthread_rwlock_unlock(&peers->lock);
+}
+
+/**
+ * @brief Records an availability advertisement for a package this peer manages.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the HAV packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+void recv_hav(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs) {
+     hav_t* hav = &pkt_in->payload.hav;
+     char ident[sizeof(hav->ident) + 1] = { 0 };
+     memcpy(ident, hav->ident, sizeof(hav->ident));
+
+     // Advertisements for packages we do not manage are of no use to the scheduler.
+     bpkg_t* bpkg = pkgs_get(bpkgs, ident);
+     bool managed = bpkg && bpkg->mtree->nchunks == hav->nchunks;
+     bpkg_release(bpkg);
+     if ( !managed ) {
+          debug_print("Ignoring HAV for unmanaged package from peer at port %d.\n", peer->port);
+          return;
+     }
+     peer_avail_apply(peer, hav);
+}
+
+/**
+ * @brief Answers a PRQ with the inclusion proof of the chunk it names, built from
+ * the expected hashes so a peer still fetching the package can answer too.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt_in Pointer to the PRQ packet.
+ * @param bpkgs Pointer to the package manager.
+ */
+void send_prf(peer_t* peer, pkt_t* pkt_in, bpkgs_t* bpkgs) {
+     prf_t* prq = &pkt_in->payload.prf;
+     char ident[sizeof(prq->ident) + 1] = { 0 };
+     memcpy(ident, prq->ident, sizeof(prq->ident));
+
+     mtree_proof_t proof;
+     uint16_t err = 1;
+     bpkg_t* bpkg = pkgs_get(bpkgs, ident);
+     if ( bpkg && mtree_get_proof(bpkg->mtree, prq->proof.index, &proof) == 0 ) {
+          err = 0;
+     }
+     bpkg_release(bpkg);
+
+     pkt_t pkt = { .msg_code = PKT_MSG_PRF, .error = err,
+          .payload = payload_create_prf(ident, prq->proof.index, err ? NULL : &proof) };
+     try_send(peer, &pkt);
+     debug_print("Sent PRF for chunk %u to peer at port %d.\n", prq->proof.index, peer->port);
 }
 
 void send_pog(peer_t* peer) {
@@ -458,26 +1303,43 @@ int acp_wait_ack(peer_t* peer) {
 
 
 /**
- * @brief Cancels all peer threads.
+ * @brief Cancels all peer threads, waiting for each to send its DSN and exit
+ * before the list they share is freed.
  * @param peers Pointer to the list of peers.
  */
 void cancel_all_peers(peers_t* peers) {
      if ( !peers ) return;
 
-     pthread_mutex_lock(&peers->lock);
+     pthread_t* threads = (pthread_t*)my_malloc(( peers->npeers_max + 1 ) * sizeof(pthread_t));
+     size_t nthreads = 0;
+     pthread_rwlock_wrlock(&peers->lock);
+
+     for ( size_t i = 0; i < peers->npeers_cur; ++i ) {
+          payload_t pl = { 0 };
+          pkt_t* pkt = pkt_create(PKT_MSG_DSN, 0, pl);
+          request_t* req = req_create(pkt);
+          threads[nthreads++] = peers->list[i]->thread;
+          reqs_enqueue(peers->list[i]->reqs_q, req);
+          peers->list[i] = NULL;
+     }
+     peers->npeers_cur = 0;
+     for ( size_t i = 0; i <= peers->table_mask; i++ ) {
+          peers->table[i] = NULL;
+     }
+
+     pthread_rwlock_unlock(&peers->lock);
 
-     for ( size_t i = 0; i < peers->npeers_max; ++i ) {
-          if ( peers->list[i] ) {
-               payload_t pl = { 0 };
-               pkt_t* pkt = pkt_create(PKT_MSG_DSN, 0, pl);
-               request_t* req = req_create(pkt);
-               reqs_enqueue(peers->list[i]->reqs_q, req);
-               peers->list[i] = NULL;
+     // A peer stuck on a full socket never reaches its DSN, so give up on it after a while.
+     for ( size_t i = 0; i < nthreads; i++ ) {
+          struct timespec deadline;
+          clock_gettime(CLOCK_REALTIME, &deadline);
+          deadline.tv_sec += PEER_EXIT_WAIT_S;
+          if ( pthread_timedjoin_np(threads[i], NULL, &deadline) != 0 ) {
+               pthread_cancel(threads[i]);
+               pthread_join(threads[i], NULL);
           }
      }
+     free(threads);
 
-     pthread_mutex_unlock(&peers->lock);
-     pthread_mutex_destroy(&peers->lock);
-     free(peers->list);
-     free(peers);
-}
\ No newline at end of file
+     peer_list_destroy(peers);
+}
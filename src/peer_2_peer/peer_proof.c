@@ -0,0 +1,117 @@
+#include <peer_2_peer/peer_avail.h>
+#include <peer_2_peer/peer_proof.h>
+#include <string.h>
+#include <utilities/my_utils.h>
+
+/**
+ * @brief Records a proof requested from a peer, to be checked when its PRF arrives.
+ * @param peer Pointer to the peer asked.
+ * @param ident Identifier of the package.
+ * @param index Index of the chunk.
+ * @param root Trusted root hash of the package.
+ * @param nchunks Trusted number of chunks in the package.
+ */
+void peer_proof_expect(peer_t* peer, const char* ident, uint32_t index, const char* root, uint32_t nchunks) {
+     if ( !peer || !peer->proofs || !ident || !root ) {
+          return;
+     }
+
+     proof_wait_t* wait = (proof_wait_t*)my_malloc(sizeof(proof_wait_t));
+     memset(wait, 0, sizeof(proof_wait_t));
+     strncpy(wait->ident, ident, IDENT_MAX - 1);
+     wait->index = index;
+     memcpy(wait->root, root, SHA256_HEXLEN);
+     wait->nchunks = nchunks;
+
+     pthread_mutex_lock(&peer->proof_lock);
+     q_enqueue(peer->proofs, wait);
+     pthread_mutex_unlock(&peer->proof_lock);
+}
+
+/**
+ * @brief Takes the oldest awaited proof matching a package and chunk.
+ * @param peer Pointer to the peer.
+ * @param ident Identifier of the package, as carried by the packet.
+ * @param index Index of the chunk.
+ * @return The awaited proof, freed by the caller, or NULL if none matches.
+ */
+static proof_wait_t* proof_take(peer_t* peer, const char* ident, uint32_t index) {
+     proof_wait_t* found = NULL;
+     pthread_mutex_lock(&peer->proof_lock);
+     for ( q_node_t* curr = peer->proofs->head; curr != NULL; curr = curr->next ) {
+          proof_wait_t* wait = (proof_wait_t*)curr->data;
+          if ( wait->index == index && strncmp(wait->ident, ident, AVAIL_IDENT_LEN) == 0 ) {
+               found = wait;
+               break;
+          }
+     }
+     if ( found ) {
+          q_remove(peer->proofs, found);
+     }
+     pthread_mutex_unlock(&peer->proof_lock);
+     return found;
+}
+
+/**
+ * @brief Checks a PRF received from a peer against the root and chunk count recorded for it,
+ * and reports the outcome.
+ * @param peer Pointer to the peer that sent it.
+ * @param pkt Pointer to the PRF packet.
+ * @return 1 if the proof verified, 0 if it failed or the peer had none, -1 if it was not asked for.
+ */
+int peer_proof_check(peer_t* peer, pkt_t* pkt) {
+     if ( !peer || !peer->proofs || !pkt ) {
+          return -1;
+     }
+
+     // The proof sits unaligned in the packed payload, so check a copy of it.
+     prf_t* prf = &pkt->payload.prf;
+     mtree_proof_t proof;
+     memcpy(&proof, &prf->proof, sizeof(proof));
+     char ident[sizeof(prf->ident) + 1] = { 0 };
+     memcpy(ident, prf->ident, sizeof(prf->ident));
+
+     proof_wait_t* wait = proof_take(peer, ident, proof.index);
+     if ( !wait ) {
+          debug_print("Ignoring unrequested PRF from peer at port %d.\n", peer->port);
+          return -1;
+     }
+
+     int status = 0;
+     if ( pkt->error ) {
+          printf("Peer has no proof for chunk %u of %.32s\n", wait->index, wait->ident);
+     }
+     else if ( proof.nchunks != wait->nchunks ) {
+          printf("Proof failed, chunk %u of %.32s comes from a tree of %u chunks, not %u\n", wait->index, wait->ident,
+                 proof.nchunks, wait->nchunks);
+     }
+     else if ( mtree_verify_proof(&proof, wait->root, wait->nchunks) ) {
+          printf("Proof verified, chunk %u of %.32s has hash %.64s\n", wait->index, wait->ident, proof.chunk_hash);
+          status = 1;
+     }
+     else {
+          printf("Proof failed, chunk %u of %.32s does not lead to root %.64s\n", wait->index, wait->ident, wait->root);
+     }
+     fflush(stdout);
+     free(wait);
+     return status;
+}
+
+/**
+ * @brief Frees every proof still awaited from a peer.
+ * @param peer Pointer to the peer.
+ */
+void peer_proof_destroy(peer_t* peer) {
+     if ( !peer || !peer->proofs ) {
+          return;
+     }
+
+     pthread_mutex_lock(&peer->proof_lock);
+     while ( !q_empty(peer->proofs) ) {
+          free(q_dequeue(peer->proofs));
+     }
+     q_destroy(peer->proofs);
+     peer->proofs = NULL;
+     pthread_mutex_unlock(&peer->proof_lock);
+     pthread_mutex_destroy(&peer->proof_lock);
+}
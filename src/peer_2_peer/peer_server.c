@@ -19,6 +19,12 @@ int p2p_setup_server(uint16_t port) {
           exit(EXIT_FAILURE);
      }
 
+     // A restarted peer binds again straight away, so peers that lost it can reconnect.
+     int reuse = 1;
+     if ( setsockopt(server_sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ) {
+          perror("Failed to set socket options\n");
+     }
+
      struct sockaddr_in server_addr = {
          .sin_family = AF_INET,
          .sin_addr.s_addr = INADDR_ANY,
@@ -32,7 +38,7 @@ int p2p_setup_server(uint16_t port) {
      }
      debug_print("Server successfully bound to: port: %d\n", port);
 
-     if ( listen(server_sock_fd, 3) < 0 ) {
+     if ( listen(server_sock_fd, SERVER_BACKLOG) < 0 ) {
           perror("Listen failed");
           close(server_sock_fd);
           exit(EXIT_FAILURE);
@@ -115,10 +121,16 @@ void p2p_server_listening(void* arg) {
           }
           peer->sock_fd = new_sock_fd;
 
+          // A full list, or a second connection from a listed address, is turned away
+          // before any thread is started for it.
+          if ( peers_add(peers, peer) != 0 ) {
+               peer_discard(peer);
+               continue;
+          }
+
           debug_print("Connected to new peer: %s:%d\n", inet_ntoa(peer_addr.sin_addr), ntohs(peer_addr.sin_port));
           printf("Connected to peer\n");
           fflush(stdout);
-          peers_add(peers, peer);
           peer_create_thread(peer, peers, bpkgs);
           pthread_testcancel();
      }
@@ -0,0 +1,193 @@
+#include <chk/pkgchk.h>
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/peer_handler.h>
+#include <peer_2_peer/pkg_loader.h>
+#include <utilities/my_utils.h>
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Keeps directory entries naming a package file.
+ * @param entry Pointer to the directory entry.
+ * @return Non-zero if the entry ends in LOAD_EXT.
+ */
+static int load_filter(const struct dirent* entry) {
+     size_t len = strlen(entry->d_name);
+     size_t ext = strlen(LOAD_EXT);
+     return len > ext && strcmp(entry->d_name + len - ext, LOAD_EXT) == 0;
+}
+
+/**
+ * @brief Prints a progress line each time another step of the scan resolves.
+ * @param loader Pointer to the loader, locked by the caller.
+ */
+static void load_report_progress(pkg_loader_t* loader) {
+     uint32_t resolved = atomic_load(&loader->nloaded) + atomic_load(&loader->nfailed);
+     if ( loader->njobs < LOAD_PROGRESS_MIN || resolved >= loader->njobs ) {
+          return;
+     }
+
+     uint32_t step = (uint32_t)( (uint64_t)resolved * LOAD_PROGRESS_STEPS / loader->njobs );
+     if ( step > loader->last_step ) {
+          loader->last_step = step;
+          printf("Load progress: %u/%u packages\n", resolved, loader->njobs);
+          fflush(stdout);
+     }
+}
+
+/**
+ * @brief Loads and verifies one package file, then starts serving it.
+ * @param work The job's work item.
+ */
+static void load_run(work_t* work) {
+     pkg_load_job_t* job = (pkg_load_job_t*)work;
+     pkg_loader_t* loader = job->loader;
+
+     bpkg_t* bpkg = NULL;
+     if ( !atomic_load(&loader->stopping) ) {
+          bpkg = bpkg_load(job->path);
+     }
+
+     if ( bpkg && pkgs_replace(loader->bpkgs, bpkg) >= 0 ) {
+          send_hav_all(loader->peers, bpkg, HAV_ALL);
+          atomic_fetch_add(&loader->nloaded, 1);
+     }
+     else {
+          if ( !atomic_load(&loader->stopping) ) {
+               fprintf(stderr, "Failed to load package %s\n", job->path);
+          }
+          atomic_fetch_add(&loader->nfailed, 1);
+     }
+     bpkg_release(bpkg);
+
+     pthread_mutex_lock(&loader->lock);
+     load_report_progress(loader);
+     pthread_cond_signal(&loader->cond);
+     pthread_mutex_unlock(&loader->lock);
+}
+
+/**
+ * @brief Queues every load of a scan, waits for them, reports the scan and stops
+ * its pool.
+ * @param arg Pointer to the loader.
+ * @return NULL.
+ */
+static void* load_wait(void* arg) {
+     pkg_loader_t* loader = (pkg_loader_t*)arg;
+
+     // Loads that find every queue full run here, off the thread that started the scan.
+     for ( uint32_t i = 0; i < loader->njobs && !atomic_load(&loader->stopping); i++ ) {
+          work_pool_submit(loader->pool, &loader->jobs[i].work);
+     }
+
+     pthread_mutex_lock(&loader->lock);
+     while ( !atomic_load(&loader->stopping)
+          && atomic_load(&loader->nloaded) + atomic_load(&loader->nfailed) < loader->njobs ) {
+          pthread_cond_wait(&loader->cond, &loader->lock);
+     }
+     pthread_mutex_unlock(&loader->lock);
+
+     // Waits for loads already running; ones still queued after a stop are dropped.
+     work_pool_destroy(loader->pool);
+     loader->pool = NULL;
+
+     struct timespec finished;
+     clock_gettime(CLOCK_MONOTONIC, &finished);
+     double elapsed = ( finished.tv_sec - loader->started.tv_sec ) + ( finished.tv_nsec - loader->started.tv_nsec ) / 1e9;
+     uint32_t nloaded = atomic_load(&loader->nloaded);
+     uint32_t nfailed = atomic_load(&loader->nfailed);
+     if ( nloaded == loader->njobs ) {
+          printf("Load complete: %u/%u packages loaded in %.2fs\n", nloaded, loader->njobs, elapsed);
+     }
+     else if ( nloaded + nfailed < loader->njobs ) {
+          printf("Load stopped: %u/%u packages loaded\n", nloaded, loader->njobs);
+     }
+     else {
+          printf("Load finished: %u/%u packages loaded, %u failed in %.2fs\n", nloaded, loader->njobs, nfailed, elapsed);
+     }
+     fflush(stdout);
+     return NULL;
+}
+
+/**
+ * @brief Starts loading every package file in the package directory.
+ * @param bpkgs Pointer to the package manager, whose directory is scanned.
+ * @param peers Pointer to the list of peers to advertise loaded packages to.
+ * @param nthreads Number of loads run at once, 0 for one per online CPU.
+ * @return Pointer to the loader, or NULL if the directory holds no package files.
+ */
+pkg_loader_t* pkg_loader_start(bpkgs_t* bpkgs, peers_t* peers, uint32_t nthreads) {
+     if ( !bpkgs || !bpkgs->directory ) {
+          return NULL;
+     }
+
+     // Loaded in name order, so a scan's progress does not depend on the file system.
+     struct dirent** entries = NULL;
+     int nentries = scandir(bpkgs->directory, &entries, load_filter, alphasort);
+     if ( nentries < 0 ) {
+          perror("Failed to scan package directory");
+          return NULL;
+     }
+     if ( nentries == 0 ) {
+          free(entries);
+          return NULL;
+     }
+
+     pkg_loader_t* loader = (pkg_loader_t*)my_malloc(sizeof(pkg_loader_t));
+     memset(loader, 0, sizeof(pkg_loader_t));
+     loader->bpkgs = bpkgs;
+     loader->peers = peers;
+     loader->njobs = (uint32_t)nentries;
+     loader->jobs = (pkg_load_job_t*)my_malloc(loader->njobs * sizeof(pkg_load_job_t));
+     atomic_init(&loader->nloaded, 0);
+     atomic_init(&loader->nfailed, 0);
+     atomic_init(&loader->stopping, false);
+     pthread_mutex_init(&loader->lock, NULL);
+     pthread_cond_init(&loader->cond, NULL);
+
+     for ( uint32_t i = 0; i < loader->njobs; i++ ) {
+          size_t len = strlen(bpkgs->directory) + strlen(entries[i]->d_name) + 2;
+          pkg_load_job_t* job = &loader->jobs[i];
+          job->work.run = load_run;
+          job->loader = loader;
+          job->path = (char*)my_malloc(len);
+          snprintf(job->path, len, "%s/%s", bpkgs->directory, entries[i]->d_name);
+          free(entries[i]);
+     }
+     free(entries);
+
+     printf("Loading %u packages from %s\n", loader->njobs, bpkgs->directory);
+     fflush(stdout);
+     clock_gettime(CLOCK_MONOTONIC, &loader->started);
+
+     loader->pool = work_pool_create(nthreads);
+     if ( pthread_create(&loader->thread, NULL, load_wait, loader) != 0 ) {
+          perror("Failed to start package loader thread");
+          exit(EXIT_FAILURE);
+     }
+     return loader;
+}
+
+/**
+ * @brief Stops a scan, waiting for loads already running, and frees the loader.
+ * Packages loaded so far stay managed.
+ * @param loader Pointer to the loader, may be NULL.
+ */
+void pkg_loader_stop(pkg_loader_t* loader) {
+     if ( !loader ) return;
+
+     pthread_mutex_lock(&loader->lock);
+     atomic_store(&loader->stopping, true);
+     pthread_cond_signal(&loader->cond);
+     pthread_mutex_unlock(&loader->lock);
+     pthread_join(loader->thread, NULL);
+
+     for ( uint32_t i = 0; i < loader->njobs; i++ ) {
+          free(loader->jobs[i].path);
+     }
+     free(loader->jobs);
+     pthread_mutex_destroy(&loader->lock);
+     pthread_cond_destroy(&loader->cond);
+     free(loader);
+}
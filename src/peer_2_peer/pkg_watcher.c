@@ -0,0 +1,254 @@
+#include <chk/pkgchk.h>
+#include <peer_2_peer/package.h>
+#include <peer_2_peer/packet.h>
+#include <peer_2_peer/peer_handler.h>
+#include <peer_2_peer/pkg_loader.h>
+#include <peer_2_peer/pkg_watcher.h>
+#include <tree/merkletree.h>
+#include <utilities/my_utils.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Packages found to use a data file, each referenced. */
+typedef struct watch_match {
+     const char* filename;
+     queue_t* bpkgs;
+} watch_match_t;
+
+/**
+ * @brief Loads a package file in place of any package loaded from it before.
+ * A file that no longer loads takes its old package with it.
+ * @param watcher Pointer to the watcher.
+ * @param path Path of the .bpkg file.
+ */
+static void watch_load(pkg_watcher_t* watcher, const char* path) {
+     bpkg_t* bpkg = bpkg_load(path);
+     if ( !bpkg ) {
+          fprintf(stderr, "Failed to load package %s\n", path);
+          if ( pkgs_rem_path(watcher->bpkgs, path) > 0 ) {
+               printf("Package unloaded: %s\n", path);
+               fflush(stdout);
+          }
+          return;
+     }
+
+     int replaced = pkgs_replace(watcher->bpkgs, bpkg);
+     send_hav_all(watcher->peers, bpkg, HAV_ALL);
+     bpkg_release(bpkg);
+     printf("Package %s: %s\n", replaced > 0 ? "reloaded" : "loaded", path);
+     fflush(stdout);
+}
+
+/**
+ * @brief Unloads every package loaded from a package file.
+ * @param watcher Pointer to the watcher.
+ * @param path Path of the .bpkg file.
+ */
+static void watch_unload(pkg_watcher_t* watcher, const char* path) {
+     if ( pkgs_rem_path(watcher->bpkgs, path) > 0 ) {
+          printf("Package unloaded: %s\n", path);
+          fflush(stdout);
+     }
+}
+
+/**
+ * @brief Collects a package that uses the data file being looked for.
+ * @param bpkg Pointer to the package.
+ * @param arg Pointer to the match.
+ */
+static void watch_match_data(bpkg_t* bpkg, void* arg) {
+     watch_match_t* match = (watch_match_t*)arg;
+     if ( strcmp(bpkg->filename, match->filename) == 0 ) {
+          q_enqueue(match->bpkgs, bpkg_retain(bpkg));
+     }
+}
+
+/**
+ * @brief Hashes again the chunks of a package whose data changed on disk and
+ * advertises the result. Packages whose data file shrank are unloaded.
+ * @param watcher Pointer to the watcher.
+ * @param bpkg Pointer to the package.
+ */
+static void watch_reverify(pkg_watcher_t* watcher, bpkg_t* bpkg) {
+     mtree_t* mtree = bpkg->mtree;
+     uint32_t* changed = (uint32_t*)my_malloc(( mtree->nchunks + 1 ) * sizeof(uint32_t));
+     int nchanged = mtree_reverify_changed(mtree, changed);
+     if ( nchanged < 0 ) {
+          // Serving it would read past the end of the file, so it goes until its
+          // package file is written again.
+          free(changed);
+          fprintf(stderr, "Data file %s is shorter than its package\n", bpkg->filename);
+          watch_unload(watcher, bpkg->path);
+          return;
+     }
+
+     // Chunks that stopped verifying can only be withdrawn by a full advertisement,
+     // which is also cheaper than a HAVE apiece once many have changed.
+     bool full = nchanged > HAV_RUN_MIN;
+     for ( int i = 0; i < nchanged && !full; i++ ) {
+          full = !check_chunk(mtree->chk_nodes[changed[i]]);
+     }
+     if ( full ) {
+          send_hav_all(watcher->peers, bpkg, HAV_ALL);
+     }
+     else {
+          for ( int i = 0; i < nchanged; i++ ) {
+               send_hav_all(watcher->peers, bpkg, changed[i]);
+          }
+     }
+     free(changed);
+
+     if ( nchanged > 0 ) {
+          printf("Package re-verified: %s, %d chunks changed\n", bpkg->path, nchanged);
+          fflush(stdout);
+     }
+}
+
+/**
+ * @brief Applies a change to a data file to every package using it.
+ * @param watcher Pointer to the watcher.
+ * @param path Path of the data file.
+ * @param replaced The file was replaced by a rename rather than written in place.
+ */
+static void watch_data(pkg_watcher_t* watcher, const char* path, bool replaced) {
+     watch_match_t match = { .filename = path, .bpkgs = q_init() };
+     pkgs_for_each(watcher->bpkgs, watch_match_data, &match);
+
+     while ( !q_empty(match.bpkgs) ) {
+          bpkg_t* bpkg = (bpkg_t*)q_dequeue(match.bpkgs);
+          // The old mapping still shows the file that was renamed over, so only a
+          // fresh load sees the new one.
+          if ( replaced && bpkg->path[0] != '\0' ) {
+               watch_load(watcher, bpkg->path);
+          }
+          else if ( !replaced ) {
+               watch_reverify(watcher, bpkg);
+          }
+          bpkg_release(bpkg);
+     }
+     q_destroy(match.bpkgs);
+}
+
+/**
+ * @brief Applies one inotify event.
+ * @param watcher Pointer to the watcher.
+ * @param event Pointer to the event.
+ * @return false once the directory itself is gone, true otherwise.
+ */
+static bool watch_event(pkg_watcher_t* watcher, const struct inotify_event* event) {
+     if ( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) ) {
+          fprintf(stderr, "Package directory %s went away, no longer watching it\n", watcher->bpkgs->directory);
+          return false;
+     }
+     if ( event->len == 0 || ( event->mask & IN_ISDIR ) ) {
+          return true;
+     }
+
+     char path[FILE_MAX];
+     if ( snprintf(path, sizeof(path), "%s/%s", watcher->bpkgs->directory, event->name) >= (int)sizeof(path) ) {
+          return true;
+     }
+
+     size_t len = strlen(event->name);
+     size_t ext = strlen(LOAD_EXT);
+     if ( len > ext && strcmp(event->name + len - ext, LOAD_EXT) == 0 ) {
+          if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) ) {
+               watch_unload(watcher, path);
+          }
+          else {
+               watch_load(watcher, path);
+          }
+     }
+     else if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) ) {
+          watch_data(watcher, path, event->mask & IN_MOVED_TO);
+     }
+     return true;
+}
+
+/**
+ * @brief Waits for changes to the package directory and applies them in turn.
+ * @param arg Pointer to the watcher.
+ * @return NULL.
+ */
+static void* watch_run(void* arg) {
+     pkg_watcher_t* watcher = (pkg_watcher_t*)arg;
+     char buf[WATCH_BUF_SIZE] __attribute__(( aligned(__alignof__(struct inotify_event)) ));
+     struct pollfd fds[2] = {
+          { .fd = watcher->fd, .events = POLLIN },
+          { .fd = watcher->stop_fd, .events = POLLIN },
+     };
+
+     bool watching = true;
+     while ( watching ) {
+          if ( poll(fds, 2, -1) < 0 ) {
+               if ( errno == EINTR ) continue;
+               perror("Failed to wait on package directory");
+               break;
+          }
+          if ( fds[1].revents & POLLIN ) {
+               break;
+          }
+
+          ssize_t n = read(watcher->fd, buf, sizeof(buf));
+          if ( n <= 0 ) {
+               continue;
+          }
+          for ( char* p = buf; p < buf + n && watching; ) {
+               const struct inotify_event* event = (const struct inotify_event*)p;
+               watching = watch_event(watcher, event);
+               p += sizeof(struct inotify_event) + event->len;
+          }
+     }
+     return NULL;
+}
+
+/**
+ * @brief Starts watching the package directory.
+ * @param bpkgs Pointer to the package manager, whose directory is watched.
+ * @param peers Pointer to the list of peers to advertise changes to.
+ * @return Pointer to the watcher, or NULL if the directory cannot be watched.
+ */
+pkg_watcher_t* pkg_watcher_start(bpkgs_t* bpkgs, peers_t* peers) {
+     if ( !bpkgs || !bpkgs->directory ) {
+          return NULL;
+     }
+
+     int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+     if ( fd < 0 || inotify_add_watch(fd, bpkgs->directory, WATCH_MASK) < 0 ) {
+          perror("Failed to watch package directory");
+          if ( fd >= 0 ) close(fd);
+          return NULL;
+     }
+
+     pkg_watcher_t* watcher = (pkg_watcher_t*)my_malloc(sizeof(pkg_watcher_t));
+     watcher->bpkgs = bpkgs;
+     watcher->peers = peers;
+     watcher->fd = fd;
+     watcher->stop_fd = eventfd(0, EFD_CLOEXEC);
+     if ( watcher->stop_fd < 0 || pthread_create(&watcher->thread, NULL, watch_run, watcher) != 0 ) {
+          perror("Failed to start package watcher thread");
+          exit(EXIT_FAILURE);
+     }
+     return watcher;
+}
+
+/**
+ * @brief Stops watching, waiting for a change being applied, and frees the watcher.
+ * @param watcher Pointer to the watcher, may be NULL.
+ */
+void pkg_watcher_stop(pkg_watcher_t* watcher) {
+     if ( !watcher ) return;
+
+     uint64_t one = 1;
+     if ( write(watcher->stop_fd, &one, sizeof(one)) < 0 ) {
+          perror("Failed to stop package watcher");
+     }
+     pthread_join(watcher->thread, NULL);
+     close(watcher->stop_fd);
+     close(watcher->fd);
+     free(watcher);
+}
@@ -0,0 +1,335 @@
+#include <utilities/my_utils.h>
+#include <peer_2_peer/peer_data_sync.h>
+#include <peer_2_peer/peer_proof.h>
+#include <peer_2_peer/packet.h>
+#include <sys/socket.h>
+
+#define PEERCHK_IP "10.0.0.1"
+#define PEERCHK_MAX_PEERS (4)   // Gives a table of 8 slots
+
+/**
+ * @brief Hashes an ip:port pair the way the peers table does, FNV-1a over the
+ * address text and the port.
+ * @param ip IP address.
+ * @param port Port number.
+ * @return Hash of the pair.
+ */
+static size_t key_hash(const char* ip, uint16_t port) {
+    uint64_t hash = 14695981039346656037ULL;
+    for ( const char* c = ip; *c; c++ ) {
+        hash = ( hash ^ (uint8_t)*c ) * 1099511628211ULL;
+    }
+    hash = ( hash ^ ( port & 0xff ) ) * 1099511628211ULL;
+    hash = ( hash ^ ( port >> 8 ) ) * 1099511628211ULL;
+    return (size_t)hash;
+}
+
+/**
+ * @brief Finds ports, after a given one, whose key lands in a given table slot.
+ * @param home Slot wanted.
+ * @param mask Table capacity - 1.
+ * @param after Port to search from.
+ * @return First port past after with that home slot.
+ */
+static uint16_t port_with_home(size_t home, size_t mask, uint16_t after) {
+    for ( uint32_t port = after + 1; port <= UINT16_MAX; port++ ) {
+        if ( ( key_hash(PEERCHK_IP, port) & mask ) == home ) {
+            return (uint16_t)port;
+        }
+    }
+    fprintf(stderr, "No port lands in slot %zu\n", home);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Prints the port held by every table slot, - for an empty one.
+ * @param peers Pointer to the peers list.
+ * @param ports Ports of the test peers, printed by their letter.
+ * @param nports Number of test peers.
+ */
+static void print_table(peers_t* peers, uint16_t* ports, int nports) {
+    printf("table:");
+    for ( size_t i = 0; i <= peers->table_mask; i++ ) {
+        char name = '-';
+        for ( int p = 0; p < nports && peers->table[i]; p++ ) {
+            if ( peers->table[i]->port == ports[p] ) {
+                name = 'A' + p;
+            }
+        }
+        printf(" %c", name);
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Prints which test peers can be found and checks the listed peers are packed.
+ * @param peers Pointer to the peers list.
+ * @param ports Ports of the test peers, printed by their letter.
+ * @param nports Number of test peers.
+ */
+static void print_found(peers_t* peers, uint16_t* ports, int nports) {
+    printf("found:");
+    for ( int p = 0; p < nports; p++ ) {
+        if ( peers_find(peers, PEERCHK_IP, ports[p]) ) {
+            printf(" %c", 'A' + p);
+        }
+    }
+    for ( size_t i = 0; i < peers->npeers_cur; i++ ) {
+        if ( peers->list[i]->slot != i ) {
+            printf(" (slot %zu out of place)", i);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Fills a peers table with a probe run that wraps past its last slot, then
+ * removes peers from it, printing the table and the peers found after each step.
+ * Backward-shift deletion must keep every remaining peer reachable from its home slot.
+ * @return 0.
+ */
+static int check_peers() {
+    peers_t* peers = peer_list_create(PEERCHK_MAX_PEERS);
+    size_t mask = peers->table_mask;
+
+    // A, B and C share the last slot, so B and C wrap to the front of the table,
+    // where D's home slot is.
+    uint16_t ports[PEERCHK_MAX_PEERS + 1];
+    ports[0] = port_with_home(mask, mask, 1024);
+    ports[1] = port_with_home(mask, mask, ports[0]);
+    ports[2] = port_with_home(mask, mask, ports[1]);
+    ports[3] = port_with_home(0, mask, 1024);
+    ports[4] = port_with_home(3, mask, 1024);
+
+    peer_t* created[PEERCHK_MAX_PEERS + 2];
+    created[PEERCHK_MAX_PEERS] = peer_create(PEERCHK_IP, ports[0]);
+    created[PEERCHK_MAX_PEERS + 1] = peer_create(PEERCHK_IP, ports[4]);
+    for ( int p = 0; p < PEERCHK_MAX_PEERS; p++ ) {
+        created[p] = peer_create(PEERCHK_IP, ports[p]);
+        printf("add %c: %d\n", 'A' + p, peers_add(peers, created[p]));
+        if ( p == 0 ) {
+            printf("add A again: %d\n", peers_add(peers, created[PEERCHK_MAX_PEERS]));
+        }
+    }
+    print_table(peers, ports, PEERCHK_MAX_PEERS + 1);
+    printf("add E to a full list: %d\n", peers_add(peers, created[PEERCHK_MAX_PEERS + 1]));
+
+    const int order[] = { 0, 2, 3, 1 };
+    for ( int r = 0; r < PEERCHK_MAX_PEERS; r++ ) {
+        peers_remove(peers, PEERCHK_IP, ports[order[r]]);
+        printf("remove %c\n", 'A' + order[r]);
+        print_table(peers, ports, PEERCHK_MAX_PEERS + 1);
+        print_found(peers, ports, PEERCHK_MAX_PEERS + 1);
+    }
+
+    for ( int p = 0; p < PEERCHK_MAX_PEERS + 2; p++ ) {
+        peer_discard(created[p]);
+    }
+    peer_list_destroy(peers);
+    return 0;
+}
+
+/**
+ * @brief Hands a proof to a peer as though it had arrived in a PRF answering a PRQ
+ * for the given chunk, and prints the outcome.
+ * @param peer Pointer to the peer.
+ * @param bpkg Pointer to the package the proof is for.
+ * @param index Chunk index the PRQ asked for.
+ * @param proof Pointer to the proof sent back.
+ */
+static void answer_proof(peer_t* peer, bpkg_t* bpkg, uint32_t index, mtree_proof_t* proof) {
+    peer_proof_expect(peer, bpkg->ident, index, bpkg->mtree->root->expected_hash, bpkg->mtree->nchunks);
+    pkt_t* pkt = pkt_create(PKT_MSG_PRF, 0, payload_create_prf(bpkg->ident, index, proof));
+    peer_proof_check(peer, pkt);
+    pkt_destroy(pkt);
+}
+
+/**
+ * @brief Checks a genuine proof is accepted and shortened ones are not. A proof
+ * cut one level short, starting from the parent of a pair of chunks, still leads
+ * to the package's root, so only the trusted chunk count can reject it.
+ * @param path Path to a package of more than one chunk.
+ * @return 0 if the package loaded, 1 otherwise.
+ */
+static int check_proof(const char* path) {
+    bpkg_t* bpkg = bpkg_load(path);
+    if ( !bpkg || !bpkg->mtree || bpkg->mtree->nchunks < 2 ) {
+        fprintf(stderr, "Unable to load %s\n", path);
+        return 1;
+    }
+
+    peer_t* peer = peer_create(PEERCHK_IP, 1024);
+    uint32_t index = 5;
+    mtree_proof_t proof;
+    mtree_get_proof(bpkg->mtree, index, &proof);
+    printf("genuine: ");
+    answer_proof(peer, bpkg, index, &proof);
+
+    mtree_proof_t forged;
+    memset(&forged, 0, sizeof(forged));
+    forged.index = index >> 1;
+    forged.nchunks = proof.nchunks >> 1;
+    forged.nsiblings = proof.nsiblings - 1;
+    memcpy(forged.chunk_hash, bpkg->mtree->chk_nodes[index]->parent->expected_hash, SHA256_HEXLEN);
+    memcpy(forged.siblings, proof.siblings[1], (size_t)forged.nsiblings * SHA256_HEXLEN);
+    char root[SHA256_HEXLEN];
+    bool leads = mtree_proof_root(&forged, root) == 0
+        && strncmp(root, bpkg->mtree->root->expected_hash, SHA256_HEXLEN) == 0;
+    printf("shortened proof leads to the root: %s\n", leads ? "yes" : "no");
+    printf("shortened: ");
+    answer_proof(peer, bpkg, forged.index, &forged);
+
+    forged.nchunks = proof.nchunks;
+    printf("shortened, claiming %u chunks: ", forged.nchunks);
+    answer_proof(peer, bpkg, forged.index, &forged);
+
+    peer_discard(peer);
+    bpkg_obj_destroy(bpkg);
+    return 0;
+}
+
+/**
+ * @brief Reads one whole packet from a socket.
+ * @param fd Socket.
+ * @param pkt Output for the packet.
+ * @return 0 if a packet was read, -1 on a timeout or a closed connection.
+ */
+static int recv_pkt(int fd, pkt_t* pkt) {
+    uint8_t buf[PAYLOAD_MAX];
+    size_t got = 0;
+    while ( got < PAYLOAD_MAX ) {
+        ssize_t n = recv(fd, buf + got, PAYLOAD_MAX - got, 0);
+        if ( n <= 0 ) {
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    pkt_unmarshall(pkt, buf);
+    return 0;
+}
+
+/**
+ * @brief Marshals and sends one packet on a socket.
+ * @param fd Socket.
+ * @param msg Message code.
+ * @param payload Payload of the packet.
+ * @return 0 if it was sent, -1 otherwise.
+ */
+static int send_pkt(int fd, uint16_t msg, payload_t payload) {
+    pkt_t pkt = { .msg_code = msg, .error = 0, .payload = payload };
+    uint8_t buf[PAYLOAD_MAX];
+    pkt_marshall(&pkt, buf);
+    return send(fd, buf, PAYLOAD_MAX, MSG_NOSIGNAL) == PAYLOAD_MAX ? 0 : -1;
+}
+
+/**
+ * @brief Connects to a btide peer as a bare client and sends it one BRQ, printing
+ * every RES answering it. Data RES are gathered per chunk and the chunk is
+ * reported once its bytes hash to the hash the packets carry.
+ * @param addr Address of the peer, ip:port.
+ * @param path Path to the package to request from.
+ * @param specs Ranges to request, each first:count.
+ * @param nspecs Number of ranges.
+ * @return 0 if the peer answered the handshake, 1 otherwise.
+ */
+static int check_brq(const char* addr, const char* path, char** specs, int nspecs) {
+    char ip[INET_ADDRSTRLEN] = { 0 };
+    uint32_t port = 0;
+    bpkg_t* bpkg = bpkg_load_meta(path);
+    if ( sscanf(addr, "%15[^:]:%u", ip, &port) != 2 || !bpkg || nspecs > (int)BRQ_RANGES_MAX ) {
+        fprintf(stderr, "Unable to load %s or parse %s\n", path, addr);
+        bpkg_obj_destroy(bpkg);
+        return 1;
+    }
+
+    brq_range_t ranges[BRQ_RANGES_MAX];
+    for ( int r = 0; r < nspecs; r++ ) {
+        if ( sscanf(specs[r], "%u:%u", &ranges[r].first, &ranges[r].count) != 2 ) {
+            fprintf(stderr, "Range %s is not first:count\n", specs[r]);
+            bpkg_obj_destroy(bpkg);
+            return 1;
+        }
+    }
+
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    payload_t empty;
+    memset(&empty, 0, sizeof(empty));
+    pkt_t pkt;
+    bool acked = inet_pton(AF_INET, ip, &sa.sin_addr) == 1 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0
+        && send_pkt(fd, PKT_MSG_ACP, empty) == 0;
+    // Both ends of a connection open with an ACP, answered by an ACK if it is not
+    // taken as the answer to the other's.
+    acked = acked && recv_pkt(fd, &pkt) == 0 && ( pkt.msg_code == PKT_MSG_ACP || pkt.msg_code == PKT_MSG_ACK );
+    if ( !acked ) {
+        fprintf(stderr, "No handshake with %s\n", addr);
+        close(fd);
+        bpkg_obj_destroy(bpkg);
+        return 1;
+    }
+
+    send_pkt(fd, PKT_MSG_BRQ, payload_create_brq(bpkg->mtree->nchunks, bpkg->ident, ranges, (uint32_t)nspecs));
+
+    // Chunk being gathered: its hash, first offset and the bytes so far.
+    char hash[SHA256_HEXLEN + 1] = { 0 };
+    uint32_t first = 0;
+    uint8_t* data = NULL;
+    size_t len = 0;
+    while ( recv_pkt(fd, &pkt) == 0 ) {
+        if ( pkt.msg_code != PKT_MSG_RES ) {
+            continue;
+        }
+        res_t* res = &pkt.payload.res;
+        if ( pkt.error ) {
+            printf("RES error for the chunk at offset %u\n", res->offset);
+            continue;
+        }
+        if ( len == 0 || strncmp(hash, res->hash, SHA256_HEXLEN) != 0 ) {
+            memcpy(hash, res->hash, SHA256_HEXLEN);
+            first = res->offset;
+            len = 0;
+        }
+        data = realloc(data, len + res->size);
+        memcpy(data + len, res->data, res->size);
+        len += res->size;
+
+        struct sha256_compute_data cdata;
+        sha256_compute_data_init(&cdata);
+        sha256_update(&cdata, data, (uint32_t)len);
+        uint8_t hashout[SHA256_INT_SZ];
+        char hex[SHA256_HEXLEN + 1] = { 0 };
+        sha256_finalize(&cdata, hashout);
+        sha256_output_hex(&cdata, hex);
+        if ( strncmp(hex, hash, SHA256_HEXLEN) == 0 ) {
+            printf("RES verified the chunk at offset %u, %zu bytes\n", first, len);
+            len = 0;
+        }
+    }
+    if ( len > 0 ) {
+        printf("RES left the chunk at offset %u unverified after %zu bytes\n", first, len);
+    }
+    printf("No more packets\n");
+
+    send_pkt(fd, PKT_MSG_DSN, empty);
+    close(fd);
+    free(data);
+    bpkg_obj_destroy(bpkg);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if ( argc >= 2 && strcmp(argv[1], "peers") == 0 ) {
+        return check_peers();
+    }
+    if ( argc >= 3 && strcmp(argv[1], "proof") == 0 ) {
+        return check_proof(argv[2]);
+    }
+    if ( argc >= 4 && strcmp(argv[1], "brq") == 0 ) {
+        return check_brq(argv[2], argv[3], argv + 4, argc - 4);
+    }
+
+    fprintf(stderr, "Usage: %s peers | proof <bpkg> | brq <ip:port> <bpkg> [first:count ...]\n", argv[0]);
+    return EXIT_FAILURE;
+}
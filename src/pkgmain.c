@@ -1,9 +1,12 @@
 #include <chk/pkgchk.h>
+#include <chk/pkg_batch.h>
+#include <chk/pkg_stream.h>
 #include <crypt/sha256.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define SHA256_HEX_LEN (64)
 
@@ -35,9 +38,128 @@ int arg_select(int argc, char** argv, int* asel, char* harg) {
      if ( strcmp(cursor, "-file_check") == 0 ) {
           *asel = 5;
      }
+     if ( strcmp(cursor, "-stream_check") == 0 ) {
+          *asel = 6;
+     }
+     if ( strcmp(cursor, "-diff") == 0 ) {
+          if ( argc < 4 ) {
+               puts("old bpkg not provided");
+               exit(1);
+          }
+          *asel = 7;
+     }
      return *asel;
 }
 
+/**
+ * @brief Runs one query over many packages on a thread pool.
+ * Usage: pkgchecker -batch <-file_check|-chunk_check|-min_hashes> [-j threads] <bpkg or dir>...
+ *
+ * @param argc Argument count.
+ * @param argv Arguments, argv[1] being -batch.
+ * @return 0 if every package loaded, 1 otherwise.
+ */
+int batch_main(int argc, char** argv) {
+     enum BatchMode mode;
+     if ( argc < 4 ) {
+          puts("Usage: pkgchecker -batch <-file_check|-chunk_check|-min_hashes> [-j threads] <bpkg or dir>...");
+          return 1;
+     }
+     if ( strcmp(argv[2], "-file_check") == 0 ) {
+          mode = BATCH_FILE_CHECK;
+     }
+     else if ( strcmp(argv[2], "-chunk_check") == 0 ) {
+          mode = BATCH_CHUNK_CHECK;
+     }
+     else if ( strcmp(argv[2], "-min_hashes") == 0 ) {
+          mode = BATCH_MIN_HASHES;
+     }
+     else {
+          puts("Argument is invalid");
+          return 1;
+     }
+
+     int first = 3;
+     uint32_t nworkers = 0;
+     if ( strcmp(argv[3], "-j") == 0 ) {
+          if ( argc < 6 ) {
+               puts("bpkg or threads not provided");
+               return 1;
+          }
+          nworkers = (uint32_t)strtoul(argv[4], NULL, 10);
+          first = 5;
+     }
+
+     uint32_t count;
+     char** paths = bpkg_batch_collect(argv + first, argc - first, &count);
+     if ( count == 0 ) {
+          puts("No packages found");
+          free(paths);
+          return 1;
+     }
+
+     batch_stats_t stats;
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     int status = bpkg_batch_run(paths, count, mode, nworkers, stdout, &stats);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     bpkg_batch_paths_destroy(paths, count);
+
+     double secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+     fprintf(stderr, "Checked %u packages, %u failed to load, %lu/%lu chunks complete, %.1f MB in %.2fs (%.1f MB/s)\n",
+          stats.npkgs, stats.nfailed, stats.ncomplete, stats.nchunks, stats.bytes / 1e6, secs,
+          secs > 0 ? stats.bytes / 1e6 / secs : 0);
+     return status;
+}
+
+/**
+ * @brief Prints the chunks of a new package that differ from an old one, as
+ * "first,count,offset,size" lines in the new package's terms.
+ * Usage: pkgchecker <new.bpkg> -diff <old.bpkg>
+ *
+ * @param new_path Path to the new package.
+ * @param old_path Path to the old package.
+ * @return 0 on success, 1 if either package cannot be compared.
+ */
+int diff_main(const char* new_path, const char* old_path) {
+     // Only the hashes are compared, so neither data file is read or created.
+     bpkg_t* new_pkg = bpkg_load_meta(new_path);
+     bpkg_t* old_pkg = bpkg_load_meta(old_path);
+     if ( !new_pkg || !old_pkg ) {
+          puts("Unable to load pkg");
+          bpkg_obj_destroy(new_pkg);
+          bpkg_obj_destroy(old_pkg);
+          return 1;
+     }
+
+     mtree_range_t* ranges = NULL;
+     uint32_t nranges = 0;
+     mtree_t* mtree = new_pkg->mtree;
+     int64_t nchanged = mtree_diff(old_pkg->mtree, mtree, &ranges, &nranges);
+     if ( nchanged < 0 ) {
+          puts("Unable to compare trees, a package is malformed");
+          bpkg_obj_destroy(new_pkg);
+          bpkg_obj_destroy(old_pkg);
+          return 1;
+     }
+
+     uint64_t bytes = 0;
+     for ( uint32_t i = 0; i < nranges; i++ ) {
+          chunk_t* first = mtree->chk_nodes[ranges[i].first]->chunk;
+          chunk_t* last = mtree->chk_nodes[ranges[i].first + ranges[i].count - 1]->chunk;
+          uint64_t size = (uint64_t)last->offset + last->size - first->offset;
+          printf("%u,%u,%u,%lu\n", ranges[i].first, ranges[i].count, first->offset, size);
+          bytes += size;
+     }
+     fprintf(stderr, "Changed %ld/%u chunks in %u ranges, %.1f MB of %.1f MB\n", nchanged, mtree->nchunks,
+          nranges, bytes / 1e6, mtree->f_size / 1e6);
+
+     free(ranges);
+     bpkg_obj_destroy(new_pkg);
+     bpkg_obj_destroy(old_pkg);
+     return 0;
+}
+
 void bpkg_print_hashes(struct bpkg_query* qry) {
      for ( int i = 0; i < qry->len; i++ ) {
           printf("%.64s\n", qry->hashes[i]);
@@ -48,7 +170,31 @@ int main(int argc, char** argv) {
      int argselect = 0;
      char hash[SHA256_HEX_LEN];
 
-     if ( arg_select(argc, argv, &argselect, hash) ) {
+     if ( argc > 1 && strcmp(argv[1], "-batch") == 0 ) {
+          return batch_main(argc, argv);
+     }
+     if ( arg_select(argc, argv, &argselect, hash) == 6 ) {
+          // Streams the data file instead of loading the tree, so memory stays flat.
+          uint32_t nhashers = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 0;
+          stream_stats_t stats;
+          struct timespec start, end;
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          int status = bpkg_stream_verify(argv[1], nhashers, stdout, stderr, &stats);
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          if ( status < 0 ) {
+               puts("Unable to stream pkg");
+               return 1;
+          }
+
+          double secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+          fprintf(stderr, "Verified %u/%u chunks, %u failed, in %.2fs (%.1f MB/s)\n", stats.verified,
+               stats.nchunks, stats.failed, secs, secs > 0 ? stats.bytes / 1e6 / secs : 0);
+          return status;
+     }
+     else if ( argselect == 7 ) {
+          return diff_main(argv[1], argv[3]);
+     }
+     else if ( argselect ) {
           struct bpkg_query* qry;
           struct bpkg_obj* obj = bpkg_load(argv[1]);
 
@@ -1,3 +1,4 @@
+#include <utilities/my_utils.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
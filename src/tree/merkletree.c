@@ -8,7 +8,14 @@
 mtree_t* mtree_build(mtree_t* mtree, char* filename)
 {
 
-    int fd = open(filename, O_RDONLY);
+    // Map the data file writable so fetched chunks can be installed in place,
+    // falling back to a read-only mapping for packages we can only seed.
+    int prot = PROT_READ | PROT_WRITE;
+    int fd = open(filename, O_RDWR);
+    if ( fd < 0 ) {
+        prot = PROT_READ;
+        fd = open(filename, O_RDONLY);
+    }
     if ( fd < 0 ) {
         fprintf(stderr, "Cannot open file: %s\n", filename);
         return NULL;
@@ -20,12 +27,13 @@ mtree_t* mtree_build(mtree_t* mtree, char* filename)
         close(fd);
         return NULL;
     }
-    mtree->f_data = (uint8_t*)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    mtree->f_data = (uint8_t*)mmap(NULL, statbuf.st_size, prot, MAP_SHARED, fd, 0);
     if ( mtree->f_data == MAP_FAILED ) {
         perror("Cannot open file\n");
         close(fd);
         return NULL;
     }
+    mtree->f_fd = fd;
 
     if ( init_chunks_data(mtree) < 0 )
     {
@@ -97,6 +105,11 @@ mtree_node_t* mtree_from_lvlorder(mtree_t* mtree, uint32_t i, uint16_t depth)
         else
         {
             node_cur->height = 0;
+            node_cur->depth = depth;
+            if ( node_cur->chunk ) {
+                node_cur->key[0] = node_cur->chunk->offset;
+                node_cur->key[1] = node_cur->chunk->offset;
+            }
             sha256_compute_chunk_hash(node_cur);
             return node_cur;
         }
@@ -138,6 +151,8 @@ chunk_t* chunk_create(uint8_t* data, uint32_t size, uint32_t offset) {
     }
     chk->size = size;
     chk->offset = offset;
+    chk->index = 0;
+    chk->fp = 0;
 
     return chk;
 }
@@ -153,6 +168,9 @@ mtree_node_t* mtree_node_create(char* expected_hash, bool is_leaf, uint16_t dept
     node_new->is_complete = false;
     node_new->left = NULL;
     node_new->right = NULL;
+    node_new->parent = NULL;
+    node_new->key[0] = 0;
+    node_new->key[1] = 0;
     node_new->depth = 0;
     node_new->height = 0;
     node_new->chunk = chunk;
@@ -205,6 +223,11 @@ void mtree_destroy(mtree_t* mtree) {
             munmap(mtree->f_data, mtree->f_size);
             mtree->f_data = NULL;
         }
+
+        if ( mtree->f_fd >= 0 ) {
+            close(mtree->f_fd);
+            mtree->f_fd = -1;
+        }
         free(mtree);
 
         mtree = NULL;  // Nullify pointer after freeing
@@ -252,6 +275,7 @@ int init_chunks_data(mtree_t* mtree)
         }
         chk_c->data = ( mtree->f_data + chk_c->offset );
         sha256_compute_chunk_hash(node_c);
+        chk_c->fp = chunk_fingerprint(chk_c);
     }
 
     return 0;
@@ -290,4 +314,220 @@ void update_parent_hashes(mtree_node_t* node) {
         // Recursively update the parent's hash
         update_parent_hashes(parent);
     }
-}
\ No newline at end of file
+}
+
+uint64_t chunk_fingerprint(const chunk_t* chunk) {
+    const uint8_t* data = chunk->data;
+    uint32_t left = chunk->size;
+    uint64_t fp = 0x9e3779b97f4a7c15ULL ^ chunk->size;
+
+    // A multiply and fold per word; only meant to notice edits, not resist them.
+    while ( left >= sizeof(uint64_t) ) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        fp = ( fp ^ word ) * 0xff51afd7ed558ccdULL;
+        fp ^= fp >> 32;
+        data += sizeof(word);
+        left -= sizeof(word);
+    }
+    while ( left-- > 0 ) {
+        fp = ( fp ^ *data++ ) * 0x100000001b3ULL;
+    }
+    return fp;
+}
+
+int mtree_reverify_changed(mtree_t* mtree, uint32_t* changed) {
+    // Reading past the end of a shrunk file through the mapping would fault.
+    struct stat statbuf;
+    if ( mtree->f_fd < 0 || fstat(mtree->f_fd, &statbuf) != 0 || (uint64_t)statbuf.st_size < mtree->f_size ) {
+        return -1;
+    }
+
+    int nchanged = 0;
+    for ( uint32_t i = 0; i < mtree->nchunks; i++ ) {
+        mtree_node_t* node = mtree->chk_nodes[i];
+        chunk_t* chk = node->chunk;
+
+        pthread_mutex_lock(&node->lock);
+        uint64_t fp = chunk_fingerprint(chk);
+        bool rehash = fp != chk->fp;
+        if ( rehash ) {
+            sha256_compute_chunk_hash(node);
+            chk->fp = fp;
+        }
+        pthread_mutex_unlock(&node->lock);
+
+        if ( rehash ) {
+            update_parent_hashes(node);
+            if ( changed ) {
+                changed[nchanged] = i;
+            }
+            nchanged++;
+        }
+    }
+    return nchanged;
+}
+
+int mtree_get_proof(mtree_t* mtree, uint32_t index, mtree_proof_t* proof) {
+    // Only a perfect tree has the shape the chunk index describes.
+    if ( !mtree || !proof || index >= mtree->nchunks || ( mtree->nchunks & ( mtree->nchunks - 1 ) ) != 0
+        || mtree->nhashes != mtree->nchunks - 1 ) {
+        return -1;
+    }
+
+    memset(proof, 0, sizeof(mtree_proof_t));
+    proof->index = index;
+    proof->nchunks = mtree->nchunks;
+
+    mtree_node_t* node = mtree->chk_nodes[index];
+    memcpy(proof->chunk_hash, node->expected_hash, SHA256_HEXLEN);
+    for ( ; node->parent; node = node->parent ) {
+        if ( proof->nsiblings == MTREE_PROOF_MAX ) {
+            return -1;
+        }
+        mtree_node_t* sibling = node->parent->left == node ? node->parent->right : node->parent->left;
+        memcpy(proof->siblings[proof->nsiblings++], sibling->expected_hash, SHA256_HEXLEN);
+    }
+    return 0;
+}
+
+int mtree_proof_root(const mtree_proof_t* proof, char root[SHA256_HEXLEN]) {
+    if ( !proof || proof->nsiblings > MTREE_PROOF_MAX || (uint64_t)proof->nchunks != ( 1ULL << proof->nsiblings )
+        || proof->index >= proof->nchunks ) {
+        return -1;
+    }
+
+    char cur[SHA256_HEXLEN];
+    memcpy(cur, proof->chunk_hash, SHA256_HEXLEN);
+    for ( uint16_t k = 0; k < proof->nsiblings; k++ ) {
+        // Parents hash the hex of the left child then the right, as sha256_compute_internal_hash.
+        struct sha256_compute_data cdata;
+        sha256_compute_data_init(&cdata);
+        if ( ( proof->index >> k ) & 1 ) {
+            sha256_update(&cdata, (void*)proof->siblings[k], SHA256_HEXLEN);
+            sha256_update(&cdata, cur, SHA256_HEXLEN);
+        }
+        else {
+            sha256_update(&cdata, cur, SHA256_HEXLEN);
+            sha256_update(&cdata, (void*)proof->siblings[k], SHA256_HEXLEN);
+        }
+        uint8_t hashout[SHA256_INT_SZ];
+        sha256_finalize(&cdata, hashout);
+        sha256_output_hex(&cdata, cur);
+    }
+    memcpy(root, cur, SHA256_HEXLEN);
+    return 0;
+}
+
+bool mtree_verify_proof(const mtree_proof_t* proof, const char* root_hash, uint32_t nchunks) {
+    char root[SHA256_HEXLEN];
+    if ( !root_hash || !proof || proof->nchunks != nchunks || mtree_proof_root(proof, root) < 0 ) {
+        return false;
+    }
+    return strncmp(root, root_hash, SHA256_HEXLEN) == 0;
+}
+
+/* Changed ranges being collected by mtree_diff. */
+typedef struct mtree_diff_state {
+    mtree_range_t* ranges;
+    uint32_t nranges;
+    uint32_t cap;
+    int64_t nchanged;
+} mtree_diff_state_t;
+
+/**
+ * @brief Gets the height of a tree built from a package, checking its shape.
+ *
+ * @param mtree Pointer to the Merkle tree structure.
+ * @return Levels below the root, or -1 if the tree is not perfect or misses a node.
+ */
+static int mtree_levels(const mtree_t* mtree) {
+    if ( !mtree || !mtree->nodes || mtree->nchunks == 0 || ( mtree->nchunks & ( mtree->nchunks - 1 ) ) != 0
+        || mtree->nhashes != mtree->nchunks - 1 || mtree->nnodes != mtree->nhashes + mtree->nchunks ) {
+        return -1;
+    }
+    for ( uint32_t i = 0; i < mtree->nnodes; i++ ) {
+        if ( !mtree->nodes[i] ) {
+            return -1;
+        }
+    }
+
+    int levels = 0;
+    while ( ( 1u << levels ) < mtree->nchunks ) {
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * @brief Adds changed chunks to a diff, extending the last range when they follow on.
+ *
+ * @param state Pointer to the diff.
+ * @param first Index of the first changed chunk, not below any already added.
+ * @param count Number of changed chunks.
+ */
+static void mtree_diff_add(mtree_diff_state_t* state, uint32_t first, uint32_t count) {
+    state->nchanged += count;
+    if ( state->nranges > 0 ) {
+        mtree_range_t* last = &state->ranges[state->nranges - 1];
+        if ( last->first + last->count == first ) {
+            last->count += count;
+            return;
+        }
+    }
+    if ( state->nranges == state->cap ) {
+        state->cap = state->cap ? state->cap * 2 : 16;
+        state->ranges = (mtree_range_t*)realloc(state->ranges, state->cap * sizeof(mtree_range_t));
+        if ( !state->ranges ) {
+            perror("Failed to grow diff ranges");
+            exit(EXIT_FAILURE);
+        }
+    }
+    state->ranges[state->nranges++] = (mtree_range_t){ .first = first, .count = count };
+}
+
+/**
+ * @brief Compares two subtrees of the same height in level order, left to right,
+ * skipping every pair whose hashes match.
+ *
+ * @param old_tree Pointer to the old tree.
+ * @param i_old Level order index of the old subtree's root.
+ * @param new_tree Pointer to the new tree.
+ * @param i_new Level order index of the new subtree's root.
+ * @param state Pointer to the diff.
+ */
+static void mtree_diff_walk(mtree_t* old_tree, uint32_t i_old, mtree_t* new_tree, uint32_t i_new, mtree_diff_state_t* state) {
+    if ( strncmp(old_tree->nodes[i_old]->expected_hash, new_tree->nodes[i_new]->expected_hash, SHA256_HEXLEN) == 0 ) {
+        return;
+    }
+    if ( i_new >= new_tree->nhashes ) {
+        mtree_diff_add(state, i_new - new_tree->nhashes, 1);
+        return;
+    }
+    mtree_diff_walk(old_tree, 2 * i_old + 1, new_tree, 2 * i_new + 1, state);
+    mtree_diff_walk(old_tree, 2 * i_old + 2, new_tree, 2 * i_new + 2, state);
+}
+
+int64_t mtree_diff(mtree_t* old_tree, mtree_t* new_tree, mtree_range_t** ranges, uint32_t* nranges) {
+    int levels_old = mtree_levels(old_tree);
+    int levels_new = mtree_levels(new_tree);
+    if ( levels_old < 0 || levels_new < 0 ) {
+        return -1;
+    }
+
+    // The leftmost node k levels down is at level order index 2^k - 1.
+    mtree_diff_state_t state = { 0 };
+    if ( levels_new >= levels_old ) {
+        mtree_diff_walk(old_tree, 0, new_tree, ( 1u << ( levels_new - levels_old ) ) - 1, &state);
+        if ( new_tree->nchunks > old_tree->nchunks ) {
+            mtree_diff_add(&state, old_tree->nchunks, new_tree->nchunks - old_tree->nchunks);
+        }
+    }
+    else {
+        mtree_diff_walk(old_tree, ( 1u << ( levels_old - levels_new ) ) - 1, new_tree, 0, &state);
+    }
+
+    *ranges = state.ranges;
+    *nranges = state.nranges;
+    return state.nchanged;
+}
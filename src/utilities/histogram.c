@@ -0,0 +1,122 @@
+#include <utilities/histogram.h>
+
+#define HIST_VALUE_MAX ( ( 1ull << HIST_VALUE_BITS ) - 1 )
+
+/**
+ * @brief Finds the bucket a value falls in.
+ *
+ * @param value Value, at most HIST_VALUE_MAX.
+ * @return Index of the bucket.
+ */
+static uint32_t hist_index(uint64_t value) {
+    if ( value < HIST_SUB ) {
+        return (uint32_t)value;
+    }
+    // The top HIST_SUB_BITS + 1 bits pick the bucket within the value's power of two.
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t shift = msb - HIST_SUB_BITS;
+    return ( shift + 1 ) * HIST_SUB + (uint32_t)( ( value >> shift ) - HIST_SUB );
+}
+
+/**
+ * @brief Returns the highest value that falls in a bucket.
+ *
+ * @param index Index of the bucket.
+ * @return Highest value of the bucket.
+ */
+static uint64_t hist_bucket_high(uint32_t index) {
+    if ( index < HIST_SUB ) {
+        return index;
+    }
+    uint32_t shift = index / HIST_SUB - 1;
+    uint64_t low = (uint64_t)( HIST_SUB + index % HIST_SUB ) << shift;
+    return low + ( 1ull << shift ) - 1;
+}
+
+/**
+ * @brief Records one value.
+ *
+ * @param hist Pointer to the histogram.
+ * @param value Value to record, clamped to the largest one told apart.
+ */
+void hist_record(histogram_t* hist, uint64_t value) {
+    if ( value > HIST_VALUE_MAX ) {
+        value = HIST_VALUE_MAX;
+    }
+    atomic_fetch_add_explicit(&hist->counts[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while ( value > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+        memory_order_relaxed, memory_order_relaxed) ) {
+    }
+}
+
+/**
+ * @brief Counts the values recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Number of values.
+ */
+uint64_t hist_count(histogram_t* hist) {
+    return atomic_load_explicit(&hist->total, memory_order_relaxed);
+}
+
+/**
+ * @brief Sums the values recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Sum of the values.
+ */
+uint64_t hist_sum(histogram_t* hist) {
+    return atomic_load_explicit(&hist->sum, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the largest value recorded.
+ *
+ * @param hist Pointer to the histogram.
+ * @return Largest value, or 0 if the histogram is empty.
+ */
+uint64_t hist_max(histogram_t* hist) {
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+/**
+ * @brief Finds the value a given fraction of the recorded values are at or below.
+ *
+ * @param hist Pointer to the histogram.
+ * @param quantile Fraction between 0 and 1, such as 0.99.
+ * @return Highest value of the bucket holding that rank, never above the maximum
+ * recorded, or 0 if the histogram is empty.
+ */
+uint64_t hist_quantile(histogram_t* hist, double quantile) {
+    // Buckets are summed rather than trusting total, which recorders bump separately.
+    uint64_t total = 0;
+    for ( uint32_t i = 0; i < HIST_BUCKETS; i++ ) {
+        total += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    if ( total == 0 ) {
+        return 0;
+    }
+
+    // Nearest rank: the smallest value with at least that fraction at or below it.
+    double want = quantile * total;
+    uint64_t rank = (uint64_t)want;
+    if ( rank < want ) {
+        rank++;
+    }
+    rank = rank < 1 ? 1 : rank > total ? total : rank;
+
+    uint64_t seen = 0;
+    uint64_t max = hist_max(hist);
+    for ( uint32_t i = 0; i < HIST_BUCKETS; i++ ) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if ( seen >= rank ) {
+            uint64_t high = hist_bucket_high(i);
+            return high < max ? high : max;
+        }
+    }
+    return max;
+}
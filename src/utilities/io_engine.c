@@ -0,0 +1,424 @@
+#include <utilities/io_engine.h>
+#include <utilities/my_utils.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Kinds of operation an engine carries out. */
+enum IoOpKind {
+    IO_OP_READ = 0,
+    IO_OP_WRITE = 1,
+    IO_OP_SEND = 2,
+    IO_OP_FSYNC = 3,
+};
+
+static _Atomic int default_backend = IO_BLOCKING;
+static atomic_bool uring_warned = false;
+static pthread_key_t thread_engine_key;
+static pthread_once_t thread_engine_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Sets up an io_uring of IO_DEPTH entries and maps its rings.
+ *
+ * @param engine Pointer to the engine.
+ * @return 0 on success, -errno on failure.
+ */
+static int uring_setup(io_engine_t* engine) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, IO_DEPTH, &params);
+    if ( fd < 0 ) {
+        return -errno;
+    }
+
+    engine->sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    engine->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if ( single_mmap ) {
+        engine->sq_len = engine->cq_len > engine->sq_len ? engine->cq_len : engine->sq_len;
+        engine->cq_len = engine->sq_len;
+    }
+
+    engine->sq_ptr = mmap(NULL, engine->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if ( engine->sq_ptr == MAP_FAILED ) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    engine->cq_ptr = engine->sq_ptr;
+    if ( !single_mmap ) {
+        engine->cq_ptr = mmap(NULL, engine->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if ( engine->cq_ptr == MAP_FAILED ) {
+            int err = -errno;
+            munmap(engine->sq_ptr, engine->sq_len);
+            close(fd);
+            return err;
+        }
+    }
+
+    engine->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL, engine->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if ( engine->sqes == MAP_FAILED ) {
+        int err = -errno;
+        if ( !single_mmap ) munmap(engine->cq_ptr, engine->cq_len);
+        munmap(engine->sq_ptr, engine->sq_len);
+        close(fd);
+        return err;
+    }
+
+    uint8_t* sq = (uint8_t*)engine->sq_ptr;
+    uint8_t* cq = (uint8_t*)engine->cq_ptr;
+    engine->sq_head = (uint32_t*)( sq + params.sq_off.head );
+    engine->sq_tail = (uint32_t*)( sq + params.sq_off.tail );
+    engine->sq_mask = *(uint32_t*)( sq + params.sq_off.ring_mask );
+    engine->sq_array = (uint32_t*)( sq + params.sq_off.array );
+    engine->cq_head = (uint32_t*)( cq + params.cq_off.head );
+    engine->cq_tail = (uint32_t*)( cq + params.cq_off.tail );
+    engine->cq_mask = *(uint32_t*)( cq + params.cq_off.ring_mask );
+    engine->cqes = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+    engine->ring_fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Enters the kernel to submit queued entries and optionally wait.
+ *
+ * @param engine Pointer to the engine.
+ * @param min_complete Completions to wait for.
+ * @return 0 on success, -errno on failure.
+ */
+static int uring_enter(io_engine_t* engine, uint32_t min_complete) {
+    uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while ( true ) {
+        long ret = syscall(__NR_io_uring_enter, engine->ring_fd, engine->nqueued, min_complete, flags, NULL, 0);
+        if ( ret >= 0 ) {
+            engine->nqueued -= ( (uint32_t)ret < engine->nqueued ) ? (uint32_t)ret : engine->nqueued;
+            return 0;
+        }
+        if ( errno != EINTR ) {
+            return -errno;
+        }
+    }
+}
+
+/**
+ * @brief Places the remaining part of an operation in the submission ring.
+ *
+ * @param engine Pointer to the engine.
+ * @param slot Slot of the operation.
+ */
+static void uring_push(io_engine_t* engine, uint32_t slot) {
+    io_op_t* op = &engine->ops[slot];
+    uint32_t tail = *engine->sq_tail;
+
+    // Every slot fits in the ring, so this only waits if the kernel lags behind.
+    while ( tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) > engine->sq_mask ) {
+        uring_enter(engine, 0);
+    }
+
+    uint32_t idx = tail & engine->sq_mask;
+    struct io_uring_sqe* sqe = &engine->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = slot;
+    sqe->addr = (uint64_t)(uintptr_t)( op->buf + op->done );
+    sqe->len = (uint32_t)( op->len - op->done );
+    sqe->off = op->off + op->done;
+
+    switch ( op->kind ) {
+    case IO_OP_READ:
+        sqe->opcode = IORING_OP_READ;
+        break;
+    case IO_OP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        break;
+    case IO_OP_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->off = 0;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    case IO_OP_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->addr = 0;
+        sqe->len = 0;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+
+    engine->sq_array[idx] = idx;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    engine->nqueued++;
+}
+
+/**
+ * @brief Records an operation as finished and frees its slot.
+ *
+ * @param engine Pointer to the engine.
+ * @param slot Slot of the operation.
+ * @param res Result to report.
+ */
+static void op_finish(io_engine_t* engine, uint32_t slot, ssize_t res) {
+    engine->done[engine->ndone].tag = engine->ops[slot].tag;
+    engine->done[engine->ndone].res = res;
+    engine->ndone++;
+    engine->free_slots[engine->nfree++] = slot;
+}
+
+/**
+ * @brief Accounts for one step of an operation, deciding whether it is finished.
+ *
+ * @param engine Pointer to the engine.
+ * @param slot Slot of the operation.
+ * @param res Result of the step, bytes moved or -errno.
+ * @return true if the operation is finished, false if the rest must be issued.
+ */
+static bool op_step(io_engine_t* engine, uint32_t slot, ssize_t res) {
+    io_op_t* op = &engine->ops[slot];
+    if ( res == -EINTR || res == -EAGAIN ) {
+        return false;
+    }
+    if ( res < 0 ) {
+        op_finish(engine, slot, res);
+        return true;
+    }
+    op->done += (size_t)res;
+    // A read reaching the end of the file stops short; nothing more will come.
+    if ( op->kind == IO_OP_FSYNC || op->done >= op->len || res == 0 ) {
+        op_finish(engine, slot, (ssize_t)op->done);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Carries out an operation on the calling thread.
+ *
+ * @param engine Pointer to the engine.
+ * @param slot Slot of the operation.
+ */
+static void blocking_run(io_engine_t* engine, uint32_t slot) {
+    io_op_t* op = &engine->ops[slot];
+    while ( true ) {
+        ssize_t n = 0;
+        switch ( op->kind ) {
+        case IO_OP_READ:
+            n = pread(op->fd, op->buf + op->done, op->len - op->done, (off_t)( op->off + op->done ));
+            break;
+        case IO_OP_WRITE:
+            n = pwrite(op->fd, op->buf + op->done, op->len - op->done, (off_t)( op->off + op->done ));
+            break;
+        case IO_OP_SEND:
+            n = send(op->fd, op->buf + op->done, op->len - op->done, MSG_NOSIGNAL);
+            break;
+        case IO_OP_FSYNC:
+            n = fdatasync(op->fd);
+            break;
+        }
+        if ( op_step(engine, slot, n < 0 ? -errno : n) ) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Takes a slot for a new operation and starts it.
+ *
+ * @return 0 on success, -1 if no slot is free.
+ */
+static int io_queue(io_engine_t* engine, uint8_t kind, int fd, const void* buf, size_t len, uint64_t off, void* tag) {
+    if ( engine->nfree == 0 ) {
+        return -1;
+    }
+
+    uint32_t slot = engine->free_slots[--engine->nfree];
+    io_op_t* op = &engine->ops[slot];
+    op->kind = kind;
+    op->fd = fd;
+    op->buf = (uint8_t*)buf;
+    op->len = len;
+    op->off = off;
+    op->done = 0;
+    op->tag = tag;
+
+    if ( engine->backend == IO_URING ) {
+        uring_push(engine, slot);
+    }
+    else {
+        blocking_run(engine, slot);
+    }
+    return 0;
+}
+
+/**
+ * @brief Drains the completion ring, reissuing the rest of short transfers.
+ *
+ * @param engine Pointer to the engine.
+ */
+static void uring_reap(io_engine_t* engine) {
+    uint32_t head = *engine->cq_head;
+    uint32_t tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+
+    while ( head != tail ) {
+        struct io_uring_cqe* cqe = &engine->cqes[head & engine->cq_mask];
+        uint32_t slot = (uint32_t)cqe->user_data;
+        ssize_t res = cqe->res;
+        head++;
+
+        if ( !op_step(engine, slot, res) ) {
+            uring_push(engine, slot);
+        }
+    }
+    __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates an engine. Falls back to the blocking backend, with a message,
+ * if io_uring is asked for but the kernel refuses it.
+ *
+ * @param backend Backend to run on.
+ * @return Pointer to the engine.
+ */
+io_engine_t* io_engine_create(enum IoBackend backend) {
+    io_engine_t* engine = (io_engine_t*)my_malloc(sizeof(io_engine_t));
+    memset(engine, 0, sizeof(io_engine_t));
+    engine->ring_fd = -1;
+    for ( uint32_t i = 0; i < IO_DEPTH; i++ ) {
+        engine->free_slots[i] = IO_DEPTH - 1 - i;
+    }
+    engine->nfree = IO_DEPTH;
+
+    engine->backend = IO_BLOCKING;
+    if ( backend == IO_URING ) {
+        int err = uring_setup(engine);
+        if ( err == 0 ) {
+            engine->backend = IO_URING;
+        }
+        else if ( !atomic_exchange(&uring_warned, true) ) {
+            fprintf(stderr, "io_uring unavailable (%s), using blocking I/O\n", strerror(-err));
+        }
+    }
+    return engine;
+}
+
+/**
+ * @brief Destroys an engine. Operations still outstanding are waited for first.
+ *
+ * @param engine Pointer to the engine.
+ */
+void io_engine_destroy(io_engine_t* engine) {
+    if ( !engine ) return;
+
+    io_result_t results[IO_DEPTH];
+    while ( io_outstanding(engine) > 0 ) {
+        io_wait(engine, results, 1, IO_DEPTH);
+    }
+
+    if ( engine->backend == IO_URING ) {
+        munmap(engine->sqes, engine->sqes_len);
+        if ( engine->cq_ptr != engine->sq_ptr ) {
+            munmap(engine->cq_ptr, engine->cq_len);
+        }
+        munmap(engine->sq_ptr, engine->sq_len);
+        close(engine->ring_fd);
+    }
+    free(engine);
+}
+
+/**
+ * @brief Sets the backend of engines handed out by io_engine_thread from now on.
+ *
+ * @param backend Backend to use.
+ */
+void io_engine_set_default(enum IoBackend backend) {
+    atomic_store(&default_backend, backend);
+}
+
+static void thread_engine_destroy(void* engine) {
+    io_engine_destroy((io_engine_t*)engine);
+}
+
+static void thread_engine_key_create() {
+    pthread_key_create(&thread_engine_key, thread_engine_destroy);
+}
+
+/**
+ * @brief Returns the calling thread's engine, creating it on first use. It is
+ * destroyed when the thread exits.
+ *
+ * @return Pointer to the engine.
+ */
+io_engine_t* io_engine_thread() {
+    pthread_once(&thread_engine_once, thread_engine_key_create);
+    io_engine_t* engine = (io_engine_t*)pthread_getspecific(thread_engine_key);
+    if ( !engine ) {
+        engine = io_engine_create((enum IoBackend)atomic_load(&default_backend));
+        pthread_setspecific(thread_engine_key, engine);
+    }
+    return engine;
+}
+
+int io_read(io_engine_t* engine, int fd, void* buf, size_t len, uint64_t off, void* tag) {
+    return io_queue(engine, IO_OP_READ, fd, buf, len, off, tag);
+}
+
+int io_write(io_engine_t* engine, int fd, const void* buf, size_t len, uint64_t off, void* tag) {
+    return io_queue(engine, IO_OP_WRITE, fd, buf, len, off, tag);
+}
+
+int io_send(io_engine_t* engine, int sock, const void* buf, size_t len, void* tag) {
+    return io_queue(engine, IO_OP_SEND, sock, buf, len, 0, tag);
+}
+
+int io_fsync(io_engine_t* engine, int fd, void* tag) {
+    return io_queue(engine, IO_OP_FSYNC, fd, NULL, 0, 0, tag);
+}
+
+/**
+ * @brief Returns the number of operations queued or running and not yet reaped.
+ *
+ * @param engine Pointer to the engine.
+ * @return Number of outstanding operations.
+ */
+uint32_t io_outstanding(io_engine_t* engine) {
+    return ( IO_DEPTH - engine->nfree ) + engine->ndone;
+}
+
+/**
+ * @brief Submits queued operations and collects finished ones.
+ *
+ * @param engine Pointer to the engine.
+ * @param results Array receiving the finished operations.
+ * @param min Number of results to wait for, capped at those outstanding.
+ * @param max Capacity of results.
+ * @return Number of results written.
+ */
+uint32_t io_wait(io_engine_t* engine, io_result_t* results, uint32_t min, uint32_t max) {
+    uint32_t outstanding = io_outstanding(engine);
+    min = min > outstanding ? outstanding : min;
+    min = min > max ? max : min;
+    uint32_t n = 0;
+
+    while ( true ) {
+        if ( engine->backend == IO_URING ) {
+            uring_reap(engine);
+        }
+
+        uint32_t take = engine->ndone < max - n ? engine->ndone : max - n;
+        memcpy(results + n, engine->done, take * sizeof(io_result_t));
+        memmove(engine->done, engine->done + take, ( engine->ndone - take ) * sizeof(io_result_t));
+        engine->ndone -= take;
+        n += take;
+
+        if ( n >= min && engine->nqueued == 0 ) {
+            return n;
+        }
+        int err = uring_enter(engine, n < min ? 1 : 0);
+        if ( err < 0 ) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-err));
+            return n;
+        }
+    }
+}
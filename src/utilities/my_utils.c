@@ -129,12 +129,33 @@ queue_t* q_init() {
     queue_t* q_obj = (queue_t*)my_malloc(sizeof(queue_t));
     q_obj->head = NULL;
     q_obj->tail = NULL;
+    q_obj->spare = NULL;
+    q_obj->nspare = 0;
     return q_obj;
 }
 
-// Enqueues a queue element, storing data in the end of the linked list and allocating memory.
+// Keeps an unlinked node for reuse, freeing it once enough are kept.
+static void q_node_release(queue_t* qobj, q_node_t* node) {
+    if ( qobj->nspare >= Q_SPARE_MAX ) {
+        free(node);
+        return;
+    }
+    node->next = qobj->spare;
+    qobj->spare = node;
+    qobj->nspare++;
+}
+
+// Enqueues a queue element, storing data in the end of the linked list and reusing a
+// spare node when there is one, so a queue in steady use stops allocating.
 void q_enqueue(queue_t* qobj, void* data) {
-    q_node_t* new_node = (q_node_t*)my_malloc(sizeof(q_node_t));
+    q_node_t* new_node = qobj->spare;
+    if ( new_node != NULL ) {
+        qobj->spare = new_node->next;
+        qobj->nspare--;
+    }
+    else {
+        new_node = (q_node_t*)my_malloc(sizeof(q_node_t));
+    }
     if ( new_node == NULL ) {
         perror("Failed to allocate memory for queue node...");
         exit(EXIT_FAILURE);
@@ -153,7 +174,7 @@ void q_enqueue(queue_t* qobj, void* data) {
     qobj->tail = new_node;
 }
 
-// Dequeues a node, removing it from the head of the list and deallocating memory.
+// Dequeues a node, removing it from the head of the list and releasing the node.
 void* q_dequeue(queue_t* qobj) {
     if ( qobj->head == NULL ) {
         return NULL; // Queue is empty
@@ -167,7 +188,7 @@ void* q_dequeue(queue_t* qobj) {
     }
 
     void* data = temp->data;
-    free(temp);
+    q_node_release(qobj, temp);
     return
         data;
 }
@@ -181,10 +202,41 @@ int q_empty(queue_t* qobj)
     return 0;
 }
 
+// Unlinks the first node holding data, wherever it sits in the list, and releases it.
+int q_remove(queue_t* qobj, void* data) {
+    q_node_t* current = qobj->head;
+    q_node_t* previous = NULL;
+
+    while ( current != NULL ) {
+        if ( current->data == data ) {
+            if ( previous != NULL ) {
+                previous->next = current->next;
+            }
+            else {
+                qobj->head = current->next;
+            }
+            if ( current == qobj->tail ) {
+                qobj->tail = previous;
+            }
+            q_node_release(qobj, current);
+            return 1;
+        }
+        previous = current;
+        current = current->next;
+    }
+    return 0;
+}
+
 // Destroys the queue, freeing all dynamically allocated memory.
 void q_destroy(queue_t* qobj) {
     q_node_t* current = qobj->head;
 
+    while ( current != NULL ) {
+        q_node_t* temp = current;
+        current = current->next;
+        free(temp);
+    }
+    current = qobj->spare;
     while ( current != NULL ) {
         q_node_t* temp = current;
         current = current->next;
@@ -0,0 +1,184 @@
+#include <utilities/rate_limit.h>
+
+static token_bucket_t global_buckets[2] = {
+    { .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static _Atomic uint64_t peer_defaults[2];
+
+/**
+ * @brief Returns the most tokens a bucket of a given rate holds.
+ *
+ * @param rate Bytes per second.
+ * @return Burst size in bytes.
+ */
+static double bucket_burst(uint64_t rate) {
+    double burst = (double)rate / RATE_BURST_DIV;
+    return burst < RATE_QUANTUM ? RATE_QUANTUM : burst;
+}
+
+/**
+ * @brief Sleeps for a number of nanoseconds.
+ *
+ * @param ns Nanoseconds to sleep, 0 to return at once.
+ */
+static void rate_sleep(uint64_t ns) {
+    if ( ns == 0 ) {
+        return;
+    }
+    struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+    while ( nanosleep(&ts, &ts) < 0 && errno == EINTR ) {
+    }
+}
+
+/**
+ * @brief Initialises a bucket, starting full.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void bucket_init(token_bucket_t* bucket, uint64_t rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    atomic_init(&bucket->rate, rate);
+    bucket->tokens = bucket_burst(rate);
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/**
+ * @brief Releases a bucket's lock.
+ *
+ * @param bucket Pointer to the bucket.
+ */
+void bucket_destroy(token_bucket_t* bucket) {
+    pthread_mutex_destroy(&bucket->lock);
+}
+
+/**
+ * @brief Changes the rate of a bucket. Takers already sleeping keep their schedule.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void bucket_set_rate(token_bucket_t* bucket, uint64_t rate) {
+    pthread_mutex_lock(&bucket->lock);
+    uint64_t old = atomic_load(&bucket->rate);
+    // A bucket going from unlimited to limited starts full rather than with stale tokens.
+    if ( old == 0 || bucket->tokens > bucket_burst(rate) ) {
+        bucket->tokens = bucket_burst(rate);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+    atomic_store(&bucket->rate, rate);
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/**
+ * @brief Returns the rate of a bucket.
+ *
+ * @param bucket Pointer to the bucket.
+ * @return Bytes per second, 0 for unlimited.
+ */
+uint64_t bucket_rate(token_bucket_t* bucket) {
+    return atomic_load(&bucket->rate);
+}
+
+/**
+ * @brief Takes tokens from a bucket, going into debt if it holds too few.
+ *
+ * @param bucket Pointer to the bucket.
+ * @param n Number of bytes.
+ * @return Nanoseconds the caller must wait before its bytes are due.
+ */
+uint64_t bucket_reserve(token_bucket_t* bucket, size_t n) {
+    if ( atomic_load(&bucket->rate) == 0 ) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&bucket->lock);
+    uint64_t rate = atomic_load(&bucket->rate);
+    if ( rate == 0 ) {
+        pthread_mutex_unlock(&bucket->lock);
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = ( now.tv_sec - bucket->last.tv_sec ) + ( now.tv_nsec - bucket->last.tv_nsec ) / 1e9;
+    bucket->last = now;
+    bucket->tokens += elapsed * rate;
+    double burst = bucket_burst(rate);
+    if ( bucket->tokens > burst ) {
+        bucket->tokens = burst;
+    }
+
+    bucket->tokens -= n;
+    uint64_t wait = bucket->tokens < 0 ? (uint64_t)( -bucket->tokens * 1e9 / rate ) : 0;
+    pthread_mutex_unlock(&bucket->lock);
+    return wait;
+}
+
+/**
+ * @brief Returns the process-wide bucket for one direction.
+ *
+ * @param dir Direction of traffic.
+ * @return Pointer to the bucket.
+ */
+token_bucket_t* rate_global(enum RateDir dir) {
+    return &global_buckets[dir];
+}
+
+/**
+ * @brief Sets the rate new peers' buckets start with.
+ *
+ * @param dir Direction of traffic.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void rate_set_peer_default(enum RateDir dir, uint64_t rate) {
+    atomic_store(&peer_defaults[dir], rate);
+}
+
+/**
+ * @brief Returns the rate new peers' buckets start with.
+ *
+ * @param dir Direction of traffic.
+ * @return Bytes per second, 0 for unlimited.
+ */
+uint64_t rate_peer_default(enum RateDir dir) {
+    return atomic_load(&peer_defaults[dir]);
+}
+
+size_t rate_burst(token_bucket_t* peer_bucket, enum RateDir dir) {
+    size_t burst = SIZE_MAX;
+    uint64_t rates[2] = { bucket_rate(peer_bucket), bucket_rate(&global_buckets[dir]) };
+    for ( int i = 0; i < 2; i++ ) {
+        if ( rates[i] != 0 && bucket_burst(rates[i]) < burst ) {
+            burst = (size_t)bucket_burst(rates[i]);
+        }
+    }
+    return burst;
+}
+
+/**
+ * @brief Waits until a peer may move a number of bytes, charging its own bucket and
+ * then the global bucket of the direction.
+ *
+ * @param peer_bucket Pointer to the peer's bucket.
+ * @param dir Direction of traffic.
+ * @param n Number of bytes.
+ */
+void rate_limit(token_bucket_t* peer_bucket, enum RateDir dir, size_t n) {
+    token_bucket_t* global = &global_buckets[dir];
+    if ( bucket_rate(peer_bucket) == 0 && bucket_rate(global) == 0 ) {
+        return;
+    }
+
+    // Bytes are reserved a quantum at a time and the global bucket is only charged
+    // once the peer's own limit lets them through. A backlogged peer therefore holds
+    // at most one reservation on the shared bucket at once, so peers competing for
+    // it are served in turn rather than the busiest taking the whole link.
+    while ( n > 0 ) {
+        size_t take = n < RATE_QUANTUM ? n : RATE_QUANTUM;
+        rate_sleep(bucket_reserve(peer_bucket, take));
+        rate_sleep(bucket_reserve(global, take));
+        n -= take;
+    }
+}
@@ -0,0 +1,183 @@
+#include <utilities/ring.h>
+#include <utilities/my_utils.h>
+
+/**
+ * @brief Creates an empty ring.
+ *
+ * @param capacity Number of slots, rounded up to a power of two.
+ * @return Pointer to the ring.
+ */
+ring_t* ring_create(size_t capacity) {
+    size_t size = 2;
+    while ( size < capacity ) {
+        size <<= 1;
+    }
+
+    ring_t* ring = (ring_t*)my_malloc(sizeof(ring_t));
+    memset(ring, 0, sizeof(ring_t));
+    ring->cells = (ring_cell_t*)my_malloc(size * sizeof(ring_cell_t));
+    ring->mask = size - 1;
+
+    for ( size_t i = 0; i < size; i++ ) {
+        atomic_init(&ring->cells[i].seq, i);
+        ring->cells[i].data = NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+/**
+ * @brief Destroys a ring. Pointers still held are not freed.
+ *
+ * @param ring Pointer to the ring.
+ */
+void ring_destroy(ring_t* ring) {
+    if ( !ring ) return;
+    free(ring->cells);
+    free(ring);
+}
+
+/**
+ * @brief Adds a pointer to the back of the ring. Safe from any number of threads.
+ *
+ * @param ring Pointer to the ring.
+ * @param data Pointer to add.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int ring_push(ring_t* ring, void* data) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_cell_t* cell;
+
+    while ( true ) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if ( dif == 0 ) {
+            if ( atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed) ) {
+                break;
+            }
+        }
+        else if ( dif < 0 ) {
+            return -1;  // The slot still holds data from the previous lap.
+        }
+        else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Adds several pointers so they sit next to each other in the ring, or
+ * none of them. Only valid on a ring with a single consumer.
+ *
+ * @param ring Pointer to the ring.
+ * @param data Array of pointers to add.
+ * @param n Number of pointers, at most the capacity.
+ * @return 0 on success, -1 if there is not room for all of them.
+ */
+int ring_push_many(ring_t* ring, void** data, size_t n) {
+    if ( n == 0 ) return 0;
+    if ( n > ring->mask + 1 ) return -1;
+
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while ( true ) {
+        // Every slot of the run must be free for this lap before it is claimed.
+        intptr_t dif = 0;
+        for ( size_t i = 0; i < n && dif == 0; i++ ) {
+            size_t seq = atomic_load_explicit(&ring->cells[( pos + i ) & ring->mask].seq, memory_order_acquire);
+            dif = (intptr_t)seq - (intptr_t)( pos + i );
+        }
+
+        if ( dif == 0 ) {
+            if ( atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + n,
+                memory_order_relaxed, memory_order_relaxed) ) {
+                break;
+            }
+        }
+        else if ( dif < 0 ) {
+            return -1;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    for ( size_t i = 0; i < n; i++ ) {
+        ring_cell_t* cell = &ring->cells[( pos + i ) & ring->mask];
+        cell->data = data[i];
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes the pointer at the front of the ring. Safe from any number of threads.
+ *
+ * @param ring Pointer to the ring.
+ * @return The pointer, or NULL if the ring is empty.
+ */
+void* ring_pop(ring_t* ring) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_cell_t* cell;
+
+    while ( true ) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)( pos + 1 );
+
+        if ( dif == 0 ) {
+            if ( atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed) ) {
+                break;
+            }
+        }
+        else if ( dif < 0 ) {
+            return NULL;  // Not yet published by its producer.
+        }
+        else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    void* data = cell->data;
+    // Hand the slot to the producer that reaches it on the next lap.
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    return data;
+}
+
+/**
+ * @brief Returns the pointer at the front of the ring without removing it. Only
+ * meaningful to the single consumer of a ring.
+ *
+ * @param ring Pointer to the ring.
+ * @return The pointer, or NULL if the ring is empty.
+ */
+void* ring_peek(ring_t* ring) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_cell_t* cell = &ring->cells[pos & ring->mask];
+    if ( atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1 ) {
+        return NULL;
+    }
+    return cell->data;
+}
+
+/**
+ * @brief Counts the pointers in the ring. Producers and consumers may move while
+ * it is read, so the count is only a snapshot.
+ *
+ * @param ring Pointer to the ring.
+ * @return Number of claimed slots not yet drained.
+ */
+size_t ring_count(ring_t* ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
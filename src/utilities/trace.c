@@ -0,0 +1,144 @@
+#include <utilities/trace.h>
+
+#ifdef TRACE
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+static _Atomic(trace_ring_t*) trace_rings = NULL;   // Every ring ever created
+static __thread trace_ring_t* trace_local = NULL;   // Ring of the calling thread
+
+/**
+ * @brief Returns the ring of the calling thread, creating it on first use.
+ *
+ * @return Pointer to the ring.
+ */
+static trace_ring_t* trace_ring() {
+    if ( trace_local ) {
+        return trace_local;
+    }
+
+    trace_ring_t* ring = (trace_ring_t*)my_malloc(sizeof(trace_ring_t));
+    atomic_init(&ring->head, 0);
+    ring->tid = (uint32_t)gettid();
+    snprintf(ring->thread_name, TRACE_NAME_MAX, "thread %u", ring->tid);
+
+    // Rings are only ever added, so a plain push keeps the list walkable.
+    ring->next = atomic_load(&trace_rings);
+    while ( !atomic_compare_exchange_weak(&trace_rings, &ring->next, ring) ) {
+    }
+    trace_local = ring;
+    return ring;
+}
+
+/**
+ * @brief Records the begin or end of a span on the calling thread.
+ *
+ * @param name Name of the span, a string literal.
+ * @param phase 'B' to begin or 'E' to end.
+ */
+void trace_event(const char* name, char phase) {
+    trace_ring_t* ring = trace_ring();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t* event = &ring->events[head % TRACE_RING_EVENTS];
+    event->ts_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    event->name = name;
+    event->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Names the calling thread in dumps.
+ *
+ * @param fmt printf style format of the name.
+ */
+void trace_thread_name(const char* fmt, ...) {
+    trace_ring_t* ring = trace_ring();
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(ring->thread_name, TRACE_NAME_MAX, fmt, args);
+    va_end(args);
+}
+
+/**
+ * @brief Writes the events of one ring that survived copying.
+ *
+ * @param out Stream to write to.
+ * @param ring Pointer to the ring.
+ * @param copy Scratch space for TRACE_RING_EVENTS events.
+ * @param pid Process id written with every event.
+ * @return Number of events written.
+ */
+static long trace_dump_ring(FILE* out, trace_ring_t* ring, trace_event_t* copy, int pid) {
+    uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t start = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+    for ( uint64_t i = start; i < end; i++ ) {
+        copy[i % TRACE_RING_EVENTS] = ring->events[i % TRACE_RING_EVENTS];
+    }
+
+    // The writer kept going while copying; slots it reached since hold newer events.
+    uint64_t now = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if ( now >= TRACE_RING_EVENTS && now - TRACE_RING_EVENTS + 1 > start ) {
+        start = now - TRACE_RING_EVENTS + 1;
+    }
+
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        pid, ring->tid, ring->thread_name);
+
+    // Ends whose begin was overwritten would close spans the viewer never opened.
+    long written = 0;
+    uint64_t depth = 0;
+    for ( uint64_t i = start; i < end; i++ ) {
+        trace_event_t* event = &copy[i % TRACE_RING_EVENTS];
+        if ( event->phase == 'E' ) {
+            if ( depth == 0 ) {
+                continue;
+            }
+            depth--;
+        }
+        else {
+            depth++;
+        }
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"btide\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%u}",
+            event->name, event->phase, event->ts_ns / 1000, event->ts_ns % 1000, pid, ring->tid);
+        written++;
+    }
+    return written;
+}
+
+/**
+ * @brief Writes the events of every thread as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto both open.
+ *
+ * @param path File to write.
+ * @return Number of events written, or -1 if the file could not be written.
+ */
+long trace_dump(const char* path) {
+    FILE* out = fopen(path, "w");
+    if ( !out ) {
+        return -1;
+    }
+
+    int pid = (int)getpid();
+    trace_event_t* copy = (trace_event_t*)my_malloc(TRACE_RING_EVENTS * sizeof(trace_event_t));
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"btide\"}}", pid);
+
+    long written = 0;
+    for ( trace_ring_t* ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next ) {
+        written += trace_dump_ring(out, ring, copy, pid);
+    }
+    fprintf(out, "\n]}\n");
+    free(copy);
+
+    if ( fclose(out) != 0 ) {
+        return -1;
+    }
+    return written;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#include <utilities/work_pool.h>
+#include <utilities/my_utils.h>
+#include <utilities/trace.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct worker_args {
+    work_pool_t* pool;
+    uint32_t index;
+} worker_args_t;
+
+static work_pool_t* shared_pool = NULL;
+static __thread work_pool_t* current_pool = NULL;   // Pool the calling thread works for
+static __thread uint32_t current_index = 0;         // Its queue in that pool
+
+/**
+ * @brief Takes the next item, from the worker's own queue first and then from the
+ * others' in turn.
+ *
+ * @param pool Pointer to the pool.
+ * @param index Worker looking for work.
+ * @return The item, or NULL if every queue is empty.
+ */
+static work_t* pool_take(work_pool_t* pool, uint32_t index) {
+    for ( uint32_t i = 0; i < pool->nworkers; i++ ) {
+        work_t* work = (work_t*)ring_pop(pool->queues[( index + i ) % pool->nworkers]);
+        if ( work ) {
+            atomic_fetch_sub(&pool->pending, 1);
+            return work;
+        }
+    }
+    return NULL;
+}
+
+static void* pool_worker(void* arg) {
+    worker_args_t* args = (worker_args_t*)arg;
+    work_pool_t* pool = args->pool;
+    current_pool = pool;
+    current_index = args->index;
+    free(args);
+    TRACE_THREAD("worker %u", current_index);
+
+    while ( !atomic_load(&pool->stopping) ) {
+        work_t* work = pool_take(pool, current_index);
+        if ( work ) {
+            work->run(work);
+            continue;
+        }
+
+        // Announcing the sleep before rechecking pending pairs with the submitter,
+        // which bumps pending before looking for sleepers, so no wakeup is lost.
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->nsleeping, 1);
+        while ( atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stopping) ) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->nsleeping, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts a pool.
+ *
+ * @param nworkers Number of worker threads, 0 for one per online CPU.
+ * @return Pointer to the pool.
+ */
+work_pool_t* work_pool_create(uint32_t nworkers) {
+    if ( nworkers == 0 ) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus > 0 ? (uint32_t)ncpus : 1;
+    }
+    nworkers = nworkers > POOL_WORKERS_MAX ? POOL_WORKERS_MAX : nworkers;
+
+    work_pool_t* pool = (work_pool_t*)my_malloc(sizeof(work_pool_t));
+    memset(pool, 0, sizeof(work_pool_t));
+    pool->nworkers = nworkers;
+    pool->threads = (pthread_t*)my_malloc(nworkers * sizeof(pthread_t));
+    pool->queues = (ring_t**)my_malloc(nworkers * sizeof(ring_t*));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for ( uint32_t i = 0; i < nworkers; i++ ) {
+        pool->queues[i] = ring_create(POOL_QUEUE_MAX);
+    }
+    for ( uint32_t i = 0; i < nworkers; i++ ) {
+        worker_args_t* args = (worker_args_t*)my_malloc(sizeof(worker_args_t));
+        args->pool = pool;
+        args->index = i;
+        if ( pthread_create(&pool->threads[i], NULL, pool_worker, args) != 0 ) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+/**
+ * @brief Stops a pool, waiting for its workers to exit. Items still queued are dropped.
+ *
+ * @param pool Pointer to the pool.
+ */
+void work_pool_destroy(work_pool_t* pool) {
+    if ( !pool ) return;
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( uint32_t i = 0; i < pool->nworkers; i++ ) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for ( uint32_t i = 0; i < pool->nworkers; i++ ) {
+        ring_destroy(pool->queues[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * @brief Queues work on a pool. Runs it on the caller if every queue is full.
+ *
+ * @param pool Pointer to the pool.
+ * @param work Work to run.
+ */
+void work_pool_submit(work_pool_t* pool, work_t* work) {
+    // Workers keep what they submit on their own queue; others spread it round.
+    uint32_t start = current_pool == pool ? current_index : atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+
+    atomic_fetch_add(&pool->pending, 1);
+    uint32_t i = 0;
+    while ( i < pool->nworkers && ring_push(pool->queues[( start + i ) % pool->nworkers], work) < 0 ) {
+        i++;
+    }
+    if ( i == pool->nworkers ) {
+        atomic_fetch_sub(&pool->pending, 1);
+        work->run(work);
+        return;
+    }
+
+    if ( atomic_load(&pool->nsleeping) > 0 ) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * @brief Sets the pool returned by work_pool_shared.
+ *
+ * @param pool Pointer to the pool, or NULL.
+ */
+void work_pool_set_shared(work_pool_t* pool) {
+    shared_pool = pool;
+}
+
+/**
+ * @brief Returns the process-wide pool.
+ *
+ * @return Pointer to the pool, or NULL if none is running.
+ */
+work_pool_t* work_pool_shared() {
+    return shared_pool;
+}
+
+/**
+ * @brief Runs a batch of a strand's items on a worker, then hands the worker back,
+ * rescheduling the strand if more items are waiting.
+ *
+ * @param work The strand's work item.
+ */
+static void strand_run(work_t* work) {
+    strand_t* strand = (strand_t*)work;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Items that block, such as sends held back by a rate limit, would otherwise keep
+    // the worker from other strands for a whole batch, so the batch is also cut short
+    // after a time slice. A rescheduled strand goes to the back of the queue.
+    for ( int n = 0; n < STRAND_BATCH; n++ ) {
+        void* item = ring_pop(strand->items);
+        if ( !item ) {
+            break;
+        }
+        strand->fn(strand->ctx, item);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ( ( now.tv_sec - start.tv_sec ) * 1000000 + ( now.tv_nsec - start.tv_nsec ) / 1000 >= STRAND_SLICE_US ) {
+            break;
+        }
+    }
+
+    atomic_store(&strand->scheduled, false);
+    // An item posted after the last pop but before the store above saw the strand
+    // still scheduled, so it is picked up here.
+    if ( ring_peek(strand->items) && !atomic_exchange(&strand->scheduled, true) ) {
+        work_pool_submit(strand->pool, &strand->work);
+    }
+}
+
+/**
+ * @brief Creates a strand.
+ *
+ * @param pool Pool to run on, or NULL to run items on the poster.
+ * @param fn Function run for every item.
+ * @param ctx Context passed to fn.
+ * @return Pointer to the strand.
+ */
+strand_t* strand_create(work_pool_t* pool, void (*fn)(void* ctx, void* item), void* ctx) {
+    strand_t* strand = (strand_t*)my_malloc(sizeof(strand_t));
+    memset(strand, 0, sizeof(strand_t));
+    strand->work.run = strand_run;
+    strand->pool = pool;
+    strand->items = ring_create(STRAND_ITEMS_MAX);
+    strand->fn = fn;
+    strand->ctx = ctx;
+    atomic_init(&strand->scheduled, false);
+    return strand;
+}
+
+/**
+ * @brief Posts an item to a strand, waiting while the strand is full.
+ *
+ * @param strand Pointer to the strand.
+ * @param item Item passed to the strand's function.
+ */
+void strand_post(strand_t* strand, void* item) {
+    if ( !strand->pool ) {
+        strand->fn(strand->ctx, item);
+        return;
+    }
+
+    // A full strand holds the poster back, which for a peer thread means it stops
+    // reading the socket until the workers catch up.
+    while ( ring_push(strand->items, item) < 0 ) {
+        sched_yield();
+    }
+    if ( !atomic_exchange(&strand->scheduled, true) ) {
+        work_pool_submit(strand->pool, &strand->work);
+    }
+}
+
+/**
+ * @brief Waits until every item posted to a strand has run.
+ *
+ * @param strand Pointer to the strand.
+ */
+void strand_drain(strand_t* strand) {
+    while ( atomic_load(&strand->scheduled) || ring_peek(strand->items) ) {
+        if ( strand->pool && atomic_load(&strand->pool->stopping) ) {
+            return;  // Nothing will run the rest.
+        }
+        usleep(1000);
+    }
+}
+
+/**
+ * @brief Destroys a strand. It must be drained first.
+ *
+ * @param strand Pointer to the strand.
+ */
+void strand_destroy(strand_t* strand) {
+    if ( !strand ) return;
+    ring_destroy(strand->items);
+    free(strand);
+}
@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# Build comparison: times the same work with every build of pkgchecker and btide
+# found in the repository root, so the optimised builds can be weighed against the
+# default sanitized one. Prints JSON on stdout and progress on stderr.
+#
+# Usage: bash testing/build_compare.sh [options]
+#   -m <mebibytes>   size of the generated package (default 64)
+#   -r <runs>        pkgchecker runs per build, the fastest counts (default 3)
+#   -p <port>        first port of the loopback transfers (default 9680)
+#
+# Builds are looked for under these names, and missing ones are skipped:
+#   debug      btide, pkgchecker              make btide pkgchecker
+#   release    btide_release, ...             make release
+#   pgo        btide_pgo, ...                 make pgo
+#
+# pkgchecker computes every hash of the package. btide moves it from one seeder to
+# one leecher over loopback through testing/swarm_bench.sh.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PKGMAKE="$ROOT/resources/pkgmake"
+
+SIZE_MB=64
+RUNS=3
+BASE_PORT=9680
+
+while getopts "m:r:p:" opt; do
+    case $opt in
+        m) SIZE_MB=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        p) BASE_PORT=$OPTARG ;;
+        *) sed -n '3,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+WORK=$(mktemp -d /tmp/build_compare.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+# 16 KiB chunks, rounded down to a power of two as pkgmake requires.
+NCHUNKS=1
+while (( NCHUNKS * 2 * 16 <= SIZE_MB * 1024 )); do
+    NCHUNKS=$(( NCHUNKS * 2 ))
+done
+head -c $(( SIZE_MB << 20 )) /dev/urandom > "$WORK/cmp.data"
+( cd "$WORK" && "$PKGMAKE" cmp.data --nchunks "$NCHUNKS" --output cmp.bpkg > /dev/null ) || {
+    echo "pkgmake failed" >&2
+    exit 1
+}
+
+# Prints the fastest wall time of RUNS pkgchecker runs, in seconds.
+time_pkgchecker() {
+    local bin=$1 best="" t
+    for (( r = 0; r < RUNS; r++ )); do
+        t=$( { TIMEFORMAT=%R; time ( cd "$WORK" && "$bin" cmp.bpkg -all_hashes > /dev/null ); } 2>&1 )
+        if [[ -z $best ]] || awk -v a="$t" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+# Prints one field of the swarm benchmark's JSON.
+json_field() {
+    sed -n "s/^  \"$2\": \([0-9.]*\),*$/\1/p" "$1"
+}
+
+first=1
+port=$BASE_PORT
+echo "{"
+echo "  \"package_mb\": ${SIZE_MB},"
+echo "  \"builds\": ["
+for build in debug release pgo; do
+    suffix=""
+    [[ $build != debug ]] && suffix="_$build"
+    pkgchecker="$ROOT/pkgchecker$suffix"
+    btide="$ROOT/btide$suffix"
+    if [[ ! -x $pkgchecker && ! -x $btide ]]; then
+        echo "Skipping ${build}, not built" >&2
+        continue
+    fi
+
+    fields=()
+    if [[ -x $pkgchecker ]]; then
+        echo "Timing pkgchecker${suffix}" >&2
+        secs=$(time_pkgchecker "$pkgchecker")
+        fields+=("\"pkgchecker_seconds\": ${secs}")
+        fields+=("\"pkgchecker_mb_per_s\": $(awk -v s="$secs" -v m="$SIZE_MB" 'BEGIN { printf "%.2f", ( s > 0 ? m * 1.048576 / s : 0 ) }')")
+    fi
+    if [[ -x $btide ]]; then
+        echo "Timing btide${suffix}" >&2
+        if bash "$ROOT/testing/swarm_bench.sh" -b "$btide" -n 2 -s 1 -t star -c "$NCHUNKS" -k 16384 -p "$port" > "$WORK/swarm.json"; then
+            fields+=("\"btide_mb_per_s\": $(json_field "$WORK/swarm.json" aggregate_mb_per_s)")
+            fields+=("\"btide_cpu_seconds_per_gb\": $(json_field "$WORK/swarm.json" cpu_seconds_per_gb)")
+        else
+            fields+=("\"btide_mb_per_s\": null" "\"btide_cpu_seconds_per_gb\": null")
+        fi
+        port=$(( port + 2 ))
+    fi
+
+    (( first )) || echo ","
+    first=0
+    printf "    { \"build\": \"%s\"" "$build"
+    for field in "${fields[@]}"; do
+        printf ", %s" "$field"
+    done
+    printf " }"
+done
+echo ""
+echo "  ]"
+echo "}"
@@ -0,0 +1,180 @@
+#!/bin/bash
+#
+# Loopback transfer tests: runs btide instances on localhost against a generated
+# package and prints what a scenario observed, for the filesend tests to compare.
+#
+# Usage: bash testing/loopback.sh <scenario> [port]
+#   brq       a bare client sends one BRQ (0x0A) to a seeder missing chunk 5. The
+#             ranges hold valid chunks, the unheld chunk and out-of-range entries.
+#   endgame   a leecher fetches from two rate-limited seeders at once. With every
+#             chunk in endgame, chunks are asked of both and the slower request
+#             is withdrawn with a CNL (0x09).
+#   partial   a leecher fetches from a seeder holding only chunks 0-3 and 12-15,
+#             which it advertises with HAV (0x08), and asks for no other chunk.
+#
+# Instances listen on the given port and the ones after it (default 9800). The
+# package has 16 chunks of 4096 bytes. Built binaries are taken from testing/bin.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TEMPLATE="$ROOT/testing/resources/configs/swarm.cfg"
+PKGMAKE="$ROOT/resources/pkgmake"
+BIN="$ROOT/testing/bin/btide"
+PEERCHK="$ROOT/testing/bin/peerchk"
+
+SCENARIO=${1:-}
+BASE_PORT=${2:-9800}
+NCHUNKS=16
+CHUNK_SIZE=4096
+WAIT_S=20
+
+WORK=$(mktemp -d /tmp/loopback.XXXXXX)
+PIDS=()
+FDS=()
+
+cleanup() {
+    for fd in "${FDS[@]}"; do
+        exec {fd}>&- 2>/dev/null
+    done
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+head -c $(( NCHUNKS * CHUNK_SIZE )) /dev/urandom > "$WORK/pkg.data"
+( cd "$WORK" && "$PKGMAKE" pkg.data --nchunks "$NCHUNKS" --output pkg.bpkg > /dev/null ) || {
+    echo "Failed to make the package" >&2
+    exit 1
+}
+IDENT=$(awk -F: '/^ident:/ { print $2; exit }' "$WORK/pkg.bpkg")
+
+# Starts instance i with the package and, when given, its data file and an extra
+# configuration line.
+start() {
+    local i=$1 data=${2:-} extra=${3:-}
+    local dir="$WORK/peer$i"
+    mkdir -p "$dir"
+    cp "$WORK/pkg.bpkg" "$dir/"
+    if [[ -n $data ]]; then
+        cp "$data" "$dir/pkg.data"
+    fi
+    sed -e "s|@DIRECTORY@|$dir|" -e "s|@MAX_PEERS@|4|" -e "s|@PORT@|$(( BASE_PORT + i ))|" \
+        "$TEMPLATE" > "$WORK/peer$i.cfg"
+    if [[ -n $extra ]]; then
+        echo "$extra" >> "$WORK/peer$i.cfg"
+    fi
+    mkfifo "$WORK/peer$i.in"
+    # The output is only opened once the fifo has a writer, so create it for wait_for.
+    : > "$WORK/peer$i.out"
+    "$BIN" "$WORK/peer$i.cfg" < "$WORK/peer$i.in" > "$WORK/peer$i.out" 2>&1 &
+    PIDS[i]=$!
+    exec {fd}>"$WORK/peer$i.in"
+    FDS[i]=$fd
+    wait_for "$i" "^Load complete: 1/1" || { echo "Instance $i did not load the package" >&2; exit 1; }
+}
+
+send() {
+    echo "$2" >&"${FDS[$1]}"
+}
+
+# Waits for a line matching a pattern to appear in an instance's output.
+wait_for() {
+    local i=$1 pattern=$2 deadline=$(( SECONDS + WAIT_S ))
+    until grep -q -E "$pattern" "$WORK/peer$i.out"; do
+        if (( SECONDS >= deadline )) || ! kill -0 "${PIDS[$i]}" 2>/dev/null; then
+            return 1
+        fi
+        sleep 0.05
+    done
+}
+
+# Has instance i fetch the package from every peer it is connected to, then prints
+# the outcome without its timing and whether the data matches the package.
+fetch() {
+    local i=$1
+    send "$i" "FETCH $IDENT"
+    wait_for "$i" "^Fetch (complete|finished|stopped)" || { echo "Instance $i did not finish fetching" >&2; exit 1; }
+    grep -E "^Fetching|^Fetch (complete|finished|stopped)" "$WORK/peer$i.out" | sed 's/ in [0-9.]*s$//'
+    if cmp -s "$WORK/pkg.data" "$WORK/peer$i/pkg.data"; then
+        echo "Fetched data matches the package"
+    else
+        echo "Fetched data differs from the package"
+    fi
+}
+
+# Waits until instance i has received a HAV, asking for its STATS until one shows.
+wait_for_hav() {
+    local i=$1 deadline=$(( SECONDS + WAIT_S ))
+    until grep -q -E "^  received:.* HAV [0-9]+" "$WORK/peer$i.out"; do
+        if (( SECONDS >= deadline )); then
+            echo "Instance $i received no HAV" >&2
+            exit 1
+        fi
+        send "$i" "STATS"
+        sleep 0.1
+    done
+}
+
+# Prints the STATS of instance i.
+stats() {
+    send "$1" "STATS"
+    wait_for "$1" "^Fetches in flight" || { echo "Instance $1 did not report its stats" >&2; exit 1; }
+}
+
+# Overwrites one chunk of a data file, so the instance holding it no longer has it.
+spoil() {
+    dd if=/dev/zero of="$1" bs=$CHUNK_SIZE seek="$2" count=1 conv=notrunc status=none
+}
+
+case $SCENARIO in
+    brq)
+        cp "$WORK/pkg.data" "$WORK/seed.data"
+        spoil "$WORK/seed.data" 5
+        start 0 "$WORK/seed.data"
+        # Chunks 0-1, the unheld chunk 5, a range running past the end, chunk 15 and
+        # a range starting past the end.
+        "$PEERCHK" brq "127.0.0.1:$BASE_PORT" "$WORK/pkg.bpkg" 0:2 5:1 14:4 15:1 20:1
+        ;;
+    endgame)
+        start 0 "$WORK/pkg.data" "upload_limit:64"
+        start 1 "$WORK/pkg.data" "upload_limit:64"
+        start 2
+        send 2 "CONNECT 127.0.0.1:$BASE_PORT 127.0.0.1:$(( BASE_PORT + 1 ))"
+        wait_for 2 "^Connected to 2/" || { echo "Instance 2 could not connect" >&2; exit 1; }
+        fetch 2
+        delivered=$(grep -c -E "^  127.0.0.1:[0-9]+ delivered [1-9]" "$WORK/peer2.out")
+        echo "Seeders that delivered chunks: $delivered"
+        stats 2
+        cnl=$(grep -m 1 "^  sent:" "$WORK/peer2.out" | grep -o -E "CNL [0-9]+" | cut -d' ' -f2)
+        echo "Duplicate requests withdrawn with CNL: $( (( ${cnl:-0} > 0 )) && echo yes || echo no )"
+        ;;
+    partial)
+        cp "$WORK/pkg.data" "$WORK/seed.data"
+        for c in 4 5 6 7 8 9 10 11; do
+            spoil "$WORK/seed.data" "$c"
+        done
+        start 0 "$WORK/seed.data"
+        start 1
+        send 1 "CONNECT 127.0.0.1:$BASE_PORT"
+        wait_for 1 "^Connection established" || { echo "Instance 1 could not connect" >&2; exit 1; }
+        wait_for_hav 1
+        send 1 "FETCH $IDENT"
+        wait_for 1 "^Fetch (complete|finished|stopped)" || { echo "Instance 1 did not finish fetching" >&2; exit 1; }
+        grep -E "^Fetching|^Fetch (complete|finished|stopped)" "$WORK/peer1.out" | sed 's/ in [0-9.]*s$//'
+        held=0
+        for c in 0 1 2 3 12 13 14 15; do
+            cmp -s -i $(( c * CHUNK_SIZE )) -n $CHUNK_SIZE "$WORK/pkg.data" "$WORK/peer1/pkg.data" && held=$(( held + 1 ))
+        done
+        echo "Held chunks fetched intact: $held/8"
+        stats 0
+        grep -m 1 "^Chunks served" "$WORK/peer0.out"
+        ;;
+    *)
+        sed -n '3,/^$/s/^# \{0,1\}//p' "$0" >&2
+        exit 2
+        ;;
+esac
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Profile training: runs profiling builds of pkgchecker and btide over the work they
+# do in practice, so the profiles they write steer the final build. Run through
+# make pgo, which builds the binaries before and the optimised ones after.
+#
+# Usage: bash testing/pgo_train.sh <pkgchecker binary> <btide binary>
+#
+# pkgchecker loads and checks a generated 64 MiB package in every query mode.
+# btide seeds that package to two leechers over loopback in a mesh, which covers
+# serving, installing and hashing.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PKGMAKE="$ROOT/resources/pkgmake"
+
+if (( $# != 2 )) || [[ ! -x $1 || ! -x $2 ]]; then
+    sed -n '3,/^$/s/^# \{0,1\}//p' "$0" >&2
+    exit 2
+fi
+PKGCHECKER=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+BTIDE=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+WORK=$(mktemp -d /tmp/pgo_train.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+head -c $(( 64 << 20 )) /dev/urandom > "$WORK/train.data"
+( cd "$WORK" && "$PKGMAKE" train.data --nchunks 4096 --output train.bpkg > /dev/null ) || {
+    echo "pkgmake failed" >&2
+    exit 1
+}
+
+echo "Training pkgchecker" >&2
+for mode in -all_hashes -chunk_check -min_hashes -file_check; do
+    ( cd "$WORK" && "$PKGCHECKER" train.bpkg "$mode" > /dev/null ) || {
+        echo "pkgchecker $mode failed" >&2
+        exit 1
+    }
+done
+
+echo "Training btide" >&2
+bash "$ROOT/testing/swarm_bench.sh" -b "$BTIDE" -n 3 -s 1 -t mesh -c 4096 -k 16384 -p 9650 > /dev/null || {
+    echo "btide transfer failed" >&2
+    exit 1
+}
@@ -0,0 +1,289 @@
+#!/bin/bash
+#
+# Swarm benchmark: runs several btide instances on localhost, connects them in a
+# chosen topology and has every leecher fetch one generated package from the
+# seeders. Prints the results as JSON on stdout and progress on stderr.
+#
+# Usage: bash testing/swarm_bench.sh [options]
+#   -n <instances>   btide instances to run (default 4)
+#   -s <seeders>     instances that start with the data (default 1)
+#   -t <topology>    star, mesh or chain (default mesh)
+#   -c <chunks>      chunks in the package, a power of two (default 1024)
+#   -k <bytes>       chunk size in bytes (default 4096)
+#   -b <binary>      btide binary (default ./btide_bench)
+#   -p <port>        port of the first instance, the rest follow (default 9600)
+#   -w <seconds>     time allowed for loading and for every fetch to finish (default 120)
+#   -d <directory>   work directory, kept afterwards (default a temporary one)
+#
+# star connects every instance to the first, mesh connects every pair and chain
+# connects each instance to the one before it. Leechers fetch at the same time,
+# except in a chain where each waits for the one before it to finish.
+# Build the binary and run with defaults through make swarm_bench.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TEMPLATE="$ROOT/testing/resources/configs/swarm.cfg"
+PKGMAKE="$ROOT/resources/pkgmake"
+
+NINST=4
+NSEED=1
+TOPOLOGY=mesh
+NCHUNKS=1024
+CHUNK_SIZE=4096
+BIN="$ROOT/btide_bench"
+BASE_PORT=9600
+WAIT_S=120
+WORK=""
+
+while getopts "n:s:t:c:k:b:p:w:d:" opt; do
+    case $opt in
+        n) NINST=$OPTARG ;;
+        s) NSEED=$OPTARG ;;
+        t) TOPOLOGY=$OPTARG ;;
+        c) NCHUNKS=$OPTARG ;;
+        k) CHUNK_SIZE=$OPTARG ;;
+        b) BIN=$OPTARG ;;
+        p) BASE_PORT=$OPTARG ;;
+        w) WAIT_S=$OPTARG ;;
+        d) WORK=$OPTARG ;;
+        *) sed -n '3,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+if (( NINST < 2 || NSEED < 1 || NSEED >= NINST )); then
+    echo "Need at least one seeder and one leecher among the instances" >&2
+    exit 2
+fi
+if (( NCHUNKS < 1 || ( NCHUNKS & ( NCHUNKS - 1 ) ) != 0 )); then
+    echo "Chunks (${NCHUNKS}) must be a power of two" >&2
+    exit 2
+fi
+case $TOPOLOGY in
+    star|mesh|chain) ;;
+    *) echo "Unknown topology (${TOPOLOGY}), expected star, mesh or chain" >&2; exit 2 ;;
+esac
+if [[ ! -x $BIN ]]; then
+    echo "No btide binary at ${BIN}, run make btide_bench first" >&2
+    exit 2
+fi
+
+KEEP=1
+if [[ -z $WORK ]]; then
+    WORK=$(mktemp -d /tmp/swarm_bench.XXXXXX)
+    KEEP=0
+fi
+mkdir -p "$WORK"
+WORK=$(cd "$WORK" && pwd)
+
+PIDS=()
+FDS=()
+
+cleanup() {
+    for fd in "${FDS[@]}"; do
+        exec {fd}>&- 2>/dev/null
+    done
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if (( KEEP == 0 )); then
+        rm -rf "$WORK"
+    fi
+}
+trap cleanup EXIT
+
+# Generate the package once; seeders get the data, leechers only the .bpkg.
+SIZE=$(( NCHUNKS * CHUNK_SIZE ))
+echo "Generating ${SIZE} bytes in ${NCHUNKS} chunks" >&2
+head -c "$SIZE" /dev/urandom > "$WORK/swarm.data"
+( cd "$WORK" && "$PKGMAKE" swarm.data --nchunks "$NCHUNKS" --output swarm.bpkg > /dev/null ) || {
+    echo "Failed to make the package" >&2
+    exit 1
+}
+IDENT=$(awk -F: '/^ident:/ { print $2; exit }' "$WORK/swarm.bpkg")
+
+for (( i = 0; i < NINST; i++ )); do
+    dir="$WORK/peer$i"
+    mkdir -p "$dir"
+    cp "$WORK/swarm.bpkg" "$dir/"
+    if (( i < NSEED )); then
+        cp "$WORK/swarm.data" "$dir/"
+    fi
+    sed -e "s|@DIRECTORY@|$dir|" -e "s|@MAX_PEERS@|$NINST|" -e "s|@PORT@|$(( BASE_PORT + i ))|" \
+        "$TEMPLATE" > "$WORK/peer$i.cfg"
+    mkfifo "$WORK/peer$i.in"
+    "$BIN" "$WORK/peer$i.cfg" < "$WORK/peer$i.in" > "$WORK/peer$i.out" 2>&1 &
+    PIDS[i]=$!
+    exec {fd}>"$WORK/peer$i.in"
+    FDS[i]=$fd
+done
+
+send() {
+    echo "$2" >&"${FDS[$1]}"
+}
+
+# Waits for a line matching a pattern to appear in an instance's output.
+wait_for() {
+    local i=$1 pattern=$2 deadline=$(( SECONDS + $3 ))
+    until grep -q -E "$pattern" "$WORK/peer$i.out"; do
+        if (( SECONDS >= deadline )) || ! kill -0 "${PIDS[$i]}" 2>/dev/null; then
+            return 1
+        fi
+        sleep 0.05
+    done
+}
+
+for (( i = 0; i < NINST; i++ )); do
+    wait_for "$i" "^Load complete: 1/1" "$WAIT_S" || { echo "Instance $i did not load the package" >&2; exit 1; }
+done
+
+# Instance i connects to every instance it links to with a lower index.
+for (( i = 1; i < NINST; i++ )); do
+    addrs=()
+    case $TOPOLOGY in
+        star)  addrs=("127.0.0.1:$BASE_PORT") ;;
+        chain) addrs=("127.0.0.1:$(( BASE_PORT + i - 1 ))") ;;
+        mesh)  for (( j = 0; j < i; j++ )); do addrs+=("127.0.0.1:$(( BASE_PORT + j ))"); done ;;
+    esac
+    send "$i" "CONNECT ${addrs[*]}"
+    # Several addresses end in a summary line, a single one in its own result.
+    if (( ${#addrs[@]} > 1 )); then
+        wait_for "$i" "^Connected to ${#addrs[@]}/" 10
+    else
+        wait_for "$i" "^Connection established" 10
+    fi || { echo "Instance $i could not connect to ${addrs[*]}" >&2; exit 1; }
+done
+echo "Connected ${NINST} instances in a ${TOPOLOGY}" >&2
+
+# CPU time in clock ticks of every instance, summed.
+cpu_ticks() {
+    local total=0 pid
+    for pid in "${PIDS[@]}"; do
+        # Fields after the command name, which may hold spaces: utime is 12th, stime 13th.
+        total=$(( total + $(sed 's/^.*) //' "/proc/$pid/stat" | awk '{ print $12 + $13 }') ))
+    done
+    echo "$total"
+}
+
+now_ns() {
+    date +%s%N
+}
+
+TICKS=$(getconf CLK_TCK)
+cpu_start=$(cpu_ticks)
+start=$(now_ns)
+
+# A chain leecher starts as soon as the one before it finishes, which may be before
+# its last HAVEs arrive; chunks nobody advertised yet fail and are fetched again.
+fetch_chain() {
+    local i=$1 tries
+    for (( tries = 1; tries <= 3; tries++ )); do
+        send "$i" "FETCH $IDENT"
+        wait_until_count "$i" "^Fetch (complete|finished|stopped)" "$tries" || return 1
+        tail -n 20 "$WORK/peer$i.out" | grep -q "^Fetch complete" && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# Waits for at least a number of lines matching a pattern.
+wait_until_count() {
+    local i=$1 pattern=$2 count=$3 deadline=$(( SECONDS + WAIT_S ))
+    until (( $(grep -c -E "$pattern" "$WORK/peer$i.out") >= count )); do
+        if (( SECONDS >= deadline )) || ! kill -0 "${PIDS[$i]}" 2>/dev/null; then
+            return 1
+        fi
+        sleep 0.05
+    done
+}
+
+FAILED=0
+for (( i = NSEED; i < NINST; i++ )); do
+    if [[ $TOPOLOGY == chain ]]; then
+        fetch_chain "$i" || FAILED=1
+    else
+        send "$i" "FETCH $IDENT"
+    fi
+done
+for (( i = NSEED; i < NINST; i++ )); do
+    wait_for "$i" "^Chunk latency|^Fetch finished" "$WAIT_S" || FAILED=1
+done
+
+end=$(now_ns)
+cpu_end=$(cpu_ticks)
+
+PEAK_KB=0
+TOTAL_KB=0
+for pid in "${PIDS[@]}"; do
+    kb=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status")
+    TOTAL_KB=$(( TOTAL_KB + kb ))
+    (( kb > PEAK_KB )) && PEAK_KB=$kb
+done
+
+for (( i = 0; i < NINST; i++ )); do
+    send "$i" "QUIT"
+done
+for pid in "${PIDS[@]}"; do
+    wait "$pid" 2>/dev/null
+done
+PIDS=()
+
+NLEECH=$(( NINST - NSEED ))
+VERIFIED=0
+for (( i = NSEED; i < NINST; i++ )); do
+    cmp -s "$WORK/swarm.data" "$WORK/peer$i/swarm.data" && VERIFIED=$(( VERIFIED + 1 ))
+done
+if (( FAILED || VERIFIED != NLEECH )); then
+    echo "Only ${VERIFIED}/${NLEECH} leechers have the data, outputs are in ${WORK}" >&2
+    KEEP=1
+fi
+
+# Per-leecher latencies come from the "Chunk latency" line of its first fetch.
+for (( i = NSEED; i < NINST; i++ )); do
+    sed -n 's/^Chunk latency: p50 \([0-9.]*\)ms, p90 \([0-9.]*\)ms, p99 \([0-9.]*\)ms, max \([0-9.]*\)ms over \([0-9]*\) chunks$/'"$i"' \1 \2 \3 \4 \5/p' \
+        "$WORK/peer$i.out" | head -n 1
+done > "$WORK/latency"
+
+awk -v ninst="$NINST" -v nseed="$NSEED" -v topology="$TOPOLOGY" -v nchunks="$NCHUNKS" \
+    -v chunk_size="$CHUNK_SIZE" -v size="$SIZE" -v start="$start" -v end="$end" \
+    -v ticks=$(( cpu_end - cpu_start )) -v hz="$TICKS" -v peak_kb="$PEAK_KB" \
+    -v total_kb="$TOTAL_KB" -v verified="$VERIFIED" -v port="$BASE_PORT" '
+    function median(a, n,   i, j, t) {
+        for ( i = 2; i <= n; i++ ) {
+            for ( j = i; j > 1 && a[j - 1] > a[j]; j-- ) { t = a[j]; a[j] = a[j - 1]; a[j - 1] = t }
+        }
+        return n % 2 ? a[( n + 1 ) / 2] : ( a[n / 2] + a[n / 2 + 1] ) / 2
+    }
+    {
+        n++
+        peer[n] = $1; p50[n] = $2; p90[n] = $3; p99[n] = $4; mx[n] = $5; cnt[n] = $6
+        m50[n] = $2
+        if ( $4 > worst99 ) worst99 = $4
+        if ( $5 > worstmax ) worstmax = $5
+    }
+    END {
+        secs = ( end - start ) / 1e9
+        bytes = ( ninst - nseed ) * size
+        cpu = ticks / hz
+        printf "{\n"
+        printf "  \"suite\": \"swarm\",\n"
+        printf "  \"instances\": %d,\n  \"seeders\": %d,\n  \"topology\": \"%s\",\n", ninst, nseed, topology
+        printf "  \"chunks\": %d,\n  \"chunk_bytes\": %d,\n  \"package_bytes\": %d,\n", nchunks, chunk_size, size
+        printf "  \"leechers_verified\": %d,\n", verified
+        printf "  \"seconds\": %.3f,\n", secs
+        printf "  \"aggregate_mb_per_s\": %.2f,\n", ( secs > 0 ? bytes / 1e6 / secs : 0 )
+        printf "  \"cpu_seconds\": %.2f,\n", cpu
+        printf "  \"cpu_seconds_per_gb\": %.2f,\n", ( bytes > 0 ? cpu / ( bytes / 1e9 ) : 0 )
+        printf "  \"peak_rss_kb\": %d,\n  \"total_peak_rss_kb\": %d,\n", peak_kb, total_kb
+        printf "  \"chunk_latency_ms\": {\"median_p50\": %.2f, \"worst_p99\": %.2f, \"worst_max\": %.2f},\n",
+            ( n ? median(m50, n) : 0 ), worst99, worstmax
+        printf "  \"leechers\": ["
+        for ( i = 1; i <= n; i++ ) {
+            printf "%s\n    {\"port\": %d, \"chunks\": %d, \"p50_ms\": %.2f, \"p90_ms\": %.2f, \"p99_ms\": %.2f, \"max_ms\": %.2f}",
+                ( i > 1 ? "," : "" ), port + peer[i], cnt[i], p50[i], p90[i], p99[i], mx[i]
+        }
+        printf "%s]\n}\n", ( n ? "\n  " : "" )
+    }' "$WORK/latency"
+
+(( FAILED == 0 && VERIFIED == NLEECH ))
@@ -48,7 +48,7 @@ run_test() {
 
 check_sec_input() {
     local sec_choice="$1"
-    if [[ "$sec_choice" != "merkletree" && "$sec_choice" != "chunk" && "$sec_choice" != "package_management" &&"$sec_choice" != "peer_management" && "$sec_choice" != "config" && "$sec_choice" != "filesend" ]]; then
+    if [[ "$sec_choice" != "merkletree" && "$sec_choice" != "chunk" && "$sec_choice" != "package" && "$sec_choice" != "package_management" &&"$sec_choice" != "peer_management" && "$sec_choice" != "config" && "$sec_choice" != "filesend" ]]; then
         printf "Invalid section name entered! \n"
         sleep 1.5
         return 1
@@ -90,12 +90,12 @@ main() {
         case $opt in
             3)
                 printf "\n[Mono-Test Mode]\n\tTest Options:\n"
-                printf "chunk              [1-2]\n"
-                printf "package            [1-2]\n"
-                printf "merkletree         [1-6]\n"
+                printf "chunk              [1-3]\n"
+                printf "package            [1-3]\n"
+                printf "merkletree         [1-8]\n"
                 printf "peer_management    [1-4]\n"
                 printf "package_management [1-4]\n"
-                printf "filesend           [1-3]\n"
+                printf "filesend           [1-6]\n"
                 printf "config             [1-3]\n"
                 printf "Choose a test to run: '{section_name} {test_num}'\n\n\t:> "
                 read part test_number